@@ -30,6 +30,12 @@
 #define USER_END_VMA    0xD0000000UL // End of user program space
 #define USER_STACK_VMA  USER_END_VMA // starting user stack pointer
 
+// Memory mappings (mmap) are placed in [USER_MMAP_START_VMA, USER_MMAP_END_VMA).
+// Below it, the program and its data grow on demand; above it, the stack does.
+
+#define USER_MMAP_START_VMA 0xC8000000UL
+#define USER_MMAP_END_VMA   0xCF000000UL
+
 #define UART0_IOBASE 0x10000000 // PMA
 #define UART1_IOBASE 0x10000100 // PMA
 #define UART0_IRQNO 10
@@ -298,4 +298,12 @@ static inline uintptr_t csrrw_satp(uintptr_t satp_new) {
     return satp_old;
 }
 
+// time
+
+static inline uint64_t csrr_time(void) {
+    uint64_t val;
+    asm inline volatile ("rdtime %0" : "=r" (val));
+    return val;
+}
+
 #endif // _CSR_H_
\ No newline at end of file
@@ -14,5 +14,8 @@
 #define EACCESS     8
 #define EBADFD      9
 #define EMFILE     10
+#define ENOSPC     11
+#define EEXIST     12
+#define ENOMEM     13
 
 #endif // _ERROR_H_
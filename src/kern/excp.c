@@ -65,9 +65,9 @@ void smode_excp_handler(unsigned int code, struct trap_frame * tfr) {
  *
  * Exception codes and their handlers:
  * - RISCV_SCAUSE_ECALL_FROM_UMODE: Handles system calls from user mode.
- * - RISCV_SCAUSE_INSTR_PAGE_FAULT: Handles instruction page faults.
- * - RISCV_SCAUSE_LOAD_PAGE_FAULT: Handles load page faults.
- * - RISCV_SCAUSE_STORE_PAGE_FAULT: Handles store page faults.
+ * - RISCV_SCAUSE_INSTR_PAGE_FAULT, RISCV_SCAUSE_LOAD_PAGE_FAULT,
+ *   RISCV_SCAUSE_STORE_PAGE_FAULT: Handled by memory_handle_page_fault, which
+ *   maps the page or terminates the process.
  * - default: Handles all other exceptions using the default handler.
  */
 void umode_excp_handler(unsigned int code, struct trap_frame * tfr) {
@@ -77,13 +77,13 @@ void umode_excp_handler(unsigned int code, struct trap_frame * tfr) {
         syscall_handler(tfr);
         break;
     case RISCV_SCAUSE_LOAD_PAGE_FAULT:
-        default_excp_handler(code, tfr);
+        memory_handle_page_fault((void *)csrr_stval(), PTE_R);
         break;
     case RISCV_SCAUSE_INSTR_PAGE_FAULT:
-        default_excp_handler(code, tfr);
+        memory_handle_page_fault((void *)csrr_stval(), PTE_X);
         break;
     case RISCV_SCAUSE_STORE_PAGE_FAULT:
-        memory_handle_page_fault((void *)csrr_stval());
+        memory_handle_page_fault((void *)csrr_stval(), PTE_W);
         break;
     default:
         default_excp_handler(code, tfr);
@@ -10,30 +10,41 @@
 #include "intr.h"
 #include "string.h"
 #include "console.h"
+#include "lock.h"
+#include "stat.h"
 
 #define BLOCK_SIZE 4096
 #define MAX_DIR_ENTRIES 63
 #define MAX_INODES 1023
-#define BOOT_RESERVED_SPACE_SZ 52
+#define MAX_EXTENTS 511
+#define MAX_CHUNKS 1018
+#define CHUNK_SIZE (4 * BLOCK_SIZE) // uncompressed bytes per chunk of a compressed file
+#define BOOT_RESERVED_SPACE_SZ 40
 #define MAX_FILE_NAME_LENGTH 32 // 32 bytes
-#define DENTRY_RESERVED_SPACE_SZ 28
-#define MAX_FILE_OPEN 32
-#define INUSE 1
-#define UNUSE 0
+#define DENTRY_RESERVED_SPACE_SZ 27
+#define DIRECT_IO_ALIGN 512 // buffer alignment for transfers that bypass the block cache
 
-typedef struct file_t
-{
-  struct io_intf *io;
-  uint64_t file_position;
-  uint64_t file_size;
-  uint64_t inode_num;
-  uint64_t flag;
-} __attribute((packed)) file_t;
+// boot_block_t features
+#define FS_FEATURE_EXTENTS 0x1 // inodes map their blocks with extents
+#define FS_FEATURE_COMPRESS 0x2 // inodes may hold compressed files
+#define FS_FEATURE_JOURNAL 0x4 // metadata is written through a journal
 
+// num_extents of an inode that holds a compressed file
+#define INODE_COMPRESSED 0xffffffff
+
+// dentry_t file types
+#define FT_FILE 0
+#define FT_DIR 1
+
+// A directory entry. The root directory is the array of entries in the boot
+// block; any other directory is a file whose contents are an array of
+// entries, with no gaps. Entries of images without directories are all
+// FT_FILE, since the type was reserved space.
 typedef struct dentry_t
 {
   char file_name[MAX_FILE_NAME_LENGTH];
   uint32_t inode;
+  uint8_t file_type; // FT_FILE or FT_DIR
   uint8_t reserved[DENTRY_RESERVED_SPACE_SZ];
 } __attribute((packed)) dentry_t;
 
@@ -42,21 +53,104 @@ typedef struct boot_block_t
   uint32_t num_dentry;
   uint32_t num_inodes;
   uint32_t num_data;
+  uint32_t num_bitmap; // blocks of the free-block bitmap, 0 if the image has none
+  uint32_t features; // FS_FEATURE_ flags, 0 for the original layout
+  uint32_t num_journal; // blocks of the journal, 0 without FS_FEATURE_JOURNAL
   uint8_t reserved[BOOT_RESERVED_SPACE_SZ];
   dentry_t dir_entries[MAX_DIR_ENTRIES];
 } __attribute((packed)) boot_block_t;
 
+// A run of data blocks, contiguous on disk
+typedef struct extent_t
+{
+  uint32_t start; // first data block
+  uint32_t len; // number of blocks
+} __attribute((packed)) extent_t;
+
+// An inode maps the blocks of a file either with one data block number per
+// file block (the original layout), or, if the image has FS_FEATURE_EXTENTS,
+// with a list of extents covering the file blocks in order.
+//
+// If the image has FS_FEATURE_COMPRESS, an inode whose num_extents is
+// INODE_COMPRESSED holds a read-only compressed file instead. The file is
+// cut into chunks of CHUNK_SIZE bytes, each compressed on its own as an LZ4
+// block, and the compressed chunks are stored one after the other in zextent.
+// Chunk i takes bytes chunk_off[i] up to chunk_off[i + 1] of the extent; a
+// chunk that did not compress is stored as is, with its uncompressed length.
 typedef struct inode_t
 {
   uint32_t byte_len;
-  uint32_t data_block_num[MAX_INODES];
+  union
+  {
+    uint32_t data_block_num[MAX_INODES];
+    struct
+    {
+      uint32_t num_extents;
+      extent_t extents[MAX_EXTENTS];
+    } __attribute((packed));
+    struct
+    {
+      uint32_t zmagic; // INODE_COMPRESSED, in place of num_extents
+      extent_t zextent;
+      uint32_t num_chunks;
+      uint32_t chunk_off[MAX_CHUNKS + 1];
+    } __attribute((packed));
+  };
 } __attribute((packed)) inode_t;
 
+// The journal of an image with FS_FEATURE_JOURNAL follows the bitmap: a
+// header block, then log blocks. The log holds copies of metadata blocks
+// (the boot block, inodes, bitmap blocks and directory blocks) written by
+// committed transactions and not yet written to their home blocks; log block
+// i is a copy of block home[i] of the device, and later copies of a block
+// replace earlier ones. Writing the header commits the blocks it lists, so
+// a header block write must be atomic. The log is empty if num_blocks is 0.
+#define JOURNAL_MAGIC 0x6c6e726a // "jrnl"
+#define MAX_JOURNAL_BLOCKS ((BLOCK_SIZE - 16) / 4)
+
+typedef struct journal_header_t
+{
+  uint32_t magic; // JOURNAL_MAGIC
+  uint32_t num_blocks; // log blocks in use
+  uint64_t seq; // sequence number of the last committed transaction
+  uint32_t home[MAX_JOURNAL_BLOCKS]; // device block of each log block
+} __attribute((packed)) journal_header_t;
+
 typedef struct data_block_t
 {
   uint8_t data[BLOCK_SIZE];
 } __attribute((packed)) data_block_t;
 
+// An inode in the inode cache. Cached inodes are found by inode number in a
+// hash table; refcnt counts the open files of the inode. The hash chain and
+// refcnt are protected by fs_lk, the on-disk inode and the file data by lk.
+struct kfs_inode
+{
+  struct kfs_inode *next; // next inode in the hash chain
+  uint32_t ino;
+  uint32_t refcnt;
+  uint8_t dir; // nonzero if the inode is a directory, set when it is looked up
+  struct rwlock lk; // held for reading to read the file, for writing to change it
+  struct lock fill_lk; // held while pages of the file are read into the page cache
+  inode_t *disk; // the on-disk inode, one page
+  // extent found by the last block lookup, and its first file block, where
+  // the next lookup of a sequential transfer starts. Readers move it too;
+  // fs_bmap updates it without sleeping, so they never see half an update.
+  uint32_t ext_idx;
+  uint32_t ext_blk;
+};
+
+// An open file. The io_intf returned by fs_open is embedded in it, so the
+// file operations find the file and its inode without a table lookup.
+typedef struct file_t
+{
+  struct io_intf io;
+  struct kfs_inode *inode;
+  struct lock lk; // serializes the reads, writes and seeks of file_position
+  uint64_t file_position;
+  struct file_t *next_free; // next closed file available for reuse
+} file_t;
+
 extern char fs_initialized;
 
 extern void fs_init(void);
@@ -65,12 +159,26 @@ extern int fs_mount(struct io_intf * blkio);
 
 extern int fs_open(const char * name, struct io_intf ** ioptr);
 
+extern int fs_create(const char * name);
+
+extern int fs_unlink(const char * name);
+
+extern int fs_mkdir(const char * name);
+
+extern int fs_stat(const char * name, struct stat * st);
+
+extern long fs_getdents(const char * name, uint64_t * cursor, struct dirent * ents, unsigned long n);
+
 void fs_close(struct io_intf *io);
 
 long fs_read(struct io_intf *io, void *buf, unsigned long n);
 
 long fs_write(struct io_intf *io, const void *buf, unsigned long n);
 
+long fs_readv(struct io_intf *io, const struct io_vec *iov, int iovcnt, const uint64_t *pos);
+
+long fs_writev(struct io_intf *io, const struct io_vec *iov, int iovcnt, const uint64_t *pos);
+
 int fs_ioctl(struct io_intf *io, int cmd, void *arg);
 
 int fs_getlen(file_t *file, void *arg);
@@ -79,6 +187,10 @@ int fs_getpos(file_t *file, void *arg);
 
 int fs_setpos(file_t *file, void *arg);
 
+int fs_setlen(file_t *file, void *arg);
+
 int fs_getblksz(file_t *file, void *arg);
+
+int fs_getstat(file_t *file, void *arg);
 //           _FS_H_
 #endif
@@ -3,6 +3,8 @@
 
 #include "io.h"
 #include "error.h"
+#include "memory.h"
+#include "pagecache.h"
 
 #include <stddef.h>
 #include <string.h>
@@ -65,6 +67,183 @@ long iowrite(struct io_intf * io, const void * buf, unsigned long n) {
     return acc;
 }
 
+long ioreadv(struct io_intf * io, const struct io_vec * iov, int iovcnt) {
+    long cnt, acc = 0;
+    int i;
+
+    if (iovcnt < 0 || iovcnt > IOV_MAX)
+        return -EINVAL;
+
+    if (io->ops->readv != NULL)
+        return io->ops->readv(io, iov, iovcnt, NULL);
+
+    //           Without readv, read each buffer in turn until a read comes up short
+
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].len == 0)
+            continue;
+        cnt = ioread(io, iov[i].buf, iov[i].len);
+        if (cnt < 0)
+            return (acc != 0) ? acc : cnt;
+        acc += cnt;
+        if (cnt < iov[i].len)
+            break;
+    }
+
+    return acc;
+}
+
+long iowritev(struct io_intf * io, const struct io_vec * iov, int iovcnt) {
+    struct io_vec rest[IOV_MAX];
+    long cnt, acc = 0;
+    int i, n;
+
+    if (iovcnt < 0 || iovcnt > IOV_MAX)
+        return -EINVAL;
+
+    if (io->ops->writev == NULL) {
+        for (i = 0; i < iovcnt; i++) {
+            cnt = iowrite(io, iov[i].buf, iov[i].len);
+            if (cnt < 0)
+                return cnt;
+            acc += cnt;
+            if (cnt < iov[i].len)
+                break;
+        }
+        return acc;
+    }
+
+    //           After a short write, write the rest of the buffers
+
+    memcpy(rest, iov, iovcnt * sizeof(struct io_vec));
+    i = 0;
+    n = iovcnt;
+    while (i < n) {
+        cnt = io->ops->writev(io, rest + i, n - i, NULL);
+        if (cnt < 0)
+            return cnt;
+        else if (cnt == 0)
+            return acc;
+        acc += cnt;
+        while (i < n && cnt >= rest[i].len)
+            cnt -= rest[i++].len;
+        if (i < n) {
+            rest[i].buf += cnt;
+            rest[i].len -= cnt;
+        }
+    }
+
+    return acc;
+}
+
+long iopread(struct io_intf * io, void * buf, unsigned long bufsz, uint64_t pos) {
+    const struct io_vec iov = { .buf = buf, .len = bufsz };
+
+    if (io->ops->readv == NULL)
+        return -ENOTSUP;
+
+    return io->ops->readv(io, &iov, 1, &pos);
+}
+
+long iopwrite(struct io_intf * io, const void * buf, unsigned long n, uint64_t pos) {
+    struct io_vec iov;
+    long cnt, acc = 0;
+    uint64_t at;
+
+    if (io->ops->writev == NULL)
+        return -ENOTSUP;
+
+    while (acc < n) {
+        iov.buf = (void *)buf + acc;
+        iov.len = n - acc;
+        at = pos + acc;
+        cnt = io->ops->writev(io, &iov, 1, &at);
+        if (cnt < 0)
+            return cnt;
+        else if (cnt == 0)
+            return acc;
+        acc += cnt;
+    }
+
+    return acc;
+}
+
+long iosendfile(struct io_intf * out, struct io_intf * in, uint64_t * pos, unsigned long count) {
+    struct io_page pg;
+    uint64_t at, len;
+    unsigned long off, n;
+    long cnt = 0, acc = 0;
+    void * buf;
+
+    //           Files in the page cache are written out of their cached pages
+
+    if (ioctl(in, IOCTL_GETPAGE, NULL) == 0) {
+        if (pos != NULL)
+            at = *pos;
+        else if ((cnt = ioctl(in, IOCTL_GETPOS, &at)) < 0)
+            return cnt;
+        if ((cnt = ioctl(in, IOCTL_GETLEN, &len)) < 0)
+            return cnt;
+
+        while (acc < count && at < len) {
+            pg.index = at / PAGE_SIZE;
+            cnt = ioctl(in, IOCTL_GETPAGE, &pg);
+            if (cnt < 0)
+                break;
+            off = at % PAGE_SIZE;
+            n = PAGE_SIZE - off;
+            if (n > count - acc)
+                n = count - acc;
+            if (n > len - at)
+                n = len - at;
+            cnt = iowrite(out, pg.page + off, n);
+            pagecache_unmap(pg.page);
+            if (cnt < 0)
+                break;
+            acc += cnt;
+            at += cnt;
+            if (cnt < n)
+                break;
+        }
+
+        if (pos != NULL)
+            *pos = at;
+        else if (acc != 0)
+            ioseek(in, at);
+        return (acc == 0 && cnt < 0) ? cnt : acc;
+    }
+
+    //           Anything else is copied through a kernel page. A short read
+    //           (end of file, or a pipe holding less data) ends the transfer.
+
+    buf = memory_alloc_page();
+
+    while (acc < count) {
+        n = count - acc;
+        if (n > PAGE_SIZE)
+            n = PAGE_SIZE;
+        if (pos != NULL)
+            cnt = iopread(in, buf, n, *pos + acc);
+        else
+            cnt = ioread(in, buf, n);
+        if (cnt <= 0)
+            break;
+        n = cnt;
+        cnt = iowrite(out, buf, n);
+        if (cnt < 0)
+            break;
+        acc += cnt;
+        if (cnt < n)
+            break;
+    }
+
+    memory_free_page(buf);
+
+    if (pos != NULL)
+        *pos += acc;
+    return (acc == 0 && cnt < 0) ? cnt : acc;
+}
+
 long io_lit_read(struct io_intf *io, void *buf, unsigned long bufsz);
 void lit_io_close(struct io_intf *io);
 long io_lit_write(struct io_intf *io, const void *buf, unsigned long n);
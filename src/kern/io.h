@@ -15,6 +15,16 @@
 
 struct io_intf; // forward decl.
 
+// A buffer of a vectored transfer (ioreadv, iowritev). A single transfer
+// takes at most IOV_MAX buffers.
+
+#define IOV_MAX 16
+
+struct io_vec {
+    void * buf;
+    size_t len;
+};
+
 // I/O operations provided by the interface. Do not call these directly, use the
 // function below instead (e.g. ioread). The /read/ function is allowed to read
 // fewer than /bufsz/ bytes, but must read at least one. A return value of 0
@@ -22,12 +32,21 @@ struct io_intf; // forward decl.
 // allowed to write fewer than /n/ bytes, but must write at least one. A return
 // value of 0 from /write/ indicates an end-of-file condition (for files that
 // cannot grow).
+//
+// The /readv/ and /writev/ functions are optional. They transfer the /iovcnt/
+// buffers of /iov/ in order, as one read or write of their concatenation, with
+// the same rules for short transfers. If /pos/ is NULL, they start at the
+// current position and advance it; otherwise they start at position /*pos/
+// and leave the current position unchanged (see iopread). Objects without a
+// position return -ENOTSUP if /pos/ is not NULL.
 
 struct io_ops {
 	void (*close)(struct io_intf * io);
 	long (*read)(struct io_intf * io, void * buf, unsigned long bufsz);
 	long (*write)(struct io_intf * io, const void * buf, unsigned long n);
 	int (*ctl)(struct io_intf * io, int cmd, void * arg);
+	long (*readv)(struct io_intf * io, const struct io_vec * iov, int iovcnt, const uint64_t * pos);
+	long (*writev)(struct io_intf * io, const struct io_vec * iov, int iovcnt, const uint64_t * pos);
 };
 
 struct io_intf {
@@ -58,8 +77,117 @@ struct io_term {
 #define IOCTL_FLUSH         5   // arg is ignored
 #define IOCTL_GETBLKSZ      6   // arg is pointer to uint32_t
 #define IOCTL_GETREFCNT 7       // arg is pointer to uint32_t
-#define IOCTL_GETDENTRY 8       // arg is pointer to struct dentry
-#define IOCTL_GETDENTRY_NUM 9   // arg is pointer to uint64_t
+#define IOCTL_GETSCHED      10  // arg is pointer to int
+#define IOCTL_SETSCHED      11  // arg is pointer to int
+#define IOCTL_GETSCHEDSTAT  12  // arg is pointer to struct iosched_stat
+#define IOCTL_GETPOLL       13  // arg is pointer to int
+#define IOCTL_SETPOLL       14  // arg is pointer to int
+#define IOCTL_DROPCACHE     15  // arg is ignored
+#define IOCTL_READDIRECT    16  // arg is pointer to struct io_direct (kernel only)
+#define IOCTL_GETRING       17  // arg is pointer to int
+#define IOCTL_GETQDEPTH     18  // arg is pointer to int
+#define IOCTL_SETQDEPTH     19  // arg is pointer to int
+#define IOCTL_DISCARD       20  // arg is pointer to struct io_range (kernel only)
+#define IOCTL_WRITEZEROES   21  // arg is pointer to struct io_range (kernel only)
+#define IOCTL_GETSTAT       22  // arg is pointer to struct io_stat
+#define IOCTL_WRITEDIRECT   23  // arg is pointer to struct io_direct (kernel only)
+#define IOCTL_READPAGES     24  // arg is pointer to struct io_pagevec (kernel only)
+#define IOCTL_GETPAGE       25  // arg is pointer to struct io_page (kernel only)
+#define IOCTL_WRITEPAGE     26  // arg is pointer to uint64_t (kernel only)
+#define IOCTL_STAT          27  // arg is pointer to struct stat (see stat.h)
+
+// Block I/O scheduler policies (IOCTL_GETSCHED, IOCTL_SETSCHED)
+
+#define IOSCHED_NOOP        0
+#define IOSCHED_DEADLINE    1
+
+// Block device completion modes (IOCTL_GETPOLL, IOCTL_SETPOLL)
+
+#define IOPOLL_INTR         0   // sleep until the completion interrupt
+#define IOPOLL_POLL         1   // spin on the used ring, no interrupts
+#define IOPOLL_HYBRID       2   // spin for a bounded time, then sleep
+
+// Virtqueue layouts of a block device (IOCTL_GETRING)
+
+#define IORING_SPLIT        0
+#define IORING_PACKED       1
+
+// Direct I/O request (IOCTL_READDIRECT, IOCTL_WRITEDIRECT). Transfers /len/
+// bytes at device position /pos/ straight between the device and /buf/,
+// bypassing the cache.
+// /pos/ and /len/ must be multiples of the device block size, and /buf/ must
+// be aligned to 512 bytes.
+
+struct io_direct {
+    uint64_t pos;
+    void * buf;
+    size_t len;
+};
+
+// Page vector read (IOCTL_READPAGES). Reads /npages/ pages of consecutive
+// device data at /pos/, one into each of the kernel pages in /pages/, which
+// need not be contiguous in memory. Used to fill page cache pages.
+// /pos/ must be a multiple of the device block size.
+
+struct io_pagevec {
+    uint64_t pos;
+    void ** pages;
+    uint32_t npages;
+};
+
+// Page of a file (IOCTL_GETPAGE). Returns in /page/ the page cache page
+// holding page /index/ of the file, with a reference taken for a user mapping
+// of it (see pagecache_map). With a NULL argument, IOCTL_GETPAGE only
+// reports whether the I/O object can be mapped. IOCTL_WRITEPAGE writes the
+// cached page with the given index back to the device, after a shared mapping
+// wrote to it.
+
+struct io_page {
+    uint64_t index;
+    void * page;
+};
+
+// Device byte range (IOCTL_DISCARD, IOCTL_WRITEZEROES). /pos/ and /len/ must
+// be multiples of the device block size. After IOCTL_WRITEZEROES the range
+// reads as zeroes; after IOCTL_DISCARD its contents are undefined, and the
+// device may release the storage backing it.
+
+struct io_range {
+    uint64_t pos;
+    uint64_t len;
+};
+
+// Block I/O scheduler statistics (IOCTL_GETSCHEDSTAT). Arrays are indexed by
+// direction (0 for reads, 1 for writes); latencies are in timer ticks, from
+// queueing to completion. Setting the policy clears the statistics.
+
+struct iosched_stat {
+    uint64_t reqs;          // requests queued
+    uint64_t back_merges;   // requests appended to a queued request
+    uint64_t front_merges;  // requests prepended to a queued request
+    uint64_t dispatches;    // merged requests sent to the device
+    uint64_t done[2];       // requests completed
+    uint64_t lat_sum[2];    // total latency of completed requests
+    uint64_t lat_max[2];    // maximum latency of a completed request
+};
+
+// I/O statistics of a device or file system (IOCTL_GETSTAT). Arrays are
+// indexed by direction (0 for reads, 1 for writes). Bucket k of a latency
+// histogram counts requests that took [2^k, 2^(k+1)) timer ticks; bucket 0
+// also counts those that took none, and the last bucket all longer ones.
+
+#define IOSTAT_NHIST 24
+
+struct io_stat {
+    uint64_t ops[2];        // requests completed
+    uint64_t bytes[2];      // bytes transferred by completed requests
+    uint64_t other;         // requests without data (flush, discard, ...)
+    uint64_t merges;        // requests merged into another one
+    uint64_t retries;       // requests resubmitted after an error
+    uint64_t errors;        // requests that failed
+    uint64_t lat_hist[2][IOSTAT_NHIST];
+};
+
 // EXPORTED FUNCTION DECLARATIONS
 //
 
@@ -113,6 +241,47 @@ extern long
 __attribute__ ((nonnull(1,2)))
 iowrite(struct io_intf * io, const void * buf, unsigned long n);
 
+// The ioreadv and iowritev functions read into and write from the /iovcnt/
+// buffers of /iov/, at most IOV_MAX, as ioread and iowrite would for their
+// concatenation: ioreadv may return after reading less than all buffers hold,
+// iowritev does not return until it writes everything or reaches the end of
+// file. Objects without the readv or writev operation get one read or write
+// per buffer.
+
+extern long
+__attribute__ ((nonnull(1)))
+ioreadv(struct io_intf * io, const struct io_vec * iov, int iovcnt);
+
+extern long
+__attribute__ ((nonnull(1)))
+iowritev(struct io_intf * io, const struct io_vec * iov, int iovcnt);
+
+// The iopread and iopwrite functions read and write like ioread and iowrite,
+// but at position /pos/, without using or changing the current position of the
+// object, so that threads sharing an object need no seek. They return -ENOTSUP
+// if the object has no readv or writev operation or no position.
+
+extern long
+__attribute__ ((nonnull(1,2)))
+iopread(struct io_intf * io, void * buf, unsigned long bufsz, uint64_t pos);
+
+extern long
+__attribute__ ((nonnull(1,2)))
+iopwrite(struct io_intf * io, const void * buf, unsigned long n, uint64_t pos);
+
+// The iosendfile function copies up to /count/ bytes from /in/ to /out/ inside
+// the kernel, so that a file can be written to a device or pipe without a user
+// buffer. If /pos/ is NULL, it reads at the current position of /in/ and
+// advances it; otherwise it reads at /*pos/ and advances /*pos/ instead. Files
+// in the page cache (see IOCTL_GETPAGE) are written straight from the cached
+// pages; anything else goes through a kernel page, and the transfer ends after
+// a short read. Returns the number of bytes written, which is less than
+// /count/ at end of file, or a negative error code if nothing was written.
+
+extern long
+__attribute__ ((nonnull(1,2)))
+iosendfile(struct io_intf * out, struct io_intf * in, uint64_t * pos, unsigned long count);
+
 // The ioctl function invokes special functions on the I/O object. See the IOCTL
 // numbers defined above.
 
@@ -0,0 +1,291 @@
+// iosched.c - Block I/O scheduler
+//
+// The scheduler sits between a block driver's request producers (cache fills,
+// writeback) and the device queue. Requests for contiguous sectors in the same
+// direction are merged into one chain, which the driver sends to the device as
+// a single scatter-gather request. The order in which chains are dispatched is
+// decided by the scheduling policy:
+//
+//   noop       First-come first-served over both directions.
+//   deadline   Separate read and write queues sorted by sector and served in
+//              ascending sweeps. Reads are preferred, but writes get a turn
+//              after IOSCHED_WRITES_STARVED read dispatches, and a request
+//              whose deadline has passed is dispatched first.
+//
+
+#include "iosched.h"
+#include "csr.h"
+#include "error.h"
+#include "string.h"
+#include "timer.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+// Deadlines of the deadline policy, relative to the time a request is queued.
+
+#ifndef IOSCHED_READ_EXPIRE_MS
+#define IOSCHED_READ_EXPIRE_MS 50
+#endif
+
+#ifndef IOSCHED_WRITE_EXPIRE_MS
+#define IOSCHED_WRITE_EXPIRE_MS 500
+#endif
+
+// Number of read dispatches after which the deadline policy serves a write.
+
+#ifndef IOSCHED_WRITES_STARVED
+#define IOSCHED_WRITES_STARVED 2
+#endif
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+#define IOSCHED_SECTOR_SIZE 512
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void noop_insert(struct iosched * sched, struct iosched_req * req);
+static struct iosched_req * noop_next(struct iosched * sched);
+
+static void deadline_insert(struct iosched * sched, struct iosched_req * req);
+static struct iosched_req * deadline_next(struct iosched * sched);
+
+static void iosched_unlink(struct iosched * sched, struct iosched_req * req);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static const struct iosched_policy iosched_policies[] = {
+    [IOSCHED_NOOP] = {
+        .name = "noop",
+        .insert = noop_insert,
+        .next = noop_next
+    },
+    [IOSCHED_DEADLINE] = {
+        .name = "deadline",
+        .insert = deadline_insert,
+        .next = deadline_next
+    }
+};
+
+#define IOSCHED_NPOLICY (sizeof(iosched_policies) / sizeof(iosched_policies[0]))
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * @brief Initializes an I/O scheduler.
+ * @param sched the scheduler to initialize
+ * @param policy_id the scheduling policy, IOSCHED_NOOP or IOSCHED_DEADLINE
+ * @param seg_max the maximum number of requests that can be merged into one chain
+ * @return no return
+ */
+void iosched_init(struct iosched * sched, int policy_id, uint32_t seg_max) {
+    memset(sched, 0, sizeof(struct iosched));
+    sched->seg_max = seg_max;
+
+    if (iosched_set_policy(sched, policy_id) < 0)
+        iosched_set_policy(sched, IOSCHED_DEADLINE);
+}
+
+/**
+ * @brief Changes the policy of a scheduler. The statistics are cleared, so that they describe only
+ * the new policy.
+ * @param sched the scheduler
+ * @param policy_id the new scheduling policy
+ * @return 0 if success, -EINVAL if the policy does not exist, -EBUSY if requests are queued
+ */
+int iosched_set_policy(struct iosched * sched, int policy_id) {
+    if (policy_id < 0 || policy_id >= IOSCHED_NPOLICY)
+        return -EINVAL;
+
+    if (sched->qcnt != 0)
+        return -EBUSY;
+
+    sched->policy = &iosched_policies[policy_id];
+    sched->policy_id = policy_id;
+    sched->next_sector = 0;
+    sched->starved = 0;
+    memset(&sched->stat, 0, sizeof(struct iosched_stat));
+    return 0;
+}
+
+/**
+ * @brief Queues a request. If a queued chain in the same direction ends where the request starts,
+ * the request is appended to it (back merge); if a queued chain starts where the request ends, the
+ * request becomes the new head of that chain (front merge). Otherwise the policy queues it.
+ * @param sched the scheduler
+ * @param req the request, with sector, len, buf and write filled in
+ * @return no return
+ */
+void iosched_add(struct iosched * sched, struct iosched_req * req) {
+    const uint64_t end = req->sector + req->len / IOSCHED_SECTOR_SIZE;
+    struct iosched_req ** pp;
+    struct iosched_req * q;
+    struct iosched_req * tail;
+    int dir;
+
+    req->next = NULL;
+    req->chain = NULL;
+    req->chain_len = req->len;
+    req->nseg = 1;
+    req->result = 0;
+    req->tqueue = csrr_time();
+    req->texpire = req->tqueue + (TIMER_FREQ / 1000) *
+        (req->write ? IOSCHED_WRITE_EXPIRE_MS : IOSCHED_READ_EXPIRE_MS);
+
+    sched->stat.reqs++;
+
+    for (dir = 0; dir < 2; dir++) {
+        for (pp = &sched->queue[dir]; (q = *pp) != NULL; pp = &q->next) {
+            if (q->write != req->write || q->nseg >= sched->seg_max)
+                continue;
+
+            if (q->sector + q->chain_len / IOSCHED_SECTOR_SIZE == req->sector) {
+                for (tail = q; tail->chain != NULL; tail = tail->chain)
+                    continue;
+                tail->chain = req;
+                q->nseg++;
+                q->chain_len += req->len;
+                sched->stat.back_merges++;
+                return;
+            }
+
+            if (end == q->sector) {
+                // req takes the place of q in the queue; the chain keeps the
+                // earlier of the two deadlines
+                req->chain = q;
+                req->next = q->next;
+                req->nseg = q->nseg + 1;
+                req->chain_len = q->chain_len + req->len;
+                if (q->texpire < req->texpire)
+                    req->texpire = q->texpire;
+                *pp = req;
+                sched->stat.front_merges++;
+                return;
+            }
+        }
+    }
+
+    sched->policy->insert(sched, req);
+    sched->qcnt++;
+}
+
+/**
+ * @brief Removes the next chain to be dispatched from the scheduler.
+ * @param sched the scheduler
+ * @return the first request of the chain, or NULL if the scheduler is empty
+ */
+struct iosched_req * iosched_next(struct iosched * sched) {
+    struct iosched_req * req;
+
+    if (sched->qcnt == 0)
+        return NULL;
+
+    req = sched->policy->next(sched);
+    iosched_unlink(sched, req);
+    sched->qcnt--;
+    sched->stat.dispatches++;
+    return req;
+}
+
+/**
+ * @brief Records the latency of every request of a completed chain.
+ * @param sched the scheduler that returned the chain
+ * @param req the first request of the chain
+ * @return no return
+ */
+void iosched_done(struct iosched * sched, struct iosched_req * req) {
+    const uint64_t now = csrr_time();
+    uint64_t lat;
+
+    for (; req != NULL; req = req->chain) {
+        lat = now - req->tqueue;
+        sched->stat.done[req->write]++;
+        sched->stat.lat_sum[req->write] += lat;
+        if (sched->stat.lat_max[req->write] < lat)
+            sched->stat.lat_max[req->write] = lat;
+    }
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// The noop policy keeps a single FIFO of both directions in queue[0].
+
+void noop_insert(struct iosched * sched, struct iosched_req * req) {
+    struct iosched_req ** pp;
+
+    for (pp = &sched->queue[0]; *pp != NULL; pp = &(*pp)->next)
+        continue;
+    *pp = req;
+}
+
+struct iosched_req * noop_next(struct iosched * sched) {
+    return sched->queue[0];
+}
+
+// The deadline policy keeps each direction sorted by sector.
+
+void deadline_insert(struct iosched * sched, struct iosched_req * req) {
+    struct iosched_req ** pp;
+
+    pp = &sched->queue[req->write];
+    while (*pp != NULL && (*pp)->sector < req->sector)
+        pp = &(*pp)->next;
+    req->next = *pp;
+    *pp = req;
+}
+
+struct iosched_req * deadline_next(struct iosched * sched) {
+    struct iosched_req * const reads = sched->queue[0];
+    struct iosched_req * const writes = sched->queue[1];
+    struct iosched_req * first;
+    struct iosched_req * req;
+    int dir;
+
+    if (reads != NULL && (writes == NULL || sched->starved < IOSCHED_WRITES_STARVED)) {
+        dir = 0;
+        if (writes != NULL)
+            sched->starved++;
+    } else {
+        dir = 1;
+        sched->starved = 0;
+    }
+
+    // The chain with the earliest deadline goes first if it has expired.
+    // Otherwise continue the sweep after the last dispatched sector, wrapping
+    // around to the lowest sector.
+
+    first = sched->queue[dir];
+    for (req = first; req != NULL; req = req->next)
+        if (req->texpire < first->texpire)
+            first = req;
+
+    if (first->texpire > csrr_time()) {
+        req = sched->queue[dir];
+        while (req != NULL && req->sector < sched->next_sector)
+            req = req->next;
+        first = (req != NULL) ? req : sched->queue[dir];
+    }
+
+    sched->next_sector = first->sector + first->chain_len / IOSCHED_SECTOR_SIZE;
+    return first;
+}
+
+void iosched_unlink(struct iosched * sched, struct iosched_req * req) {
+    struct iosched_req ** pp;
+    int dir;
+
+    for (dir = 0; dir < 2; dir++) {
+        for (pp = &sched->queue[dir]; *pp != NULL; pp = &(*pp)->next) {
+            if (*pp == req) {
+                *pp = req->next;
+                req->next = NULL;
+                return;
+            }
+        }
+    }
+}
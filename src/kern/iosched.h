@@ -0,0 +1,88 @@
+// iosched.h - Block I/O scheduler
+//
+
+#ifndef _IOSCHED_H_
+#define _IOSCHED_H_
+
+#include <stdint.h>
+#include "io.h" // struct iosched_stat, IOSCHED_NOOP, IOSCHED_DEADLINE
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// A block I/O request. The request is allocated by its owner, which fills in
+// /sector/, /len/, /buf/ and /write/ before passing it to iosched_add. If the
+// request is contiguous with a queued request, it is merged into it: the
+// requests are linked through /chain/ in ascending sector order, and the first
+// request of the chain stands for all of them in the queue. The driver sets
+// /result/ of every request in a chain when the chain completes.
+
+struct iosched_req {
+    struct iosched_req * next; // next request in the scheduler queue
+    struct iosched_req * chain; // next request merged into this one
+    uint64_t sector; // first sector
+    uint32_t len; // length in bytes, a multiple of the sector size
+    uint32_t chain_len; // length of the whole chain, valid for the first request
+    uint8_t write;
+    uint8_t nseg; // number of requests in the chain, valid for the first request
+    int result;
+    void * buf;
+    uint64_t tqueue; // time of iosched_add, for latency statistics
+    uint64_t texpire; // deadline of the chain, valid for the first request
+};
+
+struct iosched;
+
+// A scheduling policy. The /insert/ function places a request that could not
+// be merged into the queue of its direction; /next/ removes and returns the
+// next request to be dispatched, or NULL if there are none.
+
+struct iosched_policy {
+    const char * name;
+    void (*insert)(struct iosched * sched, struct iosched_req * req);
+    struct iosched_req * (*next)(struct iosched * sched);
+};
+
+struct iosched {
+    const struct iosched_policy * policy;
+    int policy_id;
+    uint32_t seg_max; // maximum number of requests in a chain
+    uint32_t qcnt; // number of queued chains
+    struct iosched_req * queue[2]; // indexed by /write/
+    uint64_t next_sector; // deadline: sector following the last dispatch
+    uint32_t starved; // deadline: reads dispatched while writes were waiting
+    struct iosched_stat stat;
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Initializes a scheduler with the given policy (IOSCHED_NOOP or
+// IOSCHED_DEADLINE). At most /seg_max/ requests are merged into one chain.
+
+extern void iosched_init(struct iosched * sched, int policy_id, uint32_t seg_max);
+
+// Changes the policy of a scheduler and clears its statistics. Returns -EBUSY
+// if requests are queued and -EINVAL if the policy is unknown.
+
+extern int iosched_set_policy(struct iosched * sched, int policy_id);
+
+// Queues a request, merging it with a queued request if they are contiguous.
+
+extern void iosched_add(struct iosched * sched, struct iosched_req * req);
+
+// Removes and returns the next chain to be dispatched, or NULL if the
+// scheduler is empty.
+
+extern struct iosched_req * iosched_next(struct iosched * sched);
+
+// Records the completion of a chain returned by iosched_next in the scheduler
+// statistics.
+
+extern void iosched_done(struct iosched * sched, struct iosched_req * req);
+
+static inline int iosched_empty(const struct iosched * sched) {
+    return (sched->qcnt == 0);
+}
+
+#endif // _IOSCHED_H_
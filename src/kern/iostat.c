@@ -0,0 +1,266 @@
+// iostat.c - I/O statistics
+//
+// Drivers and file systems keep their counters in a struct io_stat, which
+// they return for IOCTL_GETSTAT and register here by name. The "stats" device
+// reports all registered statistics as text, one source after the other:
+//
+//   blk0: read 120 ops 491520 bytes, write 8 ops 32768 bytes, other 2
+//     merges 5 retries 0 errors 0
+//     read latency: 512+:3 1024+:50 2048+:60 4096+:7
+//     write latency: 4096+:8
+//
+// Each latency histogram lists its non-empty buckets, as the lower bound of
+// the bucket in timer ticks and the number of requests in it.
+//
+
+#include "iostat.h"
+#include "console.h"
+#include "device.h"
+#include "error.h"
+#include "halt.h"
+#include "intr.h"
+#include "memory.h"
+#include "string.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+// Maximum number of registered sources.
+
+#ifndef IOSTAT_SRC_MAX
+#define IOSTAT_SRC_MAX 8
+#endif
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct iostat_src {
+    const char * name;
+    int instno;
+    struct io_stat * stat;
+};
+
+// An open stats device. The report is stored in the rest of the page holding
+// this struct.
+
+struct iostat_report {
+    struct io_intf io_intf;
+    uint64_t len;
+    uint64_t pos;
+    char text[];
+};
+
+#define IOSTAT_REPORT_MAX (PAGE_SIZE - sizeof(struct iostat_report))
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int iostat_open(struct io_intf ** ioptr, void * aux);
+static void iostat_close(struct io_intf * io);
+static long iostat_read(struct io_intf * io, void * buf, unsigned long bufsz);
+static int iostat_ioctl(struct io_intf * io, int cmd, void * arg);
+
+static void iostat_format(struct iostat_report * rpt);
+static void iostat_append(struct iostat_report * rpt, const char * fmt, ...);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct iostat_src iostat_srcs[IOSTAT_SRC_MAX];
+static int iostat_nsrc;
+
+static const struct io_ops iostat_ops = {
+    .close = iostat_close,
+    .read = iostat_read,
+    .ctl = iostat_ioctl
+};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * @brief Adds a source to the report of the stats device.
+ * @param name the name of the device or file system
+ * @param instno the instance number of the device
+ * @param stat the statistics of the source
+ * @return no return
+ */
+void iostat_register(const char * name, int instno, struct io_stat * stat) {
+    if (iostat_nsrc == IOSTAT_SRC_MAX) {
+        kprintf("iostat: too many sources, %s%d not registered\n", name, instno);
+        return;
+    }
+
+    iostat_srcs[iostat_nsrc].name = name;
+    iostat_srcs[iostat_nsrc].instno = instno;
+    iostat_srcs[iostat_nsrc].stat = stat;
+    iostat_nsrc++;
+}
+
+/**
+ * @brief Counts a completed request and adds its latency to the histogram of its direction.
+ * @param stat the statistics to update
+ * @param dir 0 for a read, 1 for a write
+ * @param bytes the number of bytes transferred
+ * @param ticks the latency of the request in timer ticks
+ * @return no return
+ */
+void iostat_record(struct io_stat * stat, int dir, uint64_t bytes, uint64_t ticks) {
+    int saved_intr_state;
+    int k;
+
+    // floor(log2(ticks)), without the libgcc count-leading-zeros helper
+    for (k = 0; ticks > 1 && k < IOSTAT_NHIST - 1; k++)
+        ticks >>= 1;
+
+    saved_intr_state = intr_disable();
+    stat->ops[dir]++;
+    stat->bytes[dir] += bytes;
+    stat->lat_hist[dir][k]++;
+    intr_restore(saved_intr_state);
+}
+
+/**
+ * @brief Registers the stats device with the device manager as "stats".
+ * @return no return
+ */
+void iostat_attach(void) {
+    device_register("stats", &iostat_open, NULL);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+/**
+ * @brief Opens the stats device, taking a snapshot of the registered statistics. Every open gets
+ * its own snapshot, so the device can be opened any number of times.
+ * @param ioptr the io_intf of the snapshot is returned here
+ * @param aux unused
+ * @return 0 if success
+ */
+int iostat_open(struct io_intf ** ioptr, void * aux) {
+    struct iostat_report * rpt;
+
+    assert (ioptr != NULL);
+
+    rpt = memory_alloc_page();
+    rpt->io_intf.ops = &iostat_ops;
+    rpt->io_intf.refcnt = 1;
+    rpt->len = 0;
+    rpt->pos = 0;
+    iostat_format(rpt);
+
+    *ioptr = &rpt->io_intf;
+    return 0;
+}
+
+/**
+ * @brief Closes a snapshot of the stats device and frees it.
+ * @param io the io_intf of the snapshot
+ * @return no return
+ */
+void iostat_close(struct io_intf * io) {
+    struct iostat_report * const rpt = (void *)io - offsetof(struct iostat_report, io_intf);
+
+    memory_free_page(rpt);
+}
+
+/**
+ * @brief Reads the report from the current position.
+ * @param io the io_intf of the snapshot
+ * @param buf the destination buffer
+ * @param bufsz the maximum number of bytes to read
+ * @return the number of bytes read, 0 at the end of the report
+ */
+long iostat_read(struct io_intf * io, void * buf, unsigned long bufsz) {
+    struct iostat_report * const rpt = (void *)io - offsetof(struct iostat_report, io_intf);
+    uint64_t len;
+
+    len = rpt->len - rpt->pos;
+    if (bufsz < len)
+        len = bufsz;
+
+    memcpy(buf, rpt->text + rpt->pos, len);
+    rpt->pos += len;
+    return len;
+}
+
+/**
+ * @brief Stats device io control function. Supports getlen, getpos and setpos on the report.
+ * @param io the io_intf of the snapshot
+ * @param cmd the ioctl number
+ * @param arg the argument of the ioctl
+ * @return 0 if success, -EINVAL if the position is out of range, -ENOTSUP for other ioctls
+ */
+int iostat_ioctl(struct io_intf * io, int cmd, void * arg) {
+    struct iostat_report * const rpt = (void *)io - offsetof(struct iostat_report, io_intf);
+
+    switch (cmd) {
+    case IOCTL_GETLEN:
+        *(uint64_t *)arg = rpt->len;
+        return 0;
+    case IOCTL_GETPOS:
+        *(uint64_t *)arg = rpt->pos;
+        return 0;
+    case IOCTL_SETPOS:
+        if (*(uint64_t *)arg > rpt->len)
+            return -EINVAL;
+        rpt->pos = *(uint64_t *)arg;
+        return 0;
+    default:
+        return -ENOTSUP;
+    }
+}
+
+// Writes the report of all registered sources into rpt. Each source is copied
+// with interrupts disabled, so that its counters are consistent with each
+// other.
+
+void iostat_format(struct iostat_report * rpt) {
+    static const char * const dir_names[] = { "read", "write" };
+    struct io_stat stat;
+    int saved_intr_state;
+    int i, dir, k;
+
+    for (i = 0; i < iostat_nsrc; i++) {
+        saved_intr_state = intr_disable();
+        memcpy(&stat, iostat_srcs[i].stat, sizeof(struct io_stat));
+        intr_restore(saved_intr_state);
+
+        iostat_append(rpt, "%s%d: read %lu ops %lu bytes, write %lu ops %lu bytes, other %lu\n",
+            iostat_srcs[i].name, iostat_srcs[i].instno,
+            (unsigned long)stat.ops[0], (unsigned long)stat.bytes[0],
+            (unsigned long)stat.ops[1], (unsigned long)stat.bytes[1],
+            (unsigned long)stat.other);
+        iostat_append(rpt, "  merges %lu retries %lu errors %lu\n",
+            (unsigned long)stat.merges, (unsigned long)stat.retries,
+            (unsigned long)stat.errors);
+
+        for (dir = 0; dir < 2; dir++) {
+            if (stat.ops[dir] == 0)
+                continue;
+
+            iostat_append(rpt, "  %s latency:", dir_names[dir]);
+            for (k = 0; k < IOSTAT_NHIST; k++)
+                if (stat.lat_hist[dir][k] != 0)
+                    iostat_append(rpt, " %lu+:%lu",
+                        (k == 0) ? 0UL : 1UL << k, (unsigned long)stat.lat_hist[dir][k]);
+            iostat_append(rpt, "\n");
+        }
+    }
+}
+
+// Appends formatted text to the report. Text that does not fit is dropped.
+
+void iostat_append(struct iostat_report * rpt, const char * fmt, ...) {
+    const size_t rem = IOSTAT_REPORT_MAX - rpt->len;
+    va_list ap;
+    size_t n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(rpt->text + rpt->len, rem, fmt, ap);
+    va_end(ap);
+
+    // vsnprintf returns the length of the whole output, even if truncated
+    rpt->len += (n < rem) ? n : rem - 1;
+}
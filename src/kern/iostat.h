@@ -0,0 +1,30 @@
+// iostat.h - I/O statistics
+//
+
+#ifndef _IOSTAT_H_
+#define _IOSTAT_H_
+
+#include <stdint.h>
+#include "io.h" // struct io_stat
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Registers the statistics of a device or file system, so that they are
+// included in the report of the "stats" device. Argument /name/ and /instno/
+// identify the source in the report; /stat/ must remain valid.
+
+extern void iostat_register(const char * name, int instno, struct io_stat * stat);
+
+// Records a completed request of /bytes/ bytes in direction /dir/ (0 for
+// reads, 1 for writes) that took /ticks/ timer ticks. May be called from an
+// interrupt handler.
+
+extern void iostat_record(struct io_stat * stat, int dir, uint64_t bytes, uint64_t ticks);
+
+// Registers the "stats" device. Opening it takes a snapshot of all registered
+// statistics as text, which is then read like a file.
+
+extern void iostat_attach(void);
+
+#endif // _IOSTAT_H_
@@ -1,52 +1,358 @@
 #include "fs.h"
 #include "lock.h"
+#include "csr.h"
+#include "iostat.h"
+#include "memory.h"
+#include "pagecache.h"
+#include "lz4.h"
+#include "thread.h"
+#include "timer.h"
+
+// Number of inodes kept in the inode cache when no file uses them. Inodes of
+// open files are always cached, so the cache grows past this size if more
+// files are open.
+#ifndef KFS_ICACHE_SIZE
+#define KFS_ICACHE_SIZE 16
+#endif
+
+// Number of hash chains of the inode cache
+#define KFS_ICACHE_HASH 16
+
+// Maximum number of pages read into the page cache by one fill, starting at
+// the page a read misses on. File blocks are pages (BLOCK_SIZE is PAGE_SIZE).
+#ifndef KFS_READAHEAD
+#define KFS_READAHEAD 16
+#endif
+
+// Number of data blocks described by one block of the free-block bitmap
+#define KFS_BITMAP_BITS (BLOCK_SIZE * 8)
+
+// Interval of the journal committer thread. Metadata changes made within an
+// interval are committed together, with one pair of flushes.
+#ifndef KFS_COMMIT_INTERVAL_MS
+#define KFS_COMMIT_INTERVAL_MS 20
+#endif
+
+// Number of hash chains of the root directory index
+#define KFS_DIR_HASH 64
+
+// Number of entries and hash chains of the dentry cache
+#ifndef KFS_DCACHE_SIZE
+#define KFS_DCACHE_SIZE 256
+#endif
+#define KFS_DCACHE_HASH 64
+
+// Directory "inode number" of the root directory, which is in the boot block
+#define KFS_ROOT_INO 0xffffffff
+
+// Type of a negative dentry cache entry, for a name that does not exist
+#define KFS_NEGATIVE 0xff
+
+// An entry of the directory index, for the directory entry with the same
+// index in the boot block
+struct kfs_dindex
+{
+  struct kfs_dindex *next; // next entry in the hash chain
+  uint32_t hash; // hash of the file name
+};
+
+// An entry of the dentry cache: the inode and type of the entry with a name
+// in the directory with inode number parent, or, if type is KFS_NEGATIVE, the
+// fact that the directory has no entry with that name. Entries are replaced
+// in clock order; an entry used since the clock hand last passed it gets a
+// second chance.
+struct kfs_dentry
+{
+  struct kfs_dentry *next; // next entry in the hash chain
+  uint32_t hash; // hash of parent and name, 0 if the entry is free
+  uint32_t parent;
+  uint32_t ino;
+  uint8_t type; // FT_FILE, FT_DIR or KFS_NEGATIVE
+  uint8_t referenced;
+  char name[MAX_FILE_NAME_LENGTH];
+};
+
+// A metadata block in the journal: the device block it belongs at, and a copy
+// of its contents in a page
+struct kfs_jblock
+{
+  uint32_t home;
+  void *data;
+};
+
 // boot blocks for the file system
 static boot_block_t* boot_block;
 // io interface for the file system
 static struct io_intf *fs_io = NULL;
-// file descriptor table
-static file_t file_desc_tab[MAX_FILE_OPEN];
+// closed files, reused by fs_open since kfree does not free memory
+static file_t *file_free_list = NULL;
+// inode cache: hash chains by inode number, unused inode structs, and the
+// number of cached inodes
+static struct kfs_inode *icache[KFS_ICACHE_HASH];
+static struct kfs_inode *inode_free_list = NULL;
+static uint32_t icache_cnt = 0;
+// root directory index: hash chains by file name, and one entry per
+// directory entry of the boot block
+static struct kfs_dindex *dir_hash[KFS_DIR_HASH];
+static struct kfs_dindex dir_index[MAX_DIR_ENTRIES];
+// dentry cache: hash chains by parent and name, the entries, and the clock
+// hand
+static struct kfs_dentry *dcache_hash[KFS_DCACHE_HASH];
+static struct kfs_dentry dcache[KFS_DCACHE_SIZE];
+static uint32_t dcache_hand = 0;
+// inodes in use, one bit per inode, found at mount by walking the directory
+// tree
+static uint8_t *fs_inode_used = NULL;
+// free-block bitmap, one bit per data block, set if the block is in use. Each
+// bitmap block is kept in a page; there are none if the image has no bitmap,
+// and then no blocks can be allocated.
+static uint8_t **fs_bitmap = NULL;
+// bitmap blocks changed since they were last written, one flag per block
+static uint8_t *fs_bitmap_dirty = NULL;
+// where the next search for a free block starts if a file has no blocks
+static uint32_t fs_alloc_next = 0;
+// a block of zeroes, for zeroing file tails and new inodes
+static char *fs_zero_block = NULL;
 // base address of the file system, basically just zero, everything operates using offsets
 static size_t fs_base = 0;
+// position of data block 0 on the device
+static uint64_t fs_data_base = 0;
+// nonzero if inodes hold extents (FS_FEATURE_EXTENTS), zero for block maps
+static int fs_extents = 0;
+// nonzero if inodes may hold compressed files (FS_FEATURE_COMPRESS)
+static int fs_compress = 0;
+// nonzero if metadata is written through the journal (FS_FEATURE_JOURNAL).
+// Metadata blocks changed under fs_lk are copied into the running
+// transaction; the committer thread writes it to the log as one transaction
+// every KFS_COMMIT_INTERVAL_MS, so operations never wait for metadata
+// writes, and copies the committed blocks to their homes only when the log is
+// full (a checkpoint). Until then, committed blocks are read from fs_jlog.
+static int fs_journal = 0;
+// device position of the journal header, number of log blocks, and the
+// number of blocks one operation may add to the running transaction
+static uint64_t fs_jbase = 0;
+static uint32_t fs_jslots = 0;
+static uint32_t fs_jreserve = 0;
+// the running transaction, the transaction being committed, and the latest
+// copies of the blocks in the log; each holds at most fs_jslots blocks
+static struct kfs_jblock *fs_jrun;
+static struct kfs_jblock *fs_jcommit;
+static struct kfs_jblock *fs_jlog;
+static uint32_t fs_jrun_cnt = 0;
+static uint32_t fs_jcommit_cnt = 0;
+static uint32_t fs_jlog_cnt = 0;
+// log blocks written since the last checkpoint
+static uint32_t fs_jused = 0;
+// the journal header as last written, used by the committer only
+static journal_header_t *fs_jhdr;
+// sequence number of the last committed transaction, and the error of the
+// last failed commit, 0 once a commit succeeds
+static uint64_t fs_jseq = 0;
+static int fs_jerror = 0;
+// broadcast when a commit ends
+static struct condition fs_jdone;
+// the bitmap as of the last commit. A block freed by a transaction that is
+// not committed is not allocated again, since the committed file system
+// still uses it.
+static uint8_t **fs_bitmap_committed = NULL;
+// a compressed chunk read from the device, and the chunk decompressed, under
+// fs_zlk. Chunks of all files are decompressed through these buffers, one at
+// a time, while the fill lock of the file is held.
+static uint8_t *fs_zbuf = NULL;
+static uint8_t *fs_zchunk = NULL;
+static struct lock fs_zlk;
+// fs_lk protects the directories (boot block, root directory index, dentry
+// cache and the contents of the other directories), the inode cache, the
+// closed files, and block and inode allocation. It is not held while file
+// data is read or written: the data and the on-disk inode of a file are
+// protected by the reader/writer lock of its cached inode, so any number of
+// threads read a file at once, and the position of an open file by the lock
+// of the file. Locks are taken in the order file, inode, fs_lk, except that
+// directory inodes are locked with fs_lk held: nothing waits for fs_lk while
+// it holds the lock of a directory inode, since directories are only changed
+// with fs_lk held and cannot be written through an open file. The page cache
+// is changed without sleeping, so it needs no lock of its own on a single
+// hart.
 struct lock fs_lk;
+// request counts and latencies of fs_read and fs_write, over all files
+static struct io_stat fs_iostat;
+
+static long fs_do_readv(struct io_intf *io, const struct io_vec *iov, int iovcnt, const uint64_t *posp);
+static long fs_do_writev(struct io_intf *io, const struct io_vec *iov, int iovcnt, const uint64_t *posp);
+static long fs_read_at(struct kfs_inode *inode, uint64_t pos, void *buf, unsigned long n);
+static long fs_write_at(struct kfs_inode *inode, uint64_t pos, const void *buf, unsigned long n);
+static void fs_account(int dir, long result, uint64_t t0);
+static int fs_direct(struct kfs_inode *inode, uint64_t first_block, void *buf, uint64_t nblocks, int write);
+static int fs_getpage(struct kfs_inode *inode, uint64_t index, struct pcache_page **pgptr);
+static int fs_fill(struct kfs_inode *inode, uint64_t index, uint64_t npages, struct pcache_page **pages);
+static int fs_zfill(struct kfs_inode *inode, uint64_t index, struct pcache_page **pgptr);
+static int inode_compressed(const inode_t *disk);
+static void fs_cache_update(struct kfs_inode *inode, uint64_t pos, const void *buf, uint64_t n);
+static int fs_mappage(file_t *file, struct io_page *pg);
+static int fs_writepage(file_t *file, const uint64_t *indexp);
+static uint64_t fs_map(struct kfs_inode *inode, uint64_t pos, uint64_t n, uint64_t *lenp);
+static uint64_t fs_bmap(struct kfs_inode *inode, uint64_t blk, uint64_t max, uint32_t *dblkptr);
+static int bmap_append(struct kfs_inode *inode, uint64_t blk, uint32_t dblk);
+static void bmap_truncate(struct kfs_inode *inode, uint64_t nblocks);
+static int inode_valid(const inode_t *disk);
+static int inode_get(uint32_t ino, struct kfs_inode **inodeptr);
+static void inode_put(struct kfs_inode *inode);
+static struct kfs_inode *inode_evict(void);
+static uint32_t dir_name_hash(const char *name);
+static void dir_index_add(int idx);
+static int dir_lookup(const char *name);
+static void dir_index_remove(int idx);
+static void inode_forget(uint32_t ino);
+static void fs_op_begin(void);
+static int journal_log(uint32_t home, const void *buf);
+static int journal_read(uint32_t home, void *buf);
+static int journal_holds(uint32_t home);
+static int journal_replay(void);
+static int journal_commit(void);
+static int journal_checkpoint(void);
+static int journal_sync(void);
+static void kfs_committer(void *arg);
+static int fs_meta_read(uint64_t pos, void *buf);
+static int fs_dev_write(uint64_t pos, const void *buf, uint64_t len);
+static int dir_write(struct kfs_inode *dir, uint64_t idx, const dentry_t *dent);
+static int entry_stat(uint32_t ino, uint8_t type, struct stat *st);
+static int path_parent(const char *path, uint32_t *dirp, char *name);
+static int dir_find(uint32_t dir, const char *name, uint32_t *inop, uint8_t *typep);
+static long subdir_scan(struct kfs_inode *dir, const char *name, dentry_t *dentp);
+static int dir_add(uint32_t dir, const dentry_t *dent);
+static int dir_remove(uint32_t dir, const char *name);
+static int fs_scan_inodes(void);
+static int inode_mark(const dentry_t *dent, uint8_t *pending);
+static int inode_alloc(uint32_t *inop);
+static uint32_t dcache_key(uint32_t parent, const char *name);
+static struct kfs_dentry *dcache_lookup(uint32_t parent, const char *name);
+static void dcache_add(uint32_t parent, const char *name, uint32_t ino, uint8_t type);
+static void dcache_purge(uint32_t parent);
+static void dcache_unlink(struct kfs_dentry *ent);
+static int fs_do_create(const char *path, uint8_t type);
+static int inode_write(struct kfs_inode *inode);
+static int file_resize(struct kfs_inode *inode, uint64_t len, int zero);
+static void file_free_blocks(struct kfs_inode *inode, uint64_t first, uint64_t end);
+static int fs_meta_write(uint64_t pos, const void *buf, uint64_t len);
+static int fs_zero(uint64_t pos, uint64_t len);
+static int block_alloc(uint32_t hint, uint32_t *blkptr);
+static void block_free(uint32_t blk);
+static void block_discard(uint32_t first, uint32_t count);
+static int bitmap_flush(void);
 
 /**
- * @brief Mounts the filesystem by initializing the file descriptor table and reading the boot block.
+ * @brief Mounts the filesystem by reading the boot block and the free-block bitmap.
  *
- * This function sets up the filesystem by associating it with the provided I/O interface,
- * reading the boot block into memory, and initializing the file descriptor table.
+ * This function sets up the filesystem by associating it with the provided I/O interface
+ * and reading the boot block and the free-block bitmap into memory, after replaying the
+ * journal if it holds committed transactions. The inodes in use are found by walking the
+ * directory tree. Inodes are read into the inode cache when their
+ * files are opened.
  *
  * @param io Pointer to the I/O interface to be used for filesystem operations.
  * @return 0 on success, non-zero error code on failure.
  */
 int fs_mount(struct io_intf *io)
 {
+  int result;
+
   lock_init(&fs_lk, "kfs_lock");
   fs_io = io;
+  fs_zero_block = memory_alloc_page();
+  memset(fs_zero_block, 0, BLOCK_SIZE);
   // Allocate memory for the boot block
   boot_block = kmalloc(sizeof(boot_block_t));
   ioseek(fs_io, 0);
   ioread_full(fs_io, boot_block, BLOCK_SIZE);
+
+  // [ boot block | inodes | bitmap | journal | data blocks ]
+  fs_extents = (boot_block->features & FS_FEATURE_EXTENTS) != 0;
+  fs_compress = fs_extents && (boot_block->features & FS_FEATURE_COMPRESS) != 0;
+  fs_journal = (boot_block->features & FS_FEATURE_JOURNAL) != 0;
+  if (fs_compress)
+  {
+    lock_init(&fs_zlk, "kfs_zlock");
+    fs_zbuf = kmalloc(CHUNK_SIZE);
+    fs_zchunk = kmalloc(CHUNK_SIZE);
+  }
+  fs_data_base = fs_base + (1 + (uint64_t)boot_block->num_inodes + boot_block->num_bitmap) * BLOCK_SIZE;
+  if (fs_journal)
+  {
+    if (boot_block->num_journal < 2)
+      return -EBADFMT;
+    fs_jbase = fs_data_base;
+    fs_data_base += (uint64_t)boot_block->num_journal * BLOCK_SIZE;
+    fs_jslots = boot_block->num_journal - 1;
+    if (fs_jslots > MAX_JOURNAL_BLOCKS)
+      fs_jslots = MAX_JOURNAL_BLOCKS;
+    // an operation changes the boot block or two directory blocks, two
+    // inodes, and bitmap blocks
+    fs_jreserve = boot_block->num_bitmap + 5;
+    if (fs_jreserve > fs_jslots)
+      return -EBADFMT;
+    fs_jrun = kmalloc(fs_jslots * sizeof(struct kfs_jblock));
+    fs_jcommit = kmalloc(fs_jslots * sizeof(struct kfs_jblock));
+    fs_jlog = kmalloc(fs_jslots * sizeof(struct kfs_jblock));
+    condition_init(&fs_jdone, "kfs_jdone");
+    // the boot block is read again if the log changes it
+    result = journal_replay();
+    if (result < 0)
+      return result;
+  }
+
   // Read the boot block
-  // get the boot block, the boot block won't be changed after mounting
-  for (int i = 0; i < MAX_FILE_OPEN; i++)
+  // the boot block is written back when files are created or deleted
+  for (int i = 0; i < boot_block->num_dentry; i++)
+    dir_index_add(i);
+
+  if (boot_block->num_bitmap != 0)
   {
-    file_desc_tab[i].flag = UNUSE;
-    // mark all file as UNUSE for initialization, all UNUSED files can be flushed by fs_open with new file opened
+    if (boot_block->num_bitmap > PAGE_SIZE / sizeof(uint8_t *))
+      return -EINVAL;
+    fs_bitmap = kmalloc(boot_block->num_bitmap * sizeof(uint8_t *));
+    fs_bitmap_dirty = kcalloc(boot_block->num_bitmap, sizeof(uint8_t));
+    if (fs_journal)
+      fs_bitmap_committed = kmalloc(boot_block->num_bitmap * sizeof(uint8_t *));
+    ioseek(fs_io, fs_base + (1 + (uint64_t)boot_block->num_inodes) * BLOCK_SIZE);
+    for (int i = 0; i < boot_block->num_bitmap; i++)
+    {
+      fs_bitmap[i] = memory_alloc_page();
+      if (ioread_full(fs_io, fs_bitmap[i], BLOCK_SIZE) != BLOCK_SIZE)
+        return -EIO;
+      if (fs_journal)
+      {
+        fs_bitmap_committed[i] = memory_alloc_page();
+        memcpy(fs_bitmap_committed[i], fs_bitmap[i], BLOCK_SIZE);
+      }
+    }
   }
+
+  lock_acquire(&fs_lk);
+  result = fs_scan_inodes();
+  lock_release(&fs_lk);
+  if (result < 0)
+    return result;
+
+  if (fs_journal)
+    thread_spawn("kfs_committer", kfs_committer, NULL);
+  iostat_register("kfs", 0, &fs_iostat);
   return 0;
 }
 
 /**
  * @brief Opens a file and sets up an I/O interface for it.
  *
- * This function searches for a file by its name in the directory entries of the boot block.
- * If the file is found, it allocates memory for a new I/O interface, sets up the interface,
- * and initializes a file descriptor for the file.
+ * This function looks up the file by its path, one directory at a time, through the
+ * dentry cache. If the file is found, it takes a reference to its inode in the inode
+ * cache, reading the inode from disk if it is not cached, and sets up a file whose
+ * io_intf is returned. A directory other than the root can be opened to read its
+ * entries, but not written.
  *
- * @param name The name of the file to open.
+ * @param name The path of the file to open, with components separated by '/'.
  * @param io A pointer to a pointer to an I/O interface structure. This will be set to the newly created I/O interface.
- * @return 0 on success, -1 on failure (e.g., memory allocation failure).
+ * @return 0 on success, -ENOENT if the file does not exist, -EINVAL if the path names
+ *         the root directory or has a component longer than MAX_FILE_NAME_LENGTH, or a
+ *         negative error code if an inode could not be read.
  */
 
 int fs_open(const char *name, struct io_intf **io)
@@ -58,453 +364,1343 @@ int fs_open(const char *name, struct io_intf **io)
       .close = fs_close,
       .read = fs_read,
       .write = fs_write,
-      .ctl = fs_ioctl};
-  for (int i = 0; i < boot_block->num_dentry; i++)
+      .ctl = fs_ioctl,
+      .readv = fs_readv,
+      .writev = fs_writev};
+  char fname[MAX_FILE_NAME_LENGTH + 1];
+  uint32_t dir, ino;
+  uint8_t type;
+  int result = path_parent(name, &dir, fname);
+  // the root directory is the boot block, not a file
+  if (result == 0 && fname[0] == '\0')
+    result = -EINVAL;
+  if (result == 0)
+    result = dir_find(dir, fname, &ino, &type);
+  if (result < 0)
   {
-    if (strcmp(boot_block->dir_entries[i].file_name, name) == 0)
-    {
-      // file found
-      // set up a new instance of io_interface for the file struct
-      struct io_intf *file_io = (struct io_intf *)kmalloc(sizeof(struct io_intf));
-      if (file_io == NULL)
-      {
-        return -EINVAL; // Handle memory allocation failure
-      }
+    lock_release(&fs_lk);
+    return result;
+  }
 
-      file_io->ops = &fs_io_ops;
-      // initialize the reference count to 1
-      file_io->refcnt = 1;
-      // pass the io interface to the caller
-      *io = file_io;
-      // check if the file has unique io interface
-
-      // set inode_num to be the inode number of the file
-      uint64_t inode_num = boot_block->dir_entries[i].inode;
-      // seek to the inode position
-      uint64_t position = fs_base + BLOCK_SIZE + boot_block->dir_entries[i].inode * BLOCK_SIZE;
-      // console_printf("Seeking to position: %d\n", position);
-      uint64_t file_position = 0;
-      ioseek(fs_io, position);
-      inode_t* file_inode = kmalloc(BLOCK_SIZE);
-      ioread_full(fs_io, file_inode, BLOCK_SIZE);
-      uint64_t file_size = (uint64_t)(file_inode->byte_len);
-      uint64_t flag = INUSE;
-      for (int j = 0; j < MAX_FILE_OPEN; j++)
-      {
-        if (file_desc_tab[j].flag == UNUSE)
-        {
-          file_desc_tab[j].file_position = file_position;
-          file_desc_tab[j].file_size = file_size;
-          file_desc_tab[j].inode_num = inode_num;
-          file_desc_tab[j].flag = flag;
-          file_desc_tab[j].io = file_io;
-          lock_release(&fs_lk);
-          return 0;
-        }
-      }
-    }
+  // file found
+  struct kfs_inode *inode;
+  result = inode_get(ino, &inode);
+  if (result < 0)
+  {
+    lock_release(&fs_lk);
+    return result;
   }
-  // console_printf("File not found\n");
+  inode->dir = (type == FT_DIR);
+
+  // reuse a closed file if there is one
+  file_t *file = file_free_list;
+  if (file != NULL)
+    file_free_list = file->next_free;
+  else
+    file = kmalloc(sizeof(file_t));
+
+  file->io.ops = &fs_io_ops;
+  // initialize the reference count to 1
+  file->io.refcnt = 1;
+  file->inode = inode;
+  lock_init(&file->lk, "kfs_file");
+  file->file_position = 0;
+  file->next_free = NULL;
+  // pass the io interface to the caller
+  *io = &file->io;
   lock_release(&fs_lk);
-  return -ENOENT;
+  return 0;
 }
 
 /**
  * @brief Closes a file associated with the given I/O interface.
  *
- * This function iterates through the file descriptor table to find the entry
- * that matches the provided I/O interface. Once found, it marks the file
- * descriptor as unused and frees the associated I/O interface memory.
+ * This function releases the reference of the file to its inode and keeps the
+ * file for reuse by fs_open.
  *
  * @param io Pointer to the I/O interface to be closed.
  */
 void fs_close(struct io_intf *io)
 {
-  for (int i = 0; i < MAX_FILE_OPEN; i++)
-  {
-    if (file_desc_tab[i].io == io)
-    {
-      file_desc_tab[i].flag = UNUSE;
-      kfree(file_desc_tab[i].io);
-      return;
-    }
-  }
+  file_t *file = (void *)io - offsetof(file_t, io);
+
+  lock_acquire(&fs_lk);
+  inode_put(file->inode);
+  file->inode = NULL;
+  file->next_free = file_free_list;
+  file_free_list = file;
+  lock_release(&fs_lk);
 }
 
 /**
- * @brief Writes data to a file in the filesystem.
+ * @brief Creates an empty file.
  *
- * This function writes up to `n` bytes from the buffer `buf` to the file
- * associated with the given `io` interface. It updates the file's position
- * accordingly and handles block-level operations to ensure data is written
- * correctly to the filesystem.
+ * This function allocates an inode that no directory entry refers to, clears
+ * it and adds an entry for it to its directory. Without the journal, the
+ * inode and the directory are written to disk before the function returns;
+ * with it, they go into the running transaction, which reaches the disk at
+ * the next commit, at most KFS_COMMIT_INTERVAL_MS later, or when a file is
+ * flushed.
  *
- * @param io Pointer to the I/O interface representing the file.
- * @param buf Pointer to the buffer containing the data to be written.
- * @param n Number of bytes to write from the buffer.
- * @return The number of bytes successfully written, or -1 if an error occurs.
+ * @param name The path of the new file; its last component is at most
+ *        MAX_FILE_NAME_LENGTH bytes.
+ * @return 0 on success, -EINVAL if the name is empty or too long, -ENOENT if
+ *         its directory does not exist, -EEXIST if the file exists, -ENOSPC if
+ *         the directory or the inodes are full, or a negative error code if the
+ *         file system could not be written.
+ */
+int fs_create(const char *name)
+{
+  return fs_do_create(name, FT_FILE);
+}
+
+/**
+ * @brief Creates an empty directory, like fs_create creates a file.
  *
- * @note The function assumes that the file descriptor table and other
- *       filesystem structures are properly initialized and accessible.
- *       It also assumes that the file is not full and has enough space
- *       to accommodate the data being written.
+ * @param name The path of the new directory.
+ * @return 0 on success, or a negative error code as for fs_create.
  */
+int fs_mkdir(const char *name)
+{
+  return fs_do_create(name, FT_DIR);
+}
 
-long fs_write(struct io_intf *io, const void *buf, unsigned long n)
+/**
+ * @brief Returns the status of a file or directory without opening it.
+ *
+ * @param name The path of the file; an empty path or "/" names the root
+ *        directory.
+ * @param st The status is returned here.
+ * @return 0 on success, -ENOENT if the file does not exist, -EINVAL if a
+ *         component of the path is too long, or a negative error code if an
+ *         inode could not be read.
+ */
+int fs_stat(const char *name, struct stat *st)
 {
+  char fname[MAX_FILE_NAME_LENGTH + 1];
+  uint32_t ino = KFS_ROOT_INO;
+  uint8_t type = FT_DIR;
+  int result;
+
   lock_acquire(&fs_lk);
-  int result = 0;
-  for (int i = 0; i < MAX_FILE_OPEN; i++)
+  result = path_parent(name, &ino, fname);
+  if (result == 0 && fname[0] != '\0')
+    result = dir_find(ino, fname, &ino, &type);
+  if (result == 0)
+    result = entry_stat(ino, type, st);
+  lock_release(&fs_lk);
+  return result;
+}
+
+/**
+ * @brief Reads a batch of entries of a directory, with the inode number and
+ * size of each, starting at a cursor that is advanced past them. Listing a
+ * directory takes a call per batch, so it needs no more memory than a batch
+ * whatever the size of the directory. Each entry is returned with no lock
+ * held, so ents may be a user buffer. Entries added or removed between calls
+ * may be missed, since removing an entry moves the last entry into its place.
+ *
+ * @param name The path of the directory; an empty path or "/" names the root
+ *        directory.
+ * @param cursor The index of the first entry to return, 0 to start at the
+ *        beginning; it is advanced past the entries returned.
+ * @param ents The entries are returned here.
+ * @param n The maximum number of entries to return.
+ * @return The number of entries returned, 0 at the end of the directory,
+ *         -ENOENT if the directory does not exist, -EINVAL if the path names a
+ *         file, or a negative error code if the directory or an inode could not
+ *         be read.
+ */
+long fs_getdents(const char *name, uint64_t *cursor, struct dirent *ents, unsigned long n)
+{
+  char fname[MAX_FILE_NAME_LENGTH + 1];
+  struct kfs_inode *dir = NULL;
+  uint32_t ino = KFS_ROOT_INO;
+  uint8_t type = FT_DIR;
+  struct dirent ent;
+  struct stat st;
+  dentry_t dent;
+  unsigned long cnt;
+  long result;
+
+  lock_acquire(&fs_lk);
+  result = path_parent(name, &ino, fname);
+  if (result == 0 && fname[0] != '\0')
+    result = dir_find(ino, fname, &ino, &type);
+  if (result == 0 && type != FT_DIR)
+    result = -EINVAL;
+  // the reference keeps the directory from being removed until the end
+  if (result == 0 && ino != KFS_ROOT_INO)
+  {
+    result = inode_get(ino, &dir);
+    if (result == 0)
+      dir->dir = 1;
+  }
+  lock_release(&fs_lk);
+  if (result < 0)
+    return result;
+
+  for (cnt = 0; cnt < n; cnt++)
   {
-    if (io == file_desc_tab[i].io && file_desc_tab[i].flag == INUSE)
+    lock_acquire(&fs_lk);
+    if (dir == NULL)
+    {
+      result = (*cursor < boot_block->num_dentry) ? sizeof(dentry_t) : 0;
+      if (result > 0)
+        dent = boot_block->dir_entries[*cursor];
+    }
+    else
+    {
+      rwlock_acquire_read(&dir->lk);
+      result = fs_read_at(dir, *cursor * sizeof(dentry_t), &dent, sizeof(dentry_t));
+      rwlock_release_read(&dir->lk);
+    }
+    // a short read is the end of the directory
+    if (result != sizeof(dentry_t))
     {
-      // found the file
-      file_t *file = &file_desc_tab[i];
-      uint64_t file_position = file->file_position;
-      uint64_t inode_num = file->inode_num;
+      lock_release(&fs_lk);
+      break;
+    }
+    result = entry_stat(dent.inode, dent.file_type, &st);
+    lock_release(&fs_lk);
+    if (result < 0)
+      break;
 
-      // Seek to the inode position
-      result = ioseek(fs_io, fs_base + BLOCK_SIZE + inode_num * BLOCK_SIZE);
+    ent.d_ino = st.st_ino;
+    ent.d_type = st.st_type;
+    ent.d_size = st.st_size;
+    memcpy(ent.d_name, dent.file_name, MAX_FILE_NAME_LENGTH);
+    ent.d_name[MAX_FILE_NAME_LENGTH] = '\0';
+    memcpy(&ents[cnt], &ent, sizeof(ent));
+    (*cursor)++;
+  }
 
-      if (result < 0)
-      {
-        lock_release(&fs_lk);
-        return result;
-      }
-      // Read the inode
-      inode_t *file_inode = kmalloc(sizeof(inode_t));
-      result = ioread_full(fs_io, file_inode, BLOCK_SIZE);
+  if (dir != NULL)
+  {
+    lock_acquire(&fs_lk);
+    inode_put(dir);
+    lock_release(&fs_lk);
+  }
+  // entries returned before an error are not lost
+  return (result < 0 && cnt == 0) ? result : (long)cnt;
+}
 
-      if (result < 0)
-      {
-        lock_release(&fs_lk);
-        return result;
-      }
-      // Calculate the number of blocks written based on the file position
-      uint64_t written_blocks = file_position / BLOCK_SIZE;
-      uint64_t written_bytes = file_position % BLOCK_SIZE;
+/**
+ * @brief Creates an empty file or directory.
+ *
+ * @param path The path of the new file.
+ * @param type FT_FILE or FT_DIR.
+ * @return 0 on success, or a negative error code as for fs_create.
+ */
+static int fs_do_create(const char *path, uint8_t type)
+{
+  char name[MAX_FILE_NAME_LENGTH + 1];
+  dentry_t dent;
+  uint32_t dir, ino;
+  uint8_t old_type;
+  int result;
 
-      if (file_position + n > file_inode->byte_len)
-      {
-        // Check if the file is full
-        // Zero byte written means EOF
-        n = file_inode->byte_len - file_position;
-      }
+  fs_op_begin();
+  result = path_parent(path, &dir, name);
+  if (result == 0 && name[0] == '\0')
+    result = -EINVAL;
+  if (result == 0)
+  {
+    result = dir_find(dir, name, &ino, &old_type);
+    if (result == 0)
+      result = -EEXIST;
+    else if (result == -ENOENT)
+      result = 0;
+  }
+  if (result == 0)
+    result = inode_alloc(&ino);
+  if (result < 0)
+  {
+    lock_release(&fs_lk);
+    return result;
+  }
 
-      // Seek to the data block position
-      result = ioseek(fs_io, fs_base + BLOCK_SIZE + boot_block->num_inodes * BLOCK_SIZE + file_inode->data_block_num[written_blocks] * BLOCK_SIZE);
+  // an empty inode has length 0 and no blocks; an empty directory has no
+  // entries
+  inode_forget(ino);
+  result = fs_meta_write(fs_base + BLOCK_SIZE + (uint64_t)ino * BLOCK_SIZE, fs_zero_block, BLOCK_SIZE);
 
-      if (result < 0)
-      {
-        lock_release(&fs_lk);
-        return result;
-      }
-      // Read the data block
-      data_block_t* data_block = kmalloc(sizeof(data_block_t));
-      size_t pos = 0;
-      result = ioctl(fs_io, IOCTL_GETPOS, &pos);
-      if (result < 0)
-      {
-        lock_release(&fs_lk);
-        return result;
-      }
+  if (result == 0)
+  {
+    memset(&dent, 0, sizeof(dentry_t));
+    strncpy(dent.file_name, name, MAX_FILE_NAME_LENGTH);
+    dent.inode = ino;
+    dent.file_type = type;
+    result = dir_add(dir, &dent);
+  }
+  if (result < 0)
+    fs_inode_used[ino / 8] &= ~(1 << (ino % 8));
+  else
+    dcache_add(dir, name, ino, type);
+  lock_release(&fs_lk);
+  return result;
+}
 
-      result = ioread_full(fs_io, data_block, BLOCK_SIZE);
+/**
+ * @brief Deletes a file or an empty directory.
+ *
+ * This function frees the blocks of the file and removes its directory entry.
+ * The last entry of the directory takes its place, so that the entries stay
+ * contiguous. A file that is open, or a directory that has entries, cannot be
+ * deleted. The changes reach the disk like those of fs_create.
+ *
+ * @param name The path of the file.
+ * @return 0 on success, -ENOENT if the file does not exist, -EBUSY if it is
+ *         open or is a directory that is not empty, or a negative error code
+ *         if the file system could not be written.
+ */
+int fs_unlink(const char *name)
+{
+  char fname[MAX_FILE_NAME_LENGTH + 1];
+  struct kfs_inode *inode;
+  uint32_t dir, ino;
+  uint8_t type;
+  int result;
 
-      if (result < 0)
-      {
-        lock_release(&fs_lk);
-        return result;
-      }
-      uint64_t bytes_written = 0;
+  fs_op_begin();
+  result = path_parent(name, &dir, fname);
+  if (result == 0)
+    result = dir_find(dir, fname, &ino, &type);
+  if (result == 0)
+    result = inode_get(ino, &inode);
+  if (result < 0)
+  {
+    lock_release(&fs_lk);
+    return result;
+  }
+  // the reference just taken is the only one if the file is not open, and
+  // then no other thread can lock the inode
+  if (inode->refcnt > 1 || (type == FT_DIR && inode->disk->byte_len != 0))
+  {
+    inode_put(inode);
+    lock_release(&fs_lk);
+    return -EBUSY;
+  }
 
-      // Write data to the blocks
-      while (bytes_written < n)
-      {
-        if (written_bytes == BLOCK_SIZE)
-        {
-          // Write the current data block to disk
-          result = ioseek(fs_io, fs_base + BLOCK_SIZE + boot_block->num_inodes * BLOCK_SIZE + file_inode->data_block_num[written_blocks] * BLOCK_SIZE);
+  result = file_resize(inode, 0, 0);
+  inode_put(inode);
+  if (result < 0)
+  {
+    lock_release(&fs_lk);
+    return result;
+  }
+  inode_forget(ino);
 
-          if (result < 0)
-          {
-            lock_release(&fs_lk);
-            return result;
-          }
-          result = iowrite(fs_io, data_block, BLOCK_SIZE);
+  result = dir_remove(dir, fname);
+  if (result == 0)
+  {
+    fs_inode_used[ino / 8] &= ~(1 << (ino % 8));
+    dcache_add(dir, fname, 0, KFS_NEGATIVE);
+    // the inode number may become another directory
+    if (type == FT_DIR)
+      dcache_purge(ino);
+  }
+  lock_release(&fs_lk);
+  return result;
+}
 
-          if (result < 0)
-          {
-            lock_release(&fs_lk);
-            return result;
-          }
-          // Move to the next block
-          written_blocks++;
-          written_bytes = 0;
-
-          // Check if the file is full
-          if (written_blocks == MAX_INODES)
-          {
-            return -EINVAL;
-          }
-
-          // Seek to the next data block position
-          result = ioseek(fs_io, fs_base + BLOCK_SIZE + boot_block->num_inodes * BLOCK_SIZE + file_inode->data_block_num[written_blocks] * BLOCK_SIZE);
+/**
+ * @brief Reads data from a file into several buffers, in order.
+ *
+ * Each buffer is read with fs_read_at, under a single acquisition of the
+ * inode lock, until a read comes up short at the end of the file. Without a
+ * position, the reads start at the file position and advance it; the file is
+ * locked so that threads sharing it read consecutive data. With a position
+ * (pread), the file position is neither used nor locked, so any number of
+ * threads read the file at once.
+ *
+ * @param io Pointer to the I/O interface associated with the file.
+ * @param iov The buffers.
+ * @param iovcnt The number of buffers.
+ * @param posp The position to read at, or NULL to read at the file position.
+ * @return The number of bytes read, or a negative error code if none were.
+ */
 
-          if (result < 0)
-          {
-            lock_release(&fs_lk);
-            return result;
-          }
+static long fs_do_readv(struct io_intf *io, const struct io_vec *iov, int iovcnt, const uint64_t *posp)
+{
+  file_t *file = (void *)io - offsetof(file_t, io);
+  uint64_t pos;
+  long result = 0;
+  long done = 0;
 
-          // Read the next data block
-          result = ioread_full(fs_io, data_block, BLOCK_SIZE);
+  if (posp == NULL)
+    lock_acquire(&file->lk);
+  rwlock_acquire_read(&file->inode->lk);
+  pos = (posp != NULL) ? *posp : file->file_position;
 
-          if (result < 0)
-          {
-            lock_release(&fs_lk);
-            return result;
-          }
-        }
+  for (int i = 0; i < iovcnt; i++)
+  {
+    result = fs_read_at(file->inode, pos + done, iov[i].buf, iov[i].len);
+    if (result < 0)
+      break;
+    done += result;
+    if (result < iov[i].len)
+      break;
+  }
 
-        // Write the byte to the data block
-        data_block->data[written_bytes] = ((char *)buf)[bytes_written];
-        written_bytes++;
-        bytes_written++;
-      }
+  if (posp == NULL)
+    file->file_position += done;
+  rwlock_release_read(&file->inode->lk);
+  if (posp == NULL)
+    lock_release(&file->lk);
+  return (done == 0 && result < 0) ? result : done;
+}
 
-      result = ioseek(fs_io, fs_base + BLOCK_SIZE + boot_block->num_inodes * BLOCK_SIZE + file_inode->data_block_num[written_blocks] * BLOCK_SIZE);
+/**
+ * @brief Writes data from several buffers to a file, in order (see
+ * fs_do_readv for the position and locking).
+ *
+ * @param io Pointer to the I/O interface representing the file.
+ * @param iov The buffers.
+ * @param iovcnt The number of buffers.
+ * @param posp The position to write at, at most the length of the file, or
+ *        NULL to write at the file position.
+ * @return The number of bytes written, or a negative error code if none were
+ *         (-EINVAL if the position is past the end of the file).
+ */
 
-      if (result < 0)
-      {
-        lock_release(&fs_lk);
-        return result;
-      }
+static long fs_do_writev(struct io_intf *io, const struct io_vec *iov, int iovcnt, const uint64_t *posp)
+{
+  file_t *file = (void *)io - offsetof(file_t, io);
+  uint64_t pos;
+  long result = 0;
+  long done = 0;
 
-      result = iowrite(fs_io, data_block, BLOCK_SIZE);
+  // directories are changed only with fs_lk held, by creating and deleting
+  // files, which would wait for the inode lock taken here
+  if (file->inode->dir)
+    return -EACCESS;
 
-      if (result < 0)
-      {
-        lock_release(&fs_lk);
-        return result;
-      }
+  if (posp == NULL)
+    lock_acquire(&file->lk);
+  rwlock_acquire_write(&file->inode->lk);
+  pos = (posp != NULL) ? *posp : file->file_position;
 
-      // Update the file position
-      // console_printf("n: %d\n", n);
-      file->file_position += n;
-      // console_printf("file position: %d\n", file->file_position);
-      lock_release(&fs_lk);
-      return n;
-    }
+  // like IOCTL_SETPOS, a write cannot start past the end of the file, which
+  // would leave a hole. Compressed files cannot be written.
+  if (inode_compressed(file->inode->disk))
+  {
+    result = -EACCESS;
+    iovcnt = 0;
   }
-  lock_release(&fs_lk);
-  return -ENOENT;
+  else if (pos > file->inode->disk->byte_len)
+  {
+    result = -EINVAL;
+    iovcnt = 0;
+  }
+
+  for (int i = 0; i < iovcnt; i++)
+  {
+    result = fs_write_at(file->inode, pos + done, iov[i].buf, iov[i].len);
+    if (result < 0)
+      break;
+    done += result;
+    if (result < iov[i].len)
+      break;
+  }
+
+  if (posp == NULL)
+    file->file_position += done;
+  rwlock_release_write(&file->inode->lk);
+  if (posp == NULL)
+    lock_release(&file->lk);
+  return (done == 0 && result < 0) ? result : done;
 }
 
 /**
- * @brief Reads data from a file into a buffer.
+ * @brief Writes data to a file at a position.
  *
- * This function reads up to `n` bytes of data from the file associated with the given
- * I/O interface (`io`) into the provided buffer (`buf`). It searches through the file
- * descriptor table to find the matching I/O interface and reads the file data starting
- * from the current file position.
+ * This function writes up to `n` bytes from the buffer `buf` to the file
+ * at position `pos`. The data is written through to the device, with
+ * one bulk write per run of file blocks that are contiguous on disk (one per
+ * extent), and then copied into the pages of the file that are in the page
+ * cache, so that cached pages never differ from the device. Whole blocks
+ * from a buffer aligned to DIRECT_IO_ALIGN are written around the block cache
+ * with IOCTL_WRITEDIRECT. Blocks are not read first: the block device reads
+ * the rest of a partially written block itself, and a fully overwritten block
+ * is not read at all.
  *
- * @param io Pointer to the I/O interface associated with the file.
- * @param buf Pointer to the buffer where the read data will be stored.
- * @param n The number of bytes to read from the file.
- * @return The number of bytes read on success, or -1 if an error occurs (e.g., if the
- *         file descriptor is not found or if the file is full).
+ * @param inode The cached inode of the file, locked for writing.
+ * @param pos The position in the file.
+ * @param buf Pointer to the buffer containing the data to be written.
+ * @param n Number of bytes to write from the buffer.
+ * @return The number of bytes successfully written, or a negative error code.
+ *
+ * @note A write past the end of the file extends it, allocating blocks as
+ *       needed. If the file system runs out of blocks, the write is cut
+ *       short at the end of the file.
  */
 
-long fs_read(struct io_intf *io, void *buf, unsigned long n)
+static long fs_write_at(struct kfs_inode *inode, uint64_t pos, const void *buf, unsigned long n)
 {
-  lock_acquire(&fs_lk);
-  int result = 0;
-  // Loop through the file descriptor table to find the matching io interface
-  for (int i = 0; i < MAX_FILE_OPEN; i++)
+  inode_t *file_inode = inode->disk;
+  uint64_t devpos;
+  uint64_t done = 0;
+  uint64_t len;
+  long result;
+
+  // Extend the file first. The new blocks are not zeroed, since the write
+  // covers them up to its end; the rest of the last block is zeroed below.
+  // If there is no space for new blocks, write what fits in the blocks the
+  // file has.
+  int grown = 0;
+  if (n > 0 && pos + n > file_inode->byte_len)
   {
-    if (io == file_desc_tab[i].io && file_desc_tab[i].flag == INUSE)
+    uint64_t block_end = ((uint64_t)file_inode->byte_len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    fs_op_begin();
+    result = file_resize(inode, pos + n, 0);
+    if (result == -ENOSPC && fs_journal)
     {
-      // Found the file descriptor
-      file_t *file = &file_desc_tab[i];
-      uint64_t file_position = file->file_position; // Current position in the file
-      uint64_t inode_num = file->inode_num;         // Inode number of the file
-      // Seek to the inode location in the filesystem
-      result = ioseek(fs_io, fs_base + BLOCK_SIZE + inode_num * BLOCK_SIZE);
-
-      if (result < 0)
-      {
-        lock_release(&fs_lk);
-        return result;
-      }
-
-      // Read the inode data
-      inode_t *file_inode = kmalloc(sizeof(inode_t));
-      memset(file_inode, 0, sizeof(inode_t));
-
-      result = ioread_full(fs_io, file_inode, BLOCK_SIZE); // Read the inode data
-
-      if (result < 0)
-      {
-        lock_release(&fs_lk);
-        return result;
-      }
-      // Calculate the number of blocks and bytes to read based on the file position
-      uint64_t read_blocks = file_position / BLOCK_SIZE;
-      uint64_t read_bytes = file_position % BLOCK_SIZE;
+      // blocks freed by transactions that are not committed yet cannot be
+      // allocated; wait for the commit and try again
+      lock_release(&fs_lk);
+      journal_sync();
+      fs_op_begin();
+      result = file_resize(inode, pos + n, 0);
+    }
+    if (result == -ENOSPC && pos < block_end && file_inode->byte_len < block_end)
+      result = file_resize(inode, block_end, 0);
+    lock_release(&fs_lk);
+    if (result < 0 && (result != -ENOSPC || pos >= file_inode->byte_len))
+      return result;
+    grown = (result == 0);
+  }
 
-      // Seek to the data block that contains the file data
-      data_block_t* data_block = kmalloc(sizeof(data_block_t));
-      if (read_blocks == sizeof(file_inode->data_block_num) / sizeof(file_inode->data_block_num[0]))
-      {
-        lock_release(&fs_lk);
-        return -EINVAL;
-      }
-      // check if the file_position is greater than the file size
+  // Zero byte written means EOF
+  if (pos >= file_inode->byte_len)
+    n = 0;
+  else if (n > file_inode->byte_len - pos)
+    n = file_inode->byte_len - pos;
 
-      if (file_position + n > file_inode->byte_len)
+  while (done < n)
+  {
+    // Direct I/O: whole blocks go from buf straight to the device
+    if ((pos + done) % BLOCK_SIZE == 0 && n - done >= BLOCK_SIZE &&
+        (uintptr_t)((const char *)buf + done) % DIRECT_IO_ALIGN == 0)
+    {
+      len = (n - done) / BLOCK_SIZE * BLOCK_SIZE;
+      result = fs_direct(inode, (pos + done) / BLOCK_SIZE, (char *)buf + done, len / BLOCK_SIZE, 1);
+      if (result == 0)
       {
-        // Zero byte read means EOF
-        n = file_inode->byte_len - file_position;
+        done += len;
+        continue;
       }
-
-      result = ioseek(fs_io, fs_base + BLOCK_SIZE + boot_block->num_inodes * BLOCK_SIZE + file_inode->data_block_num[read_blocks] * BLOCK_SIZE);
-
-      if (result < 0)
-      {
-        lock_release(&fs_lk);
+      if (result != -ENOTSUP)
         return result;
-      }
-      // console_printf("Reading from block: %d\n", file_inode.data_block_num[read_blocks]);
-      uint64_t pos = 0;
-      fs_io->ops->ctl(fs_io, IOCTL_GETPOS, &pos);
-
-      result = ioread_full(fs_io, data_block, BLOCK_SIZE); // Read the data block
+    }
 
-      if (result < 0)
-      {
-        lock_release(&fs_lk);
-        return result;
-      }
+    devpos = fs_map(inode, pos + done, n - done, &len);
+    result = ioseek(fs_io, devpos);
+    if (result >= 0)
+      result = iowrite(fs_io, (const char *)buf + done, len);
+    if (result >= 0 && result < len)
+      result = -EIO;
+    if (result < 0)
+      return result;
+    done += len;
+  }
 
-      uint64_t bytes_read = 0; // Counter for the number of bytes read
+  fs_cache_update(inode, pos, buf, n);
 
-      // Read data from the file until the requested number of bytes is read
-      while (bytes_read < n)
-      {
-        if (read_bytes == BLOCK_SIZE)
-        {
-          // Move to the next block if the current block is fully read
-          read_blocks++;
-          read_bytes = 0;
-          // Check if the file is full
-          if (read_blocks == MAX_INODES)
-          {
-            // If the file is full, return an error
-            lock_release(&fs_lk);
-            return -EINVAL;
-          }
-          // Seek to the next data block
-          result = ioseek(fs_io, fs_base + BLOCK_SIZE + boot_block->num_inodes * BLOCK_SIZE + file_inode->data_block_num[read_blocks] * BLOCK_SIZE);
+  // Bytes past the end of the file are kept zero, so that extending the file
+  // with IOCTL_SETLEN exposes zeroes
+  if (grown && (pos + n) % BLOCK_SIZE != 0)
+  {
+    devpos = fs_map(inode, pos + n, 1, &len);
+    result = fs_zero(devpos, BLOCK_SIZE - (pos + n) % BLOCK_SIZE);
+    if (result < 0)
+      return result;
+  }
 
-          if (result < 0)
-          {
-            lock_release(&fs_lk);
-            return result;
-          }
+  return n;
+}
 
-          result = ioread_full(fs_io, data_block, BLOCK_SIZE); // Read the next data block
+/**
+ * @brief Transfers whole data blocks of a file straight between the device
+ * and a buffer.
+ *
+ * Each run of file blocks that is contiguous on disk, that is, each extent,
+ * is transferred with one IOCTL_READDIRECT or IOCTL_WRITEDIRECT request, so
+ * the data is not copied through the block cache.
+ *
+ * @param inode Cached inode of the file.
+ * @param first_block Index of the first file block to transfer.
+ * @param buf The buffer, aligned to DIRECT_IO_ALIGN.
+ * @param nblocks Number of blocks to transfer.
+ * @param write 0 to read the blocks into buf, 1 to write them from buf.
+ * @return 0 on success, or a negative error code (-ENOTSUP if the device
+ *         does not support direct transfers).
+ */
+static int fs_direct(struct kfs_inode *inode, uint64_t first_block, void *buf, uint64_t nblocks, int write)
+{
+  struct io_direct dio;
+  uint32_t dblk;
+  uint64_t run;
+  int result;
 
-          if (result < 0)
-          {
-            lock_release(&fs_lk);
-            return result;
-          }
-        }
-        // Copy data from the data block to the buffer
-        // kprintf("%s on line %d storing byte at address: %x\n", __FILE__, __LINE__, &((char *)buf)[bytes_read]);
+  while (nblocks > 0)
+  {
+    run = fs_bmap(inode, first_block, nblocks, &dblk);
 
-        ((char *)buf)[bytes_read] = data_block->data[read_bytes];
-        // console_putchar(data_block.data[read_bytes]);
-        read_bytes++;
-        bytes_read++;
-      }
-      // Update the file position after reading
-      // console_printf("added %d bytes to the buffer\n", bytes_read);
-      file->file_position += n;
-      lock_release(&fs_lk);
+    dio.pos = fs_data_base + (uint64_t)dblk * BLOCK_SIZE;
+    dio.buf = buf;
+    dio.len = run * BLOCK_SIZE;
+    result = ioctl(fs_io, write ? IOCTL_WRITEDIRECT : IOCTL_READDIRECT, &dio);
+    if (result < 0)
+      return result;
 
-      return n; // Return the number of bytes read
-    }
+    first_block += run;
+    nblocks -= run;
+    buf += run * BLOCK_SIZE;
   }
-  // If the file descriptor is not found, return an error
-  lock_release(&fs_lk);
-  return -ENOENT;
+  return 0;
 }
 
 /**
- * @brief Perform an I/O control operation on a file.
+ * @brief Reads data from a file at a position into a buffer.
  *
- * This function iterates through the file descriptor table to find the file
- * associated with the provided I/O interface (`io`). Once found, it performs
- * the specified I/O control command (`cmd`) on the file.
+ * This function reads up to `n` bytes of data from the file at position `pos`
+ * into the provided buffer (`buf`). The data is copied from the pages of the file in the page cache;
+ * pages that are not cached are read from the device first (see fs_getpage), so
+ * files that are read again, such as programs that are run often, are not read
+ * from the device again while their pages stay cached.
  *
- * @param io Pointer to the I/O interface structure.
- * @param cmd The I/O control command to be performed. Supported commands are:
- *            - IOCTL_GETLEN: Get the length of the file.
+ * @param inode The cached inode of the file, locked for reading.
+ * @param pos The position in the file.
+ * @param buf Pointer to the buffer where the read data will be stored.
+ * @param n The number of bytes to read from the file.
+ * @return The number of bytes read on success, or a negative error code.
+ */
+
+static long fs_read_at(struct kfs_inode *inode, uint64_t pos, void *buf, unsigned long n)
+{
+  inode_t *file_inode = inode->disk;
+  struct pcache_page *pg;
+  uint64_t done = 0;
+  uint64_t off, len;
+  long result;
+
+  // Zero byte read means EOF
+  if (pos >= file_inode->byte_len)
+    n = 0;
+  else if (n > file_inode->byte_len - pos)
+    n = file_inode->byte_len - pos;
+
+  while (done < n)
+  {
+    off = (pos + done) % PAGE_SIZE;
+    result = fs_getpage(inode, (pos + done) / PAGE_SIZE, &pg);
+    if (result < 0)
+      return result;
+    len = PAGE_SIZE - off;
+    if (len > n - done)
+      len = n - done;
+    memcpy((char *)buf + done, (char *)pg->data + off, len);
+    pagecache_put(pg);
+    done += len;
+  }
+
+  return n; // Return the number of bytes read
+}
+
+/**
+ * @brief Gets a page of a file from the page cache, reading it from the device
+ * if it is not cached. Must be called with the inode locked for reading.
+ *
+ * A miss also reads the following pages of the file, up to KFS_READAHEAD
+ * pages, as long as they are not cached and follow each other on disk, so a
+ * sequential read fills the cache with one device request per KFS_READAHEAD
+ * pages. Misses are filled under the fill lock of the inode, so a reader that
+ * finds a page another reader is still filling waits for that fill instead of
+ * reading the page again; readers that hit in the cache do not wait. Pages of
+ * compressed files are filled a chunk at a time by fs_zfill.
+ *
+ * @param inode The cached inode of the file.
+ * @param index Index of the page in the file, which must be within the file.
+ * @param pgptr The page is returned here, with a reference taken that the
+ *        caller releases with pagecache_put.
+ * @return 0 on success, or a negative error code if the page could not be read.
+ */
+static int fs_getpage(struct kfs_inode *inode, uint64_t index, struct pcache_page **pgptr)
+{
+  const uint64_t npages = ((uint64_t)inode->disk->byte_len + PAGE_SIZE - 1) / PAGE_SIZE;
+  struct pcache_page *pages[KFS_READAHEAD];
+  struct pcache_page *pg;
+  uint32_t dblk;
+  uint64_t run, k;
+  int result;
+
+  *pgptr = pagecache_lookup(inode->ino, index);
+  if (*pgptr != NULL && (*pgptr)->uptodate)
+    return 0;
+  if (*pgptr != NULL)
+    pagecache_put(*pgptr);
+
+  // pages are filled with the fill lock held, so once it is held a cached
+  // page is up to date
+  lock_acquire(&inode->fill_lk);
+  *pgptr = pagecache_lookup(inode->ino, index);
+  if (*pgptr != NULL)
+  {
+    lock_release(&inode->fill_lk);
+    return 0;
+  }
+
+  if (inode_compressed(inode->disk))
+  {
+    result = fs_zfill(inode, index, pgptr);
+    lock_release(&inode->fill_lk);
+    return result;
+  }
+
+  run = fs_bmap(inode, index, (npages - index < KFS_READAHEAD) ? npages - index : KFS_READAHEAD, &dblk);
+
+  pages[0] = pagecache_alloc(inode->ino, index);
+  for (k = 1; k < run; k++)
+  {
+    pg = pagecache_lookup(inode->ino, index + k);
+    if (pg != NULL)
+    {
+      pagecache_put(pg);
+      break;
+    }
+    pages[k] = pagecache_alloc(inode->ino, index + k);
+  }
+  run = k;
+
+  result = fs_fill(inode, index, run, pages);
+  for (k = 0; k < run; k++)
+  {
+    if (result < 0)
+    {
+      pagecache_remove(pages[k]);
+      continue;
+    }
+    pages[k]->uptodate = 1;
+    if (k != 0)
+      pagecache_put(pages[k]);
+  }
+  lock_release(&inode->fill_lk);
+  if (result < 0)
+    return result;
+
+  *pgptr = pages[0];
+  return 0;
+}
+
+/**
+ * @brief Reads pages of a file that follow each other on disk into new page
+ * cache pages, with a single IOCTL_READPAGES request if the device supports
+ * it. The bytes past the end of the file are zeroed. Must be called with the
+ * inode locked for reading and its fill lock held.
+ *
+ * @param inode The cached inode of the file.
+ * @param index Index of the first page in the file.
+ * @param npages Number of pages, which must be contiguous on disk.
+ * @param pages The page cache pages to read into.
+ * @return 0 on success, or a negative error code.
+ */
+static int fs_fill(struct kfs_inode *inode, uint64_t index, uint64_t npages, struct pcache_page **pages)
+{
+  void *data[KFS_READAHEAD];
+  struct io_pagevec pvec;
+  uint64_t devpos, len, k;
+  long result;
+
+  devpos = fs_map(inode, index * PAGE_SIZE, PAGE_SIZE, &len);
+
+  for (k = 0; k < npages; k++)
+    data[k] = pages[k]->data;
+  pvec.pos = devpos;
+  pvec.pages = data;
+  pvec.npages = npages;
+  result = ioctl(fs_io, IOCTL_READPAGES, &pvec);
+
+  // devices without page vector reads are read one page at a time
+  if (result == -ENOTSUP)
+  {
+    for (k = 0; k < npages; k++)
+    {
+      result = ioseek(fs_io, devpos + k * PAGE_SIZE);
+      if (result >= 0)
+        result = ioread_full(fs_io, data[k], PAGE_SIZE);
+      if (result >= 0 && result < PAGE_SIZE)
+        result = -EIO;
+      if (result < 0)
+        return result;
+    }
+  }
+  else if (result < 0)
+    return result;
+
+  // directory blocks may have newer copies in the journal
+  if (fs_journal)
+  {
+    for (k = 0; k < npages; k++)
+      journal_read((devpos + k * PAGE_SIZE) / BLOCK_SIZE, data[k]);
+  }
+
+  // the last block of the file is zero past its end on disk, but the page
+  // cache does not rely on it
+  len = inode->disk->byte_len - index * PAGE_SIZE;
+  if (len < npages * PAGE_SIZE)
+    memset((char *)data[npages - 1] + len % PAGE_SIZE, 0, PAGE_SIZE - len % PAGE_SIZE);
+  return 0;
+}
+
+/**
+ * @brief Reads the chunk of a compressed file that holds a page into the page
+ * cache. The compressed chunk is read into fs_zbuf with one device request and
+ * decompressed into fs_zchunk, and the pages of the chunk that are not cached
+ * are copied from there, so a sequential read decompresses each chunk once.
+ * The bytes past the end of the file are zeroed. Must be called with the inode
+ * locked for reading and its fill lock held.
+ *
+ * @param inode The cached inode of the file, which is compressed.
+ * @param index Index of the page in the file, which must be within the file.
+ * @param pgptr The page is returned here, with a reference taken.
+ * @return 0 on success, -EBADFMT if the chunk does not decompress, or a
+ *         negative error code if it could not be read.
+ */
+static int fs_zfill(struct kfs_inode *inode, uint64_t index, struct pcache_page **pgptr)
+{
+  const inode_t *disk = inode->disk;
+  const uint64_t chunk = index / (CHUNK_SIZE / PAGE_SIZE);
+  const uint64_t first = chunk * (CHUNK_SIZE / PAGE_SIZE);
+  struct pcache_page *pg;
+  uint64_t len, zlen, npages, k;
+  long result;
+
+  len = disk->byte_len - chunk * CHUNK_SIZE;
+  if (len > CHUNK_SIZE)
+    len = CHUNK_SIZE;
+  zlen = disk->chunk_off[chunk + 1] - disk->chunk_off[chunk];
+
+  // a chunk that did not compress is stored as is, and read straight into
+  // fs_zchunk
+  lock_acquire(&fs_zlk);
+  result = ioseek(fs_io, fs_data_base + (uint64_t)disk->zextent.start * BLOCK_SIZE + disk->chunk_off[chunk]);
+  if (result >= 0)
+    result = ioread_full(fs_io, (zlen == len) ? fs_zchunk : fs_zbuf, zlen);
+  if (result >= 0 && result < zlen)
+    result = -EIO;
+  if (result >= 0 && zlen != len)
+  {
+    result = lz4_decompress(fs_zbuf, zlen, fs_zchunk, len);
+    if (result >= 0 && result != len)
+      result = -EBADFMT;
+  }
+  if (result < 0)
+  {
+    lock_release(&fs_zlk);
+    return result;
+  }
+
+  npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+  memset(fs_zchunk + len, 0, npages * PAGE_SIZE - len);
+
+  for (k = 0; k < npages; k++)
+  {
+    pg = pagecache_lookup(inode->ino, first + k);
+    if (pg == NULL)
+    {
+      pg = pagecache_alloc(inode->ino, first + k);
+      memcpy(pg->data, fs_zchunk + k * PAGE_SIZE, PAGE_SIZE);
+      pg->uptodate = 1;
+    }
+    if (first + k == index)
+      *pgptr = pg;
+    else
+      pagecache_put(pg);
+  }
+  lock_release(&fs_zlk);
+  return 0;
+}
+
+/**
+ * @brief Copies data written to a file into the pages of the file that are in
+ * the page cache. Pages that are not cached are left to be read when needed.
+ * Must be called with the inode locked for writing.
+ *
+ * @param inode The cached inode of the file.
+ * @param pos Position of the data in the file.
+ * @param buf The data.
+ * @param n Length of the data.
+ */
+static void fs_cache_update(struct kfs_inode *inode, uint64_t pos, const void *buf, uint64_t n)
+{
+  struct pcache_page *pg;
+  uint64_t done, off, len;
+
+  for (done = 0; done < n; done += len)
+  {
+    off = (pos + done) % PAGE_SIZE;
+    len = PAGE_SIZE - off;
+    if (len > n - done)
+      len = n - done;
+    pg = pagecache_lookup(inode->ino, (pos + done) / PAGE_SIZE);
+    if (pg == NULL)
+      continue;
+    memcpy((char *)pg->data + off, (const char *)buf + done, len);
+    pagecache_put(pg);
+  }
+}
+
+/**
+ * @brief Gets the page cache page of a file page for a user mapping of it
+ * (IOCTL_GETPAGE). Must be called with the inode locked for reading.
+ *
+ * @param file The file.
+ * @param pg The page index; the data page is returned in pg->page, with a
+ *        reference taken for the mapping. If pg is NULL, only reports that
+ *        files can be mapped.
+ * @return 0 on success, -EINVAL if the page is past the end of the file, or a
+ *         negative error code if the page could not be read.
+ */
+static int fs_mappage(file_t *file, struct io_page *pg)
+{
+  struct pcache_page *cpg;
+  int result;
+
+  if (pg == NULL)
+    return 0;
+  if (pg->index >= ((uint64_t)file->inode->disk->byte_len + PAGE_SIZE - 1) / PAGE_SIZE)
+    return -EINVAL;
+
+  result = fs_getpage(file->inode, pg->index, &cpg);
+  if (result < 0)
+    return result;
+  pagecache_map(cpg->data);
+  pg->page = cpg->data;
+  pagecache_put(cpg);
+  return 0;
+}
+
+/**
+ * @brief Writes a cached page of a file back to the device, after a shared
+ * mapping stored to it (IOCTL_WRITEPAGE). Only the part of the page within the
+ * file is written; a page that is no longer cached was truncated and is not
+ * written. Must be called with the inode locked for reading.
+ *
+ * @param file The file.
+ * @param indexp The index of the page.
+ * @return 0 on success, or a negative error code.
+ */
+static int fs_writepage(file_t *file, const uint64_t *indexp)
+{
+  struct kfs_inode *const inode = file->inode;
+  struct pcache_page *pg;
+  uint64_t pos, n, done, len, devpos;
+  long result = 0;
+
+  if (indexp == NULL)
+    return -EINVAL;
+  if (inode_compressed(inode->disk) || inode->dir)
+    return -EACCESS;
+  pos = *indexp * PAGE_SIZE;
+  if (pos >= inode->disk->byte_len)
+    return 0;
+  n = inode->disk->byte_len - pos;
+  if (n > PAGE_SIZE)
+    n = PAGE_SIZE;
+
+  // a page that is being filled is not the mapped page, which was truncated
+  pg = pagecache_lookup(inode->ino, *indexp);
+  if (pg == NULL)
+    return 0;
+  if (!pg->uptodate)
+  {
+    pagecache_put(pg);
+    return 0;
+  }
+
+  for (done = 0; done < n && result >= 0; done += len)
+  {
+    devpos = fs_map(inode, pos + done, n - done, &len);
+    result = ioseek(fs_io, devpos);
+    if (result >= 0)
+      result = iowrite(fs_io, (char *)pg->data + done, len);
+    if (result >= 0 && result < len)
+      result = -EIO;
+  }
+
+  pagecache_put(pg);
+  return (result < 0) ? result : 0;
+}
+
+/**
+ * @brief Maps a file position to the device.
+ *
+ * @param inode Cached inode of the file.
+ * @param pos Position in the file, within its blocks.
+ * @param n Maximum length of the run.
+ * @param lenp The length of the run of bytes at pos that are contiguous on
+ *        disk is returned here; it is at least 1 and at most n.
+ * @return The position of the byte at pos on the file system device.
+ */
+static uint64_t fs_map(struct kfs_inode *inode, uint64_t pos, uint64_t n, uint64_t *lenp)
+{
+  const uint64_t off = pos % BLOCK_SIZE;
+  uint64_t len;
+  uint32_t dblk;
+
+  len = fs_bmap(inode, pos / BLOCK_SIZE, (off + n + BLOCK_SIZE - 1) / BLOCK_SIZE, &dblk) * BLOCK_SIZE - off;
+  *lenp = (len < n) ? len : n;
+  return fs_data_base + (uint64_t)dblk * BLOCK_SIZE + off;
+}
+
+/**
+ * @brief Maps a file block to its data block.
+ *
+ * With extents, the search starts at the extent found by the previous lookup
+ * of the inode, so a sequential transfer finds each extent in constant time.
+ *
+ * @param inode Cached inode of the file.
+ * @param blk Index of the file block, less than the number of blocks of the file.
+ * @param max Maximum length of the run, at least 1.
+ * @param dblkptr The data block of file block blk is returned here.
+ * @return The number of blocks from blk on that follow each other on disk, at
+ *         least 1 and at most max.
+ */
+static uint64_t fs_bmap(struct kfs_inode *inode, uint64_t blk, uint64_t max, uint32_t *dblkptr)
+{
+  const inode_t *disk = inode->disk;
+  uint64_t run;
+
+  if (!fs_extents)
+  {
+    *dblkptr = disk->data_block_num[blk];
+    for (run = 1; run < max && blk + run < MAX_INODES &&
+                  disk->data_block_num[blk + run] == *dblkptr + run; run++)
+      continue;
+    return run;
+  }
+
+  if (blk < inode->ext_blk)
+  {
+    inode->ext_idx = 0;
+    inode->ext_blk = 0;
+  }
+  // inode_valid guarantees that the extents cover every block of the file
+  while (blk >= (uint64_t)inode->ext_blk + disk->extents[inode->ext_idx].len)
+  {
+    inode->ext_blk += disk->extents[inode->ext_idx].len;
+    inode->ext_idx++;
+  }
+
+  *dblkptr = disk->extents[inode->ext_idx].start + (blk - inode->ext_blk);
+  run = disk->extents[inode->ext_idx].len - (blk - inode->ext_blk);
+  return (run < max) ? run : max;
+}
+
+/**
+ * @brief Appends a data block to the blocks of a file. With extents, the block
+ * extends the last extent if it follows it on disk.
+ *
+ * @param inode Cached inode of the file.
+ * @param blk Index of the new file block, the number of blocks of the file.
+ * @param dblk The data block.
+ * @return 0 on success, -ENOSPC if the inode has no room for another extent.
+ */
+static int bmap_append(struct kfs_inode *inode, uint64_t blk, uint32_t dblk)
+{
+  inode_t *const disk = inode->disk;
+  const uint32_t n = disk->num_extents;
+
+  if (!fs_extents)
+  {
+    disk->data_block_num[blk] = dblk;
+    return 0;
+  }
+
+  if (n != 0 && disk->extents[n - 1].start + disk->extents[n - 1].len == dblk)
+  {
+    disk->extents[n - 1].len++;
+    return 0;
+  }
+  if (n == MAX_EXTENTS)
+    return -ENOSPC;
+
+  disk->extents[n].start = dblk;
+  disk->extents[n].len = 1;
+  disk->num_extents++;
+  return 0;
+}
+
+/**
+ * @brief Cuts the blocks of a file after the first nblocks from its block map
+ * or extents. The blocks are not freed.
+ *
+ * @param inode Cached inode of the file.
+ * @param nblocks Number of blocks to keep.
+ */
+static void bmap_truncate(struct kfs_inode *inode, uint64_t nblocks)
+{
+  inode_t *const disk = inode->disk;
+  uint64_t blk = 0;
+  uint32_t i;
+
+  if (!fs_extents)
+  {
+    if (nblocks < MAX_INODES)
+      memset(&disk->data_block_num[nblocks], 0, (MAX_INODES - nblocks) * sizeof(uint32_t));
+    return;
+  }
+
+  for (i = 0; i < disk->num_extents && blk < nblocks; i++)
+  {
+    if (blk + disk->extents[i].len > nblocks)
+      disk->extents[i].len = nblocks - blk;
+    blk += disk->extents[i].len;
+  }
+  memset(&disk->extents[i], 0, (disk->num_extents - i) * sizeof(extent_t));
+  disk->num_extents = i;
+  inode->ext_idx = 0;
+  inode->ext_blk = 0;
+}
+
+/**
+ * @brief Checks an inode read from disk: its extents must fit in the inode and
+ * cover exactly the blocks of the file. Block-map inodes cannot be checked.
+ *
+ * @param disk The on-disk inode.
+ * @return 1 if the inode is valid, 0 if not.
+ */
+static int inode_valid(const inode_t *disk)
+{
+  uint64_t nblocks = 0;
+  uint64_t len;
+
+  if (!fs_extents)
+    return 1;
+  if (inode_compressed(disk))
+  {
+    if (disk->num_chunks != ((uint64_t)disk->byte_len + CHUNK_SIZE - 1) / CHUNK_SIZE ||
+        disk->num_chunks > MAX_CHUNKS || disk->chunk_off[0] != 0 ||
+        (uint64_t)disk->zextent.start + disk->zextent.len > boot_block->num_data)
+      return 0;
+    for (uint32_t i = 0; i < disk->num_chunks; i++)
+    {
+      len = disk->byte_len - (uint64_t)i * CHUNK_SIZE;
+      if (len > CHUNK_SIZE)
+        len = CHUNK_SIZE;
+      if (disk->chunk_off[i + 1] < disk->chunk_off[i] || disk->chunk_off[i + 1] - disk->chunk_off[i] > len)
+        return 0;
+    }
+    return disk->chunk_off[disk->num_chunks] <= (uint64_t)disk->zextent.len * BLOCK_SIZE;
+  }
+  if (disk->num_extents > MAX_EXTENTS)
+    return 0;
+  for (uint32_t i = 0; i < disk->num_extents; i++)
+  {
+    if (disk->extents[i].len == 0 || (uint64_t)disk->extents[i].start + disk->extents[i].len > boot_block->num_data)
+      return 0;
+    nblocks += disk->extents[i].len;
+  }
+  return nblocks == ((uint64_t)disk->byte_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/**
+ * @brief Checks whether an inode holds a compressed file.
+ *
+ * @param disk The on-disk inode.
+ * @return 1 if the file is compressed, 0 if not.
+ */
+static int inode_compressed(const inode_t *disk)
+{
+  return fs_compress && disk->zmagic == INODE_COMPRESSED;
+}
+
+/**
+ * @brief Reads data from a file into a buffer at the file position (see
+ * fs_do_readv) and records the request in the file system statistics.
+ */
+
+long fs_read(struct io_intf *io, void *buf, unsigned long n)
+{
+  const struct io_vec iov = { .buf = buf, .len = n };
+  const uint64_t t0 = csrr_time();
+  long result = fs_do_readv(io, &iov, 1, NULL);
+
+  fs_account(0, result, t0);
+  return result;
+}
+
+/**
+ * @brief Writes data from a buffer to a file at the file position (see
+ * fs_do_writev) and records the request in the file system statistics.
+ */
+
+long fs_write(struct io_intf *io, const void *buf, unsigned long n)
+{
+  const struct io_vec iov = { .buf = (void *)buf, .len = n };
+  const uint64_t t0 = csrr_time();
+  long result = fs_do_writev(io, &iov, 1, NULL);
+
+  fs_account(1, result, t0);
+  return result;
+}
+
+/**
+ * @brief Reads data from a file into several buffers, at the file position or
+ * at pos (see fs_do_readv), and records the request in the file system
+ * statistics as a single read.
+ */
+
+long fs_readv(struct io_intf *io, const struct io_vec *iov, int iovcnt, const uint64_t *pos)
+{
+  const uint64_t t0 = csrr_time();
+  long result = fs_do_readv(io, iov, iovcnt, pos);
+
+  fs_account(0, result, t0);
+  return result;
+}
+
+/**
+ * @brief Writes data from several buffers to a file, at the file position or
+ * at pos (see fs_do_writev), and records the request in the file system
+ * statistics as a single write.
+ */
+
+long fs_writev(struct io_intf *io, const struct io_vec *iov, int iovcnt, const uint64_t *pos)
+{
+  const uint64_t t0 = csrr_time();
+  long result = fs_do_writev(io, iov, iovcnt, pos);
+
+  fs_account(1, result, t0);
+  return result;
+}
+
+/**
+ * @brief Records a read or write that started at time t0 in the file system
+ * statistics: its size and latency if it succeeded, an error otherwise.
+ */
+
+static void fs_account(int dir, long result, uint64_t t0)
+{
+  if (result < 0)
+  {
+    fs_iostat.errors++;
+    return;
+  }
+  iostat_record(&fs_iostat, dir, result, csrr_time() - t0);
+}
+
+/**
+ * @brief Perform an I/O control operation on a file.
+ *
+ * This function performs the specified I/O control command (`cmd`) on the file
+ * whose I/O interface is `io`.
+ *
+ * @param io Pointer to the I/O interface structure.
+ * @param cmd The I/O control command to be performed. Supported commands are:
+ *            - IOCTL_GETLEN: Get the length of the file.
+ *            - IOCTL_SETLEN: Truncate or extend the file; the extension reads as zeroes.
  *            - IOCTL_SETPOS: Set the position within the file.
  *            - IOCTL_GETPOS: Get the current position within the file.
  *            - IOCTL_GETBLKSZ: Get the block size of the file.
+ *            - IOCTL_FLUSH: Write cached data of the file system device to disk.
+ *            - IOCTL_DROPCACHE: Evict the page cache and the cache of the file system device.
+ *            - IOCTL_GETSCHED, IOCTL_SETSCHED, IOCTL_GETSCHEDSTAT, IOCTL_GETPOLL,
+ *              IOCTL_SETPOLL: Forwarded to the file system device.
+ *            - IOCTL_GETSTAT: Get the read and write statistics of the file system.
+ *            - IOCTL_GETPAGE, IOCTL_WRITEPAGE: Map a page of the file from the page
+ *              cache, and write a mapped page back (see mmap.c).
  * @param arg Pointer to the argument for the I/O control command.
  *
- * @return The result of the I/O control command, or -1 if the command is not supported,
- *         or -ENOTSUP if the provided I/O interface does not match any file.
+ * @return The result of the I/O control command, or -EINVAL if the command is not supported.
  */
 
 int fs_ioctl(struct io_intf *io, int cmd, void *arg)
 {
-  lock_acquire(&fs_lk);
-  for (int i = 0; i < MAX_FILE_OPEN; i++)
+  file_t *file = (void *)io - offsetof(file_t, io);
+  int result;
+
+  switch (cmd)
   {
-    file_t *file = &(file_desc_tab[i]);
-    struct io_intf *file_io = file->io;
-    // check if the file_io is the same `io_intf` as the argument provided
-    if (io == file_io)
+  case IOCTL_GETLEN:
+    rwlock_acquire_read(&file->inode->lk);
+    result = fs_getlen(file, arg);
+    rwlock_release_read(&file->inode->lk);
+    return result;
+  case IOCTL_SETPOS:
+    lock_acquire(&file->lk);
+    rwlock_acquire_read(&file->inode->lk);
+    result = fs_setpos(file, arg);
+    rwlock_release_read(&file->inode->lk);
+    lock_release(&file->lk);
+    return result;
+  case IOCTL_SETLEN:
+    if (file->inode->dir)
+      return -EACCESS;
+    lock_acquire(&file->lk);
+    rwlock_acquire_write(&file->inode->lk);
+    fs_op_begin();
+    result = fs_setlen(file, arg);
+    lock_release(&fs_lk);
+    rwlock_release_write(&file->inode->lk);
+    lock_release(&file->lk);
+    return result;
+  case IOCTL_GETPOS:
+    lock_acquire(&file->lk);
+    result = fs_getpos(file, arg);
+    lock_release(&file->lk);
+    return result;
+  case IOCTL_GETBLKSZ:
+    return fs_getblksz(file, arg);
+  case IOCTL_GETREFCNT:
+    *(uint64_t *)arg = io->refcnt;
+    return 0;
+  case IOCTL_STAT:
+    rwlock_acquire_read(&file->inode->lk);
+    result = fs_getstat(file, arg);
+    rwlock_release_read(&file->inode->lk);
+    return result;
+  case IOCTL_FLUSH:
+    // file data is written through to the device, so flushing a file
+    // commits the metadata changes made so far and flushes the device
+    if (fs_journal)
     {
-      switch (cmd)
-      {
-      case IOCTL_GETLEN:
-        lock_release(&fs_lk);
-        return fs_getlen(file, arg);
-      case IOCTL_SETPOS:
-        lock_release(&fs_lk);
-        return fs_setpos(file, arg);
-      case IOCTL_GETPOS:
-        lock_release(&fs_lk);
-        return fs_getpos(file, arg);
-      case IOCTL_GETBLKSZ:
-        lock_release(&fs_lk);
-        return fs_getblksz(file, arg);
-      case IOCTL_GETREFCNT:
-        *(uint64_t *)arg = file_io->refcnt;
-        lock_release(&fs_lk);
-        return 0;
-      case IOCTL_GETDENTRY:
-        memcpy(arg, boot_block->dir_entries, sizeof(dentry_t) * boot_block->num_dentry);
-        lock_release(&fs_lk);
-        return 0;
-      case IOCTL_GETDENTRY_NUM:
-        *(uint64_t *)arg = boot_block->num_dentry;
-        lock_release(&fs_lk);
-        return 0;
-      default:
-        lock_release(&fs_lk);
-        return -EINVAL;
-      }
+      result = journal_sync();
+      if (result < 0)
+        return result;
     }
+    return ioctl(fs_io, IOCTL_FLUSH, NULL);
+  case IOCTL_DROPCACHE:
+    // evict the file pages that are not in use, then the device cache
+    pagecache_reclaim(SIZE_MAX);
+    return ioctl(fs_io, cmd, arg);
+  case IOCTL_GETSCHED:
+  case IOCTL_SETSCHED:
+  case IOCTL_GETSCHEDSTAT:
+  case IOCTL_GETPOLL:
+  case IOCTL_SETPOLL:
+  case IOCTL_GETRING:
+  case IOCTL_GETQDEPTH:
+  case IOCTL_SETQDEPTH:
+    // the I/O scheduler, completion mode, cache and queues belong to the device
+    return ioctl(fs_io, cmd, arg);
+  case IOCTL_GETSTAT:
+    memcpy(arg, &fs_iostat, sizeof(struct io_stat));
+    return 0;
+  case IOCTL_GETPAGE:
+    rwlock_acquire_read(&file->inode->lk);
+    result = fs_mappage(file, arg);
+    rwlock_release_read(&file->inode->lk);
+    return result;
+  case IOCTL_WRITEPAGE:
+    rwlock_acquire_read(&file->inode->lk);
+    result = fs_writepage(file, arg);
+    rwlock_release_read(&file->inode->lk);
+    return result;
+  default:
+    return -EINVAL;
   }
-  lock_release(&fs_lk);
-  return -ENOTSUP;
 }
 
 /**
@@ -520,7 +1716,7 @@ int fs_getlen(file_t *file, void *arg)
 {
   if (arg != NULL)
   {
-    uint64_t size = file->file_size;
+    uint64_t size = file->inode->disk->byte_len;
     *(uint64_t *)arg = size;
   }
   else
@@ -562,7 +1758,7 @@ int fs_getpos(file_t *file, void *arg)
  */
 int fs_setpos(file_t *file, void *arg)
 {
-  if (*(uint64_t *)arg > file->file_size)
+  if (*(uint64_t *)arg > file->inode->disk->byte_len)
   {
     return -EINVAL;
   }
@@ -570,6 +1766,33 @@ int fs_setpos(file_t *file, void *arg)
   return 0;
 }
 
+/**
+ * @brief Set the length of the file.
+ *
+ * This function truncates the file, freeing the blocks past its new end, or
+ * extends it with zeroes. The position is moved back to the new end if it is
+ * past it. The new length reaches the disk like the changes of fs_create.
+ * Must be called with the file locked, the inode locked for writing, and
+ * fs_lk held.
+ *
+ * @param file Pointer to the file structure.
+ * @param arg The new length of the file.
+ * @return 0 on success, -ENOSPC if there are not enough free blocks, or a
+ *         negative error code if the file could not be changed.
+ */
+int fs_setlen(file_t *file, void *arg)
+{
+  uint64_t len = *(uint64_t *)arg;
+  int result;
+
+  result = file_resize(file->inode, len, 1);
+  if (result < 0)
+    return result;
+  if (file->file_position > len)
+    file->file_position = len;
+  return 0;
+}
+
 /**
  * @brief Get the block size of the file.
  *
@@ -591,4 +1814,1569 @@ int fs_getblksz(file_t *file, void *arg)
     return -EINVAL;
   }
   return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Returns the status of an open file.
+ *
+ * @param file Pointer to the file structure.
+ * @param arg A pointer to the struct stat to fill.
+ * @return 0 on success, -EINVAL if arg is NULL.
+ */
+int fs_getstat(file_t *file, void *arg)
+{
+  struct stat *const st = arg;
+
+  if (st == NULL)
+    return -EINVAL;
+  st->st_ino = file->inode->ino;
+  st->st_type = file->inode->dir ? ST_DIR : ST_FILE;
+  st->st_size = file->inode->disk->byte_len;
+  return 0;
+}
+
+/**
+ * @brief Takes a reference to an inode in the inode cache.
+ *
+ * A cached inode is returned without I/O. Otherwise the inode is read from
+ * disk into a new cache entry, which replaces an unused cached inode if the
+ * cache is full. Must be called with fs_lk held.
+ *
+ * @param ino The inode number.
+ * @param inodeptr The cached inode is returned here.
+ * @return 0 on success, -EINVAL if the inode number is out of range, or a
+ *         negative error code if the inode could not be read.
+ */
+static int inode_get(uint32_t ino, struct kfs_inode **inodeptr)
+{
+  struct kfs_inode **chain = &icache[ino % KFS_ICACHE_HASH];
+  struct kfs_inode *inode;
+  long result;
+
+  for (inode = *chain; inode != NULL; inode = inode->next)
+  {
+    if (inode->ino == ino)
+    {
+      inode->refcnt++;
+      *inodeptr = inode;
+      return 0;
+    }
+  }
+
+  if (ino >= boot_block->num_inodes)
+    return -EINVAL;
+
+  inode = NULL;
+  if (icache_cnt >= KFS_ICACHE_SIZE)
+    inode = inode_evict();
+  if (inode == NULL && inode_free_list != NULL)
+  {
+    inode = inode_free_list;
+    inode_free_list = inode->next;
+    inode->disk = memory_alloc_page();
+    icache_cnt++;
+  }
+  if (inode == NULL)
+  {
+    inode = kmalloc(sizeof(struct kfs_inode));
+    inode->disk = memory_alloc_page();
+    icache_cnt++;
+  }
+
+  result = fs_meta_read(fs_base + BLOCK_SIZE + (uint64_t)ino * BLOCK_SIZE, inode->disk);
+  if (result >= 0 && !inode_valid(inode->disk))
+    result = -EBADFMT;
+  if (result < 0)
+  {
+    memory_free_page(inode->disk);
+    inode->next = inode_free_list;
+    inode_free_list = inode;
+    icache_cnt--;
+    return result;
+  }
+
+  inode->ino = ino;
+  inode->refcnt = 1;
+  inode->dir = 0;
+  rwlock_init(&inode->lk, "kfs_inode");
+  lock_init(&inode->fill_lk, "kfs_fill");
+  inode->ext_idx = 0;
+  inode->ext_blk = 0;
+  inode->next = *chain;
+  *chain = inode;
+  *inodeptr = inode;
+  return 0;
+}
+
+/**
+ * @brief Releases a reference to a cached inode.
+ *
+ * An inode without references stays cached, unless the cache holds more than
+ * KFS_ICACHE_SIZE inodes because many files are open, in which case it is
+ * freed. Must be called with fs_lk held.
+ *
+ * @param inode The cached inode.
+ */
+static void inode_put(struct kfs_inode *inode)
+{
+  struct kfs_inode **pp;
+
+  if (--inode->refcnt != 0 || icache_cnt <= KFS_ICACHE_SIZE)
+    return;
+
+  for (pp = &icache[inode->ino % KFS_ICACHE_HASH]; *pp != inode; pp = &(*pp)->next)
+    continue;
+  *pp = inode->next;
+
+  memory_free_page(inode->disk);
+  inode->next = inode_free_list;
+  inode_free_list = inode;
+  icache_cnt--;
+}
+
+/**
+ * @brief Removes an unreferenced inode from the inode cache, so that its entry
+ * and page can hold another inode. Must be called with fs_lk held.
+ *
+ * @return The removed inode, or NULL if every cached inode is in use.
+ */
+static struct kfs_inode *inode_evict(void)
+{
+  struct kfs_inode **pp;
+  struct kfs_inode *inode;
+
+  for (int i = 0; i < KFS_ICACHE_HASH; i++)
+  {
+    for (pp = &icache[i]; (inode = *pp) != NULL; pp = &inode->next)
+    {
+      if (inode->refcnt == 0)
+      {
+        *pp = inode->next;
+        return inode;
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Hashes a file name (FNV-1a over at most MAX_FILE_NAME_LENGTH bytes).
+ *
+ * @param name The file name.
+ * @return The hash, never 0.
+ */
+static uint32_t dir_name_hash(const char *name)
+{
+  uint32_t hash = 2166136261u;
+
+  for (int i = 0; i < MAX_FILE_NAME_LENGTH && name[i] != '\0'; i++)
+  {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619u;
+  }
+  return (hash != 0) ? hash : 1;
+}
+
+/**
+ * @brief Adds a directory entry of the boot block to the directory index.
+ * Must be called with fs_lk held.
+ *
+ * @param idx The index of the directory entry.
+ */
+static void dir_index_add(int idx)
+{
+  struct kfs_dindex *const ent = &dir_index[idx];
+  const uint32_t hash = dir_name_hash(boot_block->dir_entries[idx].file_name);
+
+  ent->hash = hash;
+  ent->next = dir_hash[hash % KFS_DIR_HASH];
+  dir_hash[hash % KFS_DIR_HASH] = ent;
+}
+
+/**
+ * @brief Looks up a file name in the root directory index.
+ *
+ * Only the directory entries whose name has the same hash are compared. Must
+ * be called with fs_lk held.
+ *
+ * @param name The file name.
+ * @return The index of the directory entry, or -ENOENT if there is none.
+ */
+static int dir_lookup(const char *name)
+{
+  const uint32_t hash = dir_name_hash(name);
+  struct kfs_dindex *ent;
+  int idx;
+
+  // names are compared up to MAX_FILE_NAME_LENGTH bytes, so a longer name
+  // would match its prefix
+  if (strlen(name) > MAX_FILE_NAME_LENGTH)
+    return -ENOENT;
+
+  for (ent = dir_hash[hash % KFS_DIR_HASH]; ent != NULL; ent = ent->next)
+  {
+    idx = ent - dir_index;
+    if (ent->hash == hash &&
+        strncmp(boot_block->dir_entries[idx].file_name, name, MAX_FILE_NAME_LENGTH) == 0)
+      return idx;
+  }
+  return -ENOENT;
+}
+
+/**
+ * @brief Removes a directory entry from the directory index. Must be called
+ * with fs_lk held.
+ *
+ * @param idx The index of the directory entry.
+ */
+static void dir_index_remove(int idx)
+{
+  struct kfs_dindex *const ent = &dir_index[idx];
+  struct kfs_dindex **pp;
+
+  for (pp = &dir_hash[ent->hash % KFS_DIR_HASH]; *pp != ent; pp = &(*pp)->next)
+    continue;
+  *pp = ent->next;
+  ent->next = NULL;
+}
+
+/**
+ * @brief Drops an unreferenced inode from the inode cache, so that the next
+ * inode_get reads it from disk. Used when an inode number is freed or reused.
+ * Must be called with fs_lk held.
+ *
+ * @param ino The inode number.
+ */
+static void inode_forget(uint32_t ino)
+{
+  struct kfs_inode **pp;
+  struct kfs_inode *inode;
+
+  for (pp = &icache[ino % KFS_ICACHE_HASH]; (inode = *pp) != NULL; pp = &inode->next)
+  {
+    if (inode->ino == ino && inode->refcnt == 0)
+    {
+      *pp = inode->next;
+      memory_free_page(inode->disk);
+      inode->next = inode_free_list;
+      inode_free_list = inode;
+      icache_cnt--;
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Finds the directory of the last component of a path. Empty
+ * components are skipped, so "a//b/" is "a/b". Must be called with fs_lk
+ * held.
+ *
+ * @param path The path, with components separated by '/'.
+ * @param dirp The inode number of the directory, or KFS_ROOT_INO, is returned
+ *        here.
+ * @param name The last component is returned here, NUL-terminated; it is
+ *        empty if the path names the root directory. It must have room for
+ *        MAX_FILE_NAME_LENGTH + 1 bytes.
+ * @return 0 on success, -EINVAL if a component is longer than
+ *         MAX_FILE_NAME_LENGTH, -ENOENT if a directory on the path does not
+ *         exist or is a file, or a negative error code if a directory could
+ *         not be read.
+ */
+static int path_parent(const char *path, uint32_t *dirp, char *name)
+{
+  uint32_t dir = KFS_ROOT_INO;
+  const char *end;
+  uint8_t type;
+  size_t len;
+  int result;
+
+  for (;;)
+  {
+    while (*path == '/')
+      path++;
+    for (end = path; *end != '\0' && *end != '/'; end++)
+      continue;
+    len = end - path;
+    if (len > MAX_FILE_NAME_LENGTH)
+      return -EINVAL;
+    memcpy(name, path, len);
+    name[len] = '\0';
+
+    while (*end == '/')
+      end++;
+    if (*end == '\0')
+    {
+      *dirp = dir;
+      return 0;
+    }
+
+    result = dir_find(dir, name, &dir, &type);
+    if (result < 0)
+      return result;
+    if (type != FT_DIR)
+      return -ENOENT;
+    path = end;
+  }
+}
+
+/**
+ * @brief Looks up a name in a directory, through the dentry cache. A name
+ * that is not cached is looked up in the root directory index or read from
+ * the directory, and the result is cached, whether the name exists or not,
+ * so that looking it up again (e.g. the shell trying a command that does not
+ * exist) costs a hash lookup. Must be called with fs_lk held.
+ *
+ * @param dir The inode number of the directory, or KFS_ROOT_INO.
+ * @param name The name, at most MAX_FILE_NAME_LENGTH bytes.
+ * @param inop The inode number of the entry is returned here.
+ * @param typep The type of the entry, FT_FILE or FT_DIR, is returned here.
+ * @return 0 on success, -ENOENT if the directory has no entry with the name,
+ *         or a negative error code if the directory could not be read.
+ */
+static int dir_find(uint32_t dir, const char *name, uint32_t *inop, uint8_t *typep)
+{
+  struct kfs_dentry *ent = dcache_lookup(dir, name);
+  struct kfs_inode *inode;
+  dentry_t dent;
+  long result;
+
+  if (ent != NULL)
+  {
+    if (ent->type == KFS_NEGATIVE)
+      return -ENOENT;
+    *inop = ent->ino;
+    *typep = ent->type;
+    return 0;
+  }
+
+  if (dir == KFS_ROOT_INO)
+  {
+    result = dir_lookup(name);
+    if (result >= 0)
+      dent = boot_block->dir_entries[result];
+  }
+  else
+  {
+    result = inode_get(dir, &inode);
+    if (result < 0)
+      return result;
+    inode->dir = 1;
+    rwlock_acquire_read(&inode->lk);
+    result = subdir_scan(inode, name, &dent);
+    rwlock_release_read(&inode->lk);
+    inode_put(inode);
+  }
+
+  if (result == -ENOENT)
+  {
+    dcache_add(dir, name, 0, KFS_NEGATIVE);
+    return -ENOENT;
+  }
+  if (result < 0)
+    return result;
+
+  *inop = dent.inode;
+  *typep = (dent.file_type == FT_DIR) ? FT_DIR : FT_FILE;
+  dcache_add(dir, name, *inop, *typep);
+  return 0;
+}
+
+/**
+ * @brief Searches the entries of a directory other than the root for a name,
+ * reading them through the page cache. Entries do not cross pages, since a
+ * page holds a whole number of them. Must be called with the directory inode
+ * locked.
+ *
+ * @param dir The cached inode of the directory.
+ * @param name The name.
+ * @param dentp The entry is copied here if it is found, unless dentp is NULL.
+ * @return The index of the entry in the directory, -ENOENT if there is none,
+ *         or a negative error code if the directory could not be read.
+ */
+static long subdir_scan(struct kfs_inode *dir, const char *name, dentry_t *dentp)
+{
+  const uint64_t per_page = PAGE_SIZE / sizeof(dentry_t);
+  const uint64_t n = dir->disk->byte_len / sizeof(dentry_t);
+  struct pcache_page *pg = NULL;
+  const dentry_t *dent;
+  uint64_t i;
+  int result;
+
+  for (i = 0; i < n; i++)
+  {
+    if (i % per_page == 0)
+    {
+      if (pg != NULL)
+        pagecache_put(pg);
+      result = fs_getpage(dir, i / per_page, &pg);
+      if (result < 0)
+        return result;
+    }
+    dent = (const dentry_t *)pg->data + i % per_page;
+    if (strncmp(dent->file_name, name, MAX_FILE_NAME_LENGTH) == 0)
+    {
+      if (dentp != NULL)
+        *dentp = *dent;
+      pagecache_put(pg);
+      return i;
+    }
+  }
+
+  if (pg != NULL)
+    pagecache_put(pg);
+  return -ENOENT;
+}
+
+/**
+ * @brief Returns the status of a directory entry, reading its inode if it is
+ * not cached. Must be called with fs_lk held.
+ *
+ * @param ino The inode number of the entry, or KFS_ROOT_INO.
+ * @param type The type of the entry, FT_FILE or FT_DIR.
+ * @param st The status is returned here.
+ * @return 0 on success, or a negative error code if the inode could not be
+ *         read.
+ */
+static int entry_stat(uint32_t ino, uint8_t type, struct stat *st)
+{
+  struct kfs_inode *inode;
+  int result;
+
+  st->st_type = (type == FT_DIR) ? ST_DIR : ST_FILE;
+  if (ino == KFS_ROOT_INO)
+  {
+    st->st_ino = ST_ROOT_INO;
+    st->st_size = (uint64_t)boot_block->num_dentry * sizeof(dentry_t);
+    return 0;
+  }
+
+  result = inode_get(ino, &inode);
+  if (result < 0)
+    return result;
+  st->st_ino = ino;
+  st->st_size = inode->disk->byte_len;
+  inode_put(inode);
+  return 0;
+}
+
+/**
+ * @brief Adds an entry at the end of a directory and writes the directory
+ * back. The caller has checked that the name is not in the directory. Must be
+ * called with fs_lk held.
+ *
+ * @param dir The inode number of the directory, or KFS_ROOT_INO.
+ * @param dent The new entry.
+ * @return 0 on success, -ENOSPC if the directory is full, or a negative error
+ *         code if the directory could not be written.
+ */
+static int dir_add(uint32_t dir, const dentry_t *dent)
+{
+  struct kfs_inode *inode;
+  uint64_t len;
+  long result;
+  int i;
+
+  if (dir == KFS_ROOT_INO)
+  {
+    if (boot_block->num_dentry >= MAX_DIR_ENTRIES)
+      return -ENOSPC;
+    i = boot_block->num_dentry;
+    boot_block->dir_entries[i] = *dent;
+    boot_block->num_dentry++;
+    dir_index_add(i);
+    return fs_meta_write(fs_base, boot_block, BLOCK_SIZE);
+  }
+
+  result = inode_get(dir, &inode);
+  if (result < 0)
+    return result;
+  inode->dir = 1;
+  rwlock_acquire_write(&inode->lk);
+  len = inode->disk->byte_len;
+  result = file_resize(inode, len + sizeof(dentry_t), 1);
+  if (result == 0)
+  {
+    result = dir_write(inode, len / sizeof(dentry_t), dent);
+    if (result < 0)
+      file_resize(inode, len, 0);
+  }
+  rwlock_release_write(&inode->lk);
+  inode_put(inode);
+  return (result < 0) ? result : 0;
+}
+
+/**
+ * @brief Removes an entry from a directory and writes the directory back. The
+ * last entry takes its place, so that the entries stay contiguous. Must be
+ * called with fs_lk held.
+ *
+ * @param dir The inode number of the directory, or KFS_ROOT_INO.
+ * @param name The name of the entry.
+ * @return 0 on success, -ENOENT if there is no entry with the name, or a
+ *         negative error code if the directory could not be read or written.
+ */
+static int dir_remove(uint32_t dir, const char *name)
+{
+  struct kfs_inode *inode;
+  dentry_t dent;
+  uint64_t last;
+  long result;
+  int i;
+
+  if (dir == KFS_ROOT_INO)
+  {
+    i = dir_lookup(name);
+    if (i < 0)
+      return i;
+    last = boot_block->num_dentry - 1;
+    dir_index_remove(i);
+    if (i != last)
+    {
+      dir_index_remove(last);
+      boot_block->dir_entries[i] = boot_block->dir_entries[last];
+      dir_index_add(i);
+    }
+    memset(&boot_block->dir_entries[last], 0, sizeof(dentry_t));
+    boot_block->num_dentry--;
+    return fs_meta_write(fs_base, boot_block, BLOCK_SIZE);
+  }
+
+  result = inode_get(dir, &inode);
+  if (result < 0)
+    return result;
+  inode->dir = 1;
+  rwlock_acquire_write(&inode->lk);
+  result = subdir_scan(inode, name, NULL);
+  if (result >= 0)
+  {
+    last = inode->disk->byte_len / sizeof(dentry_t) - 1;
+    if (result != last)
+    {
+      const uint64_t slot = result;
+      result = fs_read_at(inode, last * sizeof(dentry_t), &dent, sizeof(dentry_t));
+      if (result >= 0)
+        result = dir_write(inode, slot, &dent);
+    }
+  }
+  // the directory is kept zero past its end
+  if (result >= 0)
+    result = dir_write(inode, last, NULL);
+  if (result >= 0)
+    result = file_resize(inode, last * sizeof(dentry_t), 0);
+  rwlock_release_write(&inode->lk);
+  inode_put(inode);
+  return (result < 0) ? result : 0;
+}
+
+/**
+ * @brief Writes an entry of a directory other than the root. The entry is
+ * changed in the page cache, and its block is written as metadata, so that
+ * with the journal it commits with the rest of the operation. Must be called
+ * with fs_lk held and the directory inode locked for writing.
+ *
+ * @param dir The cached inode of the directory.
+ * @param idx The index of the entry, which must be within the directory.
+ * @param dent The entry, or NULL to clear it.
+ * @return 0 on success, or a negative error code.
+ */
+static int dir_write(struct kfs_inode *dir, uint64_t idx, const dentry_t *dent)
+{
+  const uint64_t per_page = PAGE_SIZE / sizeof(dentry_t);
+  struct pcache_page *pg;
+  dentry_t *slot;
+  uint64_t run;
+  int result;
+
+  result = fs_getpage(dir, idx / per_page, &pg);
+  if (result < 0)
+    return result;
+  slot = (dentry_t *)pg->data + idx % per_page;
+  if (dent != NULL)
+    *slot = *dent;
+  else
+    memset(slot, 0, sizeof(dentry_t));
+  result = fs_meta_write(fs_map(dir, idx / per_page * PAGE_SIZE, 1, &run), pg->data, BLOCK_SIZE);
+  pagecache_put(pg);
+  return result;
+}
+
+/**
+ * @brief Finds the inodes in use, which are the inodes of the entries of all
+ * directories, by walking the directory tree from the root. Directories still
+ * to be read are marked in a second bitmap, so the walk needs no stack. Must
+ * be called with fs_lk held, before any file is open.
+ *
+ * @return 0 on success, -EBADFMT if an entry refers to an inode that does not
+ *         exist or to an inode in use, or a negative error code if a
+ *         directory could not be read.
+ */
+static int fs_scan_inodes(void)
+{
+  const uint32_t ninodes = boot_block->num_inodes;
+  const uint64_t per_page = PAGE_SIZE / sizeof(dentry_t);
+  struct kfs_inode *inode;
+  struct pcache_page *pg;
+  uint8_t *pending;
+  uint32_t ino, n, found;
+  int result = 0;
+
+  fs_inode_used = kcalloc((ninodes + 7) / 8, 1);
+  pending = kcalloc((ninodes + 7) / 8, 1);
+
+  for (n = 0; n < boot_block->num_dentry && result == 0; n++)
+    result = inode_mark(&boot_block->dir_entries[n], pending);
+
+  do
+  {
+    found = 0;
+    for (ino = 0; ino < ninodes && result == 0; ino++)
+    {
+      if (!(pending[ino / 8] & (1 << (ino % 8))))
+        continue;
+      pending[ino / 8] &= ~(1 << (ino % 8));
+      found = 1;
+
+      result = inode_get(ino, &inode);
+      if (result < 0)
+        break;
+      inode->dir = 1;
+      pg = NULL;
+      for (n = 0; n < inode->disk->byte_len / sizeof(dentry_t) && result == 0; n++)
+      {
+        if (n % per_page == 0)
+        {
+          if (pg != NULL)
+            pagecache_put(pg);
+          pg = NULL;
+          result = fs_getpage(inode, n / per_page, &pg);
+          if (result < 0)
+            break;
+        }
+        result = inode_mark((const dentry_t *)pg->data + n % per_page, pending);
+      }
+      if (pg != NULL)
+        pagecache_put(pg);
+      inode_put(inode);
+    }
+  } while (found && result == 0);
+
+  return result;
+}
+
+/**
+ * @brief Marks the inode of a directory entry in use while fs_scan_inodes
+ * walks the directory tree, and marks it pending if it is a directory.
+ *
+ * @param dent The directory entry.
+ * @param pending The bitmap of directories still to be read.
+ * @return 0 on success, or -EBADFMT if the inode does not exist or is
+ *         already in use.
+ */
+static int inode_mark(const dentry_t *dent, uint8_t *pending)
+{
+  const uint32_t ino = dent->inode;
+
+  if (ino >= boot_block->num_inodes || (fs_inode_used[ino / 8] & (1 << (ino % 8))))
+    return -EBADFMT;
+  fs_inode_used[ino / 8] |= 1 << (ino % 8);
+  if (dent->file_type == FT_DIR)
+    pending[ino / 8] |= 1 << (ino % 8);
+  return 0;
+}
+
+/**
+ * @brief Allocates an inode that is not in use. Must be called with fs_lk
+ * held.
+ *
+ * @param inop The inode number is returned here.
+ * @return 0 on success, or -ENOSPC if all inodes are in use.
+ */
+static int inode_alloc(uint32_t *inop)
+{
+  for (uint32_t ino = 0; ino < boot_block->num_inodes; ino++)
+  {
+    if (!(fs_inode_used[ino / 8] & (1 << (ino % 8))))
+    {
+      fs_inode_used[ino / 8] |= 1 << (ino % 8);
+      *inop = ino;
+      return 0;
+    }
+  }
+  return -ENOSPC;
+}
+
+/**
+ * @brief Hashes a dentry cache key.
+ *
+ * @param parent The inode number of the directory.
+ * @param name The name.
+ * @return The hash, never 0, so that 0 can mark a free entry.
+ */
+static uint32_t dcache_key(uint32_t parent, const char *name)
+{
+  const uint32_t hash = dir_name_hash(name) ^ (parent * 2654435761u);
+
+  return (hash != 0) ? hash : 1;
+}
+
+/**
+ * @brief Looks up a name in the dentry cache. Must be called with fs_lk held.
+ *
+ * @param parent The inode number of the directory, or KFS_ROOT_INO.
+ * @param name The name.
+ * @return The entry, or NULL if the name is not cached.
+ */
+static struct kfs_dentry *dcache_lookup(uint32_t parent, const char *name)
+{
+  const uint32_t hash = dcache_key(parent, name);
+  struct kfs_dentry *ent;
+
+  for (ent = dcache_hash[hash % KFS_DCACHE_HASH]; ent != NULL; ent = ent->next)
+  {
+    if (ent->hash == hash && ent->parent == parent &&
+        strncmp(ent->name, name, MAX_FILE_NAME_LENGTH) == 0)
+    {
+      ent->referenced = 1;
+      return ent;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Adds a name to the dentry cache, or changes the cached entry of the
+ * name. A free entry is taken if there is one; otherwise the clock hand moves
+ * to the first entry not used since it last passed, which is replaced. Must
+ * be called with fs_lk held.
+ *
+ * @param parent The inode number of the directory, or KFS_ROOT_INO.
+ * @param name The name.
+ * @param ino The inode number of the entry, unused for a negative entry.
+ * @param type FT_FILE, FT_DIR, or KFS_NEGATIVE if the name does not exist.
+ */
+static void dcache_add(uint32_t parent, const char *name, uint32_t ino, uint8_t type)
+{
+  const uint32_t hash = dcache_key(parent, name);
+  struct kfs_dentry *ent = dcache_lookup(parent, name);
+
+  if (ent == NULL)
+  {
+    for (;;)
+    {
+      ent = &dcache[dcache_hand];
+      dcache_hand = (dcache_hand + 1) % KFS_DCACHE_SIZE;
+      if (ent->hash == 0 || !ent->referenced)
+        break;
+      ent->referenced = 0;
+    }
+    if (ent->hash != 0)
+      dcache_unlink(ent);
+    ent->hash = hash;
+    ent->parent = parent;
+    strncpy(ent->name, name, MAX_FILE_NAME_LENGTH);
+    ent->next = dcache_hash[hash % KFS_DCACHE_HASH];
+    dcache_hash[hash % KFS_DCACHE_HASH] = ent;
+  }
+  ent->ino = ino;
+  ent->type = type;
+  ent->referenced = 1;
+}
+
+/**
+ * @brief Removes the entries of a deleted directory from the dentry cache,
+ * so that they are not found if its inode becomes another directory. Must be
+ * called with fs_lk held.
+ *
+ * @param parent The inode number of the directory.
+ */
+static void dcache_purge(uint32_t parent)
+{
+  for (int i = 0; i < KFS_DCACHE_SIZE; i++)
+  {
+    if (dcache[i].hash != 0 && dcache[i].parent == parent)
+    {
+      dcache_unlink(&dcache[i]);
+      dcache[i].hash = 0;
+    }
+  }
+}
+
+/**
+ * @brief Removes an entry of the dentry cache from its hash chain. Must be
+ * called with fs_lk held.
+ *
+ * @param ent The entry.
+ */
+static void dcache_unlink(struct kfs_dentry *ent)
+{
+  struct kfs_dentry **pp;
+
+  for (pp = &dcache_hash[ent->hash % KFS_DCACHE_HASH]; *pp != ent; pp = &(*pp)->next)
+    continue;
+  *pp = ent->next;
+  ent->next = NULL;
+}
+
+/**
+ * @brief Writes a cached inode back with fs_meta_write. Must be called like
+ * file_resize.
+ *
+ * @param inode The cached inode.
+ * @return 0 on success, or a negative error code.
+ */
+static int inode_write(struct kfs_inode *inode)
+{
+  return fs_meta_write(fs_base + BLOCK_SIZE + (uint64_t)inode->ino * BLOCK_SIZE, inode->disk, BLOCK_SIZE);
+}
+
+/**
+ * @brief Changes the length of a file, allocating or freeing blocks.
+ *
+ * Blocks are allocated next-fit, starting after the last block of the file,
+ * so that a growing file stays contiguous on disk and, with extents, extends
+ * its last extent. Freed blocks are discarded on the device, with the journal
+ * once the transaction that frees them commits. The bytes of the last block
+ * past the end of the file are kept zero. The inode and the bitmap are written
+ * with fs_meta_write, so with the journal they reach the disk at the next
+ * commit. Must be called with fs_lk held and the inode locked for
+ * writing, unless the file is not open.
+ *
+ * @param inode The cached inode of the file.
+ * @param len The new length in bytes.
+ * @param zero Nonzero if newly allocated blocks must be zeroed; zero if the
+ *        caller overwrites them.
+ * A compressed file can only be emptied, which turns it into an ordinary
+ * file; other lengths fail with -EACCESS.
+ *
+ * @return 0 on success, -ENOSPC if the file would be too large, there are
+ *         not enough free blocks, or the inode has no room for the extents
+ *         (the file is then unchanged), or a negative error code if the file
+ *         system could not be written.
+ */
+static int file_resize(struct kfs_inode *inode, uint64_t len, int zero)
+{
+  inode_t *const disk = inode->disk;
+  const uint64_t old_blocks = ((uint64_t)disk->byte_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  const uint64_t new_blocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  struct pcache_page *pg;
+  uint32_t hint, blk;
+  uint64_t b, run;
+  int result;
+
+  if (len > UINT32_MAX || (!fs_extents && new_blocks > MAX_INODES))
+    return -ENOSPC;
+
+  if (inode_compressed(disk))
+  {
+    if (len != 0)
+      return -EACCESS;
+    pagecache_truncate(inode->ino, 0);
+    for (b = 0; b < disk->zextent.len; b++)
+      block_free(disk->zextent.start + b);
+    if (disk->zextent.len != 0 && !fs_journal)
+      block_discard(disk->zextent.start, disk->zextent.len);
+    memset(&disk->zmagic, 0, BLOCK_SIZE - offsetof(inode_t, zmagic));
+    inode->ext_idx = 0;
+    inode->ext_blk = 0;
+  }
+  else if (len < disk->byte_len)
+  {
+    // dir_remove clears the entry past the end of a directory itself, in
+    // the same transaction
+    if (len % BLOCK_SIZE != 0 && !inode->dir)
+    {
+      result = fs_zero(fs_map(inode, len, 1, &run), BLOCK_SIZE - len % BLOCK_SIZE);
+      if (result < 0)
+        return result;
+    }
+
+    // cached pages past the end are dropped, and the cached page with the
+    // new end is zeroed past it like its block
+    pagecache_truncate(inode->ino, (len + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (len % PAGE_SIZE != 0)
+    {
+      pg = pagecache_lookup(inode->ino, len / PAGE_SIZE);
+      if (pg != NULL)
+      {
+        memset((char *)pg->data + len % PAGE_SIZE, 0, PAGE_SIZE - len % PAGE_SIZE);
+        pagecache_put(pg);
+      }
+    }
+
+    file_free_blocks(inode, new_blocks, old_blocks);
+  }
+  else if (new_blocks > old_blocks)
+  {
+    hint = fs_alloc_next;
+    if (old_blocks != 0)
+    {
+      fs_bmap(inode, old_blocks - 1, 1, &blk);
+      hint = blk + 1;
+    }
+
+    for (b = old_blocks; b < new_blocks; b++)
+    {
+      result = block_alloc(hint, &blk);
+      if (result == 0)
+      {
+        result = bmap_append(inode, b, blk);
+        if (result < 0)
+          block_free(blk);
+      }
+      if (result < 0)
+      {
+        // give back the blocks allocated so far
+        file_free_blocks(inode, old_blocks, b);
+        return result;
+      }
+      hint = blk + 1;
+    }
+
+    // zero the new blocks in runs that are contiguous on disk
+    for (b = old_blocks; zero && b < new_blocks; b += run)
+    {
+      run = fs_bmap(inode, b, new_blocks - b, &blk);
+      result = fs_zero(fs_data_base + (uint64_t)blk * BLOCK_SIZE, run * BLOCK_SIZE);
+      if (result < 0)
+        return result;
+    }
+  }
+
+  disk->byte_len = len;
+  result = bitmap_flush();
+  if (result < 0)
+    return result;
+  return inode_write(inode);
+}
+
+/**
+ * @brief Frees the blocks of a file from file block first up to end, which
+ * must be its last blocks, and removes them from the file. The blocks are
+ * discarded in runs that are contiguous on disk. Must be called like
+ * file_resize.
+ *
+ * @param inode The cached inode of the file.
+ * @param first Index of the first file block to free.
+ * @param end The number of blocks of the file.
+ */
+static void file_free_blocks(struct kfs_inode *inode, uint64_t first, uint64_t end)
+{
+  uint32_t dblk;
+  uint64_t b, run;
+
+  for (b = first; b < end; b += run)
+  {
+    run = fs_bmap(inode, b, end - b, &dblk);
+    for (uint64_t i = 0; i < run; i++)
+      block_free(dblk + i);
+    // with the journal, freed blocks are discarded once the transaction
+    // that frees them commits
+    if (!fs_journal)
+      block_discard(dblk, run);
+  }
+  bmap_truncate(inode, first);
+}
+
+/**
+ * @brief Writes a block of file system metadata (boot block, inode, bitmap
+ * block or directory block). With the journal, the block is copied into the
+ * running transaction, which the committer thread commits later; otherwise it
+ * is written to the device. Must be called with fs_lk held, within
+ * fs_op_begin.
+ *
+ * @param pos The device position of the block.
+ * @param buf The data to write.
+ * @param len The length of the data, BLOCK_SIZE.
+ * @return 0 on success, or a negative error code.
+ */
+static int fs_meta_write(uint64_t pos, const void *buf, uint64_t len)
+{
+  if (fs_journal)
+    return journal_log(pos / BLOCK_SIZE, buf);
+  return fs_dev_write(pos, buf, len);
+}
+
+/**
+ * @brief Reads a block of file system metadata, which is the copy in the
+ * journal if there is one. Must be called with fs_lk held.
+ *
+ * @param pos The device position of the block.
+ * @param buf The buffer, BLOCK_SIZE bytes.
+ * @return 0 on success, or a negative error code.
+ */
+static int fs_meta_read(uint64_t pos, void *buf)
+{
+  long result;
+
+  if (fs_journal && journal_read(pos / BLOCK_SIZE, buf))
+    return 0;
+  result = ioseek(fs_io, pos);
+  if (result >= 0)
+    result = ioread_full(fs_io, buf, BLOCK_SIZE);
+  if (result >= 0 && result < BLOCK_SIZE)
+    result = -EIO;
+  return (result < 0) ? result : 0;
+}
+
+/**
+ * @brief Writes to the file system device.
+ *
+ * @param pos The device position.
+ * @param buf The data to write.
+ * @param len The length of the data.
+ * @return 0 on success, or a negative error code.
+ */
+static int fs_dev_write(uint64_t pos, const void *buf, uint64_t len)
+{
+  long result;
+
+  result = ioseek(fs_io, pos);
+  if (result >= 0)
+    result = iowrite(fs_io, buf, len);
+  if (result >= 0 && result < len)
+    result = -EIO;
+  return (result < 0) ? result : 0;
+}
+
+/**
+ * @brief Zeroes a range of the file system device. Block-aligned ranges are
+ * zeroed with IOCTL_WRITEZEROES if the device supports it; anything else is
+ * written from a block of zeroes.
+ *
+ * @param pos The device position.
+ * @param len The length of the range.
+ * @return 0 on success, or a negative error code.
+ */
+static int fs_zero(uint64_t pos, uint64_t len)
+{
+  struct io_range range = { .pos = pos, .len = len };
+  uint64_t cnt;
+  int result;
+
+  if (pos % BLOCK_SIZE == 0 && len % BLOCK_SIZE == 0)
+  {
+    result = ioctl(fs_io, IOCTL_WRITEZEROES, &range);
+    if (result != -ENOTSUP)
+      return result;
+  }
+
+  for (; len > 0; pos += cnt, len -= cnt)
+  {
+    cnt = (len < BLOCK_SIZE) ? len : BLOCK_SIZE;
+    result = fs_dev_write(pos, fs_zero_block, cnt);
+    if (result < 0)
+      return result;
+  }
+  return 0;
+}
+
+/**
+ * @brief Returns the bitmap byte holding the bit of a data block.
+ */
+static inline uint8_t *bitmap_byte(uint32_t blk)
+{
+  return &fs_bitmap[blk / KFS_BITMAP_BITS][blk % KFS_BITMAP_BITS / 8];
+}
+
+/**
+ * @brief Allocates a free data block, searching next-fit from a hint and
+ * wrapping around at the end of the data blocks. The bitmap is updated in
+ * memory; bitmap_flush writes it back. Must be called with fs_lk held.
+ *
+ * @param hint The block to start the search at.
+ * @param blkptr The allocated block number is returned here.
+ * @return 0 on success, -ENOSPC if there are no free blocks (or no bitmap).
+ */
+static int block_alloc(uint32_t hint, uint32_t *blkptr)
+{
+  const uint32_t nblocks = boot_block->num_data;
+  uint32_t blk;
+  uint8_t *byte;
+
+  if (fs_bitmap == NULL || nblocks == 0)
+    return -ENOSPC;
+
+  if (hint >= nblocks)
+    hint = 0;
+
+  for (uint32_t i = 0; i < nblocks; i++)
+  {
+    blk = hint + i;
+    if (blk >= nblocks)
+      blk -= nblocks;
+
+    byte = bitmap_byte(blk);
+    if (*byte & (1 << (blk % 8)))
+      continue;
+    // with the journal, a block must also be free in the committed bitmap,
+    // and must not have a copy in the log, which a replay would write over it
+    if (fs_journal && (fs_bitmap_committed[blk / KFS_BITMAP_BITS][blk % KFS_BITMAP_BITS / 8] & (1 << (blk % 8)) ||
+                       journal_holds((fs_data_base / BLOCK_SIZE) + blk)))
+      continue;
+
+    *byte |= 1 << (blk % 8);
+    fs_bitmap_dirty[blk / KFS_BITMAP_BITS] = 1;
+    fs_alloc_next = blk + 1;
+    *blkptr = blk;
+    return 0;
+  }
+  return -ENOSPC;
+}
+
+/**
+ * @brief Marks a data block free in the bitmap. Must be called with fs_lk held.
+ *
+ * @param blk The block number.
+ */
+static void block_free(uint32_t blk)
+{
+  if (fs_bitmap == NULL || blk >= boot_block->num_data)
+    return;
+
+  *bitmap_byte(blk) &= ~(1 << (blk % 8));
+  fs_bitmap_dirty[blk / KFS_BITMAP_BITS] = 1;
+}
+
+/**
+ * @brief Tells the device that a run of freed data blocks no longer holds data.
+ * This is only a hint, so errors (and devices without discard) are ignored.
+ *
+ * @param first The first block of the run.
+ * @param count The number of blocks.
+ */
+static void block_discard(uint32_t first, uint32_t count)
+{
+  struct io_range range = {
+    .pos = fs_data_base + (uint64_t)first * BLOCK_SIZE,
+    .len = (uint64_t)count * BLOCK_SIZE
+  };
+
+  ioctl(fs_io, IOCTL_DISCARD, &range);
+}
+
+/**
+ * @brief Writes the changed blocks of the bitmap back with fs_meta_write. Must
+ * be called with fs_lk held.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+static int bitmap_flush(void)
+{
+  const uint64_t base = fs_base + (1 + (uint64_t)boot_block->num_inodes) * BLOCK_SIZE;
+  int result;
+
+  for (int i = 0; i < boot_block->num_bitmap; i++)
+  {
+    if (!fs_bitmap_dirty[i])
+      continue;
+    result = fs_meta_write(base + (uint64_t)i * BLOCK_SIZE, fs_bitmap[i], BLOCK_SIZE);
+    if (result < 0)
+      return result;
+    fs_bitmap_dirty[i] = 0;
+  }
+  return 0;
+}
+
+/**
+ * @brief Starts an operation that changes metadata by taking fs_lk. With the
+ * journal, it first waits until the running transaction has room for all the
+ * blocks the operation may change, so that operations never span two
+ * transactions. The operation ends when fs_lk is released.
+ */
+static void fs_op_begin(void)
+{
+  lock_acquire(&fs_lk);
+  while (fs_journal && fs_jrun_cnt + fs_jreserve > fs_jslots)
+  {
+    lock_release(&fs_lk);
+    condition_wait(&fs_jdone);
+    lock_acquire(&fs_lk);
+  }
+}
+
+/**
+ * @brief Copies a changed metadata block into the running transaction. A
+ * block changed again in the same transaction is copied over its previous
+ * copy. Must be called with fs_lk held, within fs_op_begin.
+ *
+ * @param home The device block number of the block.
+ * @param buf The contents of the block.
+ * @return 0 on success, or -ENOSPC if the transaction is full, which
+ *         fs_op_begin prevents.
+ */
+static int journal_log(uint32_t home, const void *buf)
+{
+  struct kfs_jblock *jb;
+
+  for (uint32_t i = 0; i < fs_jrun_cnt; i++)
+  {
+    if (fs_jrun[i].home == home)
+    {
+      memcpy(fs_jrun[i].data, buf, BLOCK_SIZE);
+      return 0;
+    }
+  }
+  if (fs_jrun_cnt == fs_jslots)
+    return -ENOSPC;
+
+  jb = &fs_jrun[fs_jrun_cnt++];
+  jb->home = home;
+  jb->data = memory_alloc_page();
+  memcpy(jb->data, buf, BLOCK_SIZE);
+  return 0;
+}
+
+/**
+ * @brief Finds the newest copy of a block in the journal: in the running
+ * transaction, the transaction being committed, or the log. Must be called
+ * with fs_lk held.
+ *
+ * @param home The device block number of the block.
+ * @param buf The copy is returned here if there is one.
+ * @return 1 if the journal has a copy of the block, 0 if the device has the
+ *         newest contents.
+ */
+static int journal_read(uint32_t home, void *buf)
+{
+  uint32_t i;
+
+  for (i = 0; i < fs_jrun_cnt; i++)
+  {
+    if (fs_jrun[i].home == home)
+    {
+      memcpy(buf, fs_jrun[i].data, BLOCK_SIZE);
+      return 1;
+    }
+  }
+  for (i = 0; i < fs_jcommit_cnt; i++)
+  {
+    if (fs_jcommit[i].home == home)
+    {
+      memcpy(buf, fs_jcommit[i].data, BLOCK_SIZE);
+      return 1;
+    }
+  }
+  for (i = 0; i < fs_jlog_cnt; i++)
+  {
+    if (fs_jlog[i].home == home)
+    {
+      memcpy(buf, fs_jlog[i].data, BLOCK_SIZE);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Tells whether the journal has a copy of a block. Must be called with
+ * fs_lk held.
+ *
+ * @param home The device block number of the block.
+ * @return 1 if it has, 0 if not.
+ */
+static int journal_holds(uint32_t home)
+{
+  uint32_t i;
+
+  for (i = 0; i < fs_jrun_cnt; i++)
+    if (fs_jrun[i].home == home)
+      return 1;
+  for (i = 0; i < fs_jcommit_cnt; i++)
+    if (fs_jcommit[i].home == home)
+      return 1;
+  for (i = 0; i < fs_jlog_cnt; i++)
+    if (fs_jlog[i].home == home)
+      return 1;
+  return 0;
+}
+
+/**
+ * @brief Replays the log at mount: the blocks of the committed transactions
+ * in the log are written to their homes in log order, then the log is
+ * emptied, and the boot block is read again. A crash during the replay
+ * leaves the log as it was, so it is replayed again at the next mount.
+ *
+ * @return 0 on success, -EBADFMT if the header is invalid, or a negative
+ *         error code.
+ */
+static int journal_replay(void)
+{
+  const uint64_t end = fs_data_base / BLOCK_SIZE + boot_block->num_data;
+  void *buf;
+  long result;
+  uint32_t i;
+
+  fs_jhdr = memory_alloc_page();
+  result = ioseek(fs_io, fs_jbase);
+  if (result >= 0)
+    result = ioread_full(fs_io, fs_jhdr, BLOCK_SIZE);
+  if (result >= 0 && result < BLOCK_SIZE)
+    result = -EIO;
+  if (result < 0)
+    return result;
+
+  // a journal that was never written is all zeroes
+  if (fs_jhdr->magic != JOURNAL_MAGIC)
+  {
+    memset(fs_jhdr, 0, BLOCK_SIZE);
+    fs_jhdr->magic = JOURNAL_MAGIC;
+    return 0;
+  }
+  fs_jseq = fs_jhdr->seq;
+  if (fs_jhdr->num_blocks == 0)
+    return 0;
+  if (fs_jhdr->num_blocks > fs_jslots)
+    return -EBADFMT;
+
+  buf = memory_alloc_page();
+  for (i = 0; i < fs_jhdr->num_blocks && result >= 0; i++)
+  {
+    // a log block never belongs to the journal itself
+    if (fs_jhdr->home[i] < fs_base / BLOCK_SIZE || fs_jhdr->home[i] >= end ||
+        (fs_jhdr->home[i] >= fs_jbase / BLOCK_SIZE && fs_jhdr->home[i] < fs_data_base / BLOCK_SIZE))
+    {
+      result = -EBADFMT;
+      break;
+    }
+    result = ioseek(fs_io, fs_jbase + (1 + (uint64_t)i) * BLOCK_SIZE);
+    if (result >= 0)
+      result = ioread_full(fs_io, buf, BLOCK_SIZE);
+    if (result >= 0 && result < BLOCK_SIZE)
+      result = -EIO;
+    if (result >= 0)
+      result = fs_dev_write((uint64_t)fs_jhdr->home[i] * BLOCK_SIZE, buf, BLOCK_SIZE);
+  }
+  memory_free_page(buf);
+
+  // the homes must be written before the log is emptied
+  if (result >= 0)
+    result = ioctl(fs_io, IOCTL_FLUSH, NULL);
+  if (result >= 0)
+  {
+    fs_jhdr->num_blocks = 0;
+    result = fs_dev_write(fs_jbase, fs_jhdr, BLOCK_SIZE);
+  }
+  if (result >= 0)
+    result = ioctl(fs_io, IOCTL_FLUSH, NULL);
+  if (result >= 0)
+  {
+    result = ioseek(fs_io, fs_base);
+    if (result >= 0)
+      result = ioread_full(fs_io, boot_block, BLOCK_SIZE);
+  }
+  return (result < 0) ? result : 0;
+}
+
+/**
+ * @brief Commits the running transaction, or retries the transaction whose
+ * commit failed. Called by the committer thread only.
+ *
+ * The blocks of the transaction are appended to the log with one vectored
+ * write per IOV_MAX blocks; a flush makes them durable before the header that
+ * lists them is written, and a second flush makes the header, and so the
+ * transaction, durable. File data written before the transaction was taken
+ * is flushed by the first flush, so metadata never commits before the data
+ * written ahead of it. If the log is full, it is checkpointed first. Once the
+ * transaction commits, its copies of bitmap blocks become the committed
+ * bitmap, the blocks it freed are discarded, and threads waiting in
+ * journal_sync or fs_op_begin are woken.
+ *
+ * @return 0 on success, or a negative error code; the transaction is then
+ *         kept and committed again later.
+ */
+static int journal_commit(void)
+{
+  const uint32_t bitmap_home = (fs_base + (1 + (uint64_t)boot_block->num_inodes) * BLOCK_SIZE) / BLOCK_SIZE;
+  struct io_vec iov[IOV_MAX];
+  struct kfs_jblock *jb;
+  uint32_t i, j, k, n, blk, first;
+  uint8_t *old;
+  long result = 0;
+
+  lock_acquire(&fs_lk);
+  if (fs_jcommit_cnt == 0)
+  {
+    // take the running transaction; operations start a new one
+    jb = fs_jcommit;
+    fs_jcommit = fs_jrun;
+    fs_jcommit_cnt = fs_jrun_cnt;
+    fs_jrun = jb;
+    fs_jrun_cnt = 0;
+  }
+  n = fs_jcommit_cnt;
+  lock_release(&fs_lk);
+  if (n == 0)
+    return 0;
+
+  if (fs_jused + n > fs_jslots)
+    result = journal_checkpoint();
+
+  for (i = 0; i < n && result >= 0; i += k)
+  {
+    for (k = 0; k < IOV_MAX && i + k < n; k++)
+    {
+      iov[k].buf = fs_jcommit[i + k].data;
+      iov[k].len = BLOCK_SIZE;
+    }
+    result = ioseek(fs_io, fs_jbase + (1 + (uint64_t)fs_jused + i) * BLOCK_SIZE);
+    if (result >= 0)
+      result = iowritev(fs_io, iov, k);
+    if (result >= 0 && result < k * BLOCK_SIZE)
+      result = -EIO;
+  }
+  if (result >= 0)
+    result = ioctl(fs_io, IOCTL_FLUSH, NULL);
+  if (result >= 0)
+  {
+    for (i = 0; i < n; i++)
+      fs_jhdr->home[fs_jused + i] = fs_jcommit[i].home;
+    fs_jhdr->num_blocks = fs_jused + n;
+    fs_jhdr->seq = fs_jseq + 1;
+    result = fs_dev_write(fs_jbase, fs_jhdr, BLOCK_SIZE);
+  }
+  if (result >= 0)
+    result = ioctl(fs_io, IOCTL_FLUSH, NULL);
+
+  lock_acquire(&fs_lk);
+  if (result < 0)
+  {
+    // the header in memory may list blocks that were not committed, but
+    // only up to num_blocks is used
+    fs_jhdr->num_blocks = fs_jused;
+    fs_jerror = result;
+    condition_broadcast(&fs_jdone);
+    lock_release(&fs_lk);
+    return result;
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    jb = &fs_jcommit[i];
+
+    // a committed bitmap block frees the blocks that were in use in the
+    // previous committed bitmap and are not in it
+    if (jb->home >= bitmap_home && jb->home < bitmap_home + boot_block->num_bitmap)
+    {
+      old = fs_bitmap_committed[jb->home - bitmap_home];
+      for (blk = 0; blk < KFS_BITMAP_BITS; blk = first)
+      {
+        for (; blk < KFS_BITMAP_BITS; blk++)
+          if ((old[blk / 8] & ~((uint8_t *)jb->data)[blk / 8]) & (1 << (blk % 8)))
+            break;
+        for (first = blk; first < KFS_BITMAP_BITS; first++)
+          if (!((old[first / 8] & ~((uint8_t *)jb->data)[first / 8]) & (1 << (first % 8))))
+            break;
+        if (first > blk)
+          block_discard((jb->home - bitmap_home) * KFS_BITMAP_BITS + blk, first - blk);
+      }
+      memcpy(old, jb->data, BLOCK_SIZE);
+    }
+
+    // the log keeps the newest copy of each block
+    for (j = 0; j < fs_jlog_cnt; j++)
+      if (fs_jlog[j].home == jb->home)
+        break;
+    if (j < fs_jlog_cnt)
+    {
+      memory_free_page(fs_jlog[j].data);
+      fs_jlog[j].data = jb->data;
+    }
+    else
+      fs_jlog[fs_jlog_cnt++] = *jb;
+  }
+
+  fs_jused += n;
+  fs_jcommit_cnt = 0;
+  fs_jseq++;
+  fs_jerror = 0;
+  condition_broadcast(&fs_jdone);
+  lock_release(&fs_lk);
+  return 0;
+}
+
+/**
+ * @brief Writes the blocks in the log to their homes and empties the log, so
+ * that transactions can be appended from its start again. The homes are
+ * flushed before the header is cleared, and the cleared header before new
+ * transactions overwrite the log. Called by the committer thread only.
+ *
+ * @return 0 on success, or a negative error code; the log is then kept.
+ */
+static int journal_checkpoint(void)
+{
+  long result = 0;
+  uint32_t i;
+
+  for (i = 0; i < fs_jlog_cnt && result >= 0; i++)
+    result = fs_dev_write((uint64_t)fs_jlog[i].home * BLOCK_SIZE, fs_jlog[i].data, BLOCK_SIZE);
+  if (result >= 0)
+    result = ioctl(fs_io, IOCTL_FLUSH, NULL);
+  if (result >= 0)
+  {
+    fs_jhdr->num_blocks = 0;
+    result = fs_dev_write(fs_jbase, fs_jhdr, BLOCK_SIZE);
+  }
+  if (result >= 0)
+    result = ioctl(fs_io, IOCTL_FLUSH, NULL);
+  if (result < 0)
+  {
+    fs_jhdr->num_blocks = fs_jused;
+    return result;
+  }
+
+  lock_acquire(&fs_lk);
+  for (i = 0; i < fs_jlog_cnt; i++)
+    memory_free_page(fs_jlog[i].data);
+  fs_jlog_cnt = 0;
+  fs_jused = 0;
+  lock_release(&fs_lk);
+  return 0;
+}
+
+/**
+ * @brief Waits until the metadata changes made so far are committed. Threads
+ * that call it during the same interval wait for the same commit.
+ *
+ * @return 0 on success, or the error of the failed commit.
+ */
+static int journal_sync(void)
+{
+  uint64_t target;
+  int result = 0;
+
+  lock_acquire(&fs_lk);
+  target = fs_jseq + (fs_jcommit_cnt != 0) + (fs_jrun_cnt != 0);
+  while (fs_jseq < target && result == 0)
+  {
+    lock_release(&fs_lk);
+    condition_wait(&fs_jdone);
+    lock_acquire(&fs_lk);
+    result = fs_jerror;
+  }
+  lock_release(&fs_lk);
+  return result;
+}
+
+/**
+ * @brief The journal committer thread. Commits the running transaction every
+ * KFS_COMMIT_INTERVAL_MS, if it is not empty, so that the metadata changes of
+ * all operations in an interval reach the log in one commit.
+ *
+ * @param arg Unused.
+ */
+static void kfs_committer(void *arg)
+{
+  struct alarm al;
+
+  alarm_init(&al, "kfs_committer");
+
+  for (;;)
+  {
+    alarm_sleep_ms(&al, KFS_COMMIT_INTERVAL_MS);
+
+    if (fs_jrun_cnt == 0 && fs_jcommit_cnt == 0)
+      continue;
+
+    journal_commit();
+  }
+}
@@ -1,4 +1,4 @@
-// lock.h - A sleep lock
+// lock.h - A sleep lock and a reader/writer sleep lock
 //
 
 #ifdef LOCK_TRACE
@@ -13,6 +13,7 @@
 #define _LOCK_H_
 
 #include "thread.h"
+#include "intr.h"
 #include "halt.h"
 #include "console.h"
 
@@ -21,10 +22,28 @@ struct lock {
     int tid; // thread holding lock or -1
 };
 
+// A reader/writer sleep lock: held by any number of readers, or by a single
+// writer. A waiting writer keeps new readers out, so that a steady stream of
+// readers cannot starve it. The lock is not recursive: a reader must not take
+// it again while a writer may be waiting.
+
+struct rwlock {
+    struct condition cond;
+    int writer; // thread holding lock for writing or -1
+    unsigned int readers; // number of threads holding lock for reading
+    unsigned int writers_waiting;
+};
+
 static inline void lock_init(struct lock * lk, const char * name);
 static inline void lock_acquire(struct lock * lk);
 static inline void lock_release(struct lock * lk);
 
+static inline void rwlock_init(struct rwlock * rw, const char * name);
+static inline void rwlock_acquire_read(struct rwlock * rw);
+static inline void rwlock_release_read(struct rwlock * rw);
+static inline void rwlock_acquire_write(struct rwlock * rw);
+static inline void rwlock_release_write(struct rwlock * rw);
+
 // INLINE FUNCTION DEFINITIONS
 //
 
@@ -67,4 +86,69 @@ static inline void lock_release(struct lock * lk) {
         lk->cond.name, lk);
 }
 
+static inline void rwlock_init(struct rwlock * rw, const char * name) {
+    trace("%s(<%s:%p>", __func__, name, rw);
+    condition_init(&rw->cond, name);
+    rw->writer = -1;
+    rw->readers = 0;
+    rw->writers_waiting = 0;
+}
+
+/**
+ * @brief Acquires the lock for reading. The current thread is suspended while
+ * a thread holds the lock for writing or waits to.
+ * @param rw the pointer to the lock
+ */
+static inline void rwlock_acquire_read(struct rwlock * rw) {
+    int s = intr_disable();
+    trace("%s(<%s:%p>", __func__, rw->cond.name, rw);
+    while (rw->writer != -1 || rw->writers_waiting != 0) {
+        condition_wait(&rw->cond);
+    }
+    rw->readers++;
+    intr_restore(s);
+}
+
+static inline void rwlock_release_read(struct rwlock * rw) {
+    trace("%s(<%s:%p>", __func__, rw->cond.name, rw);
+
+    assert (rw->readers != 0);
+
+    if (--rw->readers == 0)
+        condition_broadcast(&rw->cond);
+}
+
+/**
+ * @brief Acquires the lock for writing. The current thread is suspended until
+ * no thread holds the lock.
+ * @param rw the pointer to the lock
+ */
+static inline void rwlock_acquire_write(struct rwlock * rw) {
+    int s = intr_disable();
+    trace("%s(<%s:%p>", __func__, rw->cond.name, rw);
+    rw->writers_waiting++;
+    while (rw->writer != -1 || rw->readers != 0) {
+        condition_wait(&rw->cond);
+    }
+    rw->writers_waiting--;
+    rw->writer = running_thread();
+    debug("Thread <%s:%d> acquired lock <%s:%p> for writing",
+        thread_name(running_thread()), running_thread(),
+        rw->cond.name, rw);
+    intr_restore(s);
+}
+
+static inline void rwlock_release_write(struct rwlock * rw) {
+    trace("%s(<%s:%p>", __func__, rw->cond.name, rw);
+
+    assert (rw->writer == running_thread());
+
+    rw->writer = -1;
+    condition_broadcast(&rw->cond);
+
+    debug("Thread <%s:%d> released lock <%s:%p> for writing",
+        thread_name(running_thread()), running_thread(),
+        rw->cond.name, rw);
+}
+
 #endif // _LOCK_H_
\ No newline at end of file
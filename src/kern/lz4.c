@@ -0,0 +1,125 @@
+// lz4.c - LZ4 block decompression
+//
+// A block is a series of sequences. Each sequence is a token byte, whose
+// high nibble is the number of literals and low nibble the match length
+// minus 4 (a nibble of 15 continues in the following bytes, each added until
+// one is not 255), the literals, and a two-byte little-endian offset back
+// into the output from which the match is copied. The last sequence has only
+// literals.
+//
+// Literals and matches are copied eight bytes at a time while the input and
+// the output have room for the overrun and a match does not overlap its own
+// output by less than eight bytes; the rest is copied a byte at a time.
+//
+
+#include "lz4.h"
+#include "error.h"
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+#define LZ4_MINMATCH 4
+#define LZ4_WILDCOPY 8
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static inline void copy8(uint8_t * dst, const uint8_t * src);
+static inline int read_len(const uint8_t ** ipp, const uint8_t * iend, size_t * lenp);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+long lz4_decompress(const void * src, size_t srclen, void * dst, size_t dstlen) {
+    const uint8_t * ip = src;
+    const uint8_t * const iend = ip + srclen;
+    uint8_t * op = dst;
+    uint8_t * const oend = op + dstlen;
+    const uint8_t * match;
+    size_t len, off, i;
+    uint8_t token;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        //           Literals
+
+        len = token >> 4;
+        if (len == 15 && read_len(&ip, iend, &len) < 0)
+            return -EBADFMT;
+        if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+            return -EBADFMT;
+
+        if (len + LZ4_WILDCOPY <= (size_t)(iend - ip) && len + LZ4_WILDCOPY <= (size_t)(oend - op)) {
+            for (i = 0; i < len; i += LZ4_WILDCOPY)
+                copy8(op + i, ip + i);
+        } else {
+            for (i = 0; i < len; i++)
+                op[i] = ip[i];
+        }
+        ip += len;
+        op += len;
+
+        // the last sequence ends after its literals
+        if (ip == iend)
+            break;
+
+        //           Match
+
+        if (iend - ip < 2)
+            return -EBADFMT;
+        off = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - (uint8_t *)dst))
+            return -EBADFMT;
+        match = op - off;
+
+        len = token & 15;
+        if (len == 15 && read_len(&ip, iend, &len) < 0)
+            return -EBADFMT;
+        len += LZ4_MINMATCH;
+        if (len > (size_t)(oend - op))
+            return -EBADFMT;
+
+        if (off >= LZ4_WILDCOPY && len + LZ4_WILDCOPY <= (size_t)(oend - op)) {
+            for (i = 0; i < len; i += LZ4_WILDCOPY)
+                copy8(op + i, match + i);
+        } else {
+            for (i = 0; i < len; i++)
+                op[i] = match[i];
+        }
+        op += len;
+    }
+
+    return op - (uint8_t *)dst;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Copies eight bytes, which may be unaligned. The compiler turns the copy
+// into a single load and store where the target allows it.
+
+static inline void copy8(uint8_t * dst, const uint8_t * src) {
+    uint64_t w;
+
+    __builtin_memcpy(&w, src, sizeof(w));
+    __builtin_memcpy(dst, &w, sizeof(w));
+}
+
+// Adds the continuation bytes of a length nibble of 15 to *lenp.
+
+static inline int read_len(const uint8_t ** ipp, const uint8_t * iend, size_t * lenp) {
+    const uint8_t * ip = *ipp;
+    uint8_t b;
+
+    do {
+        if (ip == iend)
+            return -EBADFMT;
+        b = *ip++;
+        *lenp += b;
+    } while (b == 255);
+
+    *ipp = ip;
+    return 0;
+}
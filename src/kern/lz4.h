@@ -0,0 +1,20 @@
+// lz4.h - LZ4 block decompression
+//
+
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Decompresses the LZ4 block of /srclen/ bytes at /src/ into /dst/, which
+// holds /dstlen/ bytes. Returns the number of bytes decompressed, or -EBADFMT
+// if the block is malformed or does not fit in /dst/. Only the block format
+// is supported, without the frame header of the lz4 tool.
+
+extern long lz4_decompress(const void * src, size_t srclen, void * dst, size_t dstlen);
+
+#endif // _LZ4_H_
@@ -19,6 +19,14 @@
 // #define INIT_PROC "refcnt"
 // #define INIT_PROC "pipe_test"
 
+// Device holding the root file system: "blk" for the virtio block device, or
+// "ramdisk" to boot from a file system image linked into the kernel as the
+// companion section (sh mkcomp.sh kfs.raw).
+
+#ifndef ROOT_DEV
+#define ROOT_DEV "blk"
+#endif
+
 
 #include "console.h"
 #include "thread.h"
@@ -29,6 +37,8 @@
 #include "memory.h"
 #include "heap.h"
 #include "virtio.h"
+#include "ramdisk.h"
+#include "iostat.h"
 #include "halt.h"
 #include "elf.h"
 #include "fs.h"
@@ -36,6 +46,10 @@
 #include "process.h"
 #include "config.h"
 
+// companion section of the kernel image (defined in kernel.ld)
+extern char _companion_f_start[];
+extern char _companion_f_end[];
+
 void main(void)
 {
     struct io_intf *initio;
@@ -69,16 +83,26 @@ void main(void)
         virtio_attach(mmio_base, VIRT0_IRQNO+i);
     }
 
+    // Attach the RAM disk holding the companion section if it is the root
+    // device. Mounted, it is held by kfs; otherwise any process could open it.
+
+    if (strcmp(ROOT_DEV, "ramdisk") == 0 && _companion_f_end - _companion_f_start != 0)
+        ramdisk_attach(_companion_f_start, _companion_f_end - _companion_f_start);
+
+    // Attach the stats device, which reports the I/O statistics of the above
+
+    iostat_attach();
+
     intr_enable();
 
-    result = device_open(&blkio, "blk", 0);
+    result = device_open(&blkio, ROOT_DEV, 0);
 
     if (result != 0)
         panic("device_open failed");
 
     result = fs_mount(blkio);
 
-    debug("Mounted blk0");
+    debug("Mounted " ROOT_DEV "0");
 
     if (result != 0)
         panic("fs_mount failed");
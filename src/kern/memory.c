@@ -24,6 +24,8 @@
 #include "error.h"
 #include "thread.h"
 #include "process.h"
+#include "pagecache.h"
+#include "mmap.h"
 
 #include <stdint.h>
 
@@ -55,6 +57,10 @@ union linked_page {
     char padding[PAGE_SIZE];
 };
 
+// Number of page cache pages evicted at once when the free list runs empty
+
+#define MEMORY_RECLAIM_BATCH 16
+
 // INTERNAL MACRO DEFINITIONS
 //
 
@@ -92,6 +98,10 @@ static inline struct pte null_pte(void);
 
 static inline void sfence_vma(void);
 
+static struct pte *lookup_pte(struct pte *root, uintptr_t vma);
+static void release_leaf(struct pte *pte);
+static void free_user_mappings(struct pte *root);
+
 // INTERNAL GLOBAL VARIABLES
 //
 
@@ -317,76 +327,21 @@ struct pte *walk_pt(struct pte *root, uintptr_t vma, int create)
 // Switches the active memory space to the main memory space and reclaims the
 // memory space that was active on entry. All physical pages mapped by the memory space
 // that are not part of the global mapping are reclaimed.
-// Question: what is reclaim? Are we recalling all the previously active space?
 /**
- * @brief Reclaims memory space by traversing and freeing unused pages.
- *
- * This function switches to the main memory tag and iterates through the page tables
- * to identify and free pages that are not marked as global and are valid. It updates
- * the free list with the reclaimed pages.
- *
- * The function performs the following steps:
- * 1. Switches to the main memory tag.
- * 2. Iterates through the second-level page table entries.
- * 3. For each valid and non-global entry, iterates through the first-level page table entries.
- * 4. For each valid and non-global entry, iterates through the zero-level page table entries.
- * 5. For each valid and non-global entry, adds the page to the free list and clears the page table entry.
- * 6. Frees the zero-level page table if it is not marked as global.
- * 7. Frees the first-level page table if it is not marked as global.
- * 8. Ensures the changes are protected by calling sfence_vma to flush TLB.
- *
- * @note This function assumes that the page tables are organized in a hierarchical manner
- *       with three levels (second-level, first-level, and zero-level).
+ * @brief Reclaims the memory space that is active on entry.
+ *
+ * This function switches to the main memory space, then frees the user pages of the
+ * old memory space, the page tables of its user region and its root page table. The
+ * global mappings (MMIO and kernel) are shared with the main memory space and kept.
+ * Pages of the page cache are released to the cache instead of freed.
  */
 void memory_space_reclaim(void)
 {
     uintptr_t old_mtag = memory_space_switch(main_mtag);
+    struct pte *root = mtag_to_root(old_mtag);
 
-    union linked_page *page = free_list;
-
-    struct pte *pt2 = pagenum_to_pageptr(old_mtag);
-    for (int vpn2 = 0; vpn2 < PTE_CNT; vpn2++)
-    {
-        if (!(pt2[vpn2].flags & PTE_V) || !(pt2[vpn2].flags & PTE_X) || !(pt2[vpn2].flags & PTE_R) || !(pt2[vpn2].flags & PTE_W) || pt2[vpn2].flags & PTE_G)
-            continue;
-        struct pte *pt1 = (struct pte *)pagenum_to_pageptr(pt2[vpn2].ppn);
-        for (int vpn1 = 0; vpn1 < PTE_CNT; vpn1++)
-        {
-            if (!(pt1[vpn1].flags & PTE_V) || !(pt1[vpn1].flags & PTE_X) || !(pt1[vpn1].flags & PTE_R) || !(pt1[vpn1].flags & PTE_W) || pt1[vpn1].flags & PTE_G)
-                continue;
-            struct pte *pt0 = (struct pte *)pagenum_to_pageptr(pt1[vpn1].ppn);
-            for (int vpn0 = 0; vpn0 < PTE_CNT; vpn0++)
-            {
-                if ((pt0[vpn0].flags & PTE_V))
-                {
-                    if (!(pt0[vpn0].flags & PTE_G))
-                    {
-                        if (page == NULL)
-                        {
-                            page = pagenum_to_pageptr(pt0[vpn0].ppn);
-                            free_list = page;
-                        }
-                        else
-                        {
-                            page->next = pagenum_to_pageptr(pt0[vpn0].ppn);
-                            page = page->next;
-                        }
-                        pt0[vpn0].ppn &= 0;
-                        pt0[vpn0].flags &= 0;
-                        sfence_vma();
-                    }
-                }
-            }
-            if (pt1[vpn1].flags & PTE_G)
-                continue;
-            memory_free_page(pt0);
-            sfence_vma();
-        }
-        if (pt2[vpn2].flags & PTE_G)
-            continue;
-        memory_free_page(pt1);
-        sfence_vma();
-    }
+    free_user_mappings(root);
+    memory_free_page(root);
     sfence_vma();
 }
 
@@ -444,6 +399,13 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
                 continue;
             }
 
+            // a page cache page is shared, not copied
+            if(curr_pt0[vpn0].rsw == PTE_RSW_CACHED){
+                pagecache_map(pagenum_to_pageptr(curr_pt0[vpn0].ppn));
+                new_pt0[vpn0] = curr_pt0[vpn0];
+                continue;
+            }
+
             // allocate a physical page for the same vma of the old memory space
             void * leaf_page = memory_alloc_page();
             uintptr_t vma_to_map = vma_from_vpn(3, vpn1, vpn0, 0);
@@ -467,12 +429,15 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
 
 // Allocates a physical page from the free physical page pool and returns a pointer
 // to the direct-mapped addr of the page. Return value in [RAM_START, RAM_END],
-// so VMA = PMA. Panics if there are no free pages available.
+// so VMA = PMA. Evicts unused page cache pages if the pool is empty, and panics
+// if there are none.
 /**
  * @brief Allocates a page of memory from the free list.
  *
  * This function allocates a page of memory by removing the first page from the free list.
- * If there are no free pages available, it triggers a panic with an appropriate message.
+ * If the free list is empty, up to MEMORY_RECLAIM_BATCH unused pages are evicted from the
+ * page cache. If there are still no free pages available, it triggers a panic with an
+ * appropriate message.
  * It also checks if the allocated page is within the valid physical memory range and
  * triggers a panic if the page is invalid.
  *
@@ -484,6 +449,8 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
  */
 void *memory_alloc_page(void)
 {
+    if (free_list == NULL)
+        pagecache_reclaim(MEMORY_RECLAIM_BATCH);
     if (free_list == NULL)
         panic("No free pages available!");
     union linked_page *allocated_page = free_list;
@@ -556,6 +523,31 @@ void *memory_alloc_and_map_page(
     // map the vma to the physical page
     pte->ppn = pageptr_to_pagenum(page);
     pte->flags = rwxug_flags | PTE_D | PTE_A | PTE_V;
+    sfence_vma();
+    return (void *)vma;
+}
+
+/**
+ * @brief Maps a page of the page cache into the current memory space.
+ *
+ * The PTE is marked PTE_RSW_CACHED, so that the page is released to the page cache
+ * instead of freed with the memory space, and shared by memory_space_clone.
+ *
+ * @param vma The virtual memory address to map the page at.
+ * @param pp The data page of the page cache page.
+ * @param rwxug_flags The flags to set for the page table entry.
+ *
+ * @return The virtual memory address (vma).
+ */
+void *memory_map_cached_page(
+    uintptr_t vma, void *pp, uint_fast8_t rwxug_flags)
+{
+    struct pte *pte = walk_pt(active_space_root(), vma, 1);
+
+    pagecache_map(pp);
+    *pte = leaf_pte(pp, rwxug_flags);
+    pte->rsw = PTE_RSW_CACHED;
+    sfence_vma();
     return (void *)vma;
 }
 
@@ -594,54 +586,74 @@ void *memory_alloc_and_map_range(
 /**
  * @brief Unmaps and frees user memory pages.
  *
- * This function traverses the page table entries (PTEs) at three levels (pt2, pt1, pt0)
- * and frees the memory pages that are mapped and marked as user pages.
- *
- * The function performs the following steps:
- * 1. Retrieves the root page table (pt2).
- * 2. Iterates through the second-level PTEs (vpn2).
- * 3. Checks if the PTE is valid (PTE_V) and a user page (PTE_U).
- * 4. Retrieves the first-level page table (pt1) and iterates through its PTEs (vpn1).
- * 5. Checks if the PTE is valid (PTE_V) and a user page (PTE_U).
- * 6. Retrieves the zero-level page table (pt0) and iterates through its PTEs (vpn0).
- * 7. Checks if the PTE is valid (PTE_V) and a user page (PTE_U).
- * 8. Frees the memory page and clears the PTE.
- * 9. Frees the first-level page table if no user pages remain.
- * 10. Use sfence_vma to flush the TLB and prevent bad memory accesses.
+ * This function frees all pages mapped in the user region of the active memory
+ * space and the page tables that map them. Pages of the page cache are released
+ * to the cache instead of freed. The user region is left empty, so the next
+ * mapping in it allocates new page tables.
  */
 void memory_unmap_and_free_user(void)
 {
-    struct pte *pt2 = active_space_root();
-    for (int vpn2 = 0; vpn2 < PTE_CNT; vpn2++)
+    free_user_mappings(active_space_root());
+    sfence_vma();
+}
+
+/**
+ * @brief Unmaps and frees the pages mapped in a range of the active memory space.
+ *
+ * Pages of the page cache are released to the cache instead of freed. Pages of
+ * the range that are not mapped are skipped; the page tables are kept.
+ *
+ * @param vp The start of the range, rounded down to a page boundary.
+ * @param size The size of the range in bytes.
+ */
+void memory_unmap_and_free_range(void *vp, size_t size)
+{
+    const uintptr_t end = round_up_addr((uintptr_t)vp + size, PAGE_SIZE);
+    struct pte *pte;
+
+    for (uintptr_t vma = round_down_addr((uintptr_t)vp, PAGE_SIZE); vma < end; vma += PAGE_SIZE)
     {
-        if ((!pt2[vpn2].flags & PTE_V) || !(pt2[vpn2].flags & PTE_U))
-            continue;
-        struct pte *pt1 = (struct pte *)pagenum_to_pageptr(pt2[vpn2].ppn);
-        for (int vpn1 = 0; vpn1 < PTE_CNT; vpn1++)
-        {
-            if ((!pt1[vpn1].flags & PTE_V) || !(pt1[vpn1].flags & PTE_U))
-                continue;
-            struct pte *pt0 = (struct pte *)pagenum_to_pageptr(pt1[vpn1].ppn);
-            for (int vpn0 = 0; vpn0 < PTE_CNT; vpn0++)
-            {
-                if ((!pt0[vpn0].flags & PTE_V) || !(pt0[vpn0].flags & PTE_U))
-                    continue;
-                memory_free_page(pagenum_to_pageptr(pt0[vpn0].ppn));
-                pt0[vpn0].ppn &= 0;
-                pt0[vpn0].flags &= 0;
-            }
-            if (pt1[vpn1].flags & PTE_U)
-                continue;
-            memory_free_page(pt0);
-        }
-        if (pt2[vpn2].flags & PTE_U)
+        pte = lookup_pte(active_space_root(), vma);
+        if (pte == NULL || !(pte->flags & PTE_V))
             continue;
-        memory_free_page(pt1);
+        release_leaf(pte);
     }
-    pt2[3].flags &= ~PTE_V;
     sfence_vma();
 }
 
+/**
+ * @brief Makes the page mapped at an address private to the memory space and sets its flags.
+ *
+ * A page of the page cache is replaced by a private copy, which is released with the
+ * memory space like any page it owns; a page the memory space already owns only gets
+ * the new flags. Used for copy-on-write of private file mappings.
+ *
+ * @param vma The virtual address of the page.
+ * @param rwxug_flags The flags to set for the page table entry.
+ * @return 0 on success, or -EINVAL if no page is mapped at vma.
+ */
+int memory_copy_on_write(uintptr_t vma, uint_fast8_t rwxug_flags)
+{
+    struct pte *pte = lookup_pte(active_space_root(), vma);
+    void *page;
+
+    if (pte == NULL || !(pte->flags & PTE_V))
+        return -EINVAL;
+
+    if (pte->rsw == PTE_RSW_CACHED)
+    {
+        page = memory_alloc_page();
+        memcpy(page, pagenum_to_pageptr(pte->ppn), PAGE_SIZE);
+        pagecache_unmap(pagenum_to_pageptr(pte->ppn));
+        *pte = leaf_pte(page, rwxug_flags);
+    }
+    else
+        pte->flags = rwxug_flags | PTE_D | PTE_A | PTE_V;
+
+    sfence_vma();
+    return 0;
+}
+
 // Sets the flags of the PTE associated with vp. Only works with 4 kB pages.
 /**
  * @brief Sets the page table entry flags for a given virtual address.
@@ -667,8 +679,8 @@ void memory_set_page_flags(const void *vp, uint8_t rwxug_flags)
  * @brief Sets the memory range flags for a given virtual address range.
  *
  * This function sets the specified flags for each page table entry (PTE)
- * within the given virtual address range. The range is rounded up to the
- * nearest page size boundary.
+ * within the given virtual address range. The range is extended to page
+ * boundaries; pages of the range that are not mapped are skipped.
  *
  * @param vp Pointer to the start of the virtual address range.
  * @param size Size of the memory range in bytes.
@@ -678,15 +690,17 @@ void memory_set_page_flags(const void *vp, uint8_t rwxug_flags)
 void memory_set_range_flags(
     const void *vp, size_t size, uint_fast8_t rwxug_flags)
 {
-    size = round_up_size(size, PAGE_SIZE);
-    for (uintptr_t vma = (uintptr_t)round_up_ptr((void *)vp, PAGE_SIZE); vma < (uintptr_t)round_up_ptr((void *)vp, PAGE_SIZE) + size; vma += PAGE_SIZE)
+    const uintptr_t end = round_up_addr((uintptr_t)vp + size, PAGE_SIZE);
+    struct pte *pte;
+
+    for (uintptr_t vma = round_down_addr((uintptr_t)vp, PAGE_SIZE); vma < end; vma += PAGE_SIZE)
     {
-        struct pte *pte = walk_pt(active_space_root(), vma, 0);
-        if ((pte == NULL) | !(pte->flags | PTE_V))
+        pte = lookup_pte(active_space_root(), vma);
+        if (pte == NULL || !(pte->flags & PTE_V))
             continue;
-        pte->flags = 0x0;
-        pte->flags |= rwxug_flags | PTE_D | PTE_A | PTE_V;
+        pte->flags = rwxug_flags | PTE_D | PTE_A | PTE_V;
     }
+    sfence_vma();
 }
 
 // Checks if a virtual address range is mapped with specified flags. Returns 1
@@ -697,6 +711,9 @@ void memory_set_range_flags(
  *
  * This function checks if the memory region starting at the virtual pointer `vp`
  * and spanning `len` bytes is valid according to the specified access flags.
+ * Pages of memory mappings that have not been accessed yet are mapped first,
+ * and private copies are made of file pages the kernel is to write (see
+ * mmap_fault), so that the kernel can access them.
  *
  * @param vp The starting virtual pointer of the memory region to validate.
  * @param len The length of the memory region in bytes.
@@ -712,12 +729,12 @@ void memory_set_range_flags(
 int memory_validate_vptr_len(
     const void *vp, size_t len, uint_fast8_t rwxug_flags)
 {
-    struct pte *pte = walk_pt(active_space_root(), (uintptr_t)vp, 0);
-    if (pte == NULL)
-        return -EINVAL;
     for (uintptr_t vma = (uintptr_t)vp; vma < (uintptr_t)vp + len; vma += PAGE_SIZE)
     {
-        struct pte *pte = walk_pt(active_space_root(), vma, 0);
+        struct pte *pte = lookup_pte(active_space_root(), vma);
+        if ((pte == NULL || !(pte->flags & PTE_V) || ((rwxug_flags & PTE_W) && !(pte->flags & PTE_W))) &&
+            mmap_fault(current_process(), vma, rwxug_flags & (PTE_R | PTE_W | PTE_X)) == 0)
+            pte = lookup_pte(active_space_root(), vma);
         if (pte == NULL || !(pte->flags & PTE_V) || !(pte->flags & rwxug_flags))
             return -EINVAL;
     }
@@ -744,29 +761,67 @@ int memory_validate_vstr(
     return 0;
 }
 
+/**
+ * @brief Translates a virtual address to the direct-mapped address of the same byte.
+ *
+ * Used to point device DMA at a buffer, which the device accesses by physical
+ * address. Kernel addresses are direct-mapped and returned unchanged. User
+ * addresses are looked up in the active memory space with lookup_pte.
+ *
+ * @param vp The virtual address to translate.
+ * @param rwxug_flags The flags the page must be mapped with (all of them).
+ * @return The direct-mapped address, or NULL if the user page is not mapped
+ *         with the specified flags.
+ */
+void *memory_translate_vptr(const void *vp, uint_fast8_t rwxug_flags)
+{
+    const uintptr_t vma = (uintptr_t)vp;
+    struct pte *pte;
+
+    if (vma < USER_START_VMA || vma >= USER_END_VMA)
+        return (void *)vp;
+
+    pte = lookup_pte(active_space_root(), vma);
+    if (pte == NULL || !(pte->flags & PTE_V) ||
+        (pte->flags & rwxug_flags) != rwxug_flags)
+        return NULL;
+
+    return pagenum_to_pageptr(pte->ppn) + (vma % PAGE_SIZE);
+}
+
 // Called from excp.c to handle a page fault at the specified virtual address. Either
 // maps a page containing the faulting address, or calls process_exit, depending on if the address
-// is within the user region. Must call this func when a store page fault is triggered by a user program.
+// is within the user region and the memory mappings of the process.
 /**
- * @brief Handles a page fault by allocating and mapping a new page.
+ * @brief Handles a user page fault by mapping a page at the faulting address.
  *
- * This function is called when a page fault occurs. It checks if the faulting
- * address is within the user region. If the address is outside the user region,
- * it prints an error message and terminates the process. Otherwise, it allocates
- * and maps a new page for the faulting address with read, write, and user permissions.
- * Finally, it flushes the TLB for the updated virtual memory area.
+ * Addresses in a memory mapping of the process are handled by mmap_fault. Other stores
+ * to unmapped pages of the user region outside the region reserved for memory mappings
+ * allocate and map a new page with read, write, and user permissions, so that the stack
+ * and the data of the program grow on demand. Any other access terminates the process.
  *
  * @param vptr The faulting virtual address.
+ * @param rwx_flag The access that faulted: PTE_R for a load, PTE_W for a store, or PTE_X
+ *        for an instruction fetch.
  */
-void memory_handle_page_fault(const void *vptr)
+void memory_handle_page_fault(const void *vptr, uint_fast8_t rwx_flag)
 {
-    if ((uintptr_t)vptr < (uintptr_t)USER_START_VMA || (uintptr_t)vptr > (uintptr_t)USER_END_VMA)
+    const uintptr_t vma = (uintptr_t)vptr;
+    int result;
+
+    result = mmap_fault(current_process(), vma, rwx_flag);
+    if (result == 0)
+        return;
+
+    if (result == -ENOENT && rwx_flag == PTE_W && USER_START_VMA <= vma && vma < USER_END_VMA &&
+        memory_translate_vptr(vptr, 0) == NULL)
     {
-        panic("Address outside the user region\n");
-        process_exit();
+        memory_alloc_and_map_page(round_down_addr(vma, PAGE_SIZE), PTE_R | PTE_W | PTE_U);
+        return;
     }
-    memory_alloc_and_map_page((uintptr_t)vptr, PTE_R | PTE_W | PTE_U);
-    sfence_vma();
+
+    kprintf("Invalid access to %p by process %d\n", vptr, current_pid());
+    process_exit();
 }
 
 // INTERNAL FUNCTION DEFINITIONS
@@ -859,4 +914,63 @@ static inline void sfence_vma(void) {
 
 static inline uintptr_t vma_from_vpn(int vpn2, int vpn1, int vpn0, int offset){
     return ((uintptr_t)vpn2 << (9+9+12)) | ((uintptr_t)vpn1 << (9+12)) | ((uintptr_t)vpn0 << 12) | (uintptr_t)offset;
-}
\ No newline at end of file
+}
+
+// Returns the leaf PTE of a virtual address in the page table with the given
+// root, or NULL if a page table on the way is not mapped. Unlike walk_pt, the
+// walk stops at the first invalid page table entry.
+
+static struct pte *lookup_pte(struct pte *root, uintptr_t vma)
+{
+    struct pte *pt = root;
+
+    if (!(pt[VPN2(vma)].flags & PTE_V))
+        return NULL;
+    pt = pagenum_to_pageptr(pt[VPN2(vma)].ppn);
+
+    if (!(pt[VPN1(vma)].flags & PTE_V))
+        return NULL;
+    pt = pagenum_to_pageptr(pt[VPN1(vma)].ppn);
+
+    return &pt[VPN0(vma)];
+}
+
+// Releases the page mapped by a valid leaf PTE and clears the PTE. A page of
+// the page cache is released to the cache; any other page is freed.
+
+static void release_leaf(struct pte *pte)
+{
+    if (pte->rsw == PTE_RSW_CACHED)
+        pagecache_unmap(pagenum_to_pageptr(pte->ppn));
+    else
+        memory_free_page(pagenum_to_pageptr(pte->ppn));
+    *pte = null_pte();
+}
+
+// Frees the pages of the user region of a memory space and the page tables
+// mapping them. The user region is a single gigapage (see config.h), mapped by
+// one root PTE that is left invalid.
+
+static void free_user_mappings(struct pte *root)
+{
+    const int vpn2 = VPN2(USER_START_VMA);
+    struct pte *pt1, *pt0;
+
+    if (!(root[vpn2].flags & PTE_V))
+        return;
+
+    pt1 = pagenum_to_pageptr(root[vpn2].ppn);
+    for (int vpn1 = 0; vpn1 < PTE_CNT; vpn1++)
+    {
+        if (!(pt1[vpn1].flags & PTE_V))
+            continue;
+        pt0 = pagenum_to_pageptr(pt1[vpn1].ppn);
+        for (int vpn0 = 0; vpn0 < PTE_CNT; vpn0++)
+            if (pt0[vpn0].flags & PTE_V)
+                release_leaf(&pt0[vpn0]);
+        memory_free_page(pt0);
+        pt1[vpn1] = null_pte();
+    }
+    memory_free_page(pt1);
+    root[vpn2] = null_pte();
+}
@@ -41,6 +41,9 @@
 
 #define PTE_CNT (PAGE_SIZE/8) // number of PTEs per page table
 
+// Values of the software field (rsw) of a leaf PTE
+#define PTE_RSW_CACHED 1 // page of the page cache, not owned by the memory space
+
 // STRUCTURE DEFINITIONS
 struct pte {
     uint64_t flags:8;
@@ -109,6 +112,17 @@ extern void * memory_alloc_page(void);
 
 extern void memory_free_page(void * pp);
 
+// void * memory_map_cached_page (
+//        uintptr_t vma, void * pp, uint_fast8_t rwxug_flags)
+// Maps the data page /pp/ of a page cache page at /vma/ in the current memory
+// space and takes a reference to it for the mapping. The page is shared with
+// the page cache: it is released to the cache instead of freed when the user
+// memory is unmapped, and shared instead of copied when the memory space is
+// cloned. Returns (void*)vma.
+
+extern void * memory_map_cached_page (
+    uintptr_t vma, void * pp, uint_fast8_t rwxug_flags);
+
 // void * memory_alloc_and_map_page (
 //        uintptr_t vma, uint_fast8_t rwxug_flags)
 // Allocates and maps a physical page.
@@ -133,6 +147,10 @@ extern void * memory_alloc_and_map_range (
     uintptr_t vma, size_t size, uint_fast8_t rwxug_flags);
 
 // void memory_unmap_and_free_range(void * vp, size_t size)
+// Unmaps and frees the pages mapped in an address range. Pages of the page
+// cache are released to the cache. Unmapped pages in the range are skipped.
+
+extern void memory_unmap_and_free_range(void * vp, size_t size);
 
 // void memory_unmap_and_free_user(void)
 // Unmaps and frees all pages with the U bit set in the PTE flags.
@@ -146,6 +164,12 @@ extern void memory_unmap_and_free_user(void);
 extern void memory_set_range_flags (
 const void * vp, size_t size, uint_fast8_t rwxug_flags);
 
+// int memory_copy_on_write(uintptr_t vma, uint_fast8_t rwxug_flags)
+// Replaces a page cache page mapped at /vma/ by a private copy, and sets the
+// PTE flags of the page at /vma/. Returns -EINVAL if no page is mapped there.
+
+extern int memory_copy_on_write(uintptr_t vma, uint_fast8_t rwxug_flags);
+
 // int memory_validate_vptr_len (
 //     const void * vp, size_t len, uint_fast8_t rwxug_flags);
 // Checks if a virtual address range is mapped with specified flags. Returns 1
@@ -166,10 +190,19 @@ extern int memory_validate_vptr_len (
 extern int memory_validate_vstr (
     const char * vs, uint_fast8_t ug_flags);
 
-// Called from excp.c to handle a page fault at the specified address. Either
-// maps a page containing the faulting address, or calls process_exit().
+// void * memory_translate_vptr(const void * vp, uint_fast8_t rwxug_flags)
+// Translates a virtual address to the direct-mapped address of the same byte,
+// for handing buffers to DMA-capable devices. Addresses outside the user
+// region are returned unchanged, since the kernel is direct-mapped. Returns
+// NULL if a user address is not mapped with at least the specified flags.
+
+extern void * memory_translate_vptr(const void * vp, uint_fast8_t rwxug_flags);
+
+// Called from excp.c to handle a page fault at the specified address, for the
+// access given by /rwx_flag/ (PTE_R, PTE_W or PTE_X). Either maps a page
+// containing the faulting address, or calls process_exit().
 
-extern void memory_handle_page_fault(const void * vptr);
+extern void memory_handle_page_fault(const void * vptr, uint_fast8_t rwx_flag);
 
 // INLINE FUNCTION DEFINITIONS
 //
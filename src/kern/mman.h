@@ -0,0 +1,23 @@
+// mman.h - Memory mapping flags
+//
+
+#ifndef _MMAN_H_
+#define _MMAN_H_
+
+// Protection of a mapping (mmap, mprotect)
+
+#define PROT_NONE       0
+#define PROT_READ       (1 << 0)
+#define PROT_WRITE      (1 << 1)
+#define PROT_EXEC       (1 << 2)
+
+// Mapping flags (mmap). Exactly one of MAP_SHARED and MAP_PRIVATE must be
+// given. Stores to a shared file mapping reach the file when the mapping is
+// removed; stores to a private mapping are not visible to others.
+
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+#define MAP_FIXED       0x10 // place the mapping at addr, replacing mappings there
+#define MAP_ANONYMOUS   0x20 // zero-filled memory, not backed by a file
+
+#endif // _MMAN_H_
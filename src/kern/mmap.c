@@ -0,0 +1,432 @@
+// mmap.c - Memory mappings of user processes
+//
+// Each process has a list of memory mappings in the mmap region of its user
+// memory, [USER_MMAP_START_VMA, USER_MMAP_END_VMA), sorted by address. Pages
+// are mapped on the first access:
+//
+//   - An anonymous mapping gets a zeroed page of its own.
+//   - A shared file mapping maps the page of the file in the page cache, so
+//     that all processes mapping the file and read and write on the file see
+//     the same data. Stores reach the device when the mapping is removed.
+//   - A private file mapping maps the page cache page read-only, so reading a
+//     file costs no copy. The first store to the page replaces it with a
+//     private copy (copy-on-write).
+//
+// The memory space owns the page tables; the mappings only decide what a
+// fault maps. Forked processes share the page cache pages of the parent and
+// get copies of the other pages (see memory_space_clone).
+//
+
+#include "mmap.h"
+#include "config.h"
+#include "error.h"
+#include "heap.h"
+#include "memory.h"
+#include "pagecache.h"
+#include "process.h"
+#include "string.h"
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static struct mmap_area * area_alloc(void);
+static void area_free(struct mmap_area * area);
+static struct mmap_area * area_find(const struct process * proc, uintptr_t addr);
+static void area_split(struct mmap_area * area, uintptr_t addr);
+static void area_insert(struct process * proc, struct mmap_area * area);
+static uintptr_t area_gap(const struct process * proc, size_t len);
+static void area_sync(const struct mmap_area * area, uintptr_t start, uintptr_t end);
+
+static inline uint_fast8_t area_pte_flags(const struct mmap_area * area);
+static inline int mmap_range_valid(uintptr_t addr, size_t len);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// Unused mapping structs, reused since kfree does not free memory
+
+static struct mmap_area * area_free_list;
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * @brief Adds a memory mapping to a process. No page is mapped until it is accessed.
+ * @param proc the process, whose memory space is active
+ * @param addr the address of the mapping with MAP_FIXED, ignored otherwise
+ * @param len the length of the mapping, rounded up to whole pages
+ * @param prot PROT_READ, PROT_WRITE and PROT_EXEC, or PROT_NONE
+ * @param flags MAP_SHARED or MAP_PRIVATE, and MAP_FIXED and MAP_ANONYMOUS
+ * @param io the file to map, ignored with MAP_ANONYMOUS
+ * @param off the offset in the file, a multiple of the page size
+ * @return the address of the mapping, -EINVAL if an argument is invalid, -ENOTSUP for a shared
+ * anonymous mapping, -ENODEV if io cannot be mapped, -ENOMEM if there is no room for the mapping
+ */
+long mmap_map (
+    struct process * proc, uintptr_t addr, size_t len, int prot, int flags,
+    struct io_intf * io, uint64_t off)
+{
+    const int type = flags & (MAP_SHARED | MAP_PRIVATE);
+    struct mmap_area * area;
+
+    if (len == 0 || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0 ||
+        (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS)) != 0 ||
+        (type != MAP_SHARED && type != MAP_PRIVATE))
+        return -EINVAL;
+
+    if (len > USER_MMAP_END_VMA - USER_MMAP_START_VMA)
+        return -ENOMEM;
+    len = (len + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+
+    if (flags & MAP_ANONYMOUS) {
+        // anonymous pages belong to the memory space, which a child process
+        // gets a copy of, so they cannot be shared
+        if (type == MAP_SHARED)
+            return -ENOTSUP;
+        io = NULL;
+        off = 0;
+    } else {
+        if (io == NULL || off % PAGE_SIZE != 0)
+            return -EINVAL;
+        if (ioctl(io, IOCTL_GETPAGE, NULL) != 0)
+            return -ENODEV;
+    }
+
+    if (flags & MAP_FIXED) {
+        if (addr % PAGE_SIZE != 0 || !mmap_range_valid(addr, len))
+            return -EINVAL;
+        mmap_unmap(proc, addr, len);
+    } else {
+        addr = area_gap(proc, len);
+        if (addr == 0)
+            return -ENOMEM;
+    }
+
+    area = area_alloc();
+    area->start = addr;
+    area->end = addr + len;
+    area->off = off;
+    area->io = io;
+    area->prot = prot;
+    area->flags = type;
+    area->written = (io != NULL && type == MAP_SHARED && (prot & PROT_WRITE));
+    if (io != NULL)
+        ioref(io);
+
+    area_insert(proc, area);
+    return addr;
+}
+
+/**
+ * @brief Removes the memory mappings of a page range, and unmaps and frees their pages. Pages of
+ * shared file mappings that may have been written are written back to the file first.
+ * @param proc the process, whose memory space is active
+ * @param addr the start of the range, a multiple of the page size
+ * @param len the length of the range, rounded up to whole pages
+ * @return 0 if success, -EINVAL if the range is not page-aligned or outside the mmap region
+ */
+int mmap_unmap(struct process * proc, uintptr_t addr, size_t len) {
+    struct mmap_area ** ap;
+    struct mmap_area * area;
+    uintptr_t end;
+
+    if (addr % PAGE_SIZE != 0 || len == 0 || !mmap_range_valid(addr, len))
+        return -EINVAL;
+    end = addr + (len + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+
+    ap = &proc->mmap_areas;
+    while ((area = *ap) != NULL && area->start < end) {
+        if (area->end <= addr) {
+            ap = &area->next;
+            continue;
+        }
+
+        // split off the parts of the mapping outside the range; the part
+        // before the range is kept and the loop continues after it
+        if (area->start < addr) {
+            area_split(area, addr);
+            ap = &area->next;
+            continue;
+        }
+        if (area->end > end)
+            area_split(area, end);
+
+        area_sync(area, area->start, area->end);
+        memory_unmap_and_free_range((void *)area->start, area->end - area->start);
+        *ap = area->next;
+        area_free(area);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Changes the protection of a page range, and of the pages mapped in it. A private file
+ * mapping keeps the page cache pages it maps read-only, so that a store copies them first.
+ * @param proc the process, whose memory space is active
+ * @param addr the start of the range, a multiple of the page size
+ * @param len the length of the range, rounded up to whole pages
+ * @param prot PROT_READ, PROT_WRITE and PROT_EXEC
+ * @return 0 if success, -EINVAL if an argument is invalid, -ENOTSUP for PROT_NONE, -ENOMEM if
+ * part of the range is not mapped
+ */
+int mmap_protect(struct process * proc, uintptr_t addr, size_t len, int prot) {
+    struct mmap_area * area;
+    uint_fast8_t pte_flags;
+    uintptr_t pos, end;
+
+    if (addr % PAGE_SIZE != 0 || len == 0 || !mmap_range_valid(addr, len) ||
+        (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0)
+        return -EINVAL;
+
+    // A valid PTE without R, W and X points to a page table, so mapped pages
+    // cannot be made inaccessible without unmapping them
+    if (prot == PROT_NONE)
+        return -ENOTSUP;
+
+    end = addr + (len + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+
+    pos = addr;
+    for (area = proc->mmap_areas; area != NULL && pos < end; area = area->next) {
+        if (area->end <= pos)
+            continue;
+        if (area->start > pos)
+            break;
+        pos = area->end;
+    }
+    if (pos < end)
+        return -ENOMEM;
+
+    for (area = proc->mmap_areas; area != NULL && area->start < end; area = area->next) {
+        if (area->end <= addr)
+            continue;
+        if (area->start < addr) {
+            area_split(area, addr);
+            continue;
+        }
+        if (area->end > end)
+            area_split(area, end);
+
+        area->prot = prot;
+        if (area->io != NULL && area->flags == MAP_SHARED && (prot & PROT_WRITE))
+            area->written = 1;
+
+        pte_flags = area_pte_flags(area);
+        if (area->io != NULL && area->flags == MAP_PRIVATE)
+            pte_flags &= ~PTE_W;
+        memory_set_range_flags((void *)area->start, area->end - area->start, pte_flags);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Maps the page of a memory mapping at a faulting address, or makes a private copy of a
+ * page cache page that a private mapping stores to.
+ * @param proc the process, whose memory space is active, or NULL for a kernel thread
+ * @param addr the faulting address
+ * @param rwx_flag the access: PTE_R, PTE_W or PTE_X
+ * @return 0 if the page was mapped, -ENOENT if addr is outside the mmap region, -EACCESS if addr
+ * is not in a mapping, the mapping does not permit the access, or the page is past the end of the
+ * file
+ */
+int mmap_fault(struct process * proc, uintptr_t addr, uint_fast8_t rwx_flag) {
+    const uintptr_t page = addr / PAGE_SIZE * PAGE_SIZE;
+    struct mmap_area * area;
+    uint_fast8_t pte_flags;
+    struct io_page pg;
+
+    if (proc == NULL || !mmap_range_valid(addr, 1))
+        return -ENOENT;
+
+    area = area_find(proc, addr);
+    if (area == NULL)
+        return -EACCESS;
+    pte_flags = area_pte_flags(area);
+    if ((pte_flags & rwx_flag) != rwx_flag)
+        return -EACCESS;
+
+    // a mapped page faults on a store if it is a page cache page of a private
+    // mapping
+    if (memory_translate_vptr((void *)page, 0) != NULL) {
+        if (area->io != NULL && area->flags == MAP_PRIVATE)
+            return memory_copy_on_write(page, pte_flags);
+        memory_set_range_flags((void *)page, PAGE_SIZE, pte_flags);
+        return 0;
+    }
+
+    if (area->io == NULL) {
+        memory_alloc_and_map_page(page, pte_flags);
+        memset(memory_translate_vptr((void *)page, 0), 0, PAGE_SIZE);
+        return 0;
+    }
+
+    pg.index = (area->off + (page - area->start)) / PAGE_SIZE;
+    if (ioctl(area->io, IOCTL_GETPAGE, &pg) < 0)
+        return -EACCESS;
+
+    // a private mapping shares the page cache page until the first store,
+    // which finds the page mapped read-only and copies it
+    if (area->flags == MAP_SHARED)
+        memory_map_cached_page(page, pg.page, pte_flags);
+    else if (rwx_flag != PTE_W)
+        memory_map_cached_page(page, pg.page, pte_flags & ~PTE_W);
+    else {
+        memory_alloc_and_map_page(page, pte_flags);
+        memcpy(memory_translate_vptr((void *)page, 0), pg.page, PAGE_SIZE);
+    }
+
+    pagecache_unmap(pg.page);
+    return 0;
+}
+
+/**
+ * @brief Copies the memory mappings of a process to its child. The child takes references to the
+ * mapped files.
+ * @param parent the parent process
+ * @param child the child process, which has no mappings
+ * @return no return
+ */
+void mmap_clone(const struct process * parent, struct process * child) {
+    struct mmap_area ** tail = &child->mmap_areas;
+    const struct mmap_area * area;
+    struct mmap_area * copy;
+
+    for (area = parent->mmap_areas; area != NULL; area = area->next) {
+        copy = area_alloc();
+        *copy = *area;
+        copy->next = NULL;
+        if (copy->io != NULL)
+            ioref(copy->io);
+        *tail = copy;
+        tail = &copy->next;
+    }
+    *tail = NULL;
+}
+
+/**
+ * @brief Removes all memory mappings of a process, writing back pages of shared file mappings
+ * that may have been written. The pages stay mapped until the user memory is freed.
+ * @param proc the process, whose memory space is active
+ * @return no return
+ */
+void mmap_release(struct process * proc) {
+    struct mmap_area * area;
+
+    while ((area = proc->mmap_areas) != NULL) {
+        area_sync(area, area->start, area->end);
+        proc->mmap_areas = area->next;
+        area_free(area);
+    }
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+struct mmap_area * area_alloc(void) {
+    struct mmap_area * area = area_free_list;
+
+    if (area != NULL)
+        area_free_list = area->next;
+    else
+        area = kmalloc(sizeof(struct mmap_area));
+
+    return area;
+}
+
+// Releases the reference of a mapping to its file and keeps the struct for
+// reuse.
+
+void area_free(struct mmap_area * area) {
+    if (area->io != NULL)
+        ioclose(area->io);
+    area->io = NULL;
+    area->next = area_free_list;
+    area_free_list = area;
+}
+
+struct mmap_area * area_find(const struct process * proc, uintptr_t addr) {
+    struct mmap_area * area;
+
+    for (area = proc->mmap_areas; area != NULL && area->start <= addr; area = area->next)
+        if (addr < area->end)
+            return area;
+
+    return NULL;
+}
+
+// Splits a mapping at a page address inside it into two mappings.
+
+void area_split(struct mmap_area * area, uintptr_t addr) {
+    struct mmap_area * const tail = area_alloc();
+
+    *tail = *area;
+    tail->start = addr;
+    tail->off = area->off + (addr - area->start);
+    if (tail->io != NULL)
+        ioref(tail->io);
+
+    area->end = addr;
+    area->next = tail;
+}
+
+void area_insert(struct process * proc, struct mmap_area * area) {
+    struct mmap_area ** ap = &proc->mmap_areas;
+
+    while (*ap != NULL && (*ap)->start < area->start)
+        ap = &(*ap)->next;
+
+    area->next = *ap;
+    *ap = area;
+}
+
+// Returns the lowest address of the mmap region with /len/ free bytes, or 0 if
+// there is none.
+
+uintptr_t area_gap(const struct process * proc, size_t len) {
+    const struct mmap_area * area;
+    uintptr_t addr = USER_MMAP_START_VMA;
+
+    for (area = proc->mmap_areas; area != NULL; area = area->next) {
+        if (area->start - addr >= len)
+            return addr;
+        addr = area->end;
+    }
+
+    return (USER_MMAP_END_VMA - addr >= len) ? addr : 0;
+}
+
+// Writes the pages of a shared file mapping in [start, end) that are mapped
+// back to the file, if the mapping was ever writable. Write errors cannot be
+// reported to the process and are ignored.
+
+void area_sync(const struct mmap_area * area, uintptr_t start, uintptr_t end) {
+    uint64_t index;
+    uintptr_t vma;
+
+    if (!area->written)
+        return;
+
+    for (vma = start; vma < end; vma += PAGE_SIZE) {
+        if (memory_translate_vptr((void *)vma, 0) == NULL)
+            continue;
+        index = (area->off + (vma - area->start)) / PAGE_SIZE;
+        ioctl(area->io, IOCTL_WRITEPAGE, &index);
+    }
+}
+
+// PROT_READ, PROT_WRITE and PROT_EXEC are in the order of PTE_R, PTE_W and
+// PTE_X. Pages with W but not R are reserved in Sv39, so W implies R.
+
+static inline uint_fast8_t area_pte_flags(const struct mmap_area * area) {
+    uint_fast8_t flags = (area->prot << 1) | PTE_U;
+
+    if (flags & PTE_W)
+        flags |= PTE_R;
+    return flags;
+}
+
+static inline int mmap_range_valid(uintptr_t addr, size_t len) {
+    return (USER_MMAP_START_VMA <= addr && addr < USER_MMAP_END_VMA &&
+        len <= USER_MMAP_END_VMA - addr);
+}
@@ -0,0 +1,78 @@
+// mmap.h - Memory mappings of user processes
+//
+
+#ifndef _MMAP_H_
+#define _MMAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "io.h"
+#include "mman.h"
+
+struct process;
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// A memory mapping of a process, the pages [start, end) of its mmap region.
+// A file mapping maps the file from offset /off/ on; an anonymous mapping has
+// no /io/. Pages are mapped on the first access (see mmap_fault).
+
+struct mmap_area {
+    struct mmap_area * next; // next mapping of the process, by address
+    uintptr_t start;
+    uintptr_t end;
+    uint64_t off; // file offset of start
+    struct io_intf * io; // the file, NULL for an anonymous mapping
+    uint8_t prot; // PROT_READ, PROT_WRITE, PROT_EXEC
+    uint8_t flags; // MAP_SHARED or MAP_PRIVATE
+    uint8_t written; // shared file mapping that was ever writable
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// The functions below change the memory mappings of a process, /proc/, whose
+// memory space must be the active one.
+
+// Adds a mapping of /len/ bytes with protection /prot/ and flags /flags/ (see
+// mman.h). A file mapping maps /io/ from offset /off/, a multiple of the page
+// size; the mapping takes a reference to /io/. Returns the address of the
+// mapping: /addr/ with MAP_FIXED, otherwise the first free range of the mmap
+// region. Returns a negative error code if the arguments are invalid, the I/O
+// object cannot be mapped (-ENODEV), or there is no free range (-ENOMEM).
+
+extern long mmap_map (
+    struct process * proc, uintptr_t addr, size_t len, int prot, int flags,
+    struct io_intf * io, uint64_t off);
+
+// Removes the mappings in the page range [addr, addr+len), splitting mappings
+// that are partly in the range. Pages written through a shared file mapping
+// are written back to the file first.
+
+extern int mmap_unmap(struct process * proc, uintptr_t addr, size_t len);
+
+// Changes the protection of the page range [addr, addr+len), which must be
+// mapped throughout (-ENOMEM otherwise).
+
+extern int mmap_protect(struct process * proc, uintptr_t addr, size_t len, int prot);
+
+// Handles an access /rwx_flag/ (PTE_R, PTE_W or PTE_X) to an address that is
+// not mapped with that permission. Maps the page if the address is in a
+// mapping that permits the access, and returns 0. Returns -ENOENT if the
+// address is outside the mmap region, and -EACCESS if the access is invalid.
+
+extern int mmap_fault(struct process * proc, uintptr_t addr, uint_fast8_t rwx_flag);
+
+// Copies the mappings of /parent/ to /child/, whose memory space is a clone of
+// the parent's (see memory_space_clone).
+
+extern void mmap_clone(const struct process * parent, struct process * child);
+
+// Removes all mappings of a process when it exits or execs. Pages written
+// through shared file mappings are written back; the pages stay mapped and
+// are freed with the user memory.
+
+extern void mmap_release(struct process * proc);
+
+#endif // _MMAP_H_
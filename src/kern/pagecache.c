@@ -0,0 +1,290 @@
+// pagecache.c - File page cache
+//
+// File pages are cached in physical pages, found by file key and page index in
+// a hash table, and by data page in a second hash table for user mappings,
+// which only know the physical page. Cached pages are kept on an LRU list,
+// most recently used first. The cache holds up to PAGECACHE_MAX pages; beyond
+// that, adding a page evicts the least recently used page that is not in use.
+// When the page allocator runs out of pages, it evicts pages through
+// pagecache_reclaim before it gives up.
+//
+// Pages are not dirty: file systems write data through to the device and
+// update the cached copy, so an evicted page is simply freed.
+//
+
+#include "pagecache.h"
+#include "halt.h"
+#include "heap.h"
+#include "memory.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+// Number of pages the cache grows to before it evicts pages on its own.
+
+#ifndef PAGECACHE_MAX
+#define PAGECACHE_MAX 512
+#endif
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+#define PAGECACHE_HASH 128
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static inline unsigned int pagecache_slot(uint64_t key, uint64_t index);
+static inline unsigned int pagecache_pslot(const void * data);
+
+static struct pcache_page * pagecache_find_data(const void * data);
+static void pagecache_detach(struct pcache_page * pg);
+static void pagecache_free(struct pcache_page * pg);
+
+static inline void lru_unlink(struct pcache_page * pg);
+static inline void lru_push(struct pcache_page * pg);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct pcache_page * pagecache_hash[PAGECACHE_HASH];
+static struct pcache_page * pagecache_phash[PAGECACHE_HASH];
+
+// Head of the LRU list; lru.lru_next is the most recently used page
+
+static struct pcache_page lru = { .lru_prev = &lru, .lru_next = &lru };
+
+// Unused page structs, reused since kfree does not free memory
+
+static struct pcache_page * pagecache_free_list;
+
+static size_t pagecache_cnt; // pages in the cache, not counting detached ones
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * @brief Looks up a cached page and takes a reference to it. The page becomes the most recently
+ * used one.
+ * @param key the file
+ * @param index the page index within the file
+ * @return the page, or NULL if it is not cached
+ */
+struct pcache_page * pagecache_lookup(uint64_t key, uint64_t index) {
+    struct pcache_page * pg;
+
+    for (pg = pagecache_hash[pagecache_slot(key, index)]; pg != NULL; pg = pg->next) {
+        if (pg->key == key && pg->index == index) {
+            pg->refcnt++;
+            lru_unlink(pg);
+            lru_push(pg);
+            return pg;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Adds a page to the cache, evicting the least recently used unused page if the cache is
+ * full. The new page is the most recently used one.
+ * @param key the file
+ * @param index the page index within the file, which must not be cached
+ * @return the page, with a reference taken and undefined contents, not up to date
+ */
+struct pcache_page * pagecache_alloc(uint64_t key, uint64_t index) {
+    struct pcache_page * pg;
+    unsigned int slot;
+    void * data;
+
+    if (pagecache_cnt >= PAGECACHE_MAX)
+        pagecache_reclaim(1);
+
+    // memory_alloc_page may reclaim cached pages, so the lists are only
+    // changed after it returns
+    data = memory_alloc_page();
+
+    pg = pagecache_free_list;
+    if (pg != NULL)
+        pagecache_free_list = pg->next;
+    else
+        pg = kmalloc(sizeof(struct pcache_page));
+
+    pg->key = key;
+    pg->index = index;
+    pg->data = data;
+    pg->refcnt = 1;
+    pg->detached = 0;
+    pg->uptodate = 0;
+
+    slot = pagecache_slot(key, index);
+    pg->next = pagecache_hash[slot];
+    pagecache_hash[slot] = pg;
+
+    slot = pagecache_pslot(data);
+    pg->pnext = pagecache_phash[slot];
+    pagecache_phash[slot] = pg;
+
+    lru_push(pg);
+    pagecache_cnt++;
+    return pg;
+}
+
+/**
+ * @brief Releases a reference to a page. A detached page is freed with its last reference; other
+ * pages stay cached.
+ * @param pg the page
+ * @return no return
+ */
+void pagecache_put(struct pcache_page * pg) {
+    assert (pg->refcnt != 0);
+
+    if (--pg->refcnt == 0 && pg->detached)
+        pagecache_free(pg);
+}
+
+/**
+ * @brief Removes a page from the cache, for a page that could not be filled, and releases the
+ * caller's reference to it.
+ * @param pg the page
+ * @return no return
+ */
+void pagecache_remove(struct pcache_page * pg) {
+    pagecache_detach(pg);
+    pagecache_put(pg);
+}
+
+/**
+ * @brief Removes the pages of a file from a page index on, when the file is truncated or deleted.
+ * Unused pages are freed; pages in use are freed when their last reference is released.
+ * @param key the file
+ * @param index the first page index to remove
+ * @return no return
+ */
+void pagecache_truncate(uint64_t key, uint64_t index) {
+    struct pcache_page * pg;
+    struct pcache_page * prev;
+
+    for (pg = lru.lru_prev; pg != &lru; pg = prev) {
+        prev = pg->lru_prev;
+        if (pg->key != key || pg->index < index)
+            continue;
+
+        pagecache_detach(pg);
+        if (pg->refcnt == 0)
+            pagecache_free(pg);
+    }
+}
+
+/**
+ * @brief Takes a reference to a cached page for a user mapping of it.
+ * @param data the data page of the cached page
+ * @return no return
+ */
+void pagecache_map(void * data) {
+    struct pcache_page * const pg = pagecache_find_data(data);
+
+    pg->refcnt++;
+}
+
+/**
+ * @brief Releases the reference of a user mapping of a cached page.
+ * @param data the data page of the cached page
+ * @return no return
+ */
+void pagecache_unmap(void * data) {
+    pagecache_put(pagecache_find_data(data));
+}
+
+/**
+ * @brief Evicts unused pages, least recently used first, and frees their memory.
+ * @param npages the number of pages to evict
+ * @return the number of pages evicted, less than npages if the other pages are in use
+ */
+size_t pagecache_reclaim(size_t npages) {
+    struct pcache_page * pg;
+    struct pcache_page * prev;
+    size_t cnt = 0;
+
+    for (pg = lru.lru_prev; pg != &lru && cnt < npages; pg = prev) {
+        prev = pg->lru_prev;
+        if (pg->refcnt != 0)
+            continue;
+
+        pagecache_detach(pg);
+        pagecache_free(pg);
+        cnt++;
+    }
+
+    return cnt;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static inline unsigned int pagecache_slot(uint64_t key, uint64_t index) {
+    return (key * 31 + index) % PAGECACHE_HASH;
+}
+
+static inline unsigned int pagecache_pslot(const void * data) {
+    return ((uintptr_t)data / PAGE_SIZE) % PAGECACHE_HASH;
+}
+
+// Finds a page by its data page, including detached pages that are still
+// mapped. The page must exist.
+
+struct pcache_page * pagecache_find_data(const void * data) {
+    struct pcache_page * pg;
+
+    for (pg = pagecache_phash[pagecache_pslot(data)]; pg != NULL; pg = pg->pnext)
+        if (pg->data == data)
+            return pg;
+
+    panic("pagecache: page not cached");
+    return NULL;
+}
+
+// Removes a page from the key hash table and the LRU list, so that it can no
+// longer be found by pagecache_lookup or evicted.
+
+void pagecache_detach(struct pcache_page * pg) {
+    struct pcache_page ** pp;
+
+    if (pg->detached)
+        return;
+
+    for (pp = &pagecache_hash[pagecache_slot(pg->key, pg->index)]; *pp != pg; pp = &(*pp)->next)
+        continue;
+    *pp = pg->next;
+
+    lru_unlink(pg);
+    pg->detached = 1;
+    pagecache_cnt--;
+}
+
+// Frees a detached page without references.
+
+void pagecache_free(struct pcache_page * pg) {
+    struct pcache_page ** pp;
+
+    for (pp = &pagecache_phash[pagecache_pslot(pg->data)]; *pp != pg; pp = &(*pp)->pnext)
+        continue;
+    *pp = pg->pnext;
+
+    memory_free_page(pg->data);
+    pg->data = NULL;
+    pg->next = pagecache_free_list;
+    pagecache_free_list = pg;
+}
+
+static inline void lru_unlink(struct pcache_page * pg) {
+    pg->lru_prev->lru_next = pg->lru_next;
+    pg->lru_next->lru_prev = pg->lru_prev;
+}
+
+static inline void lru_push(struct pcache_page * pg) {
+    pg->lru_prev = &lru;
+    pg->lru_next = lru.lru_next;
+    lru.lru_next->lru_prev = pg;
+    lru.lru_next = pg;
+}
@@ -0,0 +1,78 @@
+// pagecache.h - File page cache
+//
+
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// A cached page of a file. /key/ identifies the file (kfs uses the inode
+// number) and /index/ the page within the file. /data/ is a physical page from
+// memory_alloc_page, so the same page can be mapped into user memory spaces.
+//
+// /refcnt/ counts the users of the page: every pagecache_lookup or
+// pagecache_alloc until the matching pagecache_put, and every user mapping.
+// A page without users may be evicted whenever memory runs low. The owner of
+// the file fills and updates pages under its own lock. A page is found by
+// pagecache_lookup as soon as it is added, so the owner sets /uptodate/ once
+// it is filled; a user that finds a page that is not up to date waits for the
+// fill under the owner's lock.
+
+struct pcache_page {
+    struct pcache_page * next; // next page in the hash chain by key and index
+    struct pcache_page * pnext; // next page in the hash chain by data page
+    struct pcache_page * lru_prev;
+    struct pcache_page * lru_next;
+    uint64_t key;
+    uint64_t index;
+    void * data;
+    uint32_t refcnt;
+    uint8_t detached; // removed by pagecache_truncate, freed on the last put
+    uint8_t uptodate; // filled by the owner of the file
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Returns the cached page /index/ of file /key/ with a reference taken, or
+// NULL if it is not cached.
+
+extern struct pcache_page * pagecache_lookup(uint64_t key, uint64_t index);
+
+// Adds page /index/ of file /key/ to the cache and returns it with a
+// reference taken. The page must not be cached. Its contents are undefined
+// until the caller fills it and sets /uptodate/; if that fails, the caller
+// removes the page with pagecache_remove.
+
+extern struct pcache_page * pagecache_alloc(uint64_t key, uint64_t index);
+
+// Releases a reference returned by pagecache_lookup or pagecache_alloc.
+
+extern void pagecache_put(struct pcache_page * pg);
+
+// Removes a page from the cache and releases the caller's reference.
+
+extern void pagecache_remove(struct pcache_page * pg);
+
+// Removes the pages of file /key/ from page /index/ on. Pages still in use
+// stay valid for their users and are freed when released.
+
+extern void pagecache_truncate(uint64_t key, uint64_t index);
+
+// Takes and releases the reference of a user mapping of a cached page, given
+// by its data page.
+
+extern void pagecache_map(void * data);
+extern void pagecache_unmap(void * data);
+
+// Evicts up to /npages/ pages that are not in use, least recently used first,
+// and returns their memory to the page allocator. Returns the number of pages
+// freed. Called by memory_alloc_page when it runs out of pages.
+
+extern size_t pagecache_reclaim(size_t npages);
+
+#endif // _PAGECACHE_H_
@@ -9,6 +9,7 @@ struct pipe {
     struct io_intf io_intf;
     struct lock buf_lock;
     char data[PIPE_SIZE];
+    size_t head; // index in data of the next byte to read
     size_t size_read;
     size_t size_written;
     struct condition not_empty;
@@ -25,6 +26,8 @@ static void pipe_close(struct io_intf * io);
 static long pipe_read(struct io_intf * io, void * buf, unsigned long bufsz);
 static long pipe_write(struct io_intf * io, const void * buf, unsigned long n);
 static int pipe_ioctl(struct io_intf * io, int cmd, void * arg);
+static long pipe_readv(struct io_intf * io, const struct io_vec * iov, int iovcnt, const uint64_t * pos);
+static long pipe_writev(struct io_intf * io, const struct io_vec * iov, int iovcnt, const uint64_t * pos);
 
 
 // EXPORTED FUNCTION DEFINITIONS
@@ -32,7 +35,9 @@ static const struct io_ops pipe_ops = {
     .close = pipe_close,
     .read = pipe_read,
     .write = pipe_write,
-    .ctl = pipe_ioctl
+    .ctl = pipe_ioctl,
+    .readv = pipe_readv,
+    .writev = pipe_writev
 };
 
 /**
@@ -46,10 +51,13 @@ int pipe_open(struct io_intf ** ioptr) {
     pi = kmalloc(sizeof(struct pipe));
     pi->io_intf.ops = &pipe_ops;
 
+    pi->head = 0;
     pi->size_read = 0;
     pi->size_written = 0;
     memset(pi->data, 0, PIPE_SIZE);
     lock_init(&pi->buf_lock, "pipe_lock");
+    condition_init(&pi->not_empty, "pipe_not_empty");
+    condition_init(&pi->empty, "pipe_empty");
 
     *ioptr = &pi->io_intf;
     (*ioptr)->refcnt = 1;
@@ -60,72 +68,113 @@ int pipe_open(struct io_intf ** ioptr) {
  * @brief Read from pipe buffer, compatible with ioread
  * @param io the io interface in the pipe struct to read from
  * @param buf the buffer to read to
- * @param bufsz the size of the buffer to read, but actually not used, just used to comply with ioread
+ * @param bufsz the size of the buffer
  * @note This function will block until there is data to read
  * @return number of bytes read, if negative, error code
  */
 long pipe_read(struct io_intf * io, void * buf, unsigned long bufsz) {
+    const struct io_vec iov = { .buf = buf, .len = bufsz };
 
-    lock_acquire(&((struct pipe *)io)->buf_lock); // wait for read to complete
-    
+    return pipe_readv(io, &iov, 1, NULL);
+}
+
+/**
+ * @brief Write to a pipe buffer indicated by the io interface in parameter, compatible with iowrite
+ * @param io the io interface in the pipe struct to write to
+ * @param buf the buffer to write to
+ * @param n number of bytes to write
+ * @return number of bytes written, at most PIPE_SIZE, if negative, error code
+ */
+long pipe_write(struct io_intf * io, const void * buf, unsigned long n){
+    const struct io_vec iov = { .buf = (void *)buf, .len = n };
+
+    return pipe_writev(io, &iov, 1, NULL);
+}
+
+/**
+ * @brief Read from pipe buffer into several buffers in order, compatible with ioreadv. Reads what the
+ * last write put in the pipe, up to the total size of the buffers; the rest stays for the next read.
+ * @param io the io interface in the pipe struct to read from
+ * @param iov the buffers to read to
+ * @param iovcnt the number of buffers
+ * @param pos must be NULL, a pipe has no position
+ * @note This function will block until there is data to read
+ * @return number of bytes read, if negative, error code
+ */
+long pipe_readv(struct io_intf * io, const struct io_vec * iov, int iovcnt, const uint64_t * pos) {
     struct pipe * pi = (struct pipe *)io; // io_intf is the first member of struct pipe
+    size_t cnt = 0;
+    size_t len;
+    int i;
 
-    if(bufsz > PIPE_SIZE) {
-        lock_release(&pi->buf_lock);
-        return -EINVAL;
-    }
+    if (pos != NULL)
+        return -ENOTSUP;
+
+    lock_acquire(&pi->buf_lock);
 
-    size_t initial_size_read = pi->size_read;
-    if(pi->size_read == pi->size_written) {
+    while (pi->size_read == pi->size_written) { // wait for a writer
         lock_release(&pi->buf_lock);
         condition_wait(&pi->not_empty);
         lock_acquire(&pi->buf_lock);
     }
 
-    while(pi->size_read != pi->size_written) {
-        // copy data from pipe to buf
-        for(size_t i = 0; i < pi->size_written-pi->size_read; i++) {
-            ((char *)buf)[i] = pi->data[i];
-            pi->size_read ++;
-        }
+    for (i = 0; i < iovcnt && pi->size_read != pi->size_written; i++) {
+        len = pi->size_written - pi->size_read;
+        if (iov[i].len < len)
+            len = iov[i].len;
+        memcpy(iov[i].buf, pi->data + pi->head, len);
+        pi->head += len;
+        pi->size_read += len;
+        cnt += len;
     }
 
-    condition_broadcast(&pi->empty);
+    if (pi->size_read == pi->size_written)
+        condition_broadcast(&pi->empty);
     lock_release(&pi->buf_lock);
-    return pi->size_read - initial_size_read;    
+    return cnt;
 }
 
 /**
- * @brief Write to a pipe buffer indicated by the io interface in parameter, compatible with iowrite
+ * @brief Write to a pipe buffer from several buffers in order, compatible with iowritev. Waits until
+ * the reader has read the previous write, then fills the pipe with up to PIPE_SIZE bytes.
  * @param io the io interface in the pipe struct to write to
- * @param buf the buffer to write to
- * @param n number of bytes to write
+ * @param iov the buffers to write from
+ * @param iovcnt the number of buffers
+ * @param pos must be NULL, a pipe has no position
  * @return number of bytes written, if negative, error code
  */
-long pipe_write(struct io_intf * io, const void * buf, unsigned long n){
-    lock_acquire(&((struct pipe *)io)->buf_lock); // wait for write to complete
-
+long pipe_writev(struct io_intf * io, const struct io_vec * iov, int iovcnt, const uint64_t * pos) {
     struct pipe * pi = (struct pipe *)io; // io_intf is the first member of struct pipe
+    size_t cnt = 0;
+    size_t len;
+    int i;
 
-    if(n > PIPE_SIZE) {
-        lock_release(&pi->buf_lock);
-        return -EINVAL;
-    }
+    if (pos != NULL)
+        return -ENOTSUP;
 
-    if(pi->size_read != pi->size_written) { // reader has not read previous data yet
+    lock_acquire(&pi->buf_lock);
+
+    while (pi->size_read != pi->size_written) { // reader has not read previous data yet
         lock_release(&pi->buf_lock);
         condition_wait(&pi->empty);
         lock_acquire(&pi->buf_lock);
     }
 
-    for(size_t i = 0; i < n; i++) {
-        pi->data[i] = ((char *)buf)[i];
-        pi->size_written ++;
+    for (i = 0; i < iovcnt && cnt < PIPE_SIZE; i++) {
+        len = PIPE_SIZE - cnt;
+        if (iov[i].len < len)
+            len = iov[i].len;
+        memcpy(pi->data + cnt, iov[i].buf, len);
+        cnt += len;
     }
 
-    condition_broadcast(&pi->not_empty);
+    pi->head = 0;
+    pi->size_written += cnt;
+
+    if (cnt != 0)
+        condition_broadcast(&pi->not_empty);
     lock_release(&pi->buf_lock);
-    return n;
+    return cnt;
 }
 
 /**
@@ -13,6 +13,7 @@
 #include "memory.h"
 #include "elf.h"
 #include "thread.h"
+#include "mmap.h"
 
 // COMPILE-TIME PARAMETERS
 //
@@ -76,6 +77,7 @@ void procmgr_init(void){
     for (int i = 0; i < PROCESS_IOMAX; i++){
         main_proc.iotab[i] = NULL;
     }
+    main_proc.mmap_areas = NULL;
     procmgr_initialized = 1;
 }
 
@@ -83,7 +85,8 @@ void procmgr_init(void){
  * @brief Executes a process from the given IO interface.
  *
  * This function performs the following steps to execute a process:
- * 1. Unmaps any virtual memory mappings belonging to other user processes.
+ * 1. Removes the memory mappings of the process and unmaps any virtual memory mappings
+ *    belonging to other user processes.
  * 2. Creates and initializes a fresh 2nd level (root) page table with the default mappings for a user process.
  * 3. Loads the executable from the provided IO interface into the mapped pages.
  * 4. Starts the thread associated with the process in user-mode.
@@ -93,6 +96,7 @@ void procmgr_init(void){
  */
 int process_exec(struct io_intf *exeio){
     // 1. Any virtual memory mappings belonging to other user processes should be unmapped
+    mmap_release(current_process());
     memory_unmap_and_free_user();
     // 2. A fresh 2nd level (root) page table should be created and initialized with the default mappings for a user process
     // 3. The executable should be loaded from the IO interface provided as an argument into the mapped pages
@@ -120,15 +124,19 @@ int process_exec(struct io_intf *exeio){
  *
  * This function is responsible for terminating the current process by performing
  * the following steps:
- * 1. Reclaims memory space if the running thread is not the main process.
- * 2. Closes all I/O interfaces associated with the current process.
- * 3. Exits the current thread.
+ * 1. Removes the memory mappings of the process, writing back shared file mappings.
+ * 2. Reclaims memory space if the running thread is not the main process.
+ * 3. Closes all I/O interfaces associated with the current process.
+ * 4. Exits the current thread.
  *
  * @note This function should be called when a process needs to be terminated
  *       to ensure proper resource cleanup.
  */
 void process_exit(void){
 
+    // write back shared file mappings while the memory space is active
+    mmap_release(current_process());
+
     // reclaim memory space
     if(running_thread() != main_proc.tid){
         memory_space_reclaim();
@@ -177,6 +185,8 @@ int process_fork(const struct trap_frame * parent_tfr){
     proctab[child_pid] = kmalloc(sizeof(struct process));
     proctab[child_pid]->id = child_pid;
     proctab[child_pid]->mtag = memory_space_clone(0);
+    proctab[child_pid]->mmap_areas = NULL;
+    mmap_clone(current_process(), proctab[child_pid]);
 
 
     // copies the io_intf pointers from parent's iotab to child's iotab 
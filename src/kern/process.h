@@ -16,11 +16,14 @@
 // EXPORTED TYPE DEFINITIONS
 //
 
+struct mmap_area;
+
 struct process {
     int id; // process id of this process
     int tid; // thread id of associated thread
     uintptr_t mtag; // memory space identifier
     struct io_intf * iotab[PROCESS_IOMAX]; // an array of io_intf pointers
+    struct mmap_area * mmap_areas; // memory mappings, by address (see mmap.h)
 };
 
 // EXPORTED VARIABLES DECLARATIONS
@@ -0,0 +1,445 @@
+// ramdisk.c - RAM disk block device
+//
+// A RAM disk exposes a region of memory through the same io_ops and ioctl
+// contract as vioblk, so that kfs can mount it in place of the virtio block
+// device. The region is either a buffer in the kernel image, such as the
+// companion section (see mkcomp.sh), or a set of pages from the memory
+// manager, which need not be contiguous. Since there is no device to wait
+// for, reads and writes are plain copies; this gives a baseline for file
+// system measurements without device emulation, and a way to boot without
+// disk I/O.
+//
+// Like vioblk, a read or write does not cross a page boundary (vectored reads
+// and writes do), and the RAM disk can be opened once at a time.
+//
+
+#include "ramdisk.h"
+#include "console.h"
+#include "csr.h"
+#include "device.h"
+#include "error.h"
+#include "halt.h"
+#include "heap.h"
+#include "io.h"
+#include "iostat.h"
+#include "memory.h"
+#include "string.h"
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+#define RAMDISK_BLKSZ 512
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct ramdisk_device {
+    struct io_intf io_intf;
+    int8_t opened;
+    char * base; // contiguous backing memory, or NULL if backed by pages
+    char ** pages; // backing pages if base is NULL
+    uint64_t size;
+    uint64_t pos;
+    struct io_stat stat;
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int ramdisk_open(struct io_intf ** ioptr, void * aux);
+static void ramdisk_close(struct io_intf * io);
+static long ramdisk_read(struct io_intf * io, void * buf, unsigned long bufsz);
+static long ramdisk_write(struct io_intf * io, const void * buf, unsigned long n);
+static int ramdisk_ioctl(struct io_intf * io, int cmd, void * arg);
+static long ramdisk_readv (
+    struct io_intf * io, const struct io_vec * iov, int iovcnt, const uint64_t * pos);
+static long ramdisk_writev (
+    struct io_intf * io, const struct io_vec * iov, int iovcnt, const uint64_t * pos);
+static long ramdisk_transferv (
+    struct ramdisk_device * dev, const struct io_vec * iov, int iovcnt,
+    const uint64_t * posptr, int write);
+static int ramdisk_direct (
+    struct ramdisk_device * dev, const struct io_direct * dio, int write);
+static int ramdisk_readpages (
+    struct ramdisk_device * dev, const struct io_pagevec * pvec);
+static int ramdisk_zero(struct ramdisk_device * dev, const struct io_range * range);
+
+static inline char * ramdisk_addr(const struct ramdisk_device * dev, uint64_t pos);
+static inline uint64_t ramdisk_span(const struct ramdisk_device * dev, uint64_t pos);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static const struct io_ops ramdisk_ops = {
+    .close = ramdisk_close,
+    .read = ramdisk_read,
+    .write = ramdisk_write,
+    .ctl = ramdisk_ioctl,
+    .readv = ramdisk_readv,
+    .writev = ramdisk_writev
+};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * @brief Attaches a RAM disk and registers it with the device manager as "ramdisk".
+ * @param buf the backing memory, or NULL to back the disk with newly allocated pages
+ * @param size the size of the disk in bytes
+ * @return no return
+ */
+void ramdisk_attach(void * buf, size_t size) {
+    struct ramdisk_device * dev;
+    size_t npages, i;
+    int instno;
+
+    dev = kmalloc(sizeof(struct ramdisk_device));
+    memset(dev, 0, sizeof(struct ramdisk_device));
+
+    dev->io_intf.ops = &ramdisk_ops;
+    dev->size = size;
+
+    if (buf != NULL) {
+        dev->base = buf;
+    } else {
+        npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (npages * sizeof(char *) > PAGE_SIZE) {
+            kprintf("ramdisk: %lu bytes is too large\n", (unsigned long)size);
+            return;
+        }
+
+        dev->pages = kmalloc(npages * sizeof(char *));
+        for (i = 0; i < npages; i++) {
+            dev->pages[i] = memory_alloc_page();
+            memset(dev->pages[i], 0, PAGE_SIZE);
+        }
+    }
+
+    debug("ramdisk: %lu bytes at %p", (unsigned long)size, buf);
+    instno = device_register("ramdisk", &ramdisk_open, dev);
+    iostat_register("ramdisk", instno, &dev->stat);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+/**
+ * @brief Opens a RAM disk. The position starts at 0.
+ * @param ioptr the io_intf of the device is returned here
+ * @param aux the pointer to the device struct
+ * @return 0 if success, -EBUSY if the device is already open
+ */
+int ramdisk_open(struct io_intf ** ioptr, void * aux) {
+    struct ramdisk_device * const dev = aux;
+
+    assert (ioptr != NULL);
+
+    if (dev->opened)
+        return -EBUSY;
+
+    dev->opened = 1;
+    dev->pos = 0;
+    dev->io_intf.refcnt = 1;
+    *ioptr = &dev->io_intf;
+    return 0;
+}
+
+/**
+ * @brief Closes a RAM disk. The contents are kept for the next open.
+ * @param io the io_intf of the device
+ * @return no return
+ */
+void ramdisk_close(struct io_intf * io) {
+    struct ramdisk_device * const dev = (void *)io - offsetof(struct ramdisk_device, io_intf);
+
+    assert (dev->opened);
+    dev->opened = 0;
+}
+
+/**
+ * @brief Reads from the current position, up to the end of the page containing it.
+ * @param io the io_intf of the device
+ * @param buf the destination buffer
+ * @param bufsz the maximum number of bytes to read
+ * @return the number of bytes read, 0 at the end of the device
+ */
+long ramdisk_read(struct io_intf * io, void * buf, unsigned long bufsz) {
+    struct ramdisk_device * const dev = (void *)io - offsetof(struct ramdisk_device, io_intf);
+    const uint64_t t0 = csrr_time();
+    uint64_t len;
+
+    if (dev->pos >= dev->size)
+        return 0;
+
+    len = ramdisk_span(dev, dev->pos);
+    if (bufsz < len)
+        len = bufsz;
+
+    memcpy(buf, ramdisk_addr(dev, dev->pos), len);
+    dev->pos += len;
+    iostat_record(&dev->stat, 0, len, csrr_time() - t0);
+    return len;
+}
+
+/**
+ * @brief Writes at the current position, up to the end of the page containing it.
+ * @param io the io_intf of the device
+ * @param buf the source buffer
+ * @param n the maximum number of bytes to write
+ * @return the number of bytes written, 0 at the end of the device (it cannot grow)
+ */
+long ramdisk_write(struct io_intf * io, const void * buf, unsigned long n) {
+    struct ramdisk_device * const dev = (void *)io - offsetof(struct ramdisk_device, io_intf);
+    const uint64_t t0 = csrr_time();
+    uint64_t len;
+
+    if (dev->pos >= dev->size)
+        return 0;
+
+    len = ramdisk_span(dev, dev->pos);
+    if (n < len)
+        len = n;
+
+    memcpy(ramdisk_addr(dev, dev->pos), buf, len);
+    dev->pos += len;
+    iostat_record(&dev->stat, 1, len, csrr_time() - t0);
+    return len;
+}
+
+/**
+ * @brief Reads into several buffers, at the current position (which is advanced) or at *pos, across
+ * pages.
+ * @param io the io_intf of the device
+ * @param iov the destination buffers, in order
+ * @param iovcnt the number of buffers
+ * @param pos the position to read at, or NULL to read at the current position
+ * @return the number of bytes read, 0 at the end of the device
+ */
+long ramdisk_readv (
+    struct io_intf * io, const struct io_vec * iov, int iovcnt, const uint64_t * pos)
+{
+    struct ramdisk_device * const dev = (void *)io - offsetof(struct ramdisk_device, io_intf);
+
+    return ramdisk_transferv(dev, iov, iovcnt, pos, 0);
+}
+
+/**
+ * @brief Writes from several buffers, at the current position (which is advanced) or at *pos,
+ * across pages.
+ * @param io the io_intf of the device
+ * @param iov the source buffers, in order
+ * @param iovcnt the number of buffers
+ * @param pos the position to write at, or NULL to write at the current position
+ * @return the number of bytes written, 0 at the end of the device (it cannot grow)
+ */
+long ramdisk_writev (
+    struct io_intf * io, const struct io_vec * iov, int iovcnt, const uint64_t * pos)
+{
+    struct ramdisk_device * const dev = (void *)io - offsetof(struct ramdisk_device, io_intf);
+
+    return ramdisk_transferv(dev, iov, iovcnt, pos, 1);
+}
+
+/**
+ * @brief RAM disk io control function. Supports the block device ioctls of vioblk that apply to
+ * memory: getlen, getpos, setpos, getblksz, flush, drop cache, direct reads and writes, discard, write zeroes
+ * and statistics.
+ * Flushing and dropping the cache do nothing, since the data is always in memory, and a discarded
+ * range is zeroed.
+ * @param io the io_intf of the device
+ * @param cmd the ioctl number
+ * @param arg the argument of the ioctl
+ * @return 0 if success, negative error code if not, -ENOTSUP for unsupported ioctls
+ */
+int ramdisk_ioctl(struct io_intf * io, int cmd, void * arg) {
+    struct ramdisk_device * const dev = (void *)io - offsetof(struct ramdisk_device, io_intf);
+
+    switch (cmd) {
+    case IOCTL_GETLEN:
+        *(uint64_t *)arg = dev->size;
+        return 0;
+    case IOCTL_GETPOS:
+        *(uint64_t *)arg = dev->pos;
+        return 0;
+    case IOCTL_SETPOS:
+        if (*(uint64_t *)arg > dev->size)
+            return -EINVAL;
+        dev->pos = *(uint64_t *)arg;
+        return 0;
+    case IOCTL_GETBLKSZ:
+        *(uint32_t *)arg = RAMDISK_BLKSZ;
+        return 0;
+    case IOCTL_FLUSH:
+    case IOCTL_DROPCACHE:
+        return 0;
+    case IOCTL_READDIRECT:
+    case IOCTL_WRITEDIRECT:
+        return ramdisk_direct(dev, arg, cmd == IOCTL_WRITEDIRECT);
+    case IOCTL_READPAGES:
+        return ramdisk_readpages(dev, arg);
+    case IOCTL_DISCARD:
+    case IOCTL_WRITEZEROES:
+        dev->stat.other++;
+        return ramdisk_zero(dev, arg);
+    case IOCTL_GETSTAT:
+        memcpy(arg, &dev->stat, sizeof(struct io_stat));
+        return 0;
+    default:
+        return -ENOTSUP;
+    }
+}
+
+/**
+ * @brief Copies device blocks into or out of a buffer, with the same argument checks as the direct
+ * transfers of vioblk. The buffer may be a user buffer of the current process.
+ * @param dev the device
+ * @param dio the device position, buffer and length
+ * @param write 0 to copy into the buffer, 1 to copy from it
+ * @return 0 if success, -EINVAL if the request is misaligned or out of range
+ */
+int ramdisk_direct (
+    struct ramdisk_device * dev, const struct io_direct * dio, int write)
+{
+    const uint64_t t0 = csrr_time();
+    uint64_t pos, end, len;
+    char * bp;
+
+    if (dio == NULL || dio->pos % RAMDISK_BLKSZ != 0 || dio->len % RAMDISK_BLKSZ != 0 ||
+        (uintptr_t)dio->buf % RAMDISK_BLKSZ != 0)
+        return -EINVAL;
+
+    if (dio->pos > dev->size || dio->len > dev->size - dio->pos)
+        return -EINVAL;
+
+    bp = dio->buf;
+    end = dio->pos + dio->len;
+
+    for (pos = dio->pos; pos < end; pos += len) {
+        len = ramdisk_span(dev, pos);
+        if (end - pos < len)
+            len = end - pos;
+        if (write)
+            memcpy(ramdisk_addr(dev, pos), bp, len);
+        else
+            memcpy(bp, ramdisk_addr(dev, pos), len);
+        bp += len;
+    }
+
+    iostat_record(&dev->stat, write, dio->len, csrr_time() - t0);
+    return 0;
+}
+
+/**
+ * @brief Reads consecutive pages of the disk into separate kernel pages, for page cache fills.
+ * @param dev the device
+ * @param pvec the disk position and the pages, see struct io_pagevec
+ * @return 0 if success, -EINVAL if the position is misaligned or the pages are out of range
+ */
+int ramdisk_readpages (
+    struct ramdisk_device * dev, const struct io_pagevec * pvec)
+{
+    const uint64_t t0 = csrr_time();
+    uint64_t pos, len, off;
+    uint32_t n;
+
+    if (pvec == NULL || pvec->pos % RAMDISK_BLKSZ != 0)
+        return -EINVAL;
+
+    if (pvec->pos > dev->size || (uint64_t)pvec->npages * PAGE_SIZE > dev->size - pvec->pos)
+        return -EINVAL;
+
+    pos = pvec->pos;
+
+    for (n = 0; n < pvec->npages; n++) {
+        for (off = 0; off < PAGE_SIZE; off += len) {
+            len = ramdisk_span(dev, pos);
+            if (PAGE_SIZE - off < len)
+                len = PAGE_SIZE - off;
+            memcpy((char *)pvec->pages[n] + off, ramdisk_addr(dev, pos), len);
+            pos += len;
+        }
+    }
+
+    iostat_record(&dev->stat, 0, (uint64_t)pvec->npages * PAGE_SIZE, csrr_time() - t0);
+    return 0;
+}
+
+/**
+ * @brief Zeroes a range of the disk, for both discard and write zeroes.
+ * @param dev the device
+ * @param range the byte range, aligned to the block size
+ * @return 0 if success, -EINVAL if the range is misaligned or out of range
+ */
+int ramdisk_zero(struct ramdisk_device * dev, const struct io_range * range) {
+    uint64_t pos, end, len;
+
+    if (range == NULL || range->pos % RAMDISK_BLKSZ != 0 || range->len % RAMDISK_BLKSZ != 0)
+        return -EINVAL;
+
+    if (range->pos > dev->size || range->len > dev->size - range->pos)
+        return -EINVAL;
+
+    end = range->pos + range->len;
+
+    for (pos = range->pos; pos < end; pos += len) {
+        len = ramdisk_span(dev, pos);
+        if (end - pos < len)
+            len = end - pos;
+        memset(ramdisk_addr(dev, pos), 0, len);
+    }
+
+    return 0;
+}
+
+// Copies between a vector of buffers and the disk for ramdisk_readv and
+// ramdisk_writev, up to the end of the disk, and records one request.
+
+long ramdisk_transferv (
+    struct ramdisk_device * dev, const struct io_vec * iov, int iovcnt,
+    const uint64_t * posptr, int write)
+{
+    const uint64_t t0 = csrr_time();
+    uint64_t pos, start, done, len;
+    int i;
+
+    start = (posptr != NULL) ? *posptr : dev->pos;
+    pos = start;
+
+    for (i = 0; i < iovcnt && pos < dev->size; i++) {
+        for (done = 0; done < iov[i].len && pos < dev->size; done += len, pos += len) {
+            len = ramdisk_span(dev, pos);
+            if (iov[i].len - done < len)
+                len = iov[i].len - done;
+
+            if (write)
+                memcpy(ramdisk_addr(dev, pos), (char *)iov[i].buf + done, len);
+            else
+                memcpy((char *)iov[i].buf + done, ramdisk_addr(dev, pos), len);
+        }
+    }
+
+    if (posptr == NULL)
+        dev->pos = pos;
+    iostat_record(&dev->stat, write, pos - start, csrr_time() - t0);
+    return pos - start;
+}
+
+// Returns the address of the byte at position pos of the disk.
+
+static inline char * ramdisk_addr(const struct ramdisk_device * dev, uint64_t pos) {
+    if (dev->base != NULL)
+        return dev->base + pos;
+    else
+        return dev->pages[pos / PAGE_SIZE] + pos % PAGE_SIZE;
+}
+
+// Returns the number of bytes from position pos to the end of its page or the
+// end of the disk, whichever comes first.
+
+static inline uint64_t ramdisk_span(const struct ramdisk_device * dev, uint64_t pos) {
+    uint64_t len = PAGE_SIZE - pos % PAGE_SIZE;
+
+    if (dev->size - pos < len)
+        len = dev->size - pos;
+    return len;
+}
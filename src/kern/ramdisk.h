@@ -0,0 +1,16 @@
+// ramdisk.h - RAM disk block device
+//
+
+#ifndef _RAMDISK_H_
+#define _RAMDISK_H_
+
+#include <stddef.h>
+
+// Attaches a RAM disk backed by /size/ bytes of memory at /buf/ and registers
+// it as a "ramdisk" device. If /buf/ is NULL, the disk is backed by newly
+// allocated, zero-filled pages instead. The device has the same interface as
+// the virtio block device, without its cache, scheduler and queues.
+
+extern void ramdisk_attach(void * buf, size_t size);
+
+#endif // _RAMDISK_H_
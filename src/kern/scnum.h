@@ -10,11 +10,23 @@
 #define SYSCALL_DEVOPEN 10
 #define SYSCALL_FSOPEN  11
 #define SYSCALL_PIPE    12
+#define SYSCALL_FSCREATE 13
+#define SYSCALL_FSDELETE 14
+#define SYSCALL_FSMKDIR 15
+#define SYSCALL_STAT    16
+#define SYSCALL_FSTAT   17
+#define SYSCALL_GETDENTS 18
 
 #define SYSCALL_CLOSE   20
 #define SYSCALL_READ    21
 #define SYSCALL_WRITE   22
 #define SYSCALL_IOCTL   23
+#define SYSCALL_FSYNC   24
+#define SYSCALL_PREAD   25
+#define SYSCALL_PWRITE  26
+#define SYSCALL_READV   27
+#define SYSCALL_WRITEV  28
+#define SYSCALL_SENDFILE 29
 
 #define SYSCALL_EXEC    30
 #define SYSCALL_FORK    31
@@ -22,5 +34,9 @@
 #define SYSCALL_USLEEP  40
 #define SYSCALL_WAIT    41
 
+#define SYSCALL_MMAP    50
+#define SYSCALL_MUNMAP  51
+#define SYSCALL_MPROTECT 52
+
 
 #endif // _SCNUM_H_
@@ -0,0 +1,38 @@
+// stat.h - File status and directory entries
+//
+
+#ifndef _STAT_H_
+#define _STAT_H_
+
+#include <stdint.h>
+
+// File types (st_type, d_type)
+
+#define ST_FILE         0
+#define ST_DIR          1
+
+// The root directory has no inode; stat reports this inode number for it.
+
+#define ST_ROOT_INO     0xffffffff
+
+// Status of a file (stat, fstat). The size of a directory is the size of its
+// entries on disk.
+
+struct stat {
+    uint32_t st_ino;
+    uint32_t st_type;
+    uint64_t st_size;
+};
+
+// A directory entry returned by getdents. d_name is NUL-terminated.
+
+#define DIRENT_NAMELEN  32
+
+struct dirent {
+    uint32_t d_ino;
+    uint32_t d_type;
+    uint64_t d_size;
+    char d_name[DIRENT_NAMELEN + 1];
+};
+
+#endif // _STAT_H_
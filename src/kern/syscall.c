@@ -10,6 +10,7 @@
 #include "timer.h"
 #include "memory.h"
 #include "pipe.h"
+#include "mmap.h"
 
 #define PC_ALIGN 4
 /*
@@ -73,7 +74,7 @@ static int sysmsgout(const char *msg)
 static int sysclose(int fd)
 {
   // close the device at the specified file descriptor
-  if (fd < 0 || fd >= MAX_FILE_OPEN)
+  if (fd < 0 || fd >= PROCESS_IOMAX)
   {
     return -EBADFD;
   }
@@ -110,7 +111,7 @@ static int sysclose(int fd)
 static int sysread(int fd, void *buf, size_t bufsz)
 {
   // read from the device at the specified file descriptor
-  if (fd < 0 || fd >= MAX_FILE_OPEN)
+  if (fd < 0 || fd >= PROCESS_IOMAX)
   {
     return -EBADFD;
   }
@@ -124,7 +125,7 @@ static int sysread(int fd, void *buf, size_t bufsz)
     return -EBADFD;
   }
   struct io_intf *io = proc->iotab[fd];
-  int result = memory_validate_vptr_len(buf, bufsz, PTE_U | PTE_R);
+  int result = memory_validate_vptr_len(buf, bufsz, PTE_U | PTE_W);
   if (result != 0)
   {
     return result;
@@ -149,7 +150,7 @@ static int sysread(int fd, void *buf, size_t bufsz)
  */
 static int syswrite(int fd, const void *buf, size_t len)
 {
-  if (fd < 0 || fd >= MAX_FILE_OPEN)
+  if (fd < 0 || fd >= PROCESS_IOMAX)
   {
     return -EBADFD;
   }
@@ -164,7 +165,7 @@ static int syswrite(int fd, const void *buf, size_t len)
   }
   struct io_intf *io = proc->iotab[fd];
   // kprintf("io %p\n", io);
-  int result = memory_validate_vptr_len(buf, len, PTE_U | PTE_W);
+  int result = memory_validate_vptr_len(buf, len, PTE_U | PTE_R);
   if (result != 0)
   {
     return result;
@@ -172,6 +173,233 @@ static int syswrite(int fd, const void *buf, size_t len)
   return iowrite(io, buf, len);
 }
 
+/**
+ * @brief Reads data from a file descriptor at a position.
+ *
+ * Like `sysread`, but the data is read at position `pos`, and the position of
+ * the descriptor is neither used nor changed, so a positioned read takes one
+ * system call instead of a seek and a read.
+ *
+ * @param fd The file descriptor from which to read.
+ * @param buf The buffer where the read data will be stored.
+ * @param bufsz The size of the buffer.
+ * @param pos The position to read at.
+ * @return The number of bytes read on success, or a negative error code on failure.
+ *         Possible error codes include:
+ *         - -EBADFD: Invalid file descriptor.
+ *         - -ENOENT: No current process.
+ *         - -ENOTSUP: The descriptor has no position (e.g. a pipe).
+ */
+static long syspread(int fd, void *buf, size_t bufsz, uint64_t pos)
+{
+  struct process *proc = current_process();
+  int result;
+
+  if (proc == NULL)
+  {
+    return -ENOENT;
+  }
+  if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL)
+  {
+    return -EBADFD;
+  }
+  result = memory_validate_vptr_len(buf, bufsz, PTE_U | PTE_W);
+  if (result != 0)
+  {
+    return result;
+  }
+  return iopread(proc->iotab[fd], buf, bufsz, pos);
+}
+
+/**
+ * @brief Writes data to a file descriptor at a position, without using or
+ * changing the position of the descriptor (see `syspread`).
+ *
+ * @param fd The file descriptor to write to.
+ * @param buf A pointer to the buffer containing the data to write.
+ * @param len The number of bytes to write from the buffer.
+ * @param pos The position to write at.
+ * @return The number of bytes written on success, or a negative error code on
+ *         failure (see `syspread`).
+ */
+static long syspwrite(int fd, const void *buf, size_t len, uint64_t pos)
+{
+  struct process *proc = current_process();
+  int result;
+
+  if (proc == NULL)
+  {
+    return -ENOENT;
+  }
+  if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL)
+  {
+    return -EBADFD;
+  }
+  result = memory_validate_vptr_len(buf, len, PTE_U | PTE_R);
+  if (result != 0)
+  {
+    return result;
+  }
+  return iopwrite(proc->iotab[fd], buf, len, pos);
+}
+
+/**
+ * @brief Copies a vector of user buffers into the kernel and validates each
+ * buffer, so that the vector cannot change while it is used.
+ *
+ * @param iov The user vector.
+ * @param iovcnt The number of buffers, at most IOV_MAX.
+ * @param kiov The copy of the vector.
+ * @param flags The access the buffers must permit: PTE_U | PTE_W to read into
+ *        them, PTE_U | PTE_R to write from them.
+ * @return 0 on success, -EINVAL if iovcnt is out of range, or the error
+ *         returned by `memory_validate_vptr_len`.
+ */
+static int sysiovec(const struct io_vec *iov, int iovcnt, struct io_vec *kiov, uint_fast8_t flags)
+{
+  int result;
+
+  if (iovcnt < 0 || iovcnt > IOV_MAX)
+  {
+    return -EINVAL;
+  }
+  result = memory_validate_vptr_len(iov, iovcnt * sizeof(struct io_vec), PTE_U | PTE_R);
+  if (result != 0)
+  {
+    return result;
+  }
+  memcpy(kiov, iov, iovcnt * sizeof(struct io_vec));
+
+  for (int i = 0; i < iovcnt; i++)
+  {
+    result = memory_validate_vptr_len(kiov[i].buf, kiov[i].len, flags);
+    if (result != 0)
+    {
+      return result;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Reads data from a file descriptor into several buffers, in order, as
+ * a single read of their concatenation.
+ *
+ * @param fd The file descriptor from which to read.
+ * @param iov The buffers.
+ * @param iovcnt The number of buffers, at most IOV_MAX.
+ * @return The number of bytes read on success, or a negative error code on failure.
+ *         Possible error codes include:
+ *         - -EBADFD: Invalid file descriptor.
+ *         - -ENOENT: No current process.
+ *         - -EINVAL: iovcnt is out of range.
+ */
+static long sysreadv(int fd, const struct io_vec *iov, int iovcnt)
+{
+  struct process *proc = current_process();
+  struct io_vec kiov[IOV_MAX];
+  int result;
+
+  if (proc == NULL)
+  {
+    return -ENOENT;
+  }
+  if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL)
+  {
+    return -EBADFD;
+  }
+  result = sysiovec(iov, iovcnt, kiov, PTE_U | PTE_W);
+  if (result != 0)
+  {
+    return result;
+  }
+  return ioreadv(proc->iotab[fd], kiov, iovcnt);
+}
+
+/**
+ * @brief Writes data from several buffers to a file descriptor, in order, as a
+ * single write of their concatenation (see `sysreadv`).
+ *
+ * @param fd The file descriptor to write to.
+ * @param iov The buffers.
+ * @param iovcnt The number of buffers, at most IOV_MAX.
+ * @return The number of bytes written on success, or a negative error code on
+ *         failure (see `sysreadv`).
+ */
+static long syswritev(int fd, const struct io_vec *iov, int iovcnt)
+{
+  struct process *proc = current_process();
+  struct io_vec kiov[IOV_MAX];
+  int result;
+
+  if (proc == NULL)
+  {
+    return -ENOENT;
+  }
+  if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL)
+  {
+    return -EBADFD;
+  }
+  result = sysiovec(iov, iovcnt, kiov, PTE_U | PTE_R);
+  if (result != 0)
+  {
+    return result;
+  }
+  return iowritev(proc->iotab[fd], kiov, iovcnt);
+}
+
+/**
+ * @brief Copies data from one file descriptor to another inside the kernel.
+ *
+ * This function writes up to `count` bytes read from `infd` to `outfd` (see
+ * `iosendfile`), so that a file can be sent to a device or a pipe in one system
+ * call and without a user buffer.
+ *
+ * @param outfd The file descriptor to write to.
+ * @param infd The file descriptor to read from.
+ * @param pos If NULL, reading starts at the position of `infd` and advances it;
+ *        otherwise reading starts at `*pos`, and `*pos` is advanced instead.
+ * @param count The number of bytes to copy.
+ * @return The number of bytes copied on success, or a negative error code on failure.
+ *         Possible error codes include:
+ *         - -EBADFD: Invalid file descriptor.
+ *         - -ENOENT: No current process.
+ *         - -ENOTSUP: `pos` is not NULL and `infd` has no position.
+ */
+static long syssendfile(int outfd, int infd, uint64_t *pos, size_t count)
+{
+  struct process *proc = current_process();
+  uint64_t kpos;
+  long result;
+
+  if (proc == NULL)
+  {
+    return -ENOENT;
+  }
+  if (outfd < 0 || outfd >= PROCESS_IOMAX || proc->iotab[outfd] == NULL)
+  {
+    return -EBADFD;
+  }
+  if (infd < 0 || infd >= PROCESS_IOMAX || proc->iotab[infd] == NULL)
+  {
+    return -EBADFD;
+  }
+  if (pos == NULL)
+  {
+    return iosendfile(proc->iotab[outfd], proc->iotab[infd], NULL, count);
+  }
+
+  result = memory_validate_vptr_len(pos, sizeof(uint64_t), PTE_U | PTE_R | PTE_W);
+  if (result != 0)
+  {
+    return result;
+  }
+  kpos = *pos;
+  result = iosendfile(proc->iotab[outfd], proc->iotab[infd], &kpos, count);
+  *pos = kpos;
+  return result;
+}
+
 /**
  * @brief Perform an ioctl operation on a file descriptor.
  *
@@ -186,10 +414,19 @@ static int syswrite(int fd, const void *buf, size_t len)
  * @return 0 on success, or a negative error code on failure.
  *         - -EBADFD: if the file descriptor is invalid.
  *         - -ENOENT: if the current process is not found.
+ *         - -ENOTSUP: if the command is only for the kernel.
+ *         - Errors returned by `memory_validate_vptr_len` if the argument
+ *           of the command is not valid.
  */
 static int sysioctl(int fd, const int cmd, void *arg)
 {
-  if (fd < 0 || fd >= MAX_FILE_OPEN)
+  // the argument the command reads or writes, checked before the device
+  // uses it
+  size_t arglen = 0;
+  uint_fast8_t argflags = PTE_U | PTE_W;
+  int result;
+
+  if (fd < 0 || fd >= PROCESS_IOMAX)
   {
     return -EBADFD;
   }
@@ -202,14 +439,108 @@ static int sysioctl(int fd, const int cmd, void *arg)
   {
     return -EBADFD;
   }
+
+  switch (cmd)
+  {
+  // Commands used by the kernel only: their arguments hold kernel addresses,
+  // and IOCTL_GETPAGE takes a page cache reference that the caller releases
+  case IOCTL_GETPAGE:
+  case IOCTL_WRITEPAGE:
+  // Block device commands for the file system: their arguments hold buffer
+  // addresses that the device copies to and from without checks
+  case IOCTL_READDIRECT:
+  case IOCTL_WRITEDIRECT:
+  case IOCTL_READPAGES:
+  case IOCTL_DISCARD:
+  case IOCTL_WRITEZEROES:
+    return -ENOTSUP;
+  case IOCTL_GETSTAT:
+    arglen = sizeof(struct io_stat);
+    break;
+  case IOCTL_GETSCHEDSTAT:
+    arglen = sizeof(struct iosched_stat);
+    break;
+  case IOCTL_GETSCHED:
+    arglen = sizeof(int);
+    break;
+  case IOCTL_SETSCHED:
+    arglen = sizeof(int);
+    argflags = PTE_U | PTE_R;
+    break;
+  case IOCTL_SETLEN:
+    arglen = sizeof(uint64_t);
+    argflags = PTE_U | PTE_R;
+    break;
+  case IOCTL_GETPOLL:
+    arglen = sizeof(int);
+    break;
+  case IOCTL_SETPOLL:
+    arglen = sizeof(int);
+    argflags = PTE_U | PTE_R;
+    break;
+  case IOCTL_GETRING:
+  case IOCTL_GETQDEPTH:
+    arglen = sizeof(int);
+    break;
+  case IOCTL_SETQDEPTH:
+    arglen = sizeof(int);
+    argflags = PTE_U | PTE_R;
+    break;
+  case IOCTL_STAT:
+    arglen = sizeof(struct stat);
+    break;
+  default:
+    break;
+  }
+
+  if (arglen != 0)
+  {
+    result = memory_validate_vptr_len(arg, arglen, argflags);
+    if (result != 0)
+    {
+      return result;
+    }
+  }
+
   struct io_intf *io = proc->iotab[fd];
   // kprintf("io at ioctl %p\n", io);
   // kprintf("ioref %d\n", io->refcnt);
-  int result = ioctl(io, cmd, arg);
+  result = ioctl(io, cmd, arg);
 
   return result;
 }
 
+/**
+ * @brief Flush buffered writes of a file descriptor to the underlying device.
+ *
+ * This function checks the validity of the file descriptor and the current
+ * process, and then issues an IOCTL_FLUSH on the I/O interface. On return,
+ * data previously written to the descriptor has reached the device.
+ *
+ * @param fd The file descriptor to flush.
+ * @return 0 on success, or a negative error code on failure.
+ *         - -EBADFD: if the file descriptor is invalid.
+ *         - -ENOENT: if the current process is not found.
+ *         - -ENOTSUP: if the I/O interface does not support flushing.
+ */
+static int sysfsync(int fd)
+{
+  if (fd < 0 || fd >= PROCESS_IOMAX)
+  {
+    return -EBADFD;
+  }
+  struct process *proc = current_process();
+  if (proc == NULL)
+  {
+    return -ENOENT;
+  }
+  if (proc->iotab[fd] == NULL)
+  {
+    return -EBADFD;
+  }
+  return ioctl(proc->iotab[fd], IOCTL_FLUSH, NULL);
+}
+
 /**
  * @brief Opens a device and associates it with a file descriptor in the current process.
  *
@@ -233,7 +564,7 @@ static int sysdevopen(int fd, const char *name, int instno)
     return -ENOENT;
   }
 
-  if (fd >= MAX_FILE_OPEN)
+  if (fd >= PROCESS_IOMAX)
   {
     return -EBADFD;
   }
@@ -241,7 +572,7 @@ static int sysdevopen(int fd, const char *name, int instno)
   if (fd < 0)
   {
     // find the next empty entry of proc->iotab
-    for (int i = 0; i < MAX_FILE_OPEN; i++)
+    for (int i = 0; i < PROCESS_IOMAX; i++)
     {
       if (proc->iotab[i] == NULL)
       {
@@ -271,7 +602,7 @@ static int sysdevopen(int fd, const char *name, int instno)
  * it with the provided file descriptor (fd) in the current process's I/O table.
  *
  * @param fd The file descriptor to associate with the opened file. Must be within
- *           the valid range [0, MAX_FILE_OPEN).
+ *           the valid range [0, PROCESS_IOMAX).
  * @param name The name of the file to open.
  * @return 0 on success, or a negative error code on failure:
  *         - -ENODEV: if the I/O interface is NULL.
@@ -287,14 +618,14 @@ static int sysfsopen(int fd, const char *name)
   {
     return -ENOENT;
   }
-  if (fd >= MAX_FILE_OPEN)
+  if (fd >= PROCESS_IOMAX)
   {
     return -EBADFD;
   }
   if (fd < 0)
   {
     // find the next empty entry of proc->iotab
-    for (int i = 0; i < MAX_FILE_OPEN; i++)
+    for (int i = 0; i < PROCESS_IOMAX; i++)
     {
       if (proc->iotab[i] == NULL)
       {
@@ -325,6 +656,186 @@ static int sysfsopen(int fd, const char *name)
   return fd;
 }
 
+/**
+ * @brief Creates an empty file.
+ *
+ * @param name The name of the new file.
+ * @return 0 on success, an error returned by `memory_validate_vstr` if the name
+ *         is not a valid user string, or a negative error code returned by
+ *         fs_create().
+ */
+static int sysfscreate(const char *name)
+{
+  int result;
+
+  result = memory_validate_vstr(name, PTE_U);
+  if (result != 0)
+  {
+    return result;
+  }
+  return fs_create(name);
+}
+
+/**
+ * @brief Deletes a file. The file must not be open.
+ *
+ * @param name The name of the file to delete.
+ * @return 0 on success, an error returned by `memory_validate_vstr` if the name
+ *         is not a valid user string, or a negative error code returned by
+ *         fs_unlink().
+ */
+static int sysfsdelete(const char *name)
+{
+  int result;
+
+  result = memory_validate_vstr(name, PTE_U);
+  if (result != 0)
+  {
+    return result;
+  }
+  return fs_unlink(name);
+}
+
+/**
+ * @brief Creates an empty directory.
+ *
+ * @param name The path of the new directory.
+ * @return 0 on success, an error returned by `memory_validate_vstr` if the path
+ *         is not a valid user string, or a negative error code returned by
+ *         fs_mkdir().
+ */
+static int sysfsmkdir(const char *name)
+{
+  int result;
+
+  result = memory_validate_vstr(name, PTE_U);
+  if (result != 0)
+  {
+    return result;
+  }
+  return fs_mkdir(name);
+}
+
+/**
+ * @brief Returns the status of a file without opening it.
+ *
+ * @param name The path of the file.
+ * @param st The status is returned here (see stat.h).
+ * @return 0 on success, or a negative error code on failure:
+ *         - Errors returned by `memory_validate_vstr` or
+ *           `memory_validate_vptr_len` if an argument is not valid.
+ *         - Other negative values returned by fs_stat() on failure.
+ */
+static int sysstat(const char *name, struct stat *st)
+{
+  struct stat kst;
+  int result;
+
+  result = memory_validate_vstr(name, PTE_U);
+  if (result != 0)
+  {
+    return result;
+  }
+  result = memory_validate_vptr_len(st, sizeof(struct stat), PTE_U | PTE_W);
+  if (result != 0)
+  {
+    return result;
+  }
+  result = fs_stat(name, &kst);
+  if (result == 0)
+  {
+    *st = kst;
+  }
+  return result;
+}
+
+/**
+ * @brief Returns the status of the file open at a file descriptor.
+ *
+ * @param fd The file descriptor.
+ * @param st The status is returned here (see stat.h).
+ * @return 0 on success, or a negative error code on failure:
+ *         - -EBADFD: if the file descriptor is invalid.
+ *         - -ENOENT: if the current process is not found.
+ *         - -ENOTSUP: if the descriptor is not a file.
+ */
+static int sysfstat(int fd, struct stat *st)
+{
+  struct stat kst;
+  int result;
+
+  if (fd < 0 || fd >= PROCESS_IOMAX)
+  {
+    return -EBADFD;
+  }
+  struct process *proc = current_process();
+  if (proc == NULL)
+  {
+    return -ENOENT;
+  }
+  if (proc->iotab[fd] == NULL)
+  {
+    return -EBADFD;
+  }
+  result = memory_validate_vptr_len(st, sizeof(struct stat), PTE_U | PTE_W);
+  if (result != 0)
+  {
+    return result;
+  }
+  result = ioctl(proc->iotab[fd], IOCTL_STAT, &kst);
+  if (result == 0)
+  {
+    *st = kst;
+  }
+  return result;
+}
+
+/**
+ * @brief Reads a batch of entries of a directory, starting at a cursor that is
+ * advanced past them (see fs_getdents). The directory is named by its path, so
+ * it need not be open.
+ *
+ * @param name The path of the directory.
+ * @param cursor The index of the next entry, 0 at the start of the listing.
+ * @param ents The buffer for the entries.
+ * @param n The number of entries the buffer holds.
+ * @return The number of entries returned, 0 at the end of the directory, or a
+ *         negative error code on failure:
+ *         - -EINVAL: if the buffer size overflows.
+ *         - Errors returned by `memory_validate_vstr` or
+ *           `memory_validate_vptr_len` if an argument is not valid.
+ *         - Other negative values returned by fs_getdents() on failure.
+ */
+static long sysgetdents(const char *name, uint64_t *cursor, struct dirent *ents, size_t n)
+{
+  uint64_t kcursor;
+  long result;
+
+  if (n > SIZE_MAX / sizeof(struct dirent))
+  {
+    return -EINVAL;
+  }
+  result = memory_validate_vstr(name, PTE_U);
+  if (result != 0)
+  {
+    return result;
+  }
+  result = memory_validate_vptr_len(cursor, sizeof(uint64_t), PTE_U | PTE_R | PTE_W);
+  if (result != 0)
+  {
+    return result;
+  }
+  result = memory_validate_vptr_len(ents, n * sizeof(struct dirent), PTE_U | PTE_W);
+  if (result != 0)
+  {
+    return result;
+  }
+  kcursor = *cursor;
+  result = fs_getdents(name, &kcursor, ents, n);
+  *cursor = kcursor;
+  return result;
+}
+
 static int syspipe(int fd)
 {
   struct process *proc = current_process();
@@ -332,14 +843,14 @@ static int syspipe(int fd)
   {
     return -ENOENT;
   }
-  if (fd >= MAX_FILE_OPEN)
+  if (fd >= PROCESS_IOMAX)
   {
     return -EBADFD;
   }
   if (fd < 0)
   {
     // find the next empty entry of proc->iotab
-    for (int i = 0; i < MAX_FILE_OPEN; i++)
+    for (int i = 0; i < PROCESS_IOMAX; i++)
     {
       if (proc->iotab[i] == NULL)
       {
@@ -390,7 +901,7 @@ static int sysexec(int fd)
   {
     return -ENOENT;
   }
-  if (fd < 0 || fd >= MAX_FILE_OPEN)
+  if (fd < 0 || fd >= PROCESS_IOMAX)
   {
     return -EBADFD;
   }
@@ -482,6 +993,77 @@ static int sysfork(struct trap_frame *tfr)
   return process_fork(tfr);
 }
 
+/**
+ * @brief Maps a file or anonymous memory into the memory of the current process.
+ *
+ * @param addr The address of the mapping with MAP_FIXED; ignored otherwise.
+ * @param len The length of the mapping in bytes.
+ * @param prot The protection of the mapping, an OR of PROT_READ, PROT_WRITE and PROT_EXEC.
+ * @param flags MAP_SHARED or MAP_PRIVATE, optionally ORed with MAP_FIXED and MAP_ANONYMOUS.
+ * @param fd The file descriptor of the file to map; ignored with MAP_ANONYMOUS.
+ * @param off The offset in the file, a multiple of the page size.
+ * @return The address of the mapping on success, or a negative error code:
+ *         - -EBADFD: if the file descriptor is invalid or not open.
+ *         - Any negative value returned by `mmap_map`.
+ */
+static long sysmmap(void *addr, size_t len, int prot, int flags, int fd, uint64_t off)
+{
+  struct process *proc = current_process();
+  struct io_intf *io = NULL;
+
+  if (proc == NULL)
+  {
+    return -ENOENT;
+  }
+  if (!(flags & MAP_ANONYMOUS))
+  {
+    if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL)
+    {
+      return -EBADFD;
+    }
+    io = proc->iotab[fd];
+  }
+
+  return mmap_map(proc, (uintptr_t)addr, len, prot, flags, io, off);
+}
+
+/**
+ * @brief Removes the memory mappings of an address range of the current process.
+ *
+ * @param addr The start of the range, a multiple of the page size.
+ * @param len The length of the range in bytes.
+ * @return 0 on success, or a negative error code returned by `mmap_unmap`.
+ */
+static int sysmunmap(void *addr, size_t len)
+{
+  struct process *proc = current_process();
+
+  if (proc == NULL)
+  {
+    return -ENOENT;
+  }
+  return mmap_unmap(proc, (uintptr_t)addr, len);
+}
+
+/**
+ * @brief Changes the protection of memory mappings of the current process.
+ *
+ * @param addr The start of the range, a multiple of the page size.
+ * @param len The length of the range in bytes.
+ * @param prot The new protection, an OR of PROT_READ, PROT_WRITE and PROT_EXEC.
+ * @return 0 on success, or a negative error code returned by `mmap_protect`.
+ */
+static int sysmprotect(void *addr, size_t len, int prot)
+{
+  struct process *proc = current_process();
+
+  if (proc == NULL)
+  {
+    return -ENOENT;
+  }
+  return mmap_protect(proc, (uintptr_t)addr, len, prot);
+}
+
 /**
  * @brief Handles system calls by dispatching to the appropriate syscall function.
  *
@@ -498,13 +1080,18 @@ static int sysfork(struct trap_frame *tfr)
  * - SYSCALL_CLOSE: Closes a file descriptor.
  * - SYSCALL_READ: Reads from a file descriptor.
  * - SYSCALL_WRITE: Writes to a file descriptor.
+ * - SYSCALL_PREAD, SYSCALL_PWRITE: Read or write a file descriptor at a position.
+ * - SYSCALL_READV, SYSCALL_WRITEV: Read or write a file descriptor with several buffers.
+ * - SYSCALL_SENDFILE: Copies data from one file descriptor to another.
  * - SYSCALL_IOCTL: Performs an I/O control operation.
+ * - SYSCALL_FSYNC: Flushes buffered writes of a file descriptor.
  * - SYSCALL_DEVOPEN: Opens a device.
  * - SYSCALL_FSOPEN: Opens a file system.
  * - SYSCALL_EXEC: Executes a new program.
  * - SYSCALL_FORK: Forks the current process.
  * - SYSCALL_USLEEP: Sleeps for a specified number of microseconds.
  * - SYSCALL_WAIT: Waits for a child process to exit.
+ * - SYSCALL_MMAP, SYSCALL_MUNMAP, SYSCALL_MPROTECT: Manage memory mappings.
  * If the syscall number does not match any of the handled cases, the function
  * does nothing.
  */
@@ -529,9 +1116,30 @@ void syscall_handler(struct trap_frame *tfr)
   case SYSCALL_WRITE:
     tfr->x[TFR_A0] = syswrite((int)tfr->x[TFR_A0], (const void *)tfr->x[TFR_A1], (size_t)tfr->x[TFR_A2]);
     break;
+  case SYSCALL_PREAD:
+    tfr->x[TFR_A0] = syspread((int)tfr->x[TFR_A0], (void *)tfr->x[TFR_A1], (size_t)tfr->x[TFR_A2],
+                              (uint64_t)tfr->x[TFR_A3]);
+    break;
+  case SYSCALL_PWRITE:
+    tfr->x[TFR_A0] = syspwrite((int)tfr->x[TFR_A0], (const void *)tfr->x[TFR_A1], (size_t)tfr->x[TFR_A2],
+                               (uint64_t)tfr->x[TFR_A3]);
+    break;
+  case SYSCALL_READV:
+    tfr->x[TFR_A0] = sysreadv((int)tfr->x[TFR_A0], (const struct io_vec *)tfr->x[TFR_A1], (int)tfr->x[TFR_A2]);
+    break;
+  case SYSCALL_WRITEV:
+    tfr->x[TFR_A0] = syswritev((int)tfr->x[TFR_A0], (const struct io_vec *)tfr->x[TFR_A1], (int)tfr->x[TFR_A2]);
+    break;
+  case SYSCALL_SENDFILE:
+    tfr->x[TFR_A0] = syssendfile((int)tfr->x[TFR_A0], (int)tfr->x[TFR_A1], (uint64_t *)tfr->x[TFR_A2],
+                                 (size_t)tfr->x[TFR_A3]);
+    break;
   case SYSCALL_IOCTL:
     tfr->x[TFR_A0] = sysioctl((int)tfr->x[TFR_A0], (const int)tfr->x[TFR_A1], (void *)tfr->x[TFR_A2]);
     break;
+  case SYSCALL_FSYNC:
+    tfr->x[TFR_A0] = sysfsync((int)tfr->x[TFR_A0]);
+    break;
   case SYSCALL_DEVOPEN:
     tfr->x[TFR_A0] = sysdevopen((int)tfr->x[TFR_A0], (const char *)tfr->x[TFR_A1], (int)tfr->x[TFR_A2]);
     break;
@@ -541,6 +1149,25 @@ void syscall_handler(struct trap_frame *tfr)
   case SYSCALL_PIPE:
     tfr->x[TFR_A0] = syspipe((int)tfr->x[TFR_A0]);
     break;
+  case SYSCALL_FSCREATE:
+    tfr->x[TFR_A0] = sysfscreate((const char *)tfr->x[TFR_A0]);
+    break;
+  case SYSCALL_FSDELETE:
+    tfr->x[TFR_A0] = sysfsdelete((const char *)tfr->x[TFR_A0]);
+    break;
+  case SYSCALL_FSMKDIR:
+    tfr->x[TFR_A0] = sysfsmkdir((const char *)tfr->x[TFR_A0]);
+    break;
+  case SYSCALL_STAT:
+    tfr->x[TFR_A0] = sysstat((const char *)tfr->x[TFR_A0], (struct stat *)tfr->x[TFR_A1]);
+    break;
+  case SYSCALL_FSTAT:
+    tfr->x[TFR_A0] = sysfstat((int)tfr->x[TFR_A0], (struct stat *)tfr->x[TFR_A1]);
+    break;
+  case SYSCALL_GETDENTS:
+    tfr->x[TFR_A0] = sysgetdents((const char *)tfr->x[TFR_A0], (uint64_t *)tfr->x[TFR_A1],
+                                 (struct dirent *)tfr->x[TFR_A2], (size_t)tfr->x[TFR_A3]);
+    break;
   case SYSCALL_EXEC:
     tfr->x[TFR_A0] = sysexec((int)tfr->x[TFR_A0]);
     break;
@@ -553,6 +1180,16 @@ void syscall_handler(struct trap_frame *tfr)
   case SYSCALL_USLEEP:
     tfr->x[TFR_A0] = sysusleep((unsigned long)tfr->x[TFR_A0]);
     break;
+  case SYSCALL_MMAP:
+    tfr->x[TFR_A0] = sysmmap((void *)tfr->x[TFR_A0], (size_t)tfr->x[TFR_A1], (int)tfr->x[TFR_A2],
+                             (int)tfr->x[TFR_A3], (int)tfr->x[TFR_A4], (uint64_t)tfr->x[TFR_A5]);
+    break;
+  case SYSCALL_MUNMAP:
+    tfr->x[TFR_A0] = sysmunmap((void *)tfr->x[TFR_A0], (size_t)tfr->x[TFR_A1]);
+    break;
+  case SYSCALL_MPROTECT:
+    tfr->x[TFR_A0] = sysmprotect((void *)tfr->x[TFR_A0], (size_t)tfr->x[TFR_A1], (int)tfr->x[TFR_A2]);
+    break;
   default:
     break;
   }
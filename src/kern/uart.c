@@ -12,6 +12,9 @@
 #include "halt.h"
 #include "intr.h"
 #include "limits.h"
+#include "csr.h"
+#include "iostat.h"
+#include "string.h"
 
 // COMPILE-TIME CONSTANT DEFINITIONS
 //
@@ -73,6 +76,7 @@ struct uart_device {
 	int irqno;
 
 	uint32_t rxovrcnt; // number of times OE was set
+	struct io_stat stat; // overruns are counted as errors
 
 	struct io_intf io_intf;
 	
@@ -90,6 +94,7 @@ static int uart_open(struct io_intf ** ioptr, void * aux);
 static void uart_close(struct io_intf * io);
 static long uart_read(struct io_intf * io, void * buf, unsigned long bufsz);
 static long uart_write(struct io_intf * io, const void * buf, unsigned long n);
+static int uart_ioctl(struct io_intf * io, int cmd, void * arg);
 
 static void uart_isr(int irqno, void * driver_private);
 
@@ -108,10 +113,12 @@ void uart_attach(void * mmio_base, int irqno) {
 	static const struct io_ops uart_ops = {
 		.close = uart_close,
 		.read = uart_read,
-		.write = uart_write
+		.write = uart_write,
+		.ctl = uart_ioctl
 	};
 
 	struct uart_device * dev;
+	int instno;
 
 	// UART0 is used for the console, so can't be opened
 
@@ -141,7 +148,8 @@ void uart_attach(void * mmio_base, int irqno) {
     dev->regs->lcr = 0; // DLAB=0
 
 	intr_register_isr(irqno, UART_IRQ_PRIO, uart_isr, dev);
-	device_register("ser", &uart_open, dev);
+	instno = device_register("ser", &uart_open, dev);
+	iostat_register("ser", instno, &dev->stat);
 }
 	
 int uart_open(struct io_intf ** ioptr, void * aux) {
@@ -185,6 +193,7 @@ void uart_close(struct io_intf * io) {
 long uart_read(struct io_intf * io, void * buf, unsigned long bufsz) {
 	struct uart_device * const dev =
 		(void*)io - offsetof(struct uart_device, io_intf);
+	const uint64_t t0 = csrr_time();
 	char * p = buf; // position in buf to put next byte
 
 	trace("%s(buf=%p,bufsz=%ld)", __func__, buf, bufsz);
@@ -219,6 +228,9 @@ long uart_read(struct io_intf * io, void * buf, unsigned long bufsz) {
 		*p++ = rbuf_get(&dev->rxbuf);
 	
 	dev->regs->ier |= IER_DREIE; // enable receive interrupts
+
+	// latency includes the wait for the first byte
+	iostat_record(&dev->stat, 0, p - (char*)buf, csrr_time() - t0);
 	
 	return p - (char*)buf;
 }
@@ -226,6 +238,7 @@ long uart_read(struct io_intf * io, void * buf, unsigned long bufsz) {
 long uart_write(struct io_intf * io, const void * buf, unsigned long n) {
 	struct uart_device * const dev =
 		(void*)io - offsetof(struct uart_device, io_intf);
+	const uint64_t t0 = csrr_time();
 	const char * p = buf; // position in buf to get next byte
 	
 	trace("%s(n=%ld)", __func__, n);
@@ -250,15 +263,40 @@ long uart_write(struct io_intf * io, const void * buf, unsigned long n) {
 		dev->regs->ier |= IER_THREIE;
 	}
 
+	// latency is the time to queue the data for transmission
+	iostat_record(&dev->stat, 1, p - (char*)buf, csrr_time() - t0);
+
 	return p - (char*)buf;
 }
 
+int uart_ioctl(struct io_intf * io, int cmd, void * arg) {
+	struct uart_device * const dev =
+		(void*)io - offsetof(struct uart_device, io_intf);
+	int saved_intr_state;
+
+	trace("%s(cmd=%d,arg=%p)", __func__, cmd, arg);
+	assert (io != NULL);
+
+	switch (cmd) {
+	case IOCTL_GETSTAT:
+		// the ISR counts overruns
+		saved_intr_state = intr_disable();
+		memcpy(arg, &dev->stat, sizeof(struct io_stat));
+		intr_restore(saved_intr_state);
+		return 0;
+	default:
+		return -ENOTSUP;
+	}
+}
+
 void uart_isr(int irqno, void * aux) {
 	struct uart_device * const dev = aux;
 	const uint_fast8_t line_status = dev->regs->lsr;
 
-	if (line_status & LSR_OE)
+	if (line_status & LSR_OE) {
 		dev->rxovrcnt += 1;
+		dev->stat.errors += 1;
+	}
 	
 	if (line_status & LSR_DR) {
 		if (!rbuf_full(&dev->rxbuf)) {
@@ -11,6 +11,11 @@
 #include "string.h"
 #include "thread.h"
 #include "lock.h"
+#include "memory.h"
+#include "timer.h"
+#include "iosched.h"
+#include "csr.h"
+#include "iostat.h"
 
 struct lock vblk_lk;
 
@@ -21,6 +26,64 @@ struct lock vblk_lk;
 
 #define VIOBLK_IRQ_PRIO 1
 
+// Number of cache blocks (one page each) in the write-back block cache.
+
+#ifndef VIOBLK_CACHE_SIZE
+#define VIOBLK_CACHE_SIZE 16
+#endif
+
+// When this many cache blocks are dirty, the writer writes them back itself
+// instead of leaving them to the flusher thread.
+
+#ifndef VIOBLK_DIRTY_MAX
+#define VIOBLK_DIRTY_MAX 8
+#endif
+
+// Period of the flusher thread, which writes back dirty cache blocks.
+
+#ifndef VIOBLK_FLUSH_INTERVAL_MS
+#define VIOBLK_FLUSH_INTERVAL_MS 500
+#endif
+
+// Initial I/O scheduler policy (IOSCHED_NOOP or IOSCHED_DEADLINE), can be
+// changed with IOCTL_SETSCHED.
+
+#ifndef VIOBLK_IOSCHED
+#define VIOBLK_IOSCHED IOSCHED_DEADLINE
+#endif
+
+// Initial completion mode (IOPOLL_INTR, IOPOLL_POLL or IOPOLL_HYBRID), can be
+// changed with IOCTL_SETPOLL, and the time a submitter spins on the used ring
+// in hybrid mode before it sleeps until the completion interrupt.
+
+#ifndef VIOBLK_POLL
+#define VIOBLK_POLL IOPOLL_INTR
+#endif
+
+#ifndef VIOBLK_POLL_SPIN_US
+#define VIOBLK_POLL_SPIN_US 100
+#endif
+
+// Number of segments of a direct read or write queued in the I/O scheduler at
+// a time. Longer direct transfers are done in several rounds.
+
+#ifndef VIOBLK_DIRECT_MAX
+#define VIOBLK_DIRECT_MAX 16
+#endif
+
+// Maximum number of virtqueues used if the device offers VIRTIO_BLK_F_MQ.
+
+#ifndef VIOBLK_MQ_MAX
+#define VIOBLK_MQ_MAX 4
+#endif
+
+// Use the packed virtqueue layout if the device offers VIRTIO_F_RING_PACKED
+// (QEMU: packed=on). Set to 0 to always use the split layout.
+
+#ifndef VIOBLK_RING_PACKED
+#define VIOBLK_RING_PACKED 1
+#endif
+
 //           INTERNAL CONSTANT DEFINITIONS
 //          
 
@@ -56,6 +119,19 @@ struct vioblk_request_header {
 
 #define VIRTIO_BLK_T_IN             0
 #define VIRTIO_BLK_T_OUT            1
+#define VIRTIO_BLK_T_FLUSH          4
+#define VIRTIO_BLK_T_DISCARD        11
+#define VIRTIO_BLK_T_WRITE_ZEROES   13
+
+//           Data of a discard or write zeroes request: an array of sector ranges
+
+struct vioblk_dwz_seg {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+};
+
+#define VIRTIO_BLK_WRITE_ZEROES_F_UNMAP (1 << 0)
 
 //           Status byte values
 
@@ -63,9 +139,62 @@ struct vioblk_request_header {
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
 
-// Queue size that we use
-#define VIOBLK_Q_SIZE 1
+// Queue size that we use. Each queue entry has its own request slot, so up to
+// VIOBLK_Q_SIZE requests can be outstanding at once.
+#define VIOBLK_Q_SIZE 8
+
+// Maximum number of data buffers in a request. A descriptor chain may not be
+// longer than the queue, and two descriptors go to the header and status.
+#define VIOBLK_SEG_MAX (VIOBLK_Q_SIZE - 2)
+
+// Maximum number of ranges in a discard or write zeroes request that we send.
+#define VIOBLK_DWZ_SEG_MAX 16
+
+// Maximum length of a data segment of a direct transfer. Physically contiguous
+// pages of the buffer are joined into one segment up to this length.
+#define VIOBLK_DIRECT_SEGLEN_MAX (1024 * 1024)
+
+// The cache works in units of pages, each holding PAGE_SIZE/blksz consecutive
+// device blocks, so that a 4 KiB file system block is a single request.
+#define VIOBLK_CBLK_SIZE PAGE_SIZE
+
+// A request slot. A request is made available to the device as a single
+// indirect descriptor pointing to itab, which describes the request header,
+// the data buffers of a request chain (none for a flush) and the status byte.
+// The slot index is the buffer id returned by the device.
+
+struct vioblk_slot {
+    struct virtq_desc itab[VIOBLK_Q_SIZE];
+    struct vioblk_request_header header;
+    volatile uint8_t status;
+    volatile uint8_t done; // set by the ISR when the device returns the slot
+    uint8_t busy; // slot is owned by a submitter
+    uint32_t nbytes; // data length of the request, for statistics
+    uint64_t tsubmit; // time of vioblk_submit, for statistics
+};
+
+// A virtqueue with its request slots. With VIRTIO_BLK_F_MQ, the device has
+// several of them, and each submitter uses the queue chosen by
+// vioblk_local_vq, so that concurrent submitters do not share a ring.
 
+struct vioblk_vq {
+    //           signaled from ISR
+    struct condition used_updated;
+
+    struct virtq ring;
+    char area[VIRTQ_AREA_SIZE(VIOBLK_Q_SIZE)] __attribute__ ((aligned(16)));
+    struct vioblk_slot slot[VIOBLK_Q_SIZE];
+};
+
+// An entry of the write-back block cache.
+
+struct vioblk_cblk {
+    uint64_t cblkno; // cache block number, UINT64_MAX if unused
+    uint64_t stamp; // cache clock at last use, for LRU replacement
+    char * data; // VIOBLK_CBLK_SIZE bytes (one page)
+    uint8_t dirty;
+    struct iosched_req req; // request to read or write back this block
+};
 
 //           Main device structure.
 //          
@@ -79,6 +208,12 @@ struct vioblk_device {
     uint16_t irqno;
     int8_t opened;
     int8_t readonly;
+    int8_t has_flush; // VIRTIO_BLK_F_FLUSH negotiated
+    int8_t event_idx; // VIRTIO_F_EVENT_IDX negotiated
+    int8_t poll_mode; // IOPOLL_INTR, IOPOLL_POLL or IOPOLL_HYBRID
+    int8_t has_discard; // VIRTIO_BLK_F_DISCARD negotiated
+    int8_t has_wzeroes; // VIRTIO_BLK_F_WRITE_ZEROES negotiated
+    int8_t wzeroes_unmap; // device may unmap zeroed sectors
 
     //           optimal block size
     uint32_t blksz;
@@ -89,46 +224,52 @@ struct vioblk_device {
     //           size of device in blksz blocks
     uint64_t blkcnt;
 
-    struct {
-        //           signaled from ISR
-        struct condition used_updated;
+    // Virtqueues, allocated separately (nvq of them)
 
-        //           We use a simple scheme of one transaction at a time.
+    struct vioblk_vq * vqs[VIOBLK_MQ_MAX];
+    uint16_t nvq;
+    // maximum number of requests in flight on each queue (IOCTL_SETQDEPTH)
+    uint16_t qdepth;
 
-        union {
-            struct virtq_avail avail;
-            char _avail_filler[VIRTQ_AVAIL_SIZE(VIOBLK_Q_SIZE)];
-        };
+    // Write-back block cache. Dirty blocks are written back by the flusher
+    // thread, when the cache runs out of clean blocks, or on IOCTL_FLUSH.
 
-        union {
-            volatile struct virtq_used used;
-            char _used_filler[VIRTQ_USED_SIZE(VIOBLK_Q_SIZE)];
-        };
+    struct vioblk_cblk cache[VIOBLK_CACHE_SIZE];
+    uint64_t cache_clock;
+    uint32_t dirtycnt;
+    int flusher_tid; // -1 until the first open
 
-        //           The first descriptor is an indirect descriptor and is the one used in
-        //           the avail and used rings. The second descriptor points to the header,
-        //           the third points to the data, and the fourth to the status byte.
+    // Cache fills and writebacks are queued in the I/O scheduler, which merges
+    // contiguous blocks and orders them before they are sent to the device.
 
-        struct virtq_desc desc[4];
-        struct vioblk_request_header req_header;
-        uint8_t req_status;
-    } vq;
+    struct iosched sched;
 
-    //           Block currently in block buffer
-    uint64_t bufblkno;
-    //           Block buffer
-    char * blkbuf;
+    // Requests of a direct read or write, one per physically contiguous
+    // segment of the buffer (VIOBLK_DIRECT_MAX entries, allocated separately
+    // to keep the device struct within the kmalloc limit of one page)
+
+    struct iosched_req * dio;
+
+    // Discard and write zeroes limits from the device configuration, and the
+    // ranges of the request being built (VIOBLK_DWZ_SEG_MAX entries)
+
+    uint32_t discard_max_sectors;
+    uint32_t discard_max_seg;
+    uint32_t wzeroes_max_sectors;
+    uint32_t wzeroes_max_seg;
+    struct vioblk_dwz_seg * dwz;
+
+    // source of writes when the device cannot write zeroes itself, allocated
+    // on first use
+    char * zero_page;
+
+    // request counts and latencies, from submission to completion
+    struct io_stat stat;
 };
 
 #define VIOBLK_ATTEMPT_MAX 10
 #define VIOBLK_SECTOR_SIZE 512 // this is the smallest unit of size used by VIRTIO, 512 Bytes
 
-#define VIOBLK_DESC_INDIRECT_ID 0
-#define VIOBLK_DESC_INDIRECT_TAB_OFFSET 1 // offset to the descriptor table pointed by the interrupt descriptor
-#define VIOBLK_DESC_HEADER_ID 0
-#define VIOBLK_DESC_DATA_ID 1
-#define VIOBLK_DESC_STATUS_ID 2
-
 
 //           INTERNAL FUNCTION DECLARATIONS
 //          
@@ -150,8 +291,68 @@ static long vioblk_write (
 static int vioblk_ioctl (
     struct io_intf * restrict io, int cmd, void * restrict arg);
 
+static long vioblk_readv (
+    struct io_intf * io, const struct io_vec * iov, int iovcnt,
+    const uint64_t * pos);
+
+static long vioblk_writev (
+    struct io_intf * io, const struct io_vec * iov, int iovcnt,
+    const uint64_t * pos);
+
+static long vioblk_transferv (
+    struct vioblk_device * dev, const struct io_vec * iov, int iovcnt,
+    const uint64_t * posptr, int write);
+
+static long vioblk_copy (
+    struct vioblk_device * dev, uint64_t pos, void * buf, unsigned long n,
+    int write);
+
 static void vioblk_isr(int irqno, void * aux);
 
+static int vioblk_reap(struct vioblk_vq * vq);
+
+static inline struct vioblk_vq * vioblk_local_vq(struct vioblk_device * dev);
+
+static int vioblk_submit (
+    struct vioblk_device * dev, struct vioblk_vq * vq,
+    uint32_t op_type, const struct iosched_req * req);
+
+static void vioblk_kick(struct vioblk_device * dev, struct vioblk_vq * vq);
+
+static int vioblk_complete (
+    struct vioblk_device * dev, struct vioblk_vq * vq, int sid);
+
+static int vioblk_io_request (
+    struct vioblk_device * dev, uint32_t op_type,
+    const struct iosched_req * req);
+
+static int vioblk_dispatch(struct vioblk_device * dev);
+
+static struct vioblk_cblk * vioblk_cache_get (
+    struct vioblk_device * dev, uint64_t cblkno, int fill);
+
+static int vioblk_writeback(struct vioblk_device * dev);
+
+static int vioblk_cache_clean (
+    struct vioblk_device * dev, uint64_t pos, uint64_t end);
+
+static void vioblk_cache_invalidate (
+    struct vioblk_device * dev, uint64_t pos, uint64_t end);
+
+static int vioblk_range_check (
+    const struct vioblk_device * dev, const struct io_range * range);
+
+static int vioblk_range_request (
+    struct vioblk_device * dev, uint32_t op_type, const struct io_range * range,
+    uint32_t max_sectors, uint32_t max_seg, uint32_t flags);
+
+static void vioblk_flusher(void * aux);
+
+static inline uint32_t vioblk_cblk_len (
+    const struct vioblk_device * dev, uint64_t cblkno);
+
+static inline uint64_t vioblk_cblk_sector(uint64_t cblkno);
+
 //           IOCTLs
 
 static int vioblk_getlen(const struct vioblk_device * dev, uint64_t * lenptr);
@@ -159,6 +360,17 @@ static int vioblk_getpos(const struct vioblk_device * dev, uint64_t * posptr);
 static int vioblk_setpos(struct vioblk_device * dev, const uint64_t * posptr);
 static int vioblk_getblksz (
     const struct vioblk_device * dev, uint32_t * blkszptr);
+static int vioblk_flush(struct vioblk_device * dev);
+static int vioblk_setpoll(struct vioblk_device * dev, const int * modeptr);
+static int vioblk_setqdepth(struct vioblk_device * dev, const int * depthptr);
+static int vioblk_dropcache(struct vioblk_device * dev);
+static int vioblk_direct (
+    struct vioblk_device * dev, const struct io_direct * dio, int write);
+static int vioblk_readpages (
+    struct vioblk_device * dev, const struct io_pagevec * pvec);
+static int vioblk_discard(struct vioblk_device * dev, const struct io_range * range);
+static int vioblk_writezeroes (
+    struct vioblk_device * dev, const struct io_range * range);
 
 //           EXPORTED FUNCTION DEFINITIONS
 //          
@@ -170,10 +382,12 @@ static const struct io_ops vio_ops = {
     .read = vioblk_read,
     .write = vioblk_write,
     .ctl = vioblk_ioctl,
+    .readv = vioblk_readv,
+    .writev = vioblk_writev
 };
 
 /**
- * @brief 
+ * @brief
  * This attaches a virtio block device with the provided MMIO register and register its interrupt to the irqno provided
  * @param regs the address of the MMIO register of the virtio block device
  * @param irqno the interrupt request number that you want this block device to be attached to
@@ -188,8 +402,11 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
 
     virtio_featset_t enabled_features, wanted_features, needed_features;
     struct vioblk_device * dev;
+    struct vioblk_vq * vq;
     uint_fast32_t blksz;
+    uint_fast16_t nvq;
     int result;
+    int i, q;
 
     assert (regs->device_id == VIRTIO_ID_BLOCK);
 
@@ -205,6 +422,11 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     //           We want:
     //            - VIRTIO_BLK_F_BLK_SIZE and
     //            - VIRTIO_BLK_F_TOPOLOGY.
+    //            - VIRTIO_BLK_F_FLUSH (device has a volatile write cache) and
+    //            - VIRTIO_BLK_F_DISCARD and VIRTIO_BLK_F_WRITE_ZEROES and
+    //            - VIRTIO_F_EVENT_IDX (notification and interrupt suppression) and
+    //            - VIRTIO_BLK_F_MQ (multiple virtqueues) and
+    //            - VIRTIO_F_RING_PACKED (packed virtqueue layout).
 
     virtio_featset_init(needed_features);
     virtio_featset_add(needed_features, VIRTIO_F_RING_RESET);
@@ -212,6 +434,13 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     virtio_featset_init(wanted_features);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_BLK_SIZE);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_TOPOLOGY);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_FLUSH);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_DISCARD);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_WRITE_ZEROES);
+    virtio_featset_add(wanted_features, VIRTIO_F_EVENT_IDX);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_MQ);
+    if (VIOBLK_RING_PACKED)
+        virtio_featset_add(wanted_features, VIRTIO_F_RING_PACKED);
     result = virtio_negotiate_features(regs,
         enabled_features, wanted_features, needed_features);
 
@@ -229,11 +458,37 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
 
     // the block size must be a multiple of 512 bytes
     assert(blksz % VIOBLK_SECTOR_SIZE == 0);
+    // and a cache block must hold a whole number of device blocks
+    assert(VIOBLK_CBLK_SIZE % blksz == 0);
     debug("%p: virtio block device block size is %lu", regs, (long)blksz);
 
+    // Use as many queues as the device has, up to VIOBLK_MQ_MAX. Each queue
+    // must be able to hold VIOBLK_Q_SIZE requests; if one is smaller, use
+    // only the queues before it.
+
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_MQ))
+        nvq = min(regs->config.blk.num_queues, VIOBLK_MQ_MAX);
+    else
+        nvq = 1;
+
+    for (q = 0; q < nvq; q++) {
+        regs->queue_sel = q;
+        __sync_synchronize();
+        if (regs->queue_num_max < VIOBLK_Q_SIZE)
+            break;
+    }
+
+    if (q == 0) {
+        kprintf("%p: virtio block device queue too small\n", regs);
+        return;
+    }
+
+    nvq = q;
+    debug("%p: virtio block device uses %d queues", regs, (int)nvq);
+
     //           Allocate initialize device struct
 
-    dev = kmalloc(sizeof(struct vioblk_device) + blksz);
+    dev = kmalloc(sizeof(struct vioblk_device));
     memset(dev, 0, sizeof(struct vioblk_device));
 
     lock_init(&vblk_lk, "vioblk_lock");
@@ -245,63 +500,66 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     dev->irqno = irqno;
     dev->opened = 0;
     dev->readonly = 0; // not needed
+    dev->has_flush = virtio_featset_test(enabled_features, VIRTIO_BLK_F_FLUSH);
+    dev->event_idx = virtio_featset_test(enabled_features, VIRTIO_F_EVENT_IDX);
     dev->blksz = blksz;
-    dev->pos = 0; 
-    dev->size = regs->config.blk.capacity * VIOBLK_SECTOR_SIZE; 
+    dev->pos = 0;
+    dev->size = regs->config.blk.capacity * VIOBLK_SECTOR_SIZE;
     dev->blkcnt = dev->size / blksz;
-    dev->bufblkno = UINT64_MAX; // the data in the buffer is nothing, the block number cannot reach -1 in unsigned because INT64_MAX * blksz is so large
-    dev->blkbuf = (void *)(dev)+sizeof(struct vioblk_device); // the block buffer is after the dev struct
-
-    condition_init(&(dev->vq.used_updated), "used ring updated");
-
-
-
-    // fills out the descriptors in the virtq struct
-
-    // indirect descriptor
-    struct virtq_desc* indirect_desc = &(dev->vq.desc[0]);  
-    indirect_desc->addr = (uint64_t)(void *)(dev->vq.desc)+sizeof(struct virtq_desc); // points to the second entry in the desc[] array
-    indirect_desc->flags |= VIRTQ_DESC_F_INDIRECT;
-    indirect_desc->len = 3*sizeof(struct virtq_desc); // 3 because 1 descriptor for each of request header, data, and status
-    indirect_desc->next = 0; // doesn't matter because the NEXT flag is not set
-
-    struct virtq_desc* desc_tab = (void *)(dev->vq.desc)+sizeof(struct virtq_desc);
-    // descriptor to the header
-    desc_tab[VIOBLK_DESC_HEADER_ID].addr = (uint64_t)(void *) (&(dev->vq.req_header));
-    desc_tab[VIOBLK_DESC_HEADER_ID].len = sizeof(struct vioblk_request_header); // section 2.7.5.3
-    desc_tab[VIOBLK_DESC_HEADER_ID].flags |= VIRTQ_DESC_F_NEXT;
-    desc_tab[VIOBLK_DESC_HEADER_ID].next = VIOBLK_DESC_DATA_ID; // pointing to the descriptor of the data buffer
-    
-    // descriptor to the data buffer (block buffer?)
-    desc_tab[VIOBLK_DESC_DATA_ID].addr = (uint64_t)(void *) (dev->blkbuf);
-    desc_tab[VIOBLK_DESC_DATA_ID].flags |= VIRTQ_DESC_F_NEXT; // we should change whether this is device-writable in the before IO operation
-    desc_tab[VIOBLK_DESC_DATA_ID].len = blksz; // so that the device know the size of the buffer
-    desc_tab[VIOBLK_DESC_DATA_ID].next = VIOBLK_DESC_STATUS_ID; // pointing to the descriptor of the status byte
-
-    //descriptor to the status BYTE;
-    desc_tab[VIOBLK_DESC_STATUS_ID].addr = (uint64_t)(void *)(&(dev->vq.req_status));
-    desc_tab[VIOBLK_DESC_STATUS_ID].flags |= VIRTQ_DESC_F_WRITE; // the status byte is always device writable
-    desc_tab[VIOBLK_DESC_STATUS_ID].len = sizeof(uint8_t);
-    desc_tab[VIOBLK_DESC_STATUS_ID].next = 0; // doesn't matter because NEXT flag is not set
-
-    // attaches virtq_avail and virtq_used structs using the virtio_attach_virtq function
-
-    // the size of queue is 1
-    // There's only one queue so the qid is 0
-    virtio_attach_virtq(dev->regs, 0, VIOBLK_Q_SIZE, (uint64_t)(void *)(&(dev->vq.desc)), (uint64_t)(void *)(&(dev->vq.used)), (uint64_t)(void *)(&(dev->vq.avail)));
-    
+    dev->flusher_tid = -1;
+    iosched_init(&dev->sched, VIOBLK_IOSCHED, VIOBLK_SEG_MAX);
+    dev->poll_mode = VIOBLK_POLL;
+    dev->dio = kmalloc(VIOBLK_DIRECT_MAX * sizeof(struct iosched_req));
+    dev->dwz = kmalloc(VIOBLK_DWZ_SEG_MAX * sizeof(struct vioblk_dwz_seg));
+
+    // a device without limits cannot be sent any ranges
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_DISCARD)) {
+        dev->discard_max_sectors = regs->config.blk.max_discard_sectors;
+        dev->discard_max_seg = min(regs->config.blk.max_discard_seg, VIOBLK_DWZ_SEG_MAX);
+        dev->has_discard = (dev->discard_max_sectors != 0 && dev->discard_max_seg != 0);
+    }
+
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_WRITE_ZEROES)) {
+        dev->wzeroes_max_sectors = regs->config.blk.max_write_zeroes_sectors;
+        dev->wzeroes_max_seg = min(regs->config.blk.max_write_zeroes_seg, VIOBLK_DWZ_SEG_MAX);
+        dev->wzeroes_unmap = regs->config.blk.write_zeroes_may_unmap;
+        dev->has_wzeroes = (dev->wzeroes_max_sectors != 0 && dev->wzeroes_max_seg != 0);
+    }
+    dev->nvq = nvq;
+    dev->qdepth = VIOBLK_Q_SIZE;
+
+    // every cache block is a direct-mapped physical page
+    for (i = 0; i < VIOBLK_CACHE_SIZE; i++) {
+        dev->cache[i].cblkno = UINT64_MAX;
+        dev->cache[i].data = memory_alloc_page();
+    }
+
+    for (q = 0; q < nvq; q++) {
+        vq = kmalloc(sizeof(struct vioblk_vq));
+        memset(vq, 0, sizeof(struct vioblk_vq));
+        condition_init(&(vq->used_updated), "used ring updated");
+
+        // lays out the rings in vq->area and attaches them to queue q
+        virtq_init(&vq->ring, vq->area, VIOBLK_Q_SIZE,
+            virtio_featset_test(enabled_features, VIRTIO_F_RING_PACKED), dev->event_idx);
+        virtq_attach(&vq->ring, dev->regs, q);
+        dev->vqs[q] = vq;
+    }
+
     // Finally, the isr and dev are registered
     intr_register_isr(irqno, VIOBLK_IRQ_PRIO, vioblk_isr, dev);
-    device_register("blk", &vioblk_open, dev);
+    dev->instno = device_register("blk", &vioblk_open, dev);
+    iostat_register("blk", dev->instno, &dev->stat);
 
-    regs->status |= VIRTIO_STAT_DRIVER_OK;    
+    regs->status |= VIRTIO_STAT_DRIVER_OK;
     //           fence o,oi
     __sync_synchronize();
 }
 
 /**
- * @brief 
+ * @brief
  * Opens a virtio block device specificed by aux, returns an io_intf through pointer parameter
+ * The first open also starts the flusher thread of the device.
  * @param ioptr this pointer will point to io_intf that is setup by this function, act like a return value
  * @param aux the pointer to the device struct that needs to be opened
  * @return 0 if open is successful, negative error code if not successful
@@ -310,22 +568,27 @@ int vioblk_open(struct io_intf ** ioptr, void * aux) {
     //           FIXME your code here
 
     struct vioblk_device * const dev = aux;
-    // int size = sizeof(dev->vq._avail_filler);
+    struct vioblk_vq * vq;
+    int i, q;
 
     assert (ioptr != NULL);
 
     if (dev->opened)
         return -EBUSY;
 
-    // sets the virtq_avail and virtq_used queues such that they are available for use.
-    virtio_enable_virtq(dev->regs, 0);
+    for (q = 0; q < dev->nvq; q++) {
+        vq = dev->vqs[q];
 
-    dev->vq.avail.flags = 0; // we need notification, so NO_NOTIF flag should not be set
-    dev->vq.avail.idx = 0; // the index of the indirect descriptor
-    // dev->vq._avail_filler[] = (uint64_t)(void *)(&(dev->vq.avail)) + sizeof(struct virtq_avail);
-    dev->vq.avail.ring[0] = 0; // we would only have one request at a time, so index will always be 0
+        // the device starts over at the beginning of the rings, and the
+        // interrupt suppression state is set by the first vioblk_kick
+        virtq_reset(&vq->ring);
 
-    // dev->vq.used.ring = (uint64_t)(void *)(&(dev->vq.used)) + sizeof(struct virtq_used);
+        // sets the virtq_avail and virtq_used queues such that they are available for use.
+        virtio_enable_virtq(dev->regs, q);
+
+        for (i = 0; i < VIOBLK_Q_SIZE; i++)
+            vq->slot[i].busy = 0;
+    }
 
     // enable interrupt
     intr_enable_irq(dev->irqno);
@@ -335,6 +598,9 @@ int vioblk_open(struct io_intf ** ioptr, void * aux) {
     dev->io_intf.refcnt = 1;
     *ioptr = &dev->io_intf;
 
+    if (dev->flusher_tid < 0)
+        dev->flusher_tid = thread_spawn("vioblk_flusher", vioblk_flusher, dev);
+
     return 0;
 }
 
@@ -343,114 +609,42 @@ int vioblk_open(struct io_intf ** ioptr, void * aux) {
 
 /**
  * @brief close the virtio block device with the device that the io interface specified is in
+ * Dirty cache blocks are written back before the queue is reset.
  * @param io the io interface that is in the device struct that is about to close (make sure this is actually in a device's struct)
  * @return no return value
  */
 void vioblk_close(struct io_intf * io) {
     //           FIXME your code here
     struct vioblk_device * const dev = (void *) io - offsetof(struct vioblk_device, io_intf);
+    int q;
 
     trace("%s()", __func__);
     assert(io != NULL);
     assert(dev->opened);
 
+    lock_acquire(&vblk_lk);
+    if (vioblk_flush(dev) < 0)
+        kprintf("vioblk: flush on close failed, data may be lost\n");
+
     // resets the virtq_avail and virtq_used queues
-    virtio_reset_virtq(dev->regs, 0);
+    for (q = 0; q < dev->nvq; q++)
+        virtio_reset_virtq(dev->regs, q);
 
     intr_disable_irq(dev->irqno);
     dev->opened = 0;
-}
-
-/**
- * @brief performs a single block io request (read/write to a signle block) with the provided device struct, block number and op_type
- * @param dev the pointer to the device that is performing this io
- * @param blk_no the block number that this io request will access
- * @param op_type read or write, can be VIRTIO_BLK_T_IN or VIRTIO_BLK_T_OUT
- * @return 0 if the read/write is success, -1 if not success
- */
-int vioblk_io_request(struct vioblk_device * const dev, uint64_t blk_no, uint32_t op_type){
-    assert(dev->opened);
-
-    if(op_type == VIRTIO_BLK_T_OUT && dev->bufblkno != blk_no){
-        // for write operation, check if the blk_no is the same as the number of the block in the dev buffer
-        kprintf("The block number requested is not the same as the number of the block in the buffer!\n");
-        return -1;
-    }
-    
-    // VIRTIO_BLK_T_IN or VIRTIO_BLK_T_OUT 
-    dev->vq.req_header.type = op_type; 
-    // the sector size is always 512 as defined by the virtio protocol, but we want to read/write by aligning to block size
-    uint64_t sector_no = blk_no * dev->blksz / VIOBLK_SECTOR_SIZE; 
-
-    assert(sector_no < dev->regs->config.blk.capacity);
-
-    dev->vq.req_header.sector = sector_no;
-
-
-    for(int i = 0; i < VIOBLK_ATTEMPT_MAX; i++) {
-        int next_idx = dev->vq.used.idx;
-        intr_disable(); // we don't want interrupt to trigger before entering condition_wait
-        if(op_type == VIRTIO_BLK_T_IN){
-            dev->vq.desc[2].flags |= VIRTQ_DESC_F_WRITE; // the data buffer is device-writable
-        }else{
-            dev->vq.desc[2].flags &= ~VIRTQ_DESC_F_WRITE; // the data buffer is not device-writable in a write operation
-        }
-        dev->vq.avail.idx ++;
-        virtio_notify_avail(dev->regs, 0);
-        // kprintf("notifying the block device a read/write op.\n");
-        condition_wait(&(dev->vq.used_updated)); //wait for a read/write to complete
-        intr_enable();
-
-        // if there's a used buffer notification, then the idx will be updated by plus 1.
-        assert(next_idx != dev->vq.used.idx);
-        // kprintf("the idx of the used ring has update!\n");
-
-        if(op_type == VIRTIO_BLK_T_IN){ // if this is a read operation
-            // now blkbuf contains the block data, update the bufblkno
-            dev->bufblkno = blk_no;
-        }
-
-        // check the id and the len
-        // dev->vq.used.flags does not matter because we don't use VIRTQ_USED_F_NO_NOTIFY
-        // should use next_idx as index byt it's always 0 because modulo QUEUE_SIZE(1) will always be 0
-        if(dev->vq.used.ring[0].id != 0) {
-            // we only have one descriptor chain, so id should always be 0
-            // 
-            kprintf("the used ring is not returning id of 0.\n");
-        }
-
-        // if(op_type == VIRTIO_BLK_T_IN && dev->vq.used.ring[0].len != dev->blksz){
-        //     kprintf("For a block read request, the number of bytes read is not the same as block size.\n");
-        // }
-
-        // if(op_type == VIRTIO_BLK_T_OUT && dev->vq.used.ring[0].len != 0){
-        //     kprintf("For a block write request, the number of bytes read is not 0\n");
-        // }
-
-        if (dev->vq.req_status == VIRTIO_BLK_S_OK)
-        {
-            // kprintf("read/write request ok!\n");
-            return 0; 
-        }else if(dev->vq.req_status == VIRTIO_BLK_S_IOERR){
-            kprintf("read/write request IO Error!\n");
-        }else if(dev->vq.req_status == VIRTIO_BLK_S_UNSUPP){
-            kprintf("read/write request un supported\n");
-        }
-    }
-
-    return -1;
+    lock_release(&vblk_lk);
 }
 
 /**
  * @brief performs a read from a block device indicated by the io_intf, result will be copied to the buf specified.
- * Will only perform read from a single block (if used with ioread())
+ * Reads go through the block cache and will not read past the end of the cache block containing the current position.
  * This function is compatible with ioread_full() to perform arbitrary length data reads (from multiple blocks).
  * Will read no more than bufsz
  * @param io the pointer to the io_intf contained in the device struct
  * @param buf the pointer to the buf that the result will be in
  * @param bufsz the maximum length of data that a single call will read
  * @return the number of bytes read into the buf, as required by io_ops
- * 
+ *
  */
 long vioblk_read (
     struct io_intf * restrict io,
@@ -458,46 +652,46 @@ long vioblk_read (
     unsigned long bufsz)
 {
     struct vioblk_device * const dev = (void *) io - offsetof(struct vioblk_device, io_intf);
+    struct vioblk_cblk * cblk;
+    uint64_t cblkno;
+    uint32_t off, len;
 
     lock_acquire(&vblk_lk);
 
     trace("%s(buf=%p, bufsz=%ld)", __func__, buf, bufsz);
     assert(io != NULL);
-    assert(dev->opened); 
-    //           FIXME your code here
+    assert(dev->opened);
 
-    if(dev->pos + bufsz > dev->regs->config.blk.capacity * VIOBLK_SECTOR_SIZE){
-        kprintf("read exceeds block device capacity");
+    if (dev->pos >= dev->size) {
+        // end of device
         lock_release(&vblk_lk);
         return 0;
     }
 
+    cblkno = dev->pos / VIOBLK_CBLK_SIZE;
+    off = dev->pos % VIOBLK_CBLK_SIZE; // offset of the cursor in the cache block
+    len = vioblk_cblk_len(dev, cblkno) - off; // read until the end of the cache block
+    len = min(bufsz, len); // unless we are reading enough before that
 
-    // if data in the block buffer is already the block that we need
-    // we can directly copy data from the buffer in dev struct to the output buffer
+    cblk = vioblk_cache_get(dev, cblkno, 1);
 
-    int blk_no = (dev->pos) / (dev->blksz);
-    int pos_in_blk = (dev->pos) % (dev->blksz);  // the offset of current "cursor" position in block
-    int start_pos = pos_in_blk; // the index that we are start reading from 
-    int end_pos = min(dev->blksz, start_pos + bufsz); // read until the end of block unless we are reading enough before that, this position is  (we read until end_pos - 1)
-
-    // if the buffer does not contain the block that we want, read it from the device
-    if(dev->bufblkno != blk_no){
-        // request data from vioblk device, data should be in dev->blkbuf after this.
-        vioblk_io_request(dev, blk_no, VIRTIO_BLK_T_IN);
+    if (cblk == NULL) {
+        lock_release(&vblk_lk);
+        return -EIO;
     }
 
-    // now we need to copy data from the buffer we read from the device to the output buffer
-    memcpy(buf, dev->blkbuf + pos_in_blk, end_pos - start_pos); // copy to the end of the block
+    memcpy(buf, cblk->data + off, len);
 
-    dev->pos += end_pos - start_pos;
+    dev->pos += len;
     lock_release(&vblk_lk);
-    return end_pos - start_pos;
+    return len;
 }
 
 /**
  * @brief performs a write to a block device indicated by the io_intf, using data in buf.
- * Will only perform write to a single block.
+ * The data is written to the block cache only; the cache block is marked dirty and written to the
+ * device later by the flusher thread, on IOCTL_FLUSH, or when too many blocks are dirty.
+ * Will only perform write to a single cache block.
  * This function is compatible with iowrite() to perform arbitrary length data writes (to multiple blocks).
  * Will write no more than bufsz
  * @param io the pointer to the io_intf contained in the device struct
@@ -509,59 +703,101 @@ long vioblk_write (
     const void * restrict buf,
     unsigned long n)
 {
-    // FIXME your code here
+    struct vioblk_device * const dev = (void *) io - offsetof(struct vioblk_device, io_intf);
+    struct vioblk_cblk * cblk;
+    uint64_t cblkno;
+    uint32_t off, len, cblk_len;
 
     lock_acquire(&vblk_lk);
-    struct vioblk_device * const dev = (void *) io - offsetof(struct vioblk_device, io_intf);
 
     trace("%s(buf=%p, bufsz=%ld)", __func__, buf, n);
     assert(io != NULL);
-    assert(dev->opened); 
+    assert(dev->opened);
 
-    if(dev->pos + n > dev->regs->config.blk.capacity * VIOBLK_SECTOR_SIZE){
-        kprintf("write exceeds block device capacity");
+    if (dev->pos >= dev->size) {
+        // the device cannot grow
         lock_release(&vblk_lk);
         return 0;
     }
 
-    int blk_no = (dev->pos) / (dev->blksz);
-    int pos_in_blk = (dev->pos) % (dev->blksz); // the offset of the current cursor in the block
-    int start_pos = pos_in_blk;
-    int end_pos = min(dev->blksz, start_pos+n); // we write until the end of the block unless we are writing enough data, does not include this position
-    // n - bytes_written is the number of bytes that still need to be written
+    cblkno = dev->pos / VIOBLK_CBLK_SIZE;
+    cblk_len = vioblk_cblk_len(dev, cblkno);
+    off = dev->pos % VIOBLK_CBLK_SIZE; // offset of the cursor in the cache block
+    len = min(n, cblk_len - off);
+
+    // A write that does not cover the whole cache block needs the rest of the
+    // block from the device; a full block write does not.
+
+    cblk = vioblk_cache_get(dev, cblkno, off != 0 || len != cblk_len);
 
-    // if the write is not a full block 
-    // and the block in the buffer is not the block that we want to write to,
-    // we need to read the block first
-    if((end_pos != dev->blksz || start_pos != 0) && dev->bufblkno != blk_no){
-        vioblk_io_request(dev, blk_no, VIRTIO_BLK_T_IN);
-        // now we have a full block in the block buffer of the device struct
-        assert(dev->bufblkno == blk_no);
+    if (cblk == NULL) {
+        lock_release(&vblk_lk);
+        return -EIO;
     }
 
-    // the block buffer is already the block that we want to write to
-    // we can directly modify the part of the data that we want to modify and then request a write
+    memcpy(cblk->data + off, buf, len);
 
-    // if we are writing a full block, makesure to update the bufblkno as writing into dev->buf
-    if(start_pos == 0 || end_pos == dev->blksz){
-        dev->bufblkno = blk_no;
+    if (!cblk->dirty) {
+        cblk->dirty = 1;
+        dev->dirtycnt++;
     }
 
-    // copy date from buf to the block buffer
-    memcpy(dev->blkbuf + start_pos, buf, end_pos - start_pos);
+    dev->pos += len;
+
+    // Too many dirty blocks: write them back now rather than let the flusher
+    // fall behind. The data is already in the cache, so a failure here is
+    // retried by the next writeback.
 
-    // request a write operation
-    vioblk_io_request(dev, dev->bufblkno, VIRTIO_BLK_T_OUT);
+    if (dev->dirtycnt >= VIOBLK_DIRTY_MAX)
+        vioblk_writeback(dev);
 
-    // write to device is done, update bytes_written to device
-    dev->pos += end_pos - start_pos;
     lock_release(&vblk_lk);
-    return end_pos - start_pos;
+    return len;
+}
+
+/**
+ * @brief reads from a block device into several buffers, at the current position (which is advanced) or at *pos
+ * (which leaves the current position alone), as specified by io_ops. Unlike vioblk_read, a single call reads
+ * across cache blocks, so the whole vector is read under one acquisition of the device lock.
+ * @param io the pointer to the io_intf contained in the device struct
+ * @param iov the buffers to read into, in order
+ * @param iovcnt the number of buffers
+ * @param pos the position to read at, or NULL to read at the current position
+ * @return the number of bytes read, 0 at the end of the device, negative if error
+ */
+long vioblk_readv (
+    struct io_intf * io, const struct io_vec * iov, int iovcnt,
+    const uint64_t * pos)
+{
+    struct vioblk_device * const dev = (void *) io - offsetof(struct vioblk_device, io_intf);
+
+    return vioblk_transferv(dev, iov, iovcnt, pos, 0);
+}
+
+/**
+ * @brief writes to a block device from several buffers, at the current position or at *pos, like
+ * vioblk_readv. The data goes to the block cache, as with vioblk_write.
+ * @param io the pointer to the io_intf contained in the device struct
+ * @param iov the buffers to write from, in order
+ * @param iovcnt the number of buffers
+ * @param pos the position to write at, or NULL to write at the current position
+ * @return the number of bytes written, 0 at the end of the device (it cannot grow), negative if error
+ */
+long vioblk_writev (
+    struct io_intf * io, const struct io_vec * iov, int iovcnt,
+    const uint64_t * pos)
+{
+    struct vioblk_device * const dev = (void *) io - offsetof(struct vioblk_device, io_intf);
+
+    return vioblk_transferv(dev, iov, iovcnt, pos, 1);
 }
 
 /**
  * @brief virtio block device io control function, as specified by io_ops.
- * can perform getlen, getpos, setpos, and getblksz functions as specified by cmd.
+ * can perform getlen, getpos, setpos, getblksz and flush functions as specified by cmd, and get or set
+ * the I/O scheduler policy and get its statistics, get or set the completion mode, drop the cache,
+ * read or write directly between the device and a buffer, get the virtqueue layout, get or set the queue depth, discard or
+ * zero a range of the device, and get the request statistics of the device.
  * Arguments to these functions are passed through arg
  * @param io the pointer to the io_intf contained in the device struct
  * @param cmd the type of the specific io control function that you want to execute
@@ -572,9 +808,10 @@ int vioblk_ioctl(struct io_intf * restrict io, int cmd, void * restrict arg) {
     lock_acquire(&vblk_lk);
     struct vioblk_device * const dev = (void*)io -
         offsetof(struct vioblk_device, io_intf);
-    
+    int result;
+
     trace("%s(cmd=%d,arg=%p)", __func__, cmd, arg);
-    
+
     switch (cmd) {
     case IOCTL_GETLEN:
         lock_release(&vblk_lk);
@@ -588,6 +825,67 @@ int vioblk_ioctl(struct io_intf * restrict io, int cmd, void * restrict arg) {
     case IOCTL_GETBLKSZ:
         lock_release(&vblk_lk);
         return vioblk_getblksz(dev, arg);
+    case IOCTL_FLUSH:
+        result = vioblk_flush(dev);
+        lock_release(&vblk_lk);
+        return result;
+    case IOCTL_GETSCHED:
+        *(int *)arg = dev->sched.policy_id;
+        lock_release(&vblk_lk);
+        return 0;
+    case IOCTL_SETSCHED:
+        result = iosched_set_policy(&dev->sched, *(int *)arg);
+        lock_release(&vblk_lk);
+        return result;
+    case IOCTL_GETSCHEDSTAT:
+        memcpy(arg, &dev->sched.stat, sizeof(struct iosched_stat));
+        lock_release(&vblk_lk);
+        return 0;
+    case IOCTL_GETPOLL:
+        *(int *)arg = dev->poll_mode;
+        lock_release(&vblk_lk);
+        return 0;
+    case IOCTL_SETPOLL:
+        result = vioblk_setpoll(dev, arg);
+        lock_release(&vblk_lk);
+        return result;
+    case IOCTL_DROPCACHE:
+        result = vioblk_dropcache(dev);
+        lock_release(&vblk_lk);
+        return result;
+    case IOCTL_READDIRECT:
+    case IOCTL_WRITEDIRECT:
+        result = vioblk_direct(dev, arg, cmd == IOCTL_WRITEDIRECT);
+        lock_release(&vblk_lk);
+        return result;
+    case IOCTL_READPAGES:
+        result = vioblk_readpages(dev, arg);
+        lock_release(&vblk_lk);
+        return result;
+    case IOCTL_GETRING:
+        *(int *)arg = dev->vqs[0]->ring.packed ? IORING_PACKED : IORING_SPLIT;
+        lock_release(&vblk_lk);
+        return 0;
+    case IOCTL_GETQDEPTH:
+        *(int *)arg = dev->qdepth;
+        lock_release(&vblk_lk);
+        return 0;
+    case IOCTL_SETQDEPTH:
+        result = vioblk_setqdepth(dev, arg);
+        lock_release(&vblk_lk);
+        return result;
+    case IOCTL_DISCARD:
+        result = vioblk_discard(dev, arg);
+        lock_release(&vblk_lk);
+        return result;
+    case IOCTL_WRITEZEROES:
+        result = vioblk_writezeroes(dev, arg);
+        lock_release(&vblk_lk);
+        return result;
+    case IOCTL_GETSTAT:
+        memcpy(arg, &dev->stat, sizeof(struct io_stat));
+        lock_release(&vblk_lk);
+        return 0;
     default:
         lock_release(&vblk_lk);
         return -ENOTSUP;
@@ -596,31 +894,58 @@ int vioblk_ioctl(struct io_intf * restrict io, int cmd, void * restrict arg) {
 
 /**
  * @brief the interrupt service routine for virtio block device, aux points to the device triggering this isr.
- * If there's a used buffer notification from the block device, it will broadcast the condition used_updated in the device
- * to continue execute a read/write operation.
+ * If there's a used buffer notification from the block device, it marks every request slot returned in the
+ * used rings as done and broadcasts the condition used_updated of each queue that made progress, so that
+ * the submitters waiting on it can continue. All queues share the interrupt of the device.
  * @param irqno the interrupt request number of the device that triggered this isr
  * @param aux the pointer to the device struct triggered this isr
- * @return no return 
+ * @return no return
  */
 void vioblk_isr(int irqno, void * aux) {
     //           FIXME your code here
     struct vioblk_device * const dev = aux;
-    const uint32_t USED_BUFFER_NOTIF = (1 << 0); 
+    const uint32_t USED_BUFFER_NOTIF = (1 << 0);
+    int q;
 
     if(dev->regs->interrupt_status & USED_BUFFER_NOTIF){
-        // There's a new used buffer, signal the condition to let driver continue.
-        condition_broadcast(&(dev->vq.used_updated));
-
-        // acknolwedge the interrupt is handled to the device
+        // acknowledge before consuming the used ring, so that a request
+        // completing while we consume it raises a new interrupt
         dev->regs->interrupt_ack |= USED_BUFFER_NOTIF;
-        // fence 
+        // fence
         __sync_synchronize();
+
+        for (q = 0; q < dev->nvq; q++) {
+            // There are new used buffers, signal the condition to let the driver continue.
+            if (vioblk_reap(dev->vqs[q]) > 0)
+                condition_broadcast(&(dev->vqs[q]->used_updated));
+        }
     }
 }
 
+/**
+ * @brief Consumes the used ring of a queue, marking every request slot returned by the device as done.
+ * Called from the ISR and, in the polled completion modes, by submitters with interrupts disabled.
+ * @param vq the queue whose used ring to consume
+ * @return the number of used ring entries consumed
+ */
+int vioblk_reap(struct vioblk_vq * vq) {
+    uint16_t id;
+    int cnt = 0;
+
+    while (virtq_get_used(&vq->ring, &id, NULL)) {
+        if (id < VIOBLK_Q_SIZE)
+            vq->slot[id].done = 1;
+        else
+            kprintf("the used ring returned an invalid id %u.\n", (unsigned int)id);
+        cnt++;
+    }
+
+    return cnt;
+}
+
 /**
  * @brief Get the total length in bytes of the block device, value is returned through the lenptr
- * @param dev the device that you want to ask about, 
+ * @param dev the device that you want to ask about,
  * @param lenptr the pointer to the value that you want to obtain, result will be put here
  * @return 0 if success, negative if error
  */
@@ -658,7 +983,7 @@ int vioblk_getpos(const struct vioblk_device * dev, uint64_t * posptr) {
  */
 int vioblk_setpos(struct vioblk_device * dev, const uint64_t * posptr) {
     //           FIXME your code here
-    
+
     if(*posptr >= dev->size){
         kprintf("request vioblk_setpos with a position out of device bound.\n");
         return -1;
@@ -680,3 +1005,931 @@ int vioblk_getblksz (
     *blkszptr = dev->blksz;
     return 0;
 }
+
+/**
+ * @brief Writes all dirty cache blocks to the device and, if the device has a volatile write
+ * cache (VIRTIO_BLK_F_FLUSH), issues a flush request so that the data is durable on return.
+ * Must be called with vblk_lk held.
+ * @param dev the device that you want to flush
+ * @return 0 if success, negative if error
+ */
+int vioblk_flush(struct vioblk_device * dev) {
+    int result;
+
+    result = vioblk_writeback(dev);
+
+    if (result < 0)
+        return result;
+
+    if (!dev->has_flush)
+        return 0;
+
+    return vioblk_io_request(dev, VIRTIO_BLK_T_FLUSH, NULL);
+}
+
+/**
+ * @brief Sets the completion mode of the device. In IOPOLL_POLL mode, completion interrupts are
+ * suppressed and submitters spin on the used ring; in IOPOLL_HYBRID mode, they spin for up to
+ * VIOBLK_POLL_SPIN_US before sleeping; in IOPOLL_INTR mode, they sleep until the interrupt.
+ * Must be called with vblk_lk held, so no request is outstanding.
+ * @param dev the device that you want to access
+ * @param modeptr the pointer to the new mode
+ * @return 0 if success, negative if error
+ */
+int vioblk_setpoll(struct vioblk_device * dev, const int * modeptr) {
+    if (modeptr == NULL)
+        return -EINVAL;
+
+    switch (*modeptr) {
+    case IOPOLL_INTR:
+    case IOPOLL_POLL:
+    case IOPOLL_HYBRID:
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    // interrupts are enabled or suppressed by the next vioblk_kick
+    dev->poll_mode = *modeptr;
+
+    return 0;
+}
+
+/**
+ * @brief Sets the maximum number of requests that are in flight on each queue of the device. Lower
+ * depths are used to measure how the device scales with the number of outstanding requests.
+ * @param dev the device
+ * @param depthptr the pointer to the new depth, between 1 and VIOBLK_Q_SIZE
+ * @return 0 if success, -EINVAL if the depth is out of range
+ */
+int vioblk_setqdepth(struct vioblk_device * dev, const int * depthptr) {
+    if (depthptr == NULL || *depthptr < 1 || *depthptr > VIOBLK_Q_SIZE)
+        return -EINVAL;
+
+    dev->qdepth = *depthptr;
+    return 0;
+}
+
+/**
+ * @brief Writes back and invalidates every block in the cache, so that the following accesses go to
+ * the device. Used to measure device performance.
+ * Must be called with vblk_lk held.
+ * @param dev the device whose cache to drop
+ * @return 0 if success, negative if error (the cache is not dropped)
+ */
+int vioblk_dropcache(struct vioblk_device * dev) {
+    int result;
+    int i;
+
+    result = vioblk_writeback(dev);
+
+    if (result < 0)
+        return result;
+
+    for (i = 0; i < VIOBLK_CACHE_SIZE; i++)
+        dev->cache[i].cblkno = UINT64_MAX;
+
+    return 0;
+}
+
+/**
+ * @brief Transfers device blocks straight between the device and a buffer, without copying through
+ * the cache. The pages of the buffer are translated to their direct-mapped addresses, and each run of
+ * pages that is contiguous in physical memory becomes one data segment; the I/O scheduler merges
+ * segments of contiguous sectors into scatter-gather requests. A file system extent read into or
+ * written from a kernel buffer is thus a single request. The buffer may be a user buffer of the
+ * current process: its pages stay mapped for the duration of the call, since the only thread of the
+ * process is the caller.
+ * Dirty cached blocks in the range are written back first. A direct write also drops the cached
+ * blocks of the range, which it makes stale.
+ * Must be called with vblk_lk held.
+ * @param dev the device
+ * @param dio the device position, buffer and length, see struct io_direct
+ * @param write 0 to read into the buffer, 1 to write from it
+ * @return 0 if success, negative if error
+ */
+int vioblk_direct (
+    struct vioblk_device * dev, const struct io_direct * dio, int write)
+{
+    const uint_fast8_t pte_flags = write ? PTE_R : PTE_W;
+    struct iosched_req * req;
+    uint64_t pos, end;
+    uint32_t seglen;
+    char * vp;
+    void * pp;
+    int result = 0;
+    int cnt, i;
+
+    if (dio == NULL || dio->pos % dev->blksz != 0 || dio->len % dev->blksz != 0 ||
+        (uintptr_t)dio->buf % VIOBLK_SECTOR_SIZE != 0)
+        return -EINVAL;
+
+    if (dio->pos > dev->size || dio->len > dev->size - dio->pos)
+        return -EINVAL;
+
+    pos = dio->pos;
+    end = dio->pos + dio->len;
+
+    // A dirty cached block is newer than the device copy, so write it back
+    // before going around the cache. A cached block a write goes around is
+    // stale afterwards; it may cover more than the range, so it is written
+    // back before it is dropped.
+
+    result = vioblk_cache_clean(dev, pos, end);
+    if (result < 0)
+        return result;
+
+    if (write)
+        vioblk_cache_invalidate(dev, pos, end);
+
+    vp = dio->buf;
+
+    while (pos < end && result == 0) {
+        for (cnt = 0; cnt < VIOBLK_DIRECT_MAX && pos < end; cnt++) {
+            pp = memory_translate_vptr(vp, pte_flags);
+            if (pp == NULL) {
+                result = -EINVAL;
+                break;
+            }
+
+            // a segment continues across a page boundary while the next page
+            // of the buffer is the next page in physical memory
+            seglen = min(PAGE_SIZE - (uintptr_t)vp % PAGE_SIZE, end - pos);
+            while (pos + seglen < end && seglen < VIOBLK_DIRECT_SEGLEN_MAX &&
+                memory_translate_vptr(vp + seglen, pte_flags) == (char *)pp + seglen)
+            {
+                seglen += min(PAGE_SIZE, end - pos - seglen);
+            }
+
+            req = &dev->dio[cnt];
+            req->sector = pos / VIOBLK_SECTOR_SIZE;
+            req->len = seglen;
+            req->buf = pp;
+            req->write = write;
+            iosched_add(&dev->sched, req);
+
+            pos += seglen;
+            vp += seglen;
+        }
+
+        vioblk_dispatch(dev);
+
+        for (i = 0; i < cnt; i++)
+            if (dev->dio[i].result < 0)
+                result = dev->dio[i].result;
+    }
+
+    return result;
+}
+
+/**
+ * @brief Reads consecutive device pages into separate kernel pages, for page cache fills. Each page
+ * is queued as its own request and the I/O scheduler merges them into scatter-gather requests, so a
+ * run of pages contiguous on the device is read with a single request, wherever the pages are in
+ * memory. Dirty cached blocks in the range are written back first.
+ * Must be called with vblk_lk held.
+ * @param dev the device
+ * @param pvec the device position and the pages, see struct io_pagevec
+ * @return 0 if success, negative if error
+ */
+int vioblk_readpages (
+    struct vioblk_device * dev, const struct io_pagevec * pvec)
+{
+    struct iosched_req * req;
+    uint64_t pos, end;
+    uint32_t n;
+    int result;
+    int cnt, i;
+
+    if (pvec == NULL || pvec->pos % dev->blksz != 0)
+        return -EINVAL;
+
+    if (pvec->pos > dev->size || (uint64_t)pvec->npages * PAGE_SIZE > dev->size - pvec->pos)
+        return -EINVAL;
+
+    pos = pvec->pos;
+    end = pvec->pos + (uint64_t)pvec->npages * PAGE_SIZE;
+
+    result = vioblk_cache_clean(dev, pos, end);
+    if (result < 0)
+        return result;
+
+    n = 0;
+
+    while (n < pvec->npages) {
+        for (cnt = 0; cnt < VIOBLK_DIRECT_MAX && n < pvec->npages; cnt++, n++) {
+            req = &dev->dio[cnt];
+            req->sector = (pos + (uint64_t)n * PAGE_SIZE) / VIOBLK_SECTOR_SIZE;
+            req->len = PAGE_SIZE;
+            req->buf = pvec->pages[n];
+            req->write = 0;
+            iosched_add(&dev->sched, req);
+        }
+
+        vioblk_dispatch(dev);
+
+        for (i = 0; i < cnt; i++)
+            if (dev->dio[i].result < 0)
+                return dev->dio[i].result;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Discards a range of the device, allowing the device to release the storage behind it. The
+ * range is sent as a few discard requests instead of being written. Cached blocks overlapping the range
+ * are written back first, if dirty, and dropped.
+ * Must be called with vblk_lk held.
+ * @param dev the device
+ * @param range the byte range to discard, see struct io_range
+ * @return 0 if success, -ENOTSUP if the device does not support discard, other negative error codes
+ */
+int vioblk_discard(struct vioblk_device * dev, const struct io_range * range) {
+    int result;
+
+    result = vioblk_range_check(dev, range);
+    if (result < 0)
+        return result;
+
+    if (!dev->has_discard)
+        return -ENOTSUP;
+
+    result = vioblk_cache_clean(dev, range->pos, range->pos + range->len);
+    if (result < 0)
+        return result;
+
+    vioblk_cache_invalidate(dev, range->pos, range->pos + range->len);
+
+    return vioblk_range_request(dev, VIRTIO_BLK_T_DISCARD, range,
+        dev->discard_max_sectors, dev->discard_max_seg, 0);
+}
+
+/**
+ * @brief Fills a range of the device with zeroes. If the device supports write zeroes requests, the
+ * range costs a few requests without data; otherwise, a zero page is written over the range, with the
+ * writes queued and merged in the I/O scheduler. Cached blocks overlapping the range are written back
+ * first, if dirty, and dropped.
+ * Must be called with vblk_lk held.
+ * @param dev the device
+ * @param range the byte range to zero, see struct io_range
+ * @return 0 if success, negative error code if not
+ */
+int vioblk_writezeroes (
+    struct vioblk_device * dev, const struct io_range * range)
+{
+    struct iosched_req * req;
+    uint64_t pos, end;
+    int result;
+    int cnt, i;
+
+    result = vioblk_range_check(dev, range);
+    if (result < 0)
+        return result;
+
+    pos = range->pos;
+    end = range->pos + range->len;
+
+    result = vioblk_cache_clean(dev, pos, end);
+    if (result < 0)
+        return result;
+
+    vioblk_cache_invalidate(dev, pos, end);
+
+    if (dev->has_wzeroes) {
+        return vioblk_range_request(dev, VIRTIO_BLK_T_WRITE_ZEROES, range,
+            dev->wzeroes_max_sectors, dev->wzeroes_max_seg,
+            dev->wzeroes_unmap ? VIRTIO_BLK_WRITE_ZEROES_F_UNMAP : 0);
+    }
+
+    if (dev->zero_page == NULL) {
+        dev->zero_page = memory_alloc_page();
+        memset(dev->zero_page, 0, PAGE_SIZE);
+    }
+
+    while (pos < end) {
+        for (cnt = 0; cnt < VIOBLK_DIRECT_MAX && pos < end; cnt++) {
+            req = &dev->dio[cnt];
+            req->sector = pos / VIOBLK_SECTOR_SIZE;
+            req->len = min(end - pos, PAGE_SIZE);
+            req->buf = dev->zero_page;
+            req->write = 1;
+            iosched_add(&dev->sched, req);
+            pos += req->len;
+        }
+
+        vioblk_dispatch(dev);
+
+        for (i = 0; i < cnt; i++)
+            if (dev->dio[i].result < 0)
+                return dev->dio[i].result;
+    }
+
+    return 0;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+/**
+ * @brief Places a request in a free request slot and publishes it in the avail ring. The device is
+ * not notified, so that several requests can be submitted with a single notification. Must be called
+ * with vblk_lk held.
+ * @param dev the device to submit the request to
+ * @param vq the queue of the device to use
+ * @param op_type VIRTIO_BLK_T_IN, VIRTIO_BLK_T_OUT, VIRTIO_BLK_T_FLUSH, VIRTIO_BLK_T_DISCARD or
+ * VIRTIO_BLK_T_WRITE_ZEROES
+ * @param req the request chain giving the first sector and the data buffers, NULL if the request has no
+ * data (e.g. flush)
+ * @return the slot id of the request, to be passed to vioblk_complete, or negative if there is no free slot
+ */
+int vioblk_submit (
+    struct vioblk_device * dev, struct vioblk_vq * vq,
+    uint32_t op_type, const struct iosched_req * req)
+{
+    struct vioblk_slot * slot;
+    struct virtq_desc * desc;
+    int sid, n;
+
+    assert(dev->opened);
+    assert(req == NULL || req->sector < dev->regs->config.blk.capacity);
+    assert(req == NULL || req->nseg <= VIOBLK_SEG_MAX);
+
+    for (sid = 0; sid < VIOBLK_Q_SIZE; sid++)
+        if (!vq->slot[sid].busy)
+            break;
+
+    // Submitters hold vblk_lk, so all slots can only be busy if the caller
+    // itself has VIOBLK_Q_SIZE requests outstanding on this queue.
+    if (sid == VIOBLK_Q_SIZE)
+        return -EBUSY;
+
+    slot = &vq->slot[sid];
+    slot->busy = 1;
+    slot->done = 0;
+    slot->status = VIRTIO_BLK_S_IOERR; // in case the device does not set it
+    slot->header.type = op_type;
+    slot->header.reserved = 0;
+    // the sector is only used by reads and writes, and must be 0 otherwise
+    if (req != NULL && (op_type == VIRTIO_BLK_T_IN || op_type == VIRTIO_BLK_T_OUT))
+        slot->header.sector = req->sector;
+    else
+        slot->header.sector = 0;
+    slot->nbytes = (req != NULL) ? req->chain_len : 0;
+
+    // header, then data (device-writable for a read), then status
+    desc = slot->itab;
+    n = 0;
+
+    desc[n].addr = (uint64_t)(void *)(&slot->header);
+    desc[n].len = sizeof(struct vioblk_request_header);
+    desc[n].flags = VIRTQ_DESC_F_NEXT;
+    desc[n].next = n + 1;
+    n++;
+
+    for (; req != NULL; req = req->chain) {
+        desc[n].addr = (uint64_t)req->buf;
+        desc[n].len = req->len;
+        desc[n].flags = VIRTQ_DESC_F_NEXT;
+        if (op_type == VIRTIO_BLK_T_IN)
+            desc[n].flags |= VIRTQ_DESC_F_WRITE;
+        desc[n].next = n + 1;
+        n++;
+    }
+
+    desc[n].addr = (uint64_t)(void *)(&slot->status);
+    desc[n].len = sizeof(uint8_t);
+    desc[n].flags = VIRTQ_DESC_F_WRITE;
+    desc[n].next = 0;
+    n++;
+
+    slot->tsubmit = csrr_time();
+    virtq_add(&vq->ring, sid, (uint64_t)(void *)slot->itab,
+        n * sizeof(struct virtq_desc), VIRTQ_DESC_F_INDIRECT);
+
+    return sid;
+}
+
+/**
+ * @brief Notifies the device of the requests submitted since the last notification, so that a burst of
+ * submissions costs one doorbell write. The doorbell is skipped if the device suppressed notifications
+ * (with VIRTIO_F_EVENT_IDX, if it is still processing earlier requests). With VIRTIO_F_EVENT_IDX, the
+ * device is asked to interrupt once, when all outstanding requests have completed, rather than once per
+ * request; in polled mode, it is asked not to interrupt at all.
+ * Must be called with vblk_lk held.
+ * @param dev the device to notify
+ * @param vq the queue whose requests to announce
+ * @return no return
+ */
+void vioblk_kick(struct vioblk_device * dev, struct vioblk_vq * vq) {
+    if (vq->ring.kick_idx == vq->ring.avail_idx)
+        return;
+
+    // The waiters in vioblk_complete only need to run once the last
+    // outstanding request is used.
+    if (dev->poll_mode == IOPOLL_POLL)
+        virtq_intr_disable(&vq->ring);
+    else
+        virtq_intr_at(&vq->ring, vq->ring.avail_idx - 1);
+
+    virtq_kick(&vq->ring);
+}
+
+/**
+ * @brief Waits for the request in slot sid to complete and releases the slot. Depending on the
+ * completion mode, the caller sleeps until the completion interrupt, spins on the used ring, or spins
+ * for up to VIOBLK_POLL_SPIN_US and then sleeps.
+ * @param dev the device the request was submitted to
+ * @param vq the queue the request was submitted to
+ * @param sid the slot id returned by vioblk_submit
+ * @return 0 if the request succeeded, -EIO or -ENOTSUP according to the status byte
+ */
+int vioblk_complete (
+    struct vioblk_device * dev, struct vioblk_vq * vq, int sid)
+{
+    struct vioblk_slot * const slot = &vq->slot[sid];
+    const uint64_t spin_ticks = VIOBLK_POLL_SPIN_US * (TIMER_FREQ / 1000 / 1000);
+    int saved_intr_state;
+    uint64_t tstart;
+    int result;
+
+    if (dev->poll_mode != IOPOLL_INTR) {
+        tstart = csrr_time();
+        while (!slot->done) {
+            if (dev->poll_mode == IOPOLL_HYBRID && csrr_time() - tstart > spin_ticks)
+                break;
+            // the ISR may be consuming the used ring too
+            saved_intr_state = intr_disable();
+            vioblk_reap(vq);
+            intr_restore(saved_intr_state);
+        }
+    }
+
+    // we don't want the interrupt to trigger between checking done and
+    // entering condition_wait
+    saved_intr_state = intr_disable();
+    while (!slot->done)
+        condition_wait(&(vq->used_updated));
+    intr_restore(saved_intr_state);
+
+    switch (slot->status) {
+    case VIRTIO_BLK_S_OK:
+        if (slot->header.type == VIRTIO_BLK_T_IN || slot->header.type == VIRTIO_BLK_T_OUT)
+            iostat_record(&dev->stat, slot->header.type == VIRTIO_BLK_T_OUT,
+                slot->nbytes, csrr_time() - slot->tsubmit);
+        else
+            dev->stat.other++;
+        result = 0;
+        break;
+    case VIRTIO_BLK_S_UNSUPP:
+        kprintf("read/write request un supported\n");
+        result = -ENOTSUP;
+        break;
+    default:
+        kprintf("read/write request IO Error!\n");
+        result = -EIO;
+        break;
+    }
+
+    if (result < 0)
+        dev->stat.errors++;
+
+    slot->busy = 0;
+    return result;
+}
+
+/**
+ * @brief performs a single io request and waits for it to complete, retrying up to VIOBLK_ATTEMPT_MAX times on I/O error.
+ * @param dev the pointer to the device that is performing this io
+ * @param op_type any request type accepted by vioblk_submit
+ * @param req the request chain, NULL if the request has no data
+ * @return 0 if the request is success, negative error code if not success
+ */
+int vioblk_io_request (
+    struct vioblk_device * dev, uint32_t op_type,
+    const struct iosched_req * req)
+{
+    struct vioblk_vq * const vq = vioblk_local_vq(dev);
+    int result = -EIO;
+    int sid;
+    int i;
+
+    for (i = 0; i < VIOBLK_ATTEMPT_MAX && result == -EIO; i++) {
+        if (i > 0)
+            dev->stat.retries++;
+        sid = vioblk_submit(dev, vq, op_type, req);
+        if (sid < 0)
+            return sid;
+        vioblk_kick(dev, vq);
+        result = vioblk_complete(dev, vq, sid);
+    }
+
+    return result;
+}
+
+/**
+ * @brief Looks up a cache block, replacing the least recently used entry (preferring clean entries)
+ * if it is not cached. If every entry is dirty, all of them are written back first.
+ * Must be called with vblk_lk held.
+ * @param dev the device whose cache to use
+ * @param cblkno the cache block number
+ * @param fill nonzero if a newly cached block must be read from the device; zero if the caller will
+ * overwrite the whole block
+ * @return the cache entry holding the block, or NULL on I/O error
+ */
+struct vioblk_cblk * vioblk_cache_get (
+    struct vioblk_device * dev, uint64_t cblkno, int fill)
+{
+    struct vioblk_cblk * victim = NULL;
+    struct vioblk_cblk * cblk;
+    int i;
+
+    dev->cache_clock++;
+
+    for (i = 0; i < VIOBLK_CACHE_SIZE; i++) {
+        cblk = &dev->cache[i];
+
+        if (cblk->cblkno == cblkno) {
+            cblk->stamp = dev->cache_clock;
+            return cblk;
+        }
+
+        if (victim == NULL || (victim->dirty && !cblk->dirty) ||
+            (victim->dirty == cblk->dirty && cblk->stamp < victim->stamp))
+            victim = cblk;
+    }
+
+    // The victim is only dirty if every entry is dirty.
+
+    if (victim->dirty && vioblk_writeback(dev) < 0)
+        return NULL;
+
+    victim->cblkno = UINT64_MAX;
+
+    if (fill) {
+        victim->req.sector = vioblk_cblk_sector(cblkno);
+        victim->req.len = vioblk_cblk_len(dev, cblkno);
+        victim->req.buf = victim->data;
+        victim->req.write = 0;
+        iosched_add(&dev->sched, &victim->req);
+        vioblk_dispatch(dev);
+
+        if (victim->req.result < 0)
+            return NULL;
+    }
+
+    victim->cblkno = cblkno;
+    victim->stamp = dev->cache_clock;
+    return victim;
+}
+
+/**
+ * @brief Writes all dirty cache blocks to the device. The blocks are queued in the I/O scheduler, which
+ * merges contiguous blocks and orders the writes according to its policy.
+ * Must be called with vblk_lk held.
+ * @param dev the device whose cache to write back
+ * @return 0 if success, negative error code if any block could not be written (it stays dirty)
+ */
+int vioblk_writeback(struct vioblk_device * dev) {
+    struct vioblk_cblk * cblk;
+    int result = 0;
+    int i;
+
+    if (dev->dirtycnt == 0)
+        return 0;
+
+    for (i = 0; i < VIOBLK_CACHE_SIZE; i++) {
+        cblk = &dev->cache[i];
+        if (!cblk->dirty)
+            continue;
+        cblk->req.sector = vioblk_cblk_sector(cblk->cblkno);
+        cblk->req.len = vioblk_cblk_len(dev, cblk->cblkno);
+        cblk->req.buf = cblk->data;
+        cblk->req.write = 1;
+        iosched_add(&dev->sched, &cblk->req);
+    }
+
+    vioblk_dispatch(dev);
+
+    for (i = 0; i < VIOBLK_CACHE_SIZE; i++) {
+        cblk = &dev->cache[i];
+        if (!cblk->dirty)
+            continue;
+        if (cblk->req.result < 0) {
+            result = cblk->req.result;
+            continue;
+        }
+        cblk->dirty = 0;
+        dev->dirtycnt--;
+    }
+
+    return result;
+}
+
+/**
+ * @brief Writes back the cache if any dirty block overlaps a device range, so that the device copy of
+ * the range is current. Must be called with vblk_lk held.
+ * @param dev the device
+ * @param pos the start of the range in bytes
+ * @param end the end of the range in bytes
+ * @return 0 if success, negative error code if the writeback failed
+ */
+int vioblk_cache_clean (
+    struct vioblk_device * dev, uint64_t pos, uint64_t end)
+{
+    struct vioblk_cblk * cblk;
+    int i;
+
+    for (i = 0; i < VIOBLK_CACHE_SIZE; i++) {
+        cblk = &dev->cache[i];
+        if (cblk->dirty && cblk->cblkno * VIOBLK_CBLK_SIZE < end &&
+            (cblk->cblkno + 1) * VIOBLK_CBLK_SIZE > pos)
+            return vioblk_writeback(dev);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Drops the clean cache blocks overlapping a device range, whose device copy is about to change
+ * without going through the cache. Must be called with vblk_lk held, after vioblk_cache_clean.
+ * @param dev the device
+ * @param pos the start of the range in bytes
+ * @param end the end of the range in bytes
+ * @return no return
+ */
+void vioblk_cache_invalidate (
+    struct vioblk_device * dev, uint64_t pos, uint64_t end)
+{
+    struct vioblk_cblk * cblk;
+    int i;
+
+    for (i = 0; i < VIOBLK_CACHE_SIZE; i++) {
+        cblk = &dev->cache[i];
+        if (cblk->cblkno != UINT64_MAX && !cblk->dirty &&
+            cblk->cblkno * VIOBLK_CBLK_SIZE < end &&
+            (cblk->cblkno + 1) * VIOBLK_CBLK_SIZE > pos)
+            cblk->cblkno = UINT64_MAX;
+    }
+}
+
+/**
+ * @brief Checks that a range is aligned to the device block size and lies within the device.
+ * @param dev the device
+ * @param range the range to check
+ * @return 0 if the range is valid, -EINVAL if not
+ */
+int vioblk_range_check (
+    const struct vioblk_device * dev, const struct io_range * range)
+{
+    if (range == NULL || range->pos % dev->blksz != 0 || range->len % dev->blksz != 0)
+        return -EINVAL;
+
+    if (range->pos > dev->size || range->len > dev->size - range->pos)
+        return -EINVAL;
+
+    return 0;
+}
+
+/**
+ * @brief Sends a range to the device as discard or write zeroes requests. Each request carries up to
+ * max_seg consecutive pieces of up to max_sectors sectors each.
+ * Must be called with vblk_lk held.
+ * @param dev the device
+ * @param op_type VIRTIO_BLK_T_DISCARD or VIRTIO_BLK_T_WRITE_ZEROES
+ * @param range the byte range, checked by vioblk_range_check
+ * @param max_sectors the maximum number of sectors in a piece
+ * @param max_seg the maximum number of pieces in a request, at most VIOBLK_DWZ_SEG_MAX
+ * @param flags the flags of every piece
+ * @return 0 if success, negative error code if a request failed
+ */
+int vioblk_range_request (
+    struct vioblk_device * dev, uint32_t op_type, const struct io_range * range,
+    uint32_t max_sectors, uint32_t max_seg, uint32_t flags)
+{
+    struct iosched_req req;
+    uint64_t sector, end;
+    uint32_t nseg;
+    int result;
+
+    sector = range->pos / VIOBLK_SECTOR_SIZE;
+    end = (range->pos + range->len) / VIOBLK_SECTOR_SIZE;
+
+    while (sector < end) {
+        for (nseg = 0; nseg < max_seg && sector < end; nseg++) {
+            dev->dwz[nseg].sector = sector;
+            dev->dwz[nseg].num_sectors = min(end - sector, max_sectors);
+            dev->dwz[nseg].flags = flags;
+            sector += dev->dwz[nseg].num_sectors;
+        }
+
+        // the ranges are the only data buffer of the request
+        memset(&req, 0, sizeof(struct iosched_req));
+        req.buf = dev->dwz;
+        req.len = nseg * sizeof(struct vioblk_dwz_seg);
+        req.nseg = 1;
+
+        result = vioblk_io_request(dev, op_type, &req);
+        if (result < 0)
+            return result;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Sends every request queued in the I/O scheduler to the device and waits for them. Requests are
+ * submitted in batches that fill the caller's local queue first and then the other queues of the
+ * device, so that up to nvq * qdepth requests are in flight at once. Each queue used costs a
+ * single notification per batch. The result of every request is stored in its result field.
+ * Must be called with vblk_lk held.
+ * @param dev the device whose scheduler to run
+ * @return 0 if all requests succeeded, negative error code of the last failure otherwise
+ */
+int vioblk_dispatch(struct vioblk_device * dev) {
+    struct vioblk_vq * const local = vioblk_local_vq(dev);
+    struct iosched_req * reqs[VIOBLK_MQ_MAX * VIOBLK_Q_SIZE];
+    struct vioblk_vq * rvq[VIOBLK_MQ_MAX * VIOBLK_Q_SIZE];
+    int sids[VIOBLK_MQ_MAX * VIOBLK_Q_SIZE];
+    struct iosched_req * req;
+    struct vioblk_vq * vq;
+    uint32_t op_type;
+    int result = 0;
+    int err;
+    int cnt, i, q, n;
+
+    while (!iosched_empty(&dev->sched)) {
+        cnt = 0;
+        req = NULL;
+
+        for (q = 0; q < dev->nvq; q++) {
+            vq = dev->vqs[(local->ring.qid + q) % dev->nvq];
+
+            for (n = 0; n < dev->qdepth; n++) {
+                req = iosched_next(&dev->sched);
+                if (req == NULL)
+                    break;
+                op_type = req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+                dev->stat.merges += req->nseg - 1;
+                reqs[cnt] = req;
+                rvq[cnt] = vq;
+                sids[cnt] = vioblk_submit(dev, vq, op_type, req);
+                cnt++;
+            }
+
+            vioblk_kick(dev, vq);
+
+            if (req == NULL)
+                break;
+        }
+
+        for (i = 0; i < cnt; i++) {
+            op_type = reqs[i]->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+            err = (sids[i] < 0) ? sids[i] : vioblk_complete(dev, rvq[i], sids[i]);
+
+            // retry a failed request on its own
+            if (err == -EIO) {
+                dev->stat.retries++;
+                err = vioblk_io_request(dev, op_type, reqs[i]);
+            }
+
+            iosched_done(&dev->sched, reqs[i]);
+
+            if (err < 0)
+                result = err;
+            for (req = reqs[i]; req != NULL; req = req->chain)
+                req->result = err;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * @brief The flusher thread of a block device. Periodically writes back the dirty cache blocks so
+ * that small writes are coalesced in the cache and reach the device in batches.
+ * @param aux the pointer to the device struct
+ */
+void vioblk_flusher(void * aux) {
+    struct vioblk_device * const dev = aux;
+    struct alarm al;
+
+    alarm_init(&al, "vioblk_flusher");
+
+    for (;;) {
+        alarm_sleep_ms(&al, VIOBLK_FLUSH_INTERVAL_MS);
+
+        if (dev->dirtycnt == 0)
+            continue;
+
+        lock_acquire(&vblk_lk);
+        if (dev->opened)
+            vioblk_writeback(dev);
+        lock_release(&vblk_lk);
+    }
+}
+
+// Transfers a vector of buffers for vioblk_readv and vioblk_writev, stopping
+// at the end of the device or at the first error. Returns the number of bytes
+// transferred, or the error if there were none.
+
+static long vioblk_transferv (
+    struct vioblk_device * dev, const struct io_vec * iov, int iovcnt,
+    const uint64_t * posptr, int write)
+{
+    uint64_t pos;
+    long cnt = 0;
+    long acc = 0;
+    int i;
+
+    lock_acquire(&vblk_lk);
+
+    trace("%s(iovcnt=%d,write=%d)", __func__, iovcnt, write);
+    assert(dev->opened);
+
+    pos = (posptr != NULL) ? *posptr : dev->pos;
+
+    for (i = 0; i < iovcnt; i++) {
+        cnt = vioblk_copy(dev, pos + acc, iov[i].buf, iov[i].len, write);
+        if (cnt < 0)
+            break;
+        acc += cnt;
+        if (cnt < iov[i].len)
+            break;
+    }
+
+    if (posptr == NULL)
+        dev->pos = pos + acc;
+
+    lock_release(&vblk_lk);
+    return (acc == 0 && cnt < 0) ? cnt : acc;
+}
+
+// Copies /n/ bytes between a buffer and the block cache at device position
+// /pos/, one cache block at a time. Like vioblk_write, a write marks the cache
+// blocks dirty and writes dirty blocks back when there are too many. Returns
+// the number of bytes copied, fewer at the end of the device, or -EIO if the
+// first cache block cannot be read. Must be called with vblk_lk held.
+
+static long vioblk_copy (
+    struct vioblk_device * dev, uint64_t pos, void * buf, unsigned long n,
+    int write)
+{
+    struct vioblk_cblk * cblk;
+    unsigned long done;
+    uint64_t cblkno;
+    uint32_t off, len, cblk_len;
+
+    for (done = 0; done < n && pos + done < dev->size; done += len) {
+        cblkno = (pos + done) / VIOBLK_CBLK_SIZE;
+        cblk_len = vioblk_cblk_len(dev, cblkno);
+        off = (pos + done) % VIOBLK_CBLK_SIZE;
+        len = min(n - done, cblk_len - off);
+
+        // a write that covers the whole cache block does not read it first
+        cblk = vioblk_cache_get(dev, cblkno, !write || off != 0 || len != cblk_len);
+
+        if (cblk == NULL)
+            return (done != 0) ? (long)done : -EIO;
+
+        if (!write) {
+            memcpy(buf + done, cblk->data + off, len);
+            continue;
+        }
+
+        memcpy(cblk->data + off, buf + done, len);
+
+        if (!cblk->dirty) {
+            cblk->dirty = 1;
+            dev->dirtycnt++;
+        }
+
+        if (dev->dirtycnt >= VIOBLK_DIRTY_MAX)
+            vioblk_writeback(dev);
+    }
+
+    return done;
+}
+
+// Returns the length in bytes of a cache block; only the last cache block of
+// the device can be shorter than VIOBLK_CBLK_SIZE.
+
+static inline uint32_t vioblk_cblk_len (
+    const struct vioblk_device * dev, uint64_t cblkno)
+{
+    return min(dev->size - cblkno * VIOBLK_CBLK_SIZE, VIOBLK_CBLK_SIZE);
+}
+
+// Returns the queue that the running thread submits to. The kernel runs on a
+// single hart, so requests are spread over the queues by thread instead of by
+// hart; a thread always uses the same queue.
+
+static inline struct vioblk_vq * vioblk_local_vq(struct vioblk_device * dev) {
+    return dev->vqs[running_thread() % dev->nvq];
+}
+
+// Returns the first sector of a cache block.
+
+static inline uint64_t vioblk_cblk_sector(uint64_t cblkno) {
+    return cblkno * (VIOBLK_CBLK_SIZE / VIOBLK_SECTOR_SIZE);
+}
@@ -12,6 +12,11 @@
 
 #define VIRTIO_MAGIC 0x74726976
 
+//           INTERNAL FUNCTION DECLARATIONS
+//          
+
+static inline int virtq_wrap(const struct virtq * vq, uint16_t idx);
+
 //           EXPORTED FUNCTION DEFINITIONS
 //          
 
@@ -104,6 +109,8 @@ int virtio_negotiate_features (
 
 
 /**
+ * For a packed virtqueue, the descriptor area is the descriptor ring, and the driver and device areas
+ * hold the driver and device event suppression structures (Section 2.8).
  * @param regs the address of the MMIO registers
  * @param len the size of the virtqueue, in Mp3Cp1 this is 1
  * @param desc_addr the address of the descriptor area, refer to VirtIO doc Section 2.7
@@ -125,8 +132,277 @@ void virtio_attach_virtq (
     __sync_synchronize();
 }
 
+/**
+ * @brief Lays out a virtqueue in a memory area and clears it. In the split layout, the area holds the
+ * descriptor table, the avail ring and the used ring; in the packed layout, the descriptor ring and the
+ * driver and device event suppression structures.
+ * @param vq the virtqueue to initialize
+ * @param area the memory of the virtqueue, VIRTQ_AREA_SIZE(len) bytes aligned to 16 bytes
+ * @param len the number of elements, a power of 2
+ * @param packed nonzero if VIRTIO_F_RING_PACKED was negotiated
+ * @param event_idx nonzero if VIRTIO_F_EVENT_IDX was negotiated
+ * @return no return
+ */
+void virtq_init (
+    struct virtq * vq, void * area, uint_fast16_t len,
+    int packed, int event_idx)
+{
+    const size_t desc_size = len * sizeof(struct virtq_desc);
+
+    assert (len != 0 && (len & (len - 1)) == 0);
+    assert ((uintptr_t)area % 16 == 0);
+
+    memset(vq, 0, sizeof(struct virtq));
+    vq->area = area;
+    vq->len = len;
+    vq->packed = packed;
+    vq->event_idx = event_idx;
+
+    if (packed) {
+        vq->pk.desc = area;
+        vq->pk.driver = area + desc_size;
+        vq->pk.device = area + desc_size + sizeof(struct virtq_event);
+    } else {
+        vq->sp.desc = area;
+        vq->sp.avail = area + desc_size;
+        // the used ring must be aligned to 4 bytes
+        vq->sp.used = area + (desc_size + VIRTQ_AVAIL_SIZE(len) + 3) / 4 * 4;
+    }
+
+    virtq_reset(vq);
+}
+
+/**
+ * @brief Attaches a virtqueue to a queue of a device.
+ * @param vq the virtqueue, initialized with virtq_init
+ * @param regs the address of the MMIO registers
+ * @param qid the queue index
+ * @return no return
+ */
+void virtq_attach (
+    struct virtq * vq, volatile struct virtio_mmio_regs * regs, int qid)
+{
+    vq->regs = regs;
+    vq->qid = qid;
+
+    if (vq->packed)
+        virtio_attach_virtq(regs, qid, vq->len, (uint64_t)(uintptr_t)vq->pk.desc,
+            (uint64_t)(uintptr_t)vq->pk.device, (uint64_t)(uintptr_t)vq->pk.driver);
+    else
+        virtio_attach_virtq(regs, qid, vq->len, (uint64_t)(uintptr_t)vq->sp.desc,
+            (uint64_t)(uintptr_t)vq->sp.used, (uint64_t)(uintptr_t)vq->sp.avail);
+}
+
+/**
+ * @brief Clears the rings of a virtqueue and resets its indices. The device starts over at the first
+ * ring entry when the queue is enabled, so stale entries must not look valid to either side.
+ * @param vq the virtqueue
+ * @return no return
+ */
+void virtq_reset(struct virtq * vq) {
+    memset(vq->area, 0, VIRTQ_AREA_SIZE(vq->len));
+    vq->avail_idx = 0;
+    vq->used_idx = 0;
+    vq->kick_idx = 0;
+}
+
+/**
+ * @brief Makes a buffer available to the device. In the split layout, the buffer's descriptor is the
+ * descriptor table entry /id/, and the id goes into the avail ring. In the packed layout, the
+ * descriptor is written at the next ring position and becomes available when its flags are written.
+ * @param vq the virtqueue
+ * @param id the buffer id, returned by virtq_get_used when the buffer is used
+ * @param addr the physical address of the buffer
+ * @param len the length of the buffer in bytes
+ * @param flags VIRTQ_DESC_F_WRITE and VIRTQ_DESC_F_INDIRECT
+ * @return no return
+ */
+void virtq_add (
+    struct virtq * vq, uint16_t id, uint64_t addr, uint32_t len,
+    uint16_t flags)
+{
+    volatile struct virtq_packed_desc * pd;
+    struct virtq_desc * sd;
+
+    assert (id < vq->len);
+
+    if (vq->packed) {
+        pd = &vq->pk.desc[vq->avail_idx % vq->len];
+        pd->addr = addr;
+        pd->len = len;
+        pd->id = id;
+
+        if (virtq_wrap(vq, vq->avail_idx))
+            flags |= VIRTQ_DESC_F_AVAIL;
+        else
+            flags |= VIRTQ_DESC_F_USED;
+
+        // the descriptor must be visible before its flags make it available
+        __sync_synchronize();
+        pd->flags = flags;
+        vq->avail_idx++;
+    } else {
+        sd = &vq->sp.desc[id];
+        sd->addr = addr;
+        sd->len = len;
+        sd->flags = flags;
+        sd->next = 0;
+
+        vq->sp.avail->ring[vq->avail_idx % vq->len] = id;
+        // the ring entry must be visible before the index update
+        __sync_synchronize();
+        vq->sp.avail->idx = ++vq->avail_idx;
+    }
+}
+
+/**
+ * @brief Notifies the device of the buffers made available since the last notification. The
+ * notification is skipped if the device suppressed it: with VIRTIO_F_EVENT_IDX, if the device's event
+ * index was not crossed by the new buffers; otherwise if the device disabled notifications.
+ * @param vq the virtqueue
+ * @return 1 if the device was notified, 0 otherwise
+ */
+int virtq_kick(struct virtq * vq) {
+    const uint16_t old_idx = vq->kick_idx;
+    const uint16_t new_idx = vq->avail_idx;
+    uint16_t event, off_wrap;
+
+    if (old_idx == new_idx)
+        return 0;
+
+    vq->kick_idx = new_idx;
+
+    // the new buffers (and the driver's interrupt suppression state) must be
+    // visible before we read the device's suppression state, or we could miss
+    // a needed notification
+    __sync_synchronize();
+
+    if (vq->packed) {
+        switch (vq->pk.device->flags) {
+        case VIRTQ_EVENT_F_DISABLE:
+            return 0;
+        case VIRTQ_EVENT_F_DESC:
+            // Turn the ring offset and wrap counter into a free-running
+            // index in the lap of new_idx or the one before it.
+            off_wrap = vq->pk.device->off_wrap;
+            event = new_idx - new_idx % vq->len + (off_wrap & 0x7fff);
+            if ((off_wrap >> 15) != virtq_wrap(vq, new_idx))
+                event -= vq->len;
+            if (!virtq_need_event(event, new_idx, old_idx))
+                return 0;
+            break;
+        default:
+            break;
+        }
+    } else if (vq->event_idx) {
+        event = *virtq_avail_event(vq->sp.used, vq->len);
+        if (!virtq_need_event(event, new_idx, old_idx))
+            return 0;
+    } else if (vq->sp.used->flags & VIRTQ_USED_F_NO_NOTIFY) {
+        return 0;
+    }
+
+    virtio_notify_avail(vq->regs, vq->qid);
+    return 1;
+}
+
+/**
+ * @brief Consumes the next used buffer of a virtqueue. Called with interrupts disabled if the ISR also
+ * consumes used buffers.
+ * @param vq the virtqueue
+ * @param idptr the id of the used buffer is returned here
+ * @param lenptr the number of bytes written to the buffer is returned here, unless it is NULL
+ * @return 1 if a used buffer was consumed, 0 if there is none
+ */
+int virtq_get_used (
+    struct virtq * vq, uint16_t * idptr, uint32_t * lenptr)
+{
+    volatile struct virtq_packed_desc * pd;
+    volatile struct virtq_used_elem * elem;
+    uint16_t flags;
+    int wrap;
+
+    if (vq->packed) {
+        pd = &vq->pk.desc[vq->used_idx % vq->len];
+        flags = pd->flags;
+        wrap = virtq_wrap(vq, vq->used_idx);
+
+        if (!!(flags & VIRTQ_DESC_F_AVAIL) != wrap || !!(flags & VIRTQ_DESC_F_USED) != wrap)
+            return 0;
+
+        // read the descriptor only after the flags that mark it used
+        __sync_synchronize();
+        *idptr = pd->id;
+        if (lenptr != NULL)
+            *lenptr = pd->len;
+    } else {
+        if (vq->sp.used->idx == vq->used_idx)
+            return 0;
+
+        // read the ring entry only after the index that covers it
+        __sync_synchronize();
+        elem = &vq->sp.used->ring[vq->used_idx % vq->len];
+        *idptr = elem->id;
+        if (lenptr != NULL)
+            *lenptr = elem->len;
+    }
+
+    vq->used_idx++;
+    return 1;
+}
+
+/**
+ * @brief Asks the device to interrupt once a given used buffer has been returned, so that a burst of
+ * completions costs one interrupt. Without VIRTIO_F_EVENT_IDX, enables interrupts for every used buffer.
+ * @param vq the virtqueue
+ * @param idx the free-running index of the used buffer after which to interrupt
+ * @return no return
+ */
+void virtq_intr_at(struct virtq * vq, uint16_t idx) {
+    if (vq->packed) {
+        if (vq->event_idx) {
+            vq->pk.driver->off_wrap = (idx % vq->len) | (virtq_wrap(vq, idx) << 15);
+            // the offset must be visible before the flags that enable it
+            __sync_synchronize();
+            vq->pk.driver->flags = VIRTQ_EVENT_F_DESC;
+        } else {
+            vq->pk.driver->flags = VIRTQ_EVENT_F_ENABLE;
+        }
+    } else {
+        vq->sp.avail->flags = 0;
+        if (vq->event_idx)
+            *virtq_used_event(vq->sp.avail, vq->len) = idx;
+    }
+}
+
+/**
+ * @brief Asks the device not to interrupt for used buffers of a virtqueue. With VIRTIO_F_EVENT_IDX in
+ * the split layout, the event index is put just behind the used ring, where the device does not reach
+ * it before the driver moves it again.
+ * @param vq the virtqueue
+ * @return no return
+ */
+void virtq_intr_disable(struct virtq * vq) {
+    if (vq->packed)
+        vq->pk.driver->flags = VIRTQ_EVENT_F_DISABLE;
+    else if (vq->event_idx)
+        *virtq_used_event(vq->sp.avail, vq->len) = vq->used_idx - 1;
+    else
+        vq->sp.avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+}
+
 void __attribute__ ((weak)) viocons_attach (
     volatile struct virtio_mmio_regs * regs, int irqno)
 {
     panic("viocons not included!");
 }
+
+//           INTERNAL FUNCTION DEFINITIONS
+//          
+
+// Returns the wrap counter of a packed virtq at free-running index idx. The
+// counter is 1 in the first lap and flips on every wrap-around.
+
+static inline int virtq_wrap(const struct virtq * vq, uint16_t idx) {
+    return !((idx / vq->len) & 1);
+}
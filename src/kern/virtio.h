@@ -21,6 +21,7 @@
 #define VIRTIO_F_INDIRECT_DESC		28
 #define VIRTIO_F_EVENT_IDX			29
 #define VIRTIO_F_ANY_LAYOUT			27
+#define VIRTIO_F_RING_PACKED        34
 #define VIRTIO_F_RING_RESET         40
 
 #define VIRTQ_LEN_MAX 32768
@@ -32,6 +33,17 @@
 #define VIRTQ_DESC_F_WRITE      	(1 << 1)
 #define VIRTQ_DESC_F_INDIRECT		(1 << 2)
 
+// Packed virtqueue descriptor flags (VIRTIO_F_RING_PACKED)
+
+#define VIRTQ_DESC_F_AVAIL          (1 << 7)
+#define VIRTQ_DESC_F_USED           (1 << 15)
+
+// Packed virtqueue event suppression flags
+
+#define VIRTQ_EVENT_F_ENABLE        0
+#define VIRTQ_EVENT_F_DISABLE       1
+#define VIRTQ_EVENT_F_DESC          2
+
 //           length of feature vector
 #define VIRTIO_FEATLEN 4
 
@@ -128,8 +140,11 @@ struct virtq_avail {
 //           Evaluates to a compile-time constant giving the size of a virtq avail ring
 //           sized for /n/ elements.
 
+// The size includes the used_event field that follows the ring when
+// VIRTIO_F_EVENT_IDX is negotiated.
+
 #define VIRTQ_AVAIL_SIZE(n) \
-    (sizeof(struct virtq_avail)+(n)*sizeof(uint16_t))
+    (sizeof(struct virtq_avail)+(n)*sizeof(uint16_t)+sizeof(uint16_t))
 
 struct virtq_used_elem {
     uint32_t id;
@@ -146,8 +161,73 @@ struct virtq_used {
 //           Evaluates to a compile-time constant giving the size of a virtq used ring
 //           sized for /n/ elements.
 
+// The size includes the avail_event field that follows the ring when
+// VIRTIO_F_EVENT_IDX is negotiated.
+
 #define VIRTQ_USED_SIZE(n) \
-    (sizeof(struct virtq_used)+(n)*sizeof(struct virtq_used_elem))
+    (sizeof(struct virtq_used)+(n)*sizeof(struct virtq_used_elem)+sizeof(uint16_t))
+
+// A packed virtqueue (VIRTIO_F_RING_PACKED) has a single descriptor ring
+// shared by driver and device, and an event suppression structure for each
+// side in place of the avail and used rings. The driver makes a descriptor
+// available by writing its flags with the AVAIL bit equal to its wrap counter
+// and the USED bit the inverse; the device marks it used by setting both bits
+// to its own wrap counter. Both wrap counters start at 1 and flip every time
+// the ring index wraps around.
+
+struct virtq_packed_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+};
+
+struct virtq_event {
+    uint16_t off_wrap; // ring offset in bits 0..14, wrap counter in bit 15
+    uint16_t flags;
+};
+
+//           VIRTQ_AREA_SIZE(n)
+//           Evaluates to a compile-time constant giving the size of the memory a virtq
+//           of /n/ elements needs in either layout (see virtq_init).
+
+#define VIRTQ_AREA_SIZE(n) \
+    (((n)*sizeof(struct virtq_desc)+VIRTQ_AVAIL_SIZE(n)+3)/4*4+VIRTQ_USED_SIZE(n))
+
+// Driver side of a virtqueue, in either the split or the packed layout. A
+// buffer is made available as a single descriptor (usually an indirect one)
+// tagged with an id below the queue length, and the device returns the id
+// when the buffer is used. The driver must have at most /len/ buffers
+// outstanding, and may use each id only once at a time.
+//
+// The ring indices are free-running, as in the split layout; for a packed
+// virtq, the ring position is the index modulo /len/ and the wrap counter is
+// derived from the number of laps, which is why /len/ must be a power of 2.
+
+struct virtq {
+    volatile struct virtio_mmio_regs * regs;
+    void * area; // VIRTQ_AREA_SIZE(len) bytes, 16-byte aligned
+    uint16_t qid;
+    uint16_t len;
+    int8_t packed; // VIRTIO_F_RING_PACKED negotiated
+    int8_t event_idx; // VIRTIO_F_EVENT_IDX negotiated
+    uint16_t avail_idx; // number of buffers made available
+    uint16_t used_idx; // number of used buffers consumed
+    uint16_t kick_idx; // avail_idx at the last notification of the device
+
+    union {
+        struct {
+            struct virtq_desc * desc;
+            struct virtq_avail * avail;
+            volatile struct virtq_used * used;
+        } sp; // split layout
+        struct {
+            volatile struct virtq_packed_desc * desc;
+            struct virtq_event * driver;
+            volatile struct virtq_event * device;
+        } pk; // packed layout
+    };
+};
 
 
 //           EXPORTED FUNCTION DEFINITIONS
@@ -170,6 +250,23 @@ extern int virtio_negotiate_features (
 static inline void virtio_notify_avail (
     volatile struct virtio_mmio_regs * regs, int qid);
 
+// Event index fields of a virtq of length /len/ (VIRTIO_F_EVENT_IDX). The
+// driver writes used_event, the used ring index after which it wants the
+// next interrupt. The device writes avail_event, the avail ring index after
+// which it wants the next notification.
+
+static inline volatile uint16_t * virtq_used_event (
+    struct virtq_avail * avail, uint_fast16_t len);
+
+static inline volatile uint16_t * virtq_avail_event (
+    volatile struct virtq_used * used, uint_fast16_t len);
+
+// Returns 1 if moving a ring index from /old_idx/ to /new_idx/ crosses the
+// event index /event_idx/, that is, if the other side asked to be notified.
+
+static inline int virtq_need_event (
+    uint16_t event_idx, uint16_t new_idx, uint16_t old_idx);
+
 extern void virtio_attach_virtq (
     volatile struct virtio_mmio_regs * regs, int qid, uint_fast16_t len,
     uint64_t desc_addr, uint64_t used_addr, uint64_t avail_addr);
@@ -180,6 +277,55 @@ static inline void virtio_enable_virtq (
 static inline void virtio_reset_virtq (
     volatile struct virtio_mmio_regs * regs, int qid);
 
+// Lays out a virtq of /len/ elements in /area/, which must hold
+// VIRTQ_AREA_SIZE(len) bytes, and clears it. The layout is packed if /packed/
+// is nonzero and split otherwise; both must match the negotiated features.
+
+extern void virtq_init (
+    struct virtq * vq, void * area, uint_fast16_t len,
+    int packed, int event_idx);
+
+// Attaches an initialized virtq to queue /qid/ of a device.
+
+extern void virtq_attach (
+    struct virtq * vq, volatile struct virtio_mmio_regs * regs, int qid);
+
+// Clears the rings and indices of a virtq, which must be done whenever the
+// queue is (re-)enabled after a reset.
+
+extern void virtq_reset(struct virtq * vq);
+
+// Makes a buffer available to the device. The descriptor has address /addr/,
+// length /len/ and flags /flags/ (VIRTQ_DESC_F_WRITE, VIRTQ_DESC_F_INDIRECT).
+// The device is not notified until virtq_kick.
+
+extern void virtq_add (
+    struct virtq * vq, uint16_t id, uint64_t addr, uint32_t len,
+    uint16_t flags);
+
+// Notifies the device of the buffers made available since the last
+// notification, unless it has asked not to be. Returns 1 if the device was
+// notified and 0 otherwise.
+
+extern int virtq_kick(struct virtq * vq);
+
+// Consumes the next used buffer. Returns 1 and its id and the number of
+// bytes the device wrote to it (if /lenptr/ is not NULL), or 0 if there is no
+// used buffer.
+
+extern int virtq_get_used (
+    struct virtq * vq, uint16_t * idptr, uint32_t * lenptr);
+
+// Asks the device to interrupt once used buffer /idx/ (counting from the last
+// reset) has been returned. Without VIRTIO_F_EVENT_IDX, this enables
+// interrupts for every used buffer.
+
+extern void virtq_intr_at(struct virtq * vq, uint16_t idx);
+
+// Asks the device not to interrupt for used buffers.
+
+extern void virtq_intr_disable(struct virtq * vq);
+
 //           Zero-initializes a VirtIO feature set bitmap.
 
 static inline void virtio_featset_init(virtio_featset_t fts);
@@ -263,6 +409,24 @@ static void virtio_notify_avail (
     regs->queue_notify = qid;
 }
 
+static inline volatile uint16_t * virtq_used_event (
+    struct virtq_avail * avail, uint_fast16_t len)
+{
+    return (volatile uint16_t *)&avail->ring[len];
+}
+
+static inline volatile uint16_t * virtq_avail_event (
+    volatile struct virtq_used * used, uint_fast16_t len)
+{
+    return (volatile uint16_t *)&used->ring[len];
+}
+
+static inline int virtq_need_event (
+    uint16_t event_idx, uint16_t new_idx, uint16_t old_idx)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
 static inline void virtio_enable_virtq (
     volatile struct virtio_mmio_regs * regs, int qid)
 {
@@ -0,0 +1,132 @@
+// blkbench.c - Block read latency benchmark
+//
+// Compares the latency of 4 KiB reads that miss the block cache with the
+// block device in interrupt, polled and hybrid completion mode. For each mode,
+// every block of BENCH_FILE is read BENCH_ROUNDS times, dropping the cache
+// before each round. Reported are the mean and maximum latency of _read() and
+// the mean device request latency from the I/O scheduler statistics.
+//
+
+#include "syscall.h"
+#include "string.h"
+#include "termio.h"
+
+#define BENCH_FILE "bench.dat" // a data file, not compressed by mkfs
+#define BENCH_ROUNDS 8
+#define BENCH_BLKSZ 4096
+
+#define TIMER_FREQ 10000000UL // must match kern/timer.h
+#define TICKS_PER_US (TIMER_FREQ / 1000 / 1000)
+
+static const char * const mode_names[] = {
+    [IOPOLL_INTR] = "interrupt",
+    [IOPOLL_POLL] = "polled",
+    [IOPOLL_HYBRID] = "hybrid"
+};
+
+static char buf[BENCH_BLKSZ];
+
+static inline uint64_t rdtime(void);
+static long read_block(uint64_t pos);
+
+void main(void) {
+    struct iosched_stat stat;
+    uint64_t len, pos, nblks;
+    uint64_t t0, lat, lat_sum, lat_max, cnt;
+    int sched, mode;
+    int round;
+    int result;
+
+    result = _fsopen(0, BENCH_FILE);
+    if (result < 0) {
+        _msgout("blkbench: _fsopen failed");
+        _exit();
+    }
+
+    if (_ioctl(0, IOCTL_GETLEN, &len) < 0 || _ioctl(0, IOCTL_GETSCHED, &sched) < 0) {
+        _msgout("blkbench: _ioctl failed");
+        _exit();
+    }
+
+    nblks = len / BENCH_BLKSZ;
+    if (nblks == 0) {
+        _msgout("blkbench: " BENCH_FILE " is smaller than a block");
+        _exit();
+    }
+
+    printf("blkbench: %lu blocks of %d bytes, %d rounds\n",
+        (unsigned long)nblks, BENCH_BLKSZ, BENCH_ROUNDS);
+
+    for (mode = IOPOLL_INTR; mode <= IOPOLL_HYBRID; mode++) {
+        if (_ioctl(0, IOCTL_SETPOLL, &mode) < 0) {
+            printf("%s: not supported\n", mode_names[mode]);
+            continue;
+        }
+
+        // setting the scheduler policy clears its statistics
+        _ioctl(0, IOCTL_SETSCHED, &sched);
+
+        lat_sum = 0;
+        lat_max = 0;
+        cnt = 0;
+
+        for (round = 0; round < BENCH_ROUNDS; round++) {
+            _ioctl(0, IOCTL_DROPCACHE, NULL);
+
+            for (pos = 0; pos < nblks * BENCH_BLKSZ; pos += BENCH_BLKSZ) {
+                t0 = rdtime();
+                result = read_block(pos);
+                lat = rdtime() - t0;
+
+                if (result < 0) {
+                    printf("%s: read failed (%d)\n", mode_names[mode], result);
+                    _exit();
+                }
+
+                lat_sum += lat;
+                if (lat_max < lat)
+                    lat_max = lat;
+                cnt++;
+            }
+        }
+
+        _ioctl(0, IOCTL_GETSCHEDSTAT, &stat);
+
+        printf("%s: read() mean %lu us, max %lu us; device mean %lu us over %lu requests\n",
+            mode_names[mode],
+            (unsigned long)(lat_sum / cnt / TICKS_PER_US),
+            (unsigned long)(lat_max / TICKS_PER_US),
+            (unsigned long)(stat.done[0] ? stat.lat_sum[0] / stat.done[0] / TICKS_PER_US : 0),
+            (unsigned long)stat.done[0]);
+    }
+
+    mode = IOPOLL_INTR;
+    _ioctl(0, IOCTL_SETPOLL, &mode);
+    _close(0);
+    _exit();
+}
+
+static inline uint64_t rdtime(void) {
+    uint64_t val;
+    asm volatile ("rdtime %0" : "=r" (val));
+    return val;
+}
+
+// Reads the block at /pos/ of file descriptor 0 into buf.
+
+static long read_block(uint64_t pos) {
+    long n, total;
+    int result;
+
+    result = _ioctl(0, IOCTL_SETPOS, &pos);
+    if (result < 0)
+        return result;
+
+    for (total = 0; total < BENCH_BLKSZ; total += n) {
+        n = _read(0, buf + total, BENCH_BLKSZ - total);
+        if (n <= 0)
+            return (n < 0) ? n : -EIO;
+    }
+
+    return total;
+}
@@ -0,0 +1,102 @@
+// fsbench.c - File read/write throughput benchmark
+//
+// Measures the throughput of _read() and _write() on a file for transfer
+// sizes of 1 B, 512 B, 4 KiB and 64 KiB. For each size, the first
+// BENCH_BYTES bytes of BENCH_FILE (or the whole file, if it is smaller) are
+// read with transfers of that size, and then written back with the same data,
+// so the file is left unchanged. Reads are served from the page cache after
+// the first pass, so they measure the file system rather than the device.
+//
+
+#include "syscall.h"
+#include "string.h"
+#include "termio.h"
+
+#define BENCH_FILE "bench.dat" // a data file, not compressed by mkfs
+#define BENCH_BYTES (256 * 1024)
+#define BENCH_BUFSZ (64 * 1024)
+
+#define TIMER_FREQ 10000000UL // must match kern/timer.h
+
+static const long sizes[] = { 1, 512, 4096, 64 * 1024 };
+
+static char buf[BENCH_BUFSZ];
+
+static inline uint64_t rdtime(void);
+static long seek(uint64_t pos);
+
+void main(void) {
+    uint64_t len, pos, total;
+    uint64_t t0, rticks, wticks;
+    long size, n;
+    int i;
+
+    if (_fsopen(0, BENCH_FILE) < 0) {
+        _msgout("fsbench: _fsopen failed");
+        _exit();
+    }
+
+    if (_ioctl(0, IOCTL_GETLEN, &len) < 0) {
+        _msgout("fsbench: _ioctl failed");
+        _exit();
+    }
+
+    total = (len < BENCH_BYTES) ? len : BENCH_BYTES;
+    printf("fsbench: %lu bytes of " BENCH_FILE "\n", (unsigned long)total);
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size = sizes[i];
+
+        // read pass
+        seek(0);
+        t0 = rdtime();
+        for (pos = 0; pos < total; pos += n) {
+            n = _read(0, buf, (total - pos < size) ? total - pos : size);
+            if (n <= 0) {
+                printf("%ld B: read failed (%ld)\n", size, n);
+                _exit();
+            }
+        }
+        rticks = rdtime() - t0;
+
+        // write pass: each chunk is read back first, so only the write is timed
+        wticks = 0;
+        for (pos = 0; pos < total; pos += n) {
+            seek(pos);
+            n = _read(0, buf, (total - pos < size) ? total - pos : size);
+            if (n <= 0 || seek(pos) < 0) {
+                printf("%ld B: read failed (%ld)\n", size, n);
+                _exit();
+            }
+
+            t0 = rdtime();
+            n = _write(0, buf, n);
+            wticks += rdtime() - t0;
+
+            if (n <= 0) {
+                printf("%ld B: write failed (%ld)\n", size, n);
+                _exit();
+            }
+        }
+
+        printf("%ld B: read %lu KiB/s, write %lu KiB/s\n", size,
+            (unsigned long)(rticks ? total * (TIMER_FREQ / 1024) / rticks : 0),
+            (unsigned long)(wticks ? total * (TIMER_FREQ / 1024) / wticks : 0));
+    }
+
+    _ioctl(0, IOCTL_FLUSH, NULL);
+    _close(0);
+    _exit();
+}
+
+static inline uint64_t rdtime(void) {
+    uint64_t val;
+    asm volatile ("rdtime %0" : "=r" (val));
+    return val;
+}
+
+// Sets the position of file descriptor 0.
+
+static long seek(uint64_t pos) {
+    return _ioctl(0, IOCTL_SETPOS, &pos);
+}
@@ -0,0 +1,30 @@
+// iostat.c - Print I/O statistics
+//
+// Prints the report of the stats device, which lists the request counts and
+// latency histograms of every block device, serial port and the file system.
+//
+
+#include "syscall.h"
+#include "string.h"
+#include "termio.h"
+
+static char buf[512];
+
+void main(void) {
+    long n;
+    int result;
+
+    result = _devopen(0, "stats", 0);
+    if (result < 0) {
+        _msgout("iostat: _devopen failed");
+        _exit();
+    }
+
+    while ((n = _read(0, buf, sizeof(buf) - 1)) > 0) {
+        buf[n] = '\0';
+        printf("%s", buf);
+    }
+
+    _close(0);
+    _exit();
+}
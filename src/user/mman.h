@@ -0,0 +1 @@
+../kern/mman.h
\ No newline at end of file
@@ -0,0 +1,123 @@
+// ringbench.c - Virtqueue layout benchmark
+//
+// Measures the read throughput of the block device at queue depths of 1, 2, 4
+// and 8 requests in flight. For each depth, BENCH_FILE is read BENCH_ROUNDS
+// times with direct reads, dropping the cache before each round. Reported are
+// the throughput, the number of device requests and their mean latency.
+//
+// The virtqueue layout is fixed when the device is attached: QEMU offers
+// packed virtqueues with packed=on (make run-kernel VIRTIO_PACKED=on), so
+// the split and packed layouts are compared by running the benchmark once
+// with each setting.
+//
+
+#include "syscall.h"
+#include "string.h"
+#include "termio.h"
+
+#define BENCH_FILE "bench.dat" // a data file, not compressed by mkfs
+#define BENCH_ROUNDS 8
+#define BENCH_BUFSZ (64 * 1024)
+
+#define TIMER_FREQ 10000000UL // must match kern/timer.h
+#define TICKS_PER_US (TIMER_FREQ / 1000 / 1000)
+
+static const int depths[] = { 1, 2, 4, 8 };
+
+// page-aligned, so that whole blocks are read directly into it
+static char buf[BENCH_BUFSZ] __attribute__ ((aligned(4096)));
+
+static inline uint64_t rdtime(void);
+static long read_file(void);
+
+void main(void) {
+    struct iosched_stat stat;
+    uint64_t t0, ticks, bytes;
+    int sched, ring, depth, saved_depth;
+    int round, i;
+    long result;
+
+    result = _fsopen(0, BENCH_FILE);
+    if (result < 0) {
+        _msgout("ringbench: _fsopen failed");
+        _exit();
+    }
+
+    if (_ioctl(0, IOCTL_GETRING, &ring) < 0 || _ioctl(0, IOCTL_GETSCHED, &sched) < 0 ||
+        _ioctl(0, IOCTL_GETQDEPTH, &saved_depth) < 0)
+    {
+        _msgout("ringbench: _ioctl failed");
+        _exit();
+    }
+
+    printf("ringbench: %s virtqueue, %d rounds of " BENCH_FILE "\n",
+        (ring == IORING_PACKED) ? "packed" : "split", BENCH_ROUNDS);
+
+    for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+        depth = depths[i];
+        if (_ioctl(0, IOCTL_SETQDEPTH, &depth) < 0) {
+            printf("depth %d: not supported\n", depth);
+            continue;
+        }
+
+        // setting the scheduler policy clears its statistics
+        _ioctl(0, IOCTL_SETSCHED, &sched);
+
+        ticks = 0;
+        bytes = 0;
+
+        for (round = 0; round < BENCH_ROUNDS; round++) {
+            _ioctl(0, IOCTL_DROPCACHE, NULL);
+
+            t0 = rdtime();
+            result = read_file();
+            ticks += rdtime() - t0;
+
+            if (result < 0) {
+                printf("depth %d: read failed (%d)\n", depth, (int)result);
+                _exit();
+            }
+
+            bytes += result;
+        }
+
+        _ioctl(0, IOCTL_GETSCHEDSTAT, &stat);
+
+        printf("depth %d: %lu KiB/s, %lu requests, device mean %lu us\n",
+            depth,
+            (unsigned long)(ticks ? bytes * (TIMER_FREQ / 1024) / ticks : 0),
+            (unsigned long)stat.dispatches,
+            (unsigned long)(stat.done[0] ? stat.lat_sum[0] / stat.done[0] / TICKS_PER_US : 0));
+    }
+
+    _ioctl(0, IOCTL_SETQDEPTH, &saved_depth);
+    _close(0);
+    _exit();
+}
+
+static inline uint64_t rdtime(void) {
+    uint64_t val;
+    asm volatile ("rdtime %0" : "=r" (val));
+    return val;
+}
+
+// Reads file descriptor 0 from the beginning to the end into buf. Returns the
+// number of bytes read.
+
+static long read_file(void) {
+    uint64_t pos = 0;
+    long n, total;
+    int result;
+
+    result = _ioctl(0, IOCTL_SETPOS, &pos);
+    if (result < 0)
+        return result;
+
+    total = 0;
+    for (;;) {
+        n = _read(0, buf, BENCH_BUFSZ);
+        if (n <= 0)
+            return (n < 0) ? n : total;
+        total += n;
+    }
+}
@@ -0,0 +1 @@
+../kern/stat.h
\ No newline at end of file
@@ -4,7 +4,10 @@
 #ifndef _SYSCALL_H_
 #define _SYSCALL_H_
 #include "io.h"
+#include "mman.h"
+#include "stat.h"
 #include <stddef.h>
+#include <stdint.h>
 
 extern void __attribute__ ((noreturn)) _exit(void);
 extern void _msgout(const char * msg);
@@ -12,12 +15,47 @@ extern int _close(int fd);
 extern long _read(int fd, void * buf, size_t bufsz);
 extern long _write(int fd, const void * buf, size_t len);
 extern int _ioctl(int fd, const int cmd, void * arg);
+extern int _fsync(int fd);
 extern int _devopen(int fd, const char * name, int instno);
 extern int _fsopen(int fd, const char * name);
+extern int _fscreate(const char * name);
+extern int _fsdelete(const char * name);
+extern int _fsmkdir(const char * name);
 extern int _exec(int fd);
 extern int _fork(void);
 extern int _wait(int tid);
 extern int _usleep(unsigned long us);
 extern int _pipe(int fd);
 
+// File status and directory listing (see stat.h). _getdents returns up to /n/
+// entries of the directory at /path/, starting at entry *cursor, and advances
+// *cursor past them; it returns 0 at the end of the directory. Start with
+// *cursor set to 0, and call it until it returns 0 to list the directory.
+
+extern int _stat(const char * path, struct stat * st);
+extern int _fstat(int fd, struct stat * st);
+extern long _getdents(const char * path, uint64_t * cursor, struct dirent * ents, size_t n);
+
+// Positioned and vectored I/O. _pread and _pwrite transfer at /pos/ without
+// using or changing the position of the descriptor; _readv and _writev
+// transfer up to IOV_MAX buffers (see io.h) as one read or write.
+
+extern long _pread(int fd, void * buf, size_t bufsz, uint64_t pos);
+extern long _pwrite(int fd, const void * buf, size_t len, uint64_t pos);
+extern long _readv(int fd, const struct io_vec * iov, int iovcnt);
+extern long _writev(int fd, const struct io_vec * iov, int iovcnt);
+
+// Copies up to /count/ bytes from /infd/ to /outfd/ inside the kernel. If /pos/
+// is not NULL, reads at *pos and advances *pos instead of the position of
+// /infd/.
+
+extern long _sendfile(int outfd, int infd, uint64_t * pos, size_t count);
+
+// Memory mappings (see mman.h). _mmap returns the address of the mapping, or a
+// negative error code cast to a pointer.
+
+extern void * _mmap(void * addr, size_t len, int prot, int flags, int fd, uint64_t off);
+extern int _munmap(void * addr, size_t len);
+extern int _mprotect(void * addr, size_t len, int prot);
+
 #endif // _SYSCALL_H_
@@ -25,16 +25,15 @@ int cat(char *filename)
     printf("Error %d\n", -result);
     return result;
   }
-  // n += 1;
-  char cat_buf[n];
-  result = _read(1, cat_buf, n);
-  if (result < 0)
+  // Copy the file to the console in the kernel, without a buffer here
+  long sent = _sendfile(0, 1, NULL, n);
+  if (sent < 0)
   {
     puts("Failed to read file");
-    printf("Error %d\n", -result);
-    return result;
+    printf("Error %d\n", (int)-sent);
+    _close(1);
+    return sent;
   }
-  puts(cat_buf);
   puts("\n");
   _close(1);
   return 0;
@@ -42,31 +41,30 @@ int cat(char *filename)
 
 int ls()
 {
-  _fsopen(1, "shell");
-  size_t den_num;
-  _ioctl(1, IOCTL_GETDENTRY_NUM, &den_num);
-  if (den_num == 0)
-  {
-    puts("No files in directory");
-    _close(1);
-    return 0;
-  }
+  // The root directory is listed a batch at a time, whatever its size
+  struct dirent ents[LS_BATCH];
+  uint64_t cursor = 0;
+  long n, total = 0;
 
-  dentry_t dir_entries[den_num];
-  int result = _ioctl(1, IOCTL_GETDENTRY, dir_entries);
-  if (result < 0)
+  while ((n = _getdents("/", &cursor, ents, LS_BATCH)) > 0)
   {
-    puts("Failed to get directory entries");
-    printf("Error %d\n", -result);
-    return result;
+    for (int i = 0; i < n; i++)
+    {
+      if (ents[i].d_type == ST_DIR)
+        printf("%s/\n", ents[i].d_name);
+      else
+        printf("%s %d\n", ents[i].d_name, (int)ents[i].d_size);
+    }
+    total += n;
   }
-  for (int i = 0; i < den_num; i++)
+  if (n < 0)
   {
-    // _msgout(dir_entries[i].file_name);
-    puts(dir_entries[i].file_name);
-    // puts("\n");
+    puts("Failed to get directory entries");
+    printf("Error %d\n", (int)-n);
+    return n;
   }
-  _close(1);
+  if (total == 0)
+    puts("No files in directory");
   return 0;
 }
 
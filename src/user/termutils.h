@@ -11,12 +11,7 @@
 #define MAX_FILE_NAME_LENGTH 32 // 32 bytes
 #define DENTRY_RESERVED_SPACE_SZ 28
 #define MAX_FILE_OPEN 32
-typedef struct dentry_t
-{
-  char file_name[MAX_FILE_NAME_LENGTH];
-  uint32_t inode;
-  uint8_t reserved[DENTRY_RESERVED_SPACE_SZ];
-} __attribute((packed)) dentry_t;
+#define LS_BATCH 8 // directory entries read per _getdents call
 
 extern int cat(char *filename);
 extern int ls();
@@ -5,41 +5,170 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #define FS_BLKSZ      4096
 #define FS_NAMELEN    32
+#define FS_MAXDENTRY  63
+#define FS_MAXEXTENT  511
+#define FS_MAXCHUNK   1018
+#define FS_CHUNKSZ    (4 * FS_BLKSZ)
+
+#define FS_FEATURE_EXTENTS 0x1
+#define FS_FEATURE_COMPRESS 0x2
+#define FS_FEATURE_JOURNAL 0x4
+
+#define FT_FILE 0
+#define FT_DIR  1
+
+#define INODE_COMPRESSED 0xffffffff
+
+// LZ4 block format limits: a match is at least LZ4_MINMATCH bytes and at most
+// 65535 bytes back, the last match starts at least LZ4_MFLIMIT bytes before
+// the end of the block, and the last LZ4_LASTLITERALS bytes are literals
+#define LZ4_MINMATCH      4
+#define LZ4_MAXOFFSET     65535
+#define LZ4_MFLIMIT       12
+#define LZ4_LASTLITERALS  5
+#define LZ4_HASHLOG       12
+
+// Number of free data blocks to leave in the image for files that grow or are
+// created at run time
+#ifndef FS_FREE_BLOCKS
+#define FS_FREE_BLOCKS 4096
+#endif
+
+// Number of unused inodes to leave in the image for files and directories
+// created at run time
+#ifndef FS_FREE_INODES
+#define FS_FREE_INODES 64
+#endif
+
+// Minimum number of journal blocks, the header included
+#ifndef FS_JOURNAL_BLOCKS
+#define FS_JOURNAL_BLOCKS 32
+#endif
+
+#define FS_BITMAP_BITS (FS_BLKSZ * 8)
+
+// Rank of the first file not in the boot-order manifest
+#define RANK_UNLISTED (1 << 20)
+
+// Size of the buffer the image is written through
+#define OUTBUFSZ (1 << 20)
 
 #ifndef static_assert
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
 // Disk layout:
-// [ boot block | inodes | data blocks ]
+// [ boot block | inodes | free-block bitmap | journal | data blocks ]
+//
+// Unused inodes are written after the ones in use (at least one per root
+// directory entry), so that the kernel can create files in them. Inodes hold
+// extents: every file is written contiguously, so it has at most one. Bit n
+// of the bitmap is set if data block n is in use. The journal is written
+// empty, all zeroes; the kernel logs its metadata changes there.
+//
+// The files and directories named on the command line go in the root
+// directory, which is the array of entries in the boot block; the contents
+// of a directory argument go there too. A directory below an argument
+// becomes a directory of the image: a file holding the array of its entries.
+//
+// Files get inodes and data blocks in the same order: first the files named
+// in the boot-order manifest (-b), in the order the system reads them at
+// boot, each after the directories on its path, then the others. The inodes
+// and data of the boot files are then the first blocks of their areas, in
+// the order they are read, so booting reads the image in one pass from the
+// front.
+//
+// With -z, executables (ELF files) are compressed if that saves a block: the
+// file is cut into chunks of FS_CHUNKSZ bytes, each compressed as an LZ4
+// block, and the inode holds the extent of the compressed chunks and the
+// offset of each chunk in it. A chunk that does not compress is stored as is.
+// The kernel reads compressed files, but cannot write them.
 
 typedef struct dentry_t{
     char file_name[FS_NAMELEN];
     uint32_t inode;
-    uint8_t reserved[28];
+    uint8_t file_type;
+    uint8_t reserved[27];
 }__attribute((packed)) dentry_t; 
 
 typedef struct boot_block_t{
     uint32_t num_dentry;
     uint32_t num_inodes;
     uint32_t num_data;
-    uint8_t reserved[52];
+    uint32_t num_bitmap;
+    uint32_t features;
+    uint32_t num_journal;
+    uint8_t reserved[40];
     dentry_t dir_entries[63];
 }__attribute((packed)) boot_block_t;
 
+typedef struct extent_t{
+    uint32_t start;
+    uint32_t len;
+}__attribute((packed)) extent_t;
+
 typedef struct inode_t{
     uint32_t byte_len;
-    uint32_t data_block_num[1023];
+    union{
+        struct{
+            uint32_t num_extents;
+            extent_t extents[FS_MAXEXTENT];
+        }__attribute((packed));
+        struct{
+            uint32_t zmagic;
+            extent_t zextent;
+            uint32_t num_chunks;
+            uint32_t chunk_off[FS_MAXCHUNK + 1];
+        }__attribute((packed));
+    };
 }__attribute((packed)) inode_t;
 
 typedef struct data_block_t{
     uint8_t data[FS_BLKSZ];
 }__attribute((packed)) data_block_t;
 
+// A file or directory to put in the image. Files are placed by rank: the
+// position of the file in the boot-order manifest, or, for files not in it,
+// RANK_UNLISTED plus the position of the file in the arguments.
+struct file{
+    char *path;
+    char *relpath; // path in the image, which the manifest names
+    char name[FS_NAMELEN + 1];
+    int parent; // index of the directory in files, -1 for the root
+    int is_dir;
+    int rank;
+    int ino;
+    uint8_t *data; // the entries of a directory
+    int len;
+    uint8_t *zdata; // compressed data, NULL if the file is not compressed
+};
+
+struct file *files;
+int nfiles;
+int maxfiles;
+
+uint8_t outbuf[OUTBUFSZ];
+size_t outlen;
+
 void die(const char *);
+void usage(void);
+void add_path(const char *path, int parent, int top);
+int add_file(const char *path, int parent, int is_dir);
+void read_manifest(const char *path);
+int file_cmp(const void *a, const void *b);
+void read_file(struct file *f);
+void read_dir(struct file *f);
+void dentry_name(dentry_t *de, const char *name);
+void out_write(int fd, const void *buf, size_t len);
+void out_zero(int fd, size_t len);
+void out_flush(int fd);
+int lz4_compress(const uint8_t *src, int n, uint8_t *dst, int cap);
+int compress_file(inode_t *inode, const uint8_t *data, int n, uint8_t **zdatap);
 
 // convert to riscv byte order
 unsigned short
@@ -69,116 +198,525 @@ main(int argc, char *argv[])
 {
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: ./mkfs [filesystem_image] [file1] [file2] ...\n");
-    exit(1);
+  // -z compresses executables, -b names the boot-order manifest
+  int compress = 0;
+  const char *manifest = NULL;
+  int opt;
+  while((opt = getopt(argc, argv, "zb:")) != -1){
+    if(opt == 'z')
+      compress = 1;
+    else if(opt == 'b')
+      manifest = optarg;
+    else
+      usage();
   }
+  if(optind >= argc)
+    usage();
 
   boot_block_t boot_block = {0};
 
   printf("Making fs\n");
 
-  int fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
+  int fsfd = open(argv[optind], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0)
-    die(argv[1]);
+    die(argv[optind]);
 
-  int number_inodes = 0;
   int i;
-  for(i = 2; i < argc; i++){ //Add all dentries
-    // get rid of "../user/bin/" or "user/bin/"
-    char *shortname;
-    // if(strncmp(argv[i], "../user/bin/", 12) == 0)
-    //   shortname = argv[i] + 12;
-    // else if(strncmp(argv[i], "user/bin/", 9) == 0)
-    //   shortname = argv[i] + 9;
-    // else
-    //   shortname = argv[i];
-
-    char * index_slash = index(argv[i], '/');
-    if(index_slash == NULL){
-      // no '/', already a good file name
-      shortname = argv[i];
-    }else{
-      // find the last '/' and take the name after that as the file name
-      // while there are still '/' in index_slash, find '/'
-      while(index(index_slash, '/') != NULL){ 
-        index_slash = index(index_slash, '/')+1;
+  for(i = optind + 1; i < argc; i++)
+    add_path(argv[i], -1, 1);
+  if(manifest != NULL)
+    read_manifest(manifest);
+
+  // boot files first, in manifest order, then the rest in argument order
+  // (ranks are unique)
+  int *order = malloc((nfiles + 1) * sizeof(int));
+  if(order == NULL)
+    die("malloc");
+  for(i = 0; i < nfiles; i++)
+    order[i] = i;
+  qsort(order, nfiles, sizeof(int), file_cmp);
+  for(i = 0; i < nfiles; i++)
+    files[order[i]].ino = i;
+
+  int num_inodes = nfiles + FS_FREE_INODES;
+  if(num_inodes < FS_MAXDENTRY)
+    num_inodes = FS_MAXDENTRY;
+  inode_t *inode_array = calloc(num_inodes, sizeof(inode_t));
+  if(inode_array == NULL)
+    die("calloc");
+
+  // Inodes and data blocks are given out in file order, so that the files
+  // read at boot have the first inodes and the first data blocks, and
+  // booting reads the image from the front.
+  int data_block_idx = 0;
+  for(i = 0; i < nfiles; i++){
+    struct file *f = &files[order[i]];
+
+    printf("File name is %s\n", f->relpath);
+    printf("Inode number is %d\n", i);
+    if(f->parent < 0){
+      if(boot_block.num_dentry == FS_MAXDENTRY){
+        fprintf(stderr, "mkfs: at most %d files in the root directory\n", FS_MAXDENTRY);
+        exit(1);
+      }
+      dentry_t *de = &boot_block.dir_entries[boot_block.num_dentry];
+      printf("Dentry index is %d\n", boot_block.num_dentry);
+      dentry_name(de, f->name);
+      de->inode = i;
+      de->file_type = f->is_dir ? FT_DIR : FT_FILE;
+      boot_block.num_dentry++;
+    }
+
+    if(f->is_dir)
+      read_dir(f);
+    else
+      read_file(f);
+    printf("Number of bytes for file %s: %d\n", f->name, f->len);
+
+    int num_data_blocks_for_file = (f->len + FS_BLKSZ - 1) / FS_BLKSZ;
+    if(compress && f->len >= 4 && memcmp(f->data, "\177ELF", 4) == 0){
+      int zlen = compress_file(&inode_array[i], f->data, f->len, &f->zdata);
+      if(zlen >= 0){
+        printf("Compressed file %s to %d bytes\n", f->name, zlen);
+        num_data_blocks_for_file = (zlen + FS_BLKSZ - 1) / FS_BLKSZ;
       }
-      shortname = index_slash; // to get rid of '/'s, because we assume flat directory
     }
-    
 
-    
-    // printf("%s",shortname);
-    // assert(index(shortname, '/') == 0);
+    printf("Number of data blocks for file %s: %d\n", f->name, num_data_blocks_for_file);
+    // the data blocks of the file are written one after the other
+    if(f->zdata != NULL){
+      inode_array[i].zextent.start = data_block_idx;
+      inode_array[i].zextent.len = num_data_blocks_for_file;
+    }else if(num_data_blocks_for_file != 0){
+      inode_array[i].num_extents = 1;
+      inode_array[i].extents[0].start = data_block_idx;
+      inode_array[i].extents[0].len = num_data_blocks_for_file;
+    }
+    data_block_idx += num_data_blocks_for_file;
+    inode_array[i].byte_len = f->len;
+  }
 
-    printf("File name is %s\n", shortname);
-    printf("Dentry index is %d\n", number_inodes);
-    printf("Inode number is %d\n", number_inodes);
-    strncpy(boot_block.dir_entries[number_inodes].file_name, shortname, FS_NAMELEN);
-    boot_block.dir_entries[number_inodes].inode = number_inodes;
+  int used_blocks = data_block_idx;
+
+  boot_block.num_inodes = num_inodes;
+  boot_block.num_data = used_blocks + FS_FREE_BLOCKS;
+  boot_block.num_bitmap = (boot_block.num_data + FS_BITMAP_BITS - 1) / FS_BITMAP_BITS;
+  // room for the transactions of a few operations that each change every
+  // bitmap block
+  boot_block.num_journal = FS_JOURNAL_BLOCKS;
+  if(boot_block.num_journal < boot_block.num_bitmap + 8)
+    boot_block.num_journal = boot_block.num_bitmap + 8;
+  boot_block.features = FS_FEATURE_EXTENTS | FS_FEATURE_JOURNAL;
+  if(compress)
+    boot_block.features |= FS_FEATURE_COMPRESS;
+
+  // mark the used blocks, and the bits past the last data block so that they
+  // are never allocated
+  uint8_t *bitmap = calloc(boot_block.num_bitmap, FS_BLKSZ);
+  if(bitmap == NULL)
+    die("calloc");
+  for (i = 0; i < (int)boot_block.num_bitmap * FS_BITMAP_BITS; ++i) {
+    if (i < used_blocks || i >= (int)boot_block.num_data)
+      bitmap[i / 8] |= 1 << (i % 8);
+  }
 
-    number_inodes += 1;
+  printf("Total number of dentries: %d\n", boot_block.num_dentry);
+  printf("Total number of inodes: %d\n", boot_block.num_inodes);
+  printf("Total number of data blocks: %d (%d free)\n", boot_block.num_data, FS_FREE_BLOCKS);
+  printf("Total number of bitmap blocks: %d\n", boot_block.num_bitmap);
+  printf("Total number of journal blocks: %d\n", boot_block.num_journal);
+
+  out_write(fsfd, &boot_block, sizeof(boot_block_t));
+
+  for (i = 0; i < num_inodes; ++i) {
+    out_write(fsfd, &inode_array[i], sizeof(inode_t));
+    if (i < nfiles)
+      printf("Wrote Inode %d, Program: %s\n", i, files[order[i]].relpath);
   }
 
-  int data_block_idx = 0;
-  int inode_idx = 0;
-  inode_t inode_array[number_inodes];
-
-  for(i = 2; i < argc; i++){ //Add all inodes
-    FILE* fp;
-    if((fp = fopen(argv[i], "r")) == NULL)
-      die(argv[i]);
-
-    fseek(fp, 0L, SEEK_END);
-    int num_bytes = ftell(fp);
-    int num_data_blocks_for_file = (num_bytes / FS_BLKSZ) + 1;
-    if(num_bytes % FS_BLKSZ == 0){
-      num_data_blocks_for_file -= 1;
+  out_write(fsfd, bitmap, (size_t)boot_block.num_bitmap * FS_BLKSZ);
+  out_zero(fsfd, (size_t)boot_block.num_journal * FS_BLKSZ);
+
+  for(i = 0; i < nfiles; i++){ //Add all data blocks
+    struct file *f = &files[order[i]];
+    int len = f->len;
+    if(f->zdata != NULL)
+      len = inode_array[i].chunk_off[inode_array[i].num_chunks];
+    out_write(fsfd, (f->zdata != NULL) ? f->zdata : f->data, len);
+    out_zero(fsfd, (FS_BLKSZ - len % FS_BLKSZ) % FS_BLKSZ);
+    free(f->data);
+    free(f->zdata);
+  }
+
+  // the free blocks
+  out_zero(fsfd, (size_t)FS_FREE_BLOCKS * FS_BLKSZ);
+  out_flush(fsfd);
+
+  printf("Wrote filesystem image to %s\n", argv[optind]);
+
+  close(fsfd);
+}
+
+void
+usage(void)
+{
+  fprintf(stderr, "Usage: ./mkfs [-z] [-b boot_order] [filesystem_image] [file or directory] ...\n");
+  exit(1);
+}
+
+// Adds a file or directory to the image in directory parent. A directory
+// named on the command line (top) is not added itself: its files and
+// subdirectories go in the root directory. Directories are read in name
+// order.
+void
+add_path(const char *path, int parent, int top)
+{
+  struct stat st;
+  if(stat(path, &st) < 0)
+    die(path);
+
+  if(S_ISDIR(st.st_mode)){
+    if(!top)
+      parent = add_file(path, parent, 1);
+    struct dirent **ents;
+    int n = scandir(path, &ents, NULL, alphasort);
+    if(n < 0)
+      die(path);
+    for(int k = 0; k < n; k++){
+      if(strcmp(ents[k]->d_name, ".") != 0 && strcmp(ents[k]->d_name, "..") != 0){
+        char *sub = malloc(strlen(path) + strlen(ents[k]->d_name) + 2);
+        if(sub == NULL)
+          die("malloc");
+        sprintf(sub, "%s/%s", path, ents[k]->d_name);
+        add_path(sub, parent, 0);
+        free(sub);
+      }
+      free(ents[k]);
     }
-    // we can do this since the inode index is the same as the dentry index
-    printf("Number of bytes for file %s: %d\n",boot_block.dir_entries[inode_idx].file_name, num_bytes); 
-    printf("Number of data blocks for file %s: %d\n", boot_block.dir_entries[inode_idx].file_name, num_data_blocks_for_file);
-    int j;
-    for (j = 0; j < num_data_blocks_for_file; ++j){
-      inode_array[inode_idx].data_block_num[j] = data_block_idx;
-      data_block_idx += 1; 
+    free(ents);
+    return;
+  }
+  if(S_ISREG(st.st_mode))
+    add_file(path, parent, 0);
+}
+
+// Adds a file or directory, named by the last component of its path, to
+// directory parent and returns its index in files.
+int
+add_file(const char *path, int parent, int is_dir)
+{
+  const char *shortname = strrchr(path, '/');
+  shortname = (shortname != NULL) ? shortname + 1 : path;
+  if(strlen(shortname) > FS_NAMELEN){
+    fprintf(stderr, "mkfs: file name too long: %s\n", shortname);
+    exit(1);
+  }
+  for(int k = 0; k < nfiles; k++){
+    if(files[k].parent == parent && strcmp(files[k].name, shortname) == 0){
+      fprintf(stderr, "mkfs: duplicate file name %s (%s and %s)\n", shortname, files[k].path, path);
+      exit(1);
     }
+  }
+  if(nfiles == maxfiles){
+    maxfiles = (maxfiles == 0) ? FS_MAXDENTRY : 2 * maxfiles;
+    files = realloc(files, maxfiles * sizeof(struct file));
+    if(files == NULL)
+      die("realloc");
+  }
 
-    inode_array[inode_idx].byte_len = num_bytes;
-    inode_idx += 1;
+  struct file *f = &files[nfiles];
+  memset(f, 0, sizeof(*f));
+  f->path = strdup(path);
+  strncpy(f->name, shortname, FS_NAMELEN);
+  f->parent = parent;
+  f->is_dir = is_dir;
+  f->rank = RANK_UNLISTED + nfiles;
+  if(parent < 0)
+    f->relpath = strdup(shortname);
+  else{
+    f->relpath = malloc(strlen(files[parent].relpath) + strlen(shortname) + 2);
+    if(f->relpath != NULL)
+      sprintf(f->relpath, "%s/%s", files[parent].relpath, shortname);
+  }
+  if(f->path == NULL || f->relpath == NULL)
+    die("malloc");
+  return nfiles++;
+}
 
-    fclose(fp);
+// Reads the boot-order manifest: the paths in the image of the files read
+// at boot, one per line, in the order they are read. The directories on the
+// path of a file are placed before it. Blank lines and lines starting with
+// # are skipped, and so are paths of files not in the image.
+void
+read_manifest(const char *path)
+{
+  FILE *fp = fopen(path, "r");
+  if(fp == NULL)
+    die(path);
+
+  char line[256];
+  int rank = 0;
+  while(fgets(line, sizeof(line), fp) != NULL){
+    line[strcspn(line, "\r\n")] = '\0';
+    if(line[0] == '\0' || line[0] == '#')
+      continue;
+    int k;
+    for(k = 0; k < nfiles; k++)
+      if(strcmp(files[k].relpath, line) == 0)
+        break;
+    if(k == nfiles){
+      printf("Boot file %s is not in the image\n", line);
+      continue;
+    }
+    // rank the outermost unranked directory on the path first
+    while(files[k].rank >= RANK_UNLISTED){
+      int d = k;
+      while(files[d].parent >= 0 && files[files[d].parent].rank >= RANK_UNLISTED)
+        d = files[d].parent;
+      files[d].rank = rank++;
+    }
   }
+  fclose(fp);
+}
 
-  boot_block.num_dentry = number_inodes;
-  boot_block.num_inodes = number_inodes;
-  boot_block.num_data = data_block_idx;
+// Compares two indexes in files by rank.
+int
+file_cmp(const void *a, const void *b)
+{
+  return files[*(const int *)a].rank - files[*(const int *)b].rank;
+}
 
-  printf("Total number of dentries: %d\n", boot_block.num_dentry);
-  printf("Total number of inodes: %d\n", boot_block.num_inodes);
-  printf("Total number of data blocks: %d\n", boot_block.num_data);
+// Reads a whole file into memory with one read per call.
+void
+read_file(struct file *f)
+{
+  int fd = open(f->path, O_RDONLY);
+  if(fd < 0)
+    die(f->path);
+  struct stat st;
+  if(fstat(fd, &st) < 0)
+    die(f->path);
+  if(st.st_size > INT32_MAX)
+    die(f->path);
+  f->len = st.st_size;
+  f->data = malloc(f->len + 1);
+  if(f->data == NULL)
+    die("malloc");
+  int done = 0;
+  while(done < f->len){
+    ssize_t n = read(fd, f->data + done, f->len - done);
+    if(n <= 0)
+      die(f->path);
+    done += n;
+  }
+  close(fd);
+}
+
+// Fills in the contents of a directory: an entry for each file in it. The
+// inodes of the files must be assigned.
+void
+read_dir(struct file *f)
+{
+  int dir = f - files;
+  int n = 0;
+  for(int k = 0; k < nfiles; k++)
+    if(files[k].parent == dir)
+      n++;
+
+  dentry_t *ents = calloc(n + 1, sizeof(dentry_t));
+  if(ents == NULL)
+    die("calloc");
+  n = 0;
+  for(int k = 0; k < nfiles; k++){
+    if(files[k].parent != dir)
+      continue;
+    dentry_name(&ents[n], files[k].name);
+    ents[n].inode = files[k].ino;
+    ents[n].file_type = files[k].is_dir ? FT_DIR : FT_FILE;
+    n++;
+  }
+  f->data = (uint8_t *)ents;
+  f->len = n * sizeof(dentry_t);
+}
 
-  write(fsfd, &boot_block, sizeof(boot_block_t)); 
+// Sets the name of a zeroed directory entry. A name of FS_NAMELEN bytes fills
+// file_name with no NUL, as the kernel expects.
+void
+dentry_name(dentry_t *de, const char *name)
+{
+  size_t len = strlen(name);
+
+  memcpy(de->file_name, name, (len < FS_NAMELEN) ? len : FS_NAMELEN);
+}
 
-  for (i = 0; i < number_inodes; ++i) {
-    write(fsfd, &inode_array[i], sizeof(inode_t));
-    printf("Wrote Inode %d, Program: %s\n", i, boot_block.dir_entries[i].file_name);
+// The image is written through a buffer of OUTBUFSZ bytes, so that it takes
+// few large writes.
+void
+out_write(int fd, const void *buf, size_t len)
+{
+  while(len > 0){
+    size_t n = OUTBUFSZ - outlen;
+    if(n > len)
+      n = len;
+    memcpy(outbuf + outlen, buf, n);
+    outlen += n;
+    buf = (const char *)buf + n;
+    len -= n;
+    if(outlen == OUTBUFSZ)
+      out_flush(fd);
   }
+}
 
-  for(i = 2; i < argc; i++){ //Add all data blocks
-    int fd;
-    if((fd = open(argv[i], 0)) < 0)
-      die(argv[i]);
+void
+out_zero(int fd, size_t len)
+{
+  while(len > 0){
+    size_t n = OUTBUFSZ - outlen;
+    if(n > len)
+      n = len;
+    memset(outbuf + outlen, 0, n);
+    outlen += n;
+    len -= n;
+    if(outlen == OUTBUFSZ)
+      out_flush(fd);
+  }
+}
 
-    char buf[FS_BLKSZ] = {0};
-    while(read(fd, buf, sizeof(buf)) > 0)
-      write(fsfd, buf, FS_BLKSZ);
+void
+out_flush(int fd)
+{
+  size_t done = 0;
+  while(done < outlen){
+    ssize_t n = write(fd, outbuf + done, outlen - done);
+    if(n <= 0)
+      die("write");
+    done += n;
   }
+  outlen = 0;
+}
 
-  printf("Wrote filesystem image to %s\n", argv[1]);
+// Compresses a file into chunks (see the disk layout above) and fills in its
+// inode, except for the extent. Returns the length of the compressed data,
+// returned in *zdatap, or -1 if compression would not save a block or the
+// file has too many chunks; the inode is then left alone.
+int
+compress_file(inode_t *inode, const uint8_t *data, int n, uint8_t **zdatap)
+{
+  int nchunks = (n + FS_CHUNKSZ - 1) / FS_CHUNKSZ;
+  if(nchunks > FS_MAXCHUNK)
+    return -1;
+
+  uint8_t *zdata = malloc(n);
+  if(zdata == NULL)
+    die("malloc");
+
+  uint32_t chunk_off[FS_MAXCHUNK + 1];
+  int zlen = 0;
+  int c;
+  chunk_off[0] = 0;
+  for(c = 0; c < nchunks; c++){
+    int len = n - c * FS_CHUNKSZ;
+    if(len > FS_CHUNKSZ)
+      len = FS_CHUNKSZ;
+    // a chunk is only compressed if it gets shorter, so that the kernel
+    // tells stored chunks by their length
+    int clen = lz4_compress(data + c * FS_CHUNKSZ, len, zdata + zlen, len - 1);
+    if(clen < 0){
+      memcpy(zdata + zlen, data + c * FS_CHUNKSZ, len);
+      clen = len;
+    }
+    zlen += clen;
+    chunk_off[c + 1] = zlen;
+  }
 
-  close(fsfd);
+  if((zlen + FS_BLKSZ - 1) / FS_BLKSZ >= (n + FS_BLKSZ - 1) / FS_BLKSZ){
+    free(zdata);
+    return -1;
+  }
+
+  inode->zmagic = INODE_COMPRESSED;
+  inode->num_chunks = nchunks;
+  memcpy(inode->chunk_off, chunk_off, (nchunks + 1) * sizeof(uint32_t));
+  *zdatap = zdata;
+  return zlen;
+}
+
+static uint32_t
+read32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static int
+put_len(uint8_t *dst, int op, int len)
+{
+  for(; len >= 255; len -= 255)
+    dst[op++] = 255;
+  dst[op++] = len;
+  return op;
+}
+
+// Compresses n bytes at src into an LZ4 block at dst, which holds cap bytes.
+// Matches are found greedily through a hash table of the positions of the
+// last four-byte sequences seen. Returns the length of the block, or -1 if it
+// does not fit.
+int
+lz4_compress(const uint8_t *src, int n, uint8_t *dst, int cap)
+{
+  static int table[1 << LZ4_HASHLOG];
+  int ip = 0, anchor = 0, op = 0;
+  int ref, mlen, lit, tok;
+  uint32_t h;
+
+  memset(table, -1, sizeof(table));
+
+  while(ip <= n - LZ4_MFLIMIT){
+    h = (read32(src + ip) * 2654435761u) >> (32 - LZ4_HASHLOG);
+    ref = table[h];
+    table[h] = ip;
+    if(ref < 0 || ip - ref > LZ4_MAXOFFSET || read32(src + ref) != read32(src + ip)){
+      ip++;
+      continue;
+    }
+
+    mlen = LZ4_MINMATCH;
+    while(ip + mlen < n - LZ4_LASTLITERALS && src[ref + mlen] == src[ip + mlen])
+      mlen++;
+
+    lit = ip - anchor;
+    if(op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > cap)
+      return -1;
+    tok = op++;
+    dst[tok] = (lit >= 15 ? 15 : lit) << 4;
+    if(lit >= 15)
+      op = put_len(dst, op, lit - 15);
+    memcpy(dst + op, src + anchor, lit);
+    op += lit;
+    dst[op++] = (ip - ref) & 0xff;
+    dst[op++] = (ip - ref) >> 8;
+    if(mlen - LZ4_MINMATCH >= 15){
+      dst[tok] |= 15;
+      op = put_len(dst, op, mlen - LZ4_MINMATCH - 15);
+    }else
+      dst[tok] |= mlen - LZ4_MINMATCH;
+
+    ip += mlen;
+    anchor = ip;
+  }
+
+  // the last sequence holds the remaining literals
+  lit = n - anchor;
+  if(op + 1 + lit / 255 + 1 + lit > cap)
+    return -1;
+  tok = op++;
+  dst[tok] = (lit >= 15 ? 15 : lit) << 4;
+  if(lit >= 15)
+    op = put_len(dst, op, lit - 15);
+  memcpy(dst + op, src + anchor, lit);
+  op += lit;
+  return op;
 }
 
 void
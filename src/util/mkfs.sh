@@ -4,12 +4,17 @@ make
 # Define the root folder
 ROOT_FOLDER="root_folder"
 
-# Collect all files in the root folder
-FILES=$(find "$ROOT_FOLDER" -type f)
+# The benchmarks (fsbench, blkbench, ringbench) read and write bench.dat, a
+# data file that mkfs does not compress, since compressed files are read-only
+# and read by chunk
+if [ ! -f "$ROOT_FOLDER/bench.dat" ]; then
+    dd if=/dev/urandom of="$ROOT_FOLDER/bench.dat" bs=4096 count=128 status=none
+fi
 
-# Execute the mkfs command with the collected files
-echo ./mkfs kfs.raw $FILES
-./mkfs kfs.raw $FILES
+# Execute the mkfs command on the root folder, placing the files read at
+# boot first
+echo ./mkfs -z -b boot.order kfs.raw "$ROOT_FOLDER"
+./mkfs -z -b boot.order kfs.raw "$ROOT_FOLDER"
 
 # Remove the existing kfs.raw file in the ../kern/ directory
 rm -f ../kern/kfs.raw
@@ -1,4 +1,4 @@
 make clean
 make
-./mkfs kfs.raw helloworld.txt trek enum.txt
+./mkfs -z kfs.raw helloworld.txt trek enum.txt
 mv kfs.raw ../kern
\ No newline at end of file